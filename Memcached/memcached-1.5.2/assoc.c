@@ -38,14 +38,26 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 #define hashsize(n) ((ub4)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
+/*
+ * Buckets live in blocks which never move once allocated. Block 0 holds the
+ * initial hashsize(hashpower_init) buckets; every expansion appends a block
+ * as large as the whole table before it. Growing therefore never swaps the
+ * table out from under a reader, and workers keep running while it happens.
+ */
+static item** hash_blocks[HASHPOWER_MAX + 1];
+static unsigned int hashpower_init = HASHPOWER_DEFAULT;
 
 /*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
+ * Number of buckets in use. The table grows by linear hashing: while
+ * expanding from hashpower to hashpower + 1, the first
+ * hash_buckets - hashsize(hashpower) buckets have already been split into
+ * their upper halves. Readers derive everything from this one value, so the
+ * maintenance thread bumping it never gives them a torn view of the table.
+ * Moving a bucket's items only touches that bucket and its upper half, which
+ * share an item lock, so a reader holding the item lock for its key sees a
+ * stable bucket.
  */
-static item** old_hashtable = 0;
+static ub4 hash_buckets = 0;
 
 /* Number of items in the hash table. */
 static unsigned int hash_items = 0;
@@ -54,21 +66,48 @@ static unsigned int hash_items = 0;
 static bool expanding = false;
 static bool started_expanding = false;
 
-/*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
- */
-static unsigned int expand_bucket = 0;
+/* Index of the highest set bit; n must not be zero. */
+static inline unsigned int _hash_log2(ub4 n) {
+#if defined(__GNUC__)
+    return (sizeof(ub4) * 8 - 1) - __builtin_clzl(n);
+#else
+    unsigned int r = 0;
+    while (n >>= 1)
+        r++;
+    return r;
+#endif
+}
+
+static inline item** _bucket_at(const ub4 bucket) {
+    unsigned int high;
+
+    if (bucket < hashsize(hashpower_init))
+        return &hash_blocks[0][bucket];
+    high = _hash_log2(bucket);
+    return &hash_blocks[high - hashpower_init + 1][bucket - hashsize(high)];
+}
+
+static inline item** _hashbucket(const uint32_t hv) {
+    ub4 buckets = hash_buckets;
+    unsigned int power = _hash_log2(buckets);
+    ub4 bucket = hv & hashmask(power + 1);
+
+    if (bucket >= buckets)
+        bucket = hv & hashmask(power);
+    return _bucket_at(bucket);
+}
 
 void assoc_init(const int hashtable_init) {
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
-    primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
-    if (! primary_hashtable) {
+    hashpower_init = hashpower;
+    hash_blocks[0] = calloc(hashsize(hashpower), sizeof(void *));
+    if (! hash_blocks[0]) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
     }
+    hash_buckets = hashsize(hashpower);
     STATS_LOCK();
     stats_state.hash_power_level = hashpower;
     stats_state.hash_bytes = hashsize(hashpower) * sizeof(void *);
@@ -76,16 +115,7 @@ void assoc_init(const int hashtable_init) {
 }
 
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
-    item *it;
-    unsigned int oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
-    }
+    item *it = *_hashbucket(hv);
 
     item *ret = NULL;
     int depth = 0;
@@ -101,20 +131,24 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     return ret;
 }
 
+/* Multigets hash all of their keys up front and warm the cache in two
+ * passes, bucket slots first and then the items at the head of each chain,
+ * so the misses overlap instead of being taken one key at a time. These are
+ * only hints: they don't take the item lock, and a stale head is harmless.
+ */
+void assoc_prefetch_bucket(const uint32_t hv) {
+    prefetch(_hashbucket(hv));
+}
+
+void assoc_prefetch_item(const uint32_t hv) {
+    prefetch(*_hashbucket(hv));
+}
+
 /* returns the address of the item pointer before the key.  if *item == 0,
    the item wasn't found */
 
 static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    unsigned int oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
-    }
+    item **pos = _hashbucket(hv);
 
     while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
         pos = &(*pos)->h_next;
@@ -122,25 +156,54 @@ static item** _hashitem_before (const char *key, const size_t nkey, const uint32
     return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
+/* adds the block of buckets for the next power of 2. */
 static void assoc_expand(void) {
-    old_hashtable = primary_hashtable;
+    item **block = calloc(hashsize(hashpower), sizeof(void *));
 
-    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
+    if (block) {
         if (settings.verbose > 1)
             fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
+        hash_blocks[hashpower - hashpower_init + 1] = block;
         expanding = true;
-        expand_bucket = 0;
         STATS_LOCK();
-        stats_state.hash_power_level = hashpower;
+        stats_state.hash_power_level = hashpower + 1;
         stats_state.hash_bytes += hashsize(hashpower) * sizeof(void *);
         stats_state.hash_is_expanding = true;
         STATS_UNLOCK();
-    } else {
-        primary_hashtable = old_hashtable;
-        /* Bad news, but we can keep running. */
+    }
+    /* else: Bad news, but we can keep running. */
+}
+
+/* Moves the items of the next unsplit bucket which belong in its upper half.
+ * Caller must hold the item lock covering the bucket. */
+static void assoc_split_bucket(void) {
+    ub4 bucket = hash_buckets - hashsize(hashpower);
+    item **lo = _bucket_at(bucket);
+    item **hi = _bucket_at(bucket + hashsize(hashpower));
+    item *it, *next;
+
+    it = *lo;
+    *lo = NULL;
+    for (; NULL != it; it = next) {
+        next = it->h_next;
+        if (it->hv & hashsize(hashpower)) {
+            it->h_next = *hi;
+            *hi = it;
+        } else {
+            it->h_next = *lo;
+            *lo = it;
+        }
+    }
+
+    hash_buckets++;
+    if (hash_buckets == hashsize(hashpower + 1)) {
+        hashpower++;
+        expanding = false;
+        STATS_LOCK();
+        stats_state.hash_is_expanding = false;
+        STATS_UNLOCK();
+        if (settings.verbose > 1)
+            fprintf(stderr, "Hash table expansion done\n");
     }
 }
 
@@ -154,23 +217,17 @@ static void assoc_start_expand(void) {
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(item *it, const uint32_t hv) {
-    unsigned int oldbucket;
+    item **bucket;
 
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
-    } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
-    }
+    bucket = _hashbucket(hv);
+    it->h_next = *bucket;
+    *bucket = it;
 
     pthread_mutex_lock(&hash_items_counter_lock);
     hash_items++;
-    if (! expanding && hash_items > (hashsize(hashpower) * 3) / 2 &&
+    if (! expanding && hash_items > (hash_buckets * 3) / 2 &&
           hashpower < HASHPOWER_MAX) {
         assoc_start_expand();
     }
@@ -216,60 +273,28 @@ static void *assoc_maintenance_thread(void *arg) {
 
         /* There is only one expansion thread, so no need to global lock. */
         for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            unsigned int bucket;
             void *item_lock = NULL;
 
-            /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
-             * is the lowest N bits of the hv, and the bucket of item_locks is
-             *  also the lowest M bits of hv, and N is greater than M.
-             *  So we can process expanding with only one item_lock. cool! */
-            if ((item_lock = item_trylock(expand_bucket))) {
-                    for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                        next = it->h_next;
-                        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                        it->h_next = primary_hashtable[bucket];
-                        primary_hashtable[bucket] = it;
-                    }
-
-                    old_hashtable[expand_bucket] = NULL;
-
-                    expand_bucket++;
-                    if (expand_bucket == hashsize(hashpower - 1)) {
-                        expanding = false;
-                        free(old_hashtable);
-                        STATS_LOCK();
-                        stats_state.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
-                        stats_state.hash_is_expanding = false;
-                        STATS_UNLOCK();
-                        if (settings.verbose > 1)
-                            fprintf(stderr, "Hash table expansion done\n");
-                    }
-
+            /* The bucket being split is the lowest N bits of the hv, its
+             * upper half the lowest N + 1 bits, and the bucket of item_locks
+             * the lowest M bits of hv, with N greater than M. So both halves
+             * are covered by a single item_lock. cool! */
+            if ((item_lock = item_trylock(hash_buckets - hashsize(hashpower)))) {
+                assoc_split_bucket();
+                item_trylock_unlock(item_lock);
             } else {
                 usleep(10*1000);
             }
-
-            if (item_lock) {
-                item_trylock_unlock(item_lock);
-                item_lock = NULL;
-            }
         }
 
         if (!expanding) {
             /* We are done expanding.. just wait for next invocation */
             started_expanding = false;
             pthread_cond_wait(&maintenance_cond, &maintenance_lock);
-            /* assoc_expand() swaps out the hash table entirely, so we need
-             * all threads to not hold any references related to the hash
-             * table while this happens.
-             * This is instead of a more complex, possibly slower algorithm to
-             * allow dynamic hash table expansion without causing significant
-             * wait times.
-             */
-            pause_threads(PAUSE_ALL_THREADS);
+            /* Expanding only adds a new block of buckets; nothing anyone
+             * may hold a reference to moves, so the worker threads don't
+             * need to be paused. */
             assoc_expand();
-            pause_threads(RESUME_ALL_THREADS);
         }
     }
     return NULL;
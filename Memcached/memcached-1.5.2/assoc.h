@@ -3,6 +3,8 @@ void assoc_init(const int hashpower_init);
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
 int assoc_insert(item *item, const uint32_t hv);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
+void assoc_prefetch_bucket(const uint32_t hv);
+void assoc_prefetch_item(const uint32_t hv);
 void do_assoc_move_next_bucket(void);
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
@@ -0,0 +1,178 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Server side value compression. Worker threads deflate large values as they
+ * are stored, and keep the result only when it moves the item down into a
+ * smaller slab class: memory is handed out a chunk at a time, so anything
+ * less saves nothing. Gets inflate a compressed value into a temporary item,
+ * the same way extstore reads values back, unless the client asked for the
+ * value as stored.
+ */
+#include "memcached.h"
+#ifdef COMPRESSION
+
+#include "compress.h"
+#include <zlib.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    z_stream def;       /* only set up when compress_min is */
+    z_stream inf;
+    char *buf;          /* deflate output, until it's known to pay off */
+    int size;
+} compress_thread;
+
+void *compress_thread_init(void) {
+    compress_thread *ct = calloc(1, sizeof(compress_thread));
+    if (ct == NULL)
+        return NULL;
+
+    /* Items compressed before a warm restart (-e) may still have to be
+     * inflated with compress_min off, so inflate is always ready. */
+    if (inflateInit(&ct->inf) != Z_OK) {
+        free(ct);
+        return NULL;
+    }
+    if (settings.compress_min > 0 &&
+            deflateInit(&ct->def, settings.compress_level) != Z_OK) {
+        inflateEnd(&ct->inf);
+        free(ct);
+        return NULL;
+    }
+    return ct;
+}
+
+/* Length of the uncompressed value, counted like nbytes with its "\r\n". */
+int item_raw_nbytes(item *it) {
+    unsigned char *p = (unsigned char *)ITEM_data(it);
+    uint32_t len = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16)
+        | ((uint32_t)p[2] << 8) | p[3];
+    return (int)len + 2;
+}
+
+/* Returns a compressed copy of a freshly read item, or NULL if the value is
+ * small, chunked or doesn't shrink enough to be worth it. */
+item *item_compress(conn *c, item *it) {
+    compress_thread *ct = c->thread->compress;
+    unsigned int id = ITEM_clsid(it);
+    uint32_t raw = it->nbytes - 2;
+    int limit, clen;
+    uint32_t flags;
+    unsigned char *p;
+    item *new_it = NULL;
+
+    if (it->nbytes - 2 < settings.compress_min ||
+            (it->it_flags & ITEM_CHUNKED) != 0)
+        return NULL;
+
+    /* Room left in a chunk of the next class down. The header can only get
+     * shorter, as the length in an inline suffix has fewer digits. deflate
+     * gives up as soon as it runs out of that room. */
+    limit = 0;
+    if (id > POWER_SMALLEST) {
+        limit = (int)slabs_size(id - 1) - (ITEM_ntotal(it) - it->nbytes)
+            - 2 - COMPRESS_HDR_LEN;
+    }
+    if (limit > ct->size) {
+        char *buf = realloc(ct->buf, limit);
+        if (buf == NULL) {
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            return NULL;
+        }
+        ct->buf = buf;
+        ct->size = limit;
+    }
+
+    if (limit > 0) {
+        deflateReset(&ct->def);
+        ct->def.next_in = (Bytef *)ITEM_data(it);
+        ct->def.avail_in = raw;
+        ct->def.next_out = (Bytef *)ct->buf;
+        ct->def.avail_out = limit;
+        if (deflate(&ct->def, Z_FINISH) == Z_STREAM_END) {
+            clen = limit - ct->def.avail_out;
+            FLAGS_CONV(settings.inline_ascii_response, it, flags);
+            new_it = item_alloc(ITEM_key(it), it->nkey, flags, it->exptime,
+                    COMPRESS_HDR_LEN + clen + 2);
+        }
+    }
+
+    if (new_it == NULL) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.compress_skipped++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        return NULL;
+    }
+
+    p = (unsigned char *)ITEM_data(new_it);
+    p[0] = raw >> 24;
+    p[1] = raw >> 16;
+    p[2] = raw >> 8;
+    p[3] = raw;
+    memcpy(p + COMPRESS_HDR_LEN, ct->buf, clen);
+    memcpy(p + COMPRESS_HDR_LEN + clen, "\r\n", 2);
+    new_it->it_flags |= ITEM_COMPRESSED;
+    /* a cas command's item carries the CAS to compare against */
+    ITEM_set_cas(new_it, ITEM_get_cas(it));
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.compress_sets++;
+    c->thread->stats.compress_bytes_saved +=
+        slabs_size(id) - slabs_size(ITEM_clsid(new_it));
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    return new_it;
+}
+
+/* Inflates a compressed item's value into dst, which must have room for
+ * item_raw_nbytes(it) - 2 bytes. */
+int item_decompress_to(conn *c, item *it, char *dst) {
+    compress_thread *ct = c->thread->compress;
+
+    inflateReset(&ct->inf);
+    ct->inf.next_in = (Bytef *)ITEM_data(it) + COMPRESS_HDR_LEN;
+    ct->inf.avail_in = it->nbytes - 2 - COMPRESS_HDR_LEN;
+    ct->inf.next_out = (Bytef *)dst;
+    ct->inf.avail_out = item_raw_nbytes(it) - 2;
+    if (inflate(&ct->inf, Z_FINISH) != Z_STREAM_END ||
+            ct->inf.avail_out != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Swaps the reference to a compressed item for one to an unlinked copy of
+ * it holding the plain value. Returns NULL if that couldn't be made. */
+item *item_decompress(conn *c, item *it) {
+    item *new_it;
+    uint32_t flags;
+    int nbytes = item_raw_nbytes(it);
+
+    FLAGS_CONV(settings.inline_ascii_response, it, flags);
+    new_it = item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, nbytes);
+    /* Compressed values weren't chunked to begin with, but slab settings
+     * may have changed across a warm restart. */
+    if (new_it != NULL && ((new_it->it_flags & ITEM_CHUNKED) != 0 ||
+            item_decompress_to(c, it, ITEM_data(new_it)) != 0)) {
+        item_remove(new_it);
+        new_it = NULL;
+    }
+    if (new_it != NULL) {
+        memcpy(ITEM_data(new_it) + nbytes - 2, "\r\n", 2);
+        ITEM_set_cas(new_it, ITEM_get_cas(it));
+    }
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    if (new_it != NULL) {
+        c->thread->stats.decompress_gets++;
+    } else {
+        c->thread->stats.decompress_errors++;
+    }
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+
+    item_remove(it);
+    return new_it;
+}
+
+#endif
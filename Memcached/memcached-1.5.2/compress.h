@@ -0,0 +1,15 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+/* A compressed value is its uncompressed length, 4 bytes in network order,
+ * followed by a zlib stream. The item is marked ITEM_COMPRESSED and its
+ * nbytes covers the compressed form plus the usual "\r\n". */
+#define COMPRESS_HDR_LEN 4
+
+void *compress_thread_init(void);
+item *item_compress(conn *c, item *it);
+item *item_decompress(conn *c, item *it);
+int item_decompress_to(conn *c, item *it, char *dst);
+int item_raw_nbytes(item *it);
+
+#endif
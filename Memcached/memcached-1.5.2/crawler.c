@@ -28,6 +28,8 @@ typedef struct {
     int sfd; /* client fd. */
     bipbuf_t *buf; /* output buffer */
     char *cbuf; /* current buffer */
+    item *it; /* value still being written out, with a reference held */
+    int written; /* bytes of its value already in buf */
 } crawler_client_t;
 
 typedef struct _crawler_module_t crawler_module_t;
@@ -78,10 +80,24 @@ crawler_module_reg_t crawler_metadump_mod = {
     .needs_client = true
 };
 
-crawler_module_reg_t *crawler_mod_regs[3] = {
+static int crawler_dump_init(crawler_module_t *cm, void *data);
+static void crawler_dump_eval(crawler_module_t *cm, item *search, uint32_t hv, int i);
+static void crawler_dump_finalize(crawler_module_t *cm);
+
+crawler_module_reg_t crawler_dump_mod = {
+    .init = crawler_dump_init,
+    .eval = crawler_dump_eval,
+    .doneclass = NULL,
+    .finalize = crawler_dump_finalize,
+    .needs_lock = false,
+    .needs_client = true
+};
+
+crawler_module_reg_t *crawler_mod_regs[4] = {
     &crawler_expired_mod,
     &crawler_expired_mod,
-    &crawler_metadump_mod
+    &crawler_metadump_mod,
+    &crawler_dump_mod
 };
 
 crawler_module_t active_crawler_mod;
@@ -104,6 +120,10 @@ static pthread_cond_t  lru_crawler_cond = PTHREAD_COND_INITIALIZER;
 
 static void lru_crawler_close_client(crawler_client_t *c) {
     //fprintf(stderr, "CRAWLER: Closing client\n");
+    if (c->it != NULL) {
+        item_remove(c->it);
+        c->it = NULL;
+    }
     sidethread_conn_close(c->c);
     c->c = NULL;
     c->cbuf = NULL;
@@ -244,6 +264,90 @@ static void crawler_metadump_eval(crawler_module_t *cm, item *it, uint32_t hv, i
     bipbuf_push(cm->c.buf, total);
 }
 
+/* Copies len bytes of an item's value, starting at off, into dst. */
+static void crawler_copy_value(item *it, int off, char *dst, int len) {
+    item_chunk *ch;
+
+    if ((it->it_flags & ITEM_CHUNKED) == 0) {
+        memcpy(dst, ITEM_data(it) + off, len);
+        return;
+    }
+    ch = (item_chunk *) ITEM_data(it);
+    while (off >= ch->used) {
+        off -= ch->used;
+        ch = ch->next;
+    }
+    while (len > 0) {
+        int todo = ch->used - off < len ? ch->used - off : len;
+        memcpy(dst, ch->data + off, todo);
+        dst += todo;
+        len -= todo;
+        off = 0;
+        ch = ch->next;
+    }
+}
+
+static int crawler_dump_init(crawler_module_t *cm, void *data) {
+    /* Stands in for the "OK" the worker can't send once it's let go of the
+     * connection. */
+    bipbuf_offer(cm->c.buf, (unsigned char *)"OK\r\n", 4);
+    return 0;
+}
+
+/* Writes the record header, key and as much of the value as fits. The rest
+ * of a large value is written by lru_crawler_client_getbuf(), once the item
+ * lock has been let go. */
+static void crawler_dump_eval(crawler_module_t *cm, item *it, uint32_t hv, int i) {
+    char *p = cm->c.cbuf;
+    uint32_t flags, exptime, nbytes;
+    int total, todo;
+
+    /* Ignore expired content, and values which only live in extstore. */
+    if ((it->exptime != 0 && it->exptime < current_time)
+        || item_is_flushed(it) || (it->it_flags & ITEM_HDR)) {
+        refcount_decr(it);
+        return;
+    }
+
+    FLAGS_CONV(settings.inline_ascii_response, it, flags);
+    flags = htonl(flags);
+    exptime = htonl(it->exptime == 0 ? 0 : it->exptime + process_started);
+    nbytes = htonl(it->nbytes);
+    p[0] = it->nkey;
+    p[1] = 0;
+#ifdef COMPRESSION
+    if (it->it_flags & ITEM_COMPRESSED)
+        p[1] |= DUMP_COMPRESSED;
+#endif
+    memcpy(p + 2, &flags, 4);
+    memcpy(p + 6, &exptime, 4);
+    memcpy(p + 10, &nbytes, 4);
+    memcpy(p + DUMP_HDR_LEN, ITEM_key(it), it->nkey);
+    total = DUMP_HDR_LEN + it->nkey;
+
+    todo = LRU_CRAWLER_WRITEBUF - total;
+    if (todo > it->nbytes)
+        todo = it->nbytes;
+    crawler_copy_value(it, 0, p + total, todo);
+    bipbuf_push(cm->c.buf, total + todo);
+
+    if (todo < it->nbytes) {
+        cm->c.it = it;
+        cm->c.written = todo;
+    } else {
+        refcount_decr(it);
+    }
+}
+
+static int lru_crawler_client_getbuf(crawler_client_t *c);
+
+static void crawler_dump_finalize(crawler_module_t *cm) {
+    if (lru_crawler_client_getbuf(&cm->c) != 0)
+        return;
+    memset(cm->c.cbuf, 0, DUMP_HDR_LEN);
+    bipbuf_push(cm->c.buf, DUMP_HDR_LEN);
+}
+
 static int lru_crawler_poll(crawler_client_t *c) {
     unsigned char *data;
     unsigned int data_size = 0;
@@ -297,6 +401,24 @@ static int lru_crawler_poll(crawler_client_t *c) {
 static int lru_crawler_client_getbuf(crawler_client_t *c) {
     void *buf = NULL;
     if (c->c == NULL) return -1;
+    /* Finish off a value too large to be written in one go. */
+    while (c->it != NULL) {
+        int todo = c->it->nbytes - c->written;
+        if (todo > LRU_CRAWLER_WRITEBUF)
+            todo = LRU_CRAWLER_WRITEBUF;
+        if ((buf = bipbuf_request(c->buf, todo)) == NULL) {
+            int ret = lru_crawler_poll(c);
+            if (ret < 0) return ret;
+            continue;
+        }
+        crawler_copy_value(c->it, c->written, buf, todo);
+        bipbuf_push(c->buf, todo);
+        c->written += todo;
+        if (c->written == c->it->nbytes) {
+            item_remove(c->it);
+            c->it = NULL;
+        }
+    }
     /* not enough space. */
     while ((buf = bipbuf_request(c->buf, LRU_CRAWLER_WRITEBUF)) == NULL) {
         // TODO: max loops before closing.
@@ -360,7 +482,7 @@ static void *item_crawler_thread(void *arg) {
                 lru_crawler_class_done(i);
                 continue;
             }
-            uint32_t hv = hash(ITEM_key(search), search->nkey);
+            uint32_t hv = search->hv;
             /* Attempt to hash item lock the "search" item. If locked, no
              * other callers can incr the refcount
              */
@@ -559,9 +681,6 @@ int lru_crawler_start(uint8_t *ids, uint32_t remaining,
         assert(crawler_mod_regs[type] != NULL);
         active_crawler_mod.mod = crawler_mod_regs[type];
         active_crawler_type = type;
-        if (active_crawler_mod.mod->init != NULL) {
-            active_crawler_mod.mod->init(&active_crawler_mod, data);
-        }
         if (active_crawler_mod.mod->needs_client) {
             if (c == NULL || sfd == 0) {
                 pthread_mutex_unlock(&lru_crawler_lock);
@@ -572,6 +691,9 @@ int lru_crawler_start(uint8_t *ids, uint32_t remaining,
                 return -2;
             }
         }
+        if (active_crawler_mod.mod->init != NULL) {
+            active_crawler_mod.mod->init(&active_crawler_mod, data);
+        }
     }
 
     /* we allow the autocrawler to restart sub-LRU's before completion */
@@ -22,6 +22,14 @@ struct crawler_expired_data {
     bool is_external; /* whether this was an alloc local or remote to the module. */
 };
 
+/* "lru_crawler dump" streams each item as a header, the key, and then the
+ * value with its "\r\n". The header is nkey (1 byte), dump flags (1 byte),
+ * client flags, exptime as a unix time or 0, and nbytes (4 bytes each, in
+ * network order). A header with a zero nkey ends the stream. "load" reads
+ * the same records back in. */
+#define DUMP_HDR_LEN 14
+#define DUMP_COMPRESSED 1 /* value is as stored by --enable-compression */
+
 enum crawler_result_type {
     CRAWLER_OK=0, CRAWLER_RUNNING, CRAWLER_BADCLASS, CRAWLER_NOTSTARTED, CRAWLER_ERROR
 };
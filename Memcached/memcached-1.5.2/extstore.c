@@ -0,0 +1,667 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Flash-backed object store, see extstore.h.
+ *
+ * The backing file is split into page_count pages of page_size bytes. A
+ * single page at a time receives writes: it is carved into wbuf_size regions,
+ * each filled by an in-memory write buffer which is written out with one
+ * pwrite() once full. Objects never span write buffers, which lets readers
+ * serve objects still sitting in a buffer from memory and lets compaction
+ * walk a page one buffer-sized region at a time.
+ *
+ * Locking order: write_mutex -> page mutex -> engine mutex. The engine mutex
+ * is a leaf lock protecting the free lists and counters.
+ */
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#include "extstore.h"
+
+/* objects are aligned within pages so disk copies can be parsed in place */
+#define EXTSTORE_ALIGN 8
+
+typedef struct _store_wbuf {
+    struct _store_wbuf *next; /* free stack, or page's in-flight list */
+    char *buf;
+    char *buf_pos;
+    unsigned int free;
+    unsigned int size;
+    unsigned int offset; /* offset into the page this buffer covers */
+    unsigned int page_id;
+    obj_io io; /* used to queue the flush */
+} _store_wbuf;
+
+typedef struct _store_page {
+    pthread_mutex_t mutex;
+    unsigned int id;
+    unsigned int allocated; /* bytes of the page handed to write buffers */
+    uint64_t version; /* 0 while the page is free */
+    uint64_t obj_count;
+    uint64_t bytes_used;
+    bool active; /* receiving writes */
+    bool closed; /* full; may be compacted or evicted */
+    bool compacting;
+    _store_wbuf *wbufs; /* buffers not yet written to disk */
+    struct _store_page *next;
+} store_page;
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    obj_io *queue;
+    obj_io *queue_tail;
+    void *e;
+} store_io_thread;
+
+typedef struct {
+    pthread_mutex_t mutex; /* free lists and stats */
+    pthread_mutex_t write_mutex; /* serializes writers */
+    int fd;
+    unsigned int page_size;
+    unsigned int page_count;
+    unsigned int wbuf_size;
+    uint64_t version; /* global page version counter */
+    store_page *pages;
+    store_page *page_freelist;
+    store_page *page_writing;
+    _store_wbuf *wbuf_stack;
+    _store_wbuf *wbuf;
+    store_io_thread *io_threads;
+    unsigned int io_threadcount;
+    unsigned int io_last;
+    struct extstore_stats stats;
+} store_engine;
+
+static void *extstore_io_thread(void *arg);
+static void _wbuf_cb(void *ep, obj_io *io, int ret);
+
+const char *extstore_err(enum extstore_res res) {
+    const char *rv = "unknown error";
+    switch (res) {
+        case EXTSTORE_INIT_BAD_WBUF_SIZE:
+            rv = "page_size must be divisible by wbuf_size";
+            break;
+        case EXTSTORE_INIT_NEED_MORE_WBUF:
+            rv = "wbuf_count must be >= 2";
+            break;
+        case EXTSTORE_INIT_NEED_MORE_PAGES:
+            rv = "file must hold at least 2 pages";
+            break;
+        case EXTSTORE_INIT_OOM:
+            rv = "failed calloc for engine";
+            break;
+        case EXTSTORE_INIT_OPEN_FAIL:
+            rv = "failed to open file";
+            break;
+        case EXTSTORE_INIT_THREAD_FAIL:
+            rv = "failed to start IO thread";
+            break;
+    }
+    return rv;
+}
+
+void *extstore_init(char *fn, struct extstore_conf *cf,
+        enum extstore_res *res) {
+    unsigned int i;
+    store_engine *e = NULL;
+
+    if (cf->wbuf_size == 0 || cf->page_size % cf->wbuf_size != 0) {
+        *res = EXTSTORE_INIT_BAD_WBUF_SIZE;
+        return NULL;
+    }
+    if (cf->wbuf_count < 2) {
+        *res = EXTSTORE_INIT_NEED_MORE_WBUF;
+        return NULL;
+    }
+    if (cf->page_count < 2) {
+        *res = EXTSTORE_INIT_NEED_MORE_PAGES;
+        return NULL;
+    }
+
+    e = calloc(1, sizeof(store_engine));
+    if (e == NULL) {
+        *res = EXTSTORE_INIT_OOM;
+        return NULL;
+    }
+
+    e->fd = open(fn, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (e->fd < 0) {
+        *res = EXTSTORE_INIT_OPEN_FAIL;
+        free(e);
+        return NULL;
+    }
+
+    e->page_size = cf->page_size;
+    e->page_count = cf->page_count;
+    e->wbuf_size = cf->wbuf_size;
+    pthread_mutex_init(&e->mutex, NULL);
+    pthread_mutex_init(&e->write_mutex, NULL);
+
+    e->pages = calloc(e->page_count, sizeof(store_page));
+    if (e->pages == NULL) {
+        *res = EXTSTORE_INIT_OOM;
+        close(e->fd);
+        free(e);
+        return NULL;
+    }
+
+    /* Build the free list backwards so pages are used in file order. */
+    for (i = e->page_count; i > 0; i--) {
+        store_page *p = &e->pages[i-1];
+        pthread_mutex_init(&p->mutex, NULL);
+        p->id = i-1;
+        p->next = e->page_freelist;
+        e->page_freelist = p;
+        e->stats.pages_free++;
+    }
+
+    for (i = 0; i < cf->wbuf_count; i++) {
+        _store_wbuf *w = calloc(1, sizeof(_store_wbuf));
+        if (w == NULL || (w->buf = malloc(e->wbuf_size)) == NULL) {
+            *res = EXTSTORE_INIT_OOM;
+            return NULL;
+        }
+        w->size = e->wbuf_size;
+        w->next = e->wbuf_stack;
+        e->wbuf_stack = w;
+    }
+
+    e->io_threadcount = cf->io_threadcount ? cf->io_threadcount : 1;
+    e->io_threads = calloc(e->io_threadcount, sizeof(store_io_thread));
+    if (e->io_threads == NULL) {
+        *res = EXTSTORE_INIT_OOM;
+        return NULL;
+    }
+    for (i = 0; i < e->io_threadcount; i++) {
+        pthread_t thread;
+        store_io_thread *t = &e->io_threads[i];
+        pthread_mutex_init(&t->mutex, NULL);
+        pthread_cond_init(&t->cond, NULL);
+        t->e = e;
+        if (pthread_create(&thread, NULL, extstore_io_thread, t) != 0) {
+            *res = EXTSTORE_INIT_THREAD_FAIL;
+            return NULL;
+        }
+    }
+
+    return (void *)e;
+}
+
+/* Must be called with the page locked, and the page must not be the one
+ * currently taking writes. Takes the engine lock. */
+static void _free_page(store_engine *e, store_page *p) {
+    assert(!p->active);
+    assert(p->wbufs == NULL);
+    p->version = 0;
+    p->obj_count = 0;
+    p->bytes_used = 0;
+    p->allocated = 0;
+    p->closed = false;
+    p->compacting = false;
+    pthread_mutex_lock(&e->mutex);
+    p->next = e->page_freelist;
+    e->page_freelist = p;
+    e->stats.pages_free++;
+    e->stats.pages_used--;
+    pthread_mutex_unlock(&e->mutex);
+}
+
+/* Finds a page to write into next. Falls back to evicting the oldest closed
+ * page, which loses every object still in it. Called with write_mutex. */
+static store_page *_allocate_page(store_engine *e) {
+    store_page *p = NULL;
+    unsigned int i;
+
+    pthread_mutex_lock(&e->mutex);
+    if (e->page_freelist != NULL) {
+        p = e->page_freelist;
+        e->page_freelist = p->next;
+        e->stats.pages_free--;
+        e->stats.pages_used++;
+    }
+    pthread_mutex_unlock(&e->mutex);
+
+    if (p == NULL) {
+        store_page *oldest = NULL;
+        uint64_t oldest_version = UINT64_MAX;
+        for (i = 0; i < e->page_count; i++) {
+            store_page *tmp = &e->pages[i];
+            pthread_mutex_lock(&tmp->mutex);
+            if (tmp->closed && !tmp->compacting && tmp->wbufs == NULL
+                    && tmp->version < oldest_version) {
+                oldest = tmp;
+                oldest_version = tmp->version;
+            }
+            pthread_mutex_unlock(&tmp->mutex);
+        }
+        if (oldest == NULL)
+            return NULL;
+
+        pthread_mutex_lock(&oldest->mutex);
+        /* Only the writer can make pages eligible; recheck compaction. */
+        if (oldest->compacting || oldest->version != oldest_version) {
+            pthread_mutex_unlock(&oldest->mutex);
+            return NULL;
+        }
+        pthread_mutex_lock(&e->mutex);
+        e->stats.page_evictions++;
+        e->stats.objects_evicted += oldest->obj_count;
+        e->stats.bytes_evicted += oldest->bytes_used;
+        pthread_mutex_unlock(&e->mutex);
+        _free_page(e, oldest);
+        pthread_mutex_unlock(&oldest->mutex);
+
+        pthread_mutex_lock(&e->mutex);
+        p = e->page_freelist;
+        e->page_freelist = p->next;
+        e->stats.pages_free--;
+        e->stats.pages_used++;
+        pthread_mutex_unlock(&e->mutex);
+    }
+
+    pthread_mutex_lock(&p->mutex);
+    p->version = ++e->version;
+    p->active = true;
+    p->allocated = 0;
+    pthread_mutex_unlock(&p->mutex);
+
+    pthread_mutex_lock(&e->mutex);
+    e->stats.page_allocs++;
+    pthread_mutex_unlock(&e->mutex);
+    return p;
+}
+
+static store_io_thread *_get_io_thread(store_engine *e) {
+    unsigned int tid;
+    pthread_mutex_lock(&e->mutex);
+    tid = e->io_last++ % e->io_threadcount;
+    pthread_mutex_unlock(&e->mutex);
+    return &e->io_threads[tid];
+}
+
+static void _queue_io(store_engine *e, obj_io *io) {
+    store_io_thread *t = _get_io_thread(e);
+    obj_io *tail = io;
+    while (tail->next != NULL)
+        tail = tail->next;
+
+    pthread_mutex_lock(&t->mutex);
+    if (t->queue == NULL) {
+        t->queue = io;
+    } else {
+        t->queue_tail->next = io;
+    }
+    t->queue_tail = tail;
+    pthread_cond_signal(&t->cond);
+    pthread_mutex_unlock(&t->mutex);
+}
+
+/* Hands the current write buffer off to be flushed and sets up a fresh one,
+ * opening a new page if the current one is full. Called with write_mutex. */
+static int _allocate_wbuf(store_engine *e) {
+    _store_wbuf *w;
+    store_page *p;
+
+    if (e->wbuf != NULL) {
+        w = e->wbuf;
+        e->wbuf = NULL;
+        w->io.mode = OBJ_IO_WRITE;
+        w->io.buf = w->buf;
+        w->io.len = w->size;
+        w->io.offset = w->offset;
+        w->io.page_id = w->page_id;
+        w->io.data = w;
+        w->io.cb = _wbuf_cb;
+        w->io.next = NULL;
+        _queue_io(e, &w->io);
+    }
+
+    pthread_mutex_lock(&e->mutex);
+    w = e->wbuf_stack;
+    if (w != NULL)
+        e->wbuf_stack = w->next;
+    pthread_mutex_unlock(&e->mutex);
+    if (w == NULL)
+        return -1;
+
+    p = e->page_writing;
+    if (p != NULL && p->allocated + e->wbuf_size > e->page_size) {
+        pthread_mutex_lock(&p->mutex);
+        p->active = false;
+        p->closed = true;
+        /* Everything written to it may already be gone. */
+        if (p->obj_count == 0 && p->wbufs == NULL) {
+            pthread_mutex_lock(&e->mutex);
+            e->stats.page_reclaims++;
+            pthread_mutex_unlock(&e->mutex);
+            _free_page(e, p);
+        }
+        pthread_mutex_unlock(&p->mutex);
+        p = e->page_writing = NULL;
+    }
+    if (p == NULL) {
+        p = e->page_writing = _allocate_page(e);
+        if (p == NULL) {
+            pthread_mutex_lock(&e->mutex);
+            w->next = e->wbuf_stack;
+            e->wbuf_stack = w;
+            pthread_mutex_unlock(&e->mutex);
+            return -1;
+        }
+    }
+
+    memset(w->buf, 0, w->size);
+    w->buf_pos = w->buf;
+    w->free = w->size;
+    w->page_id = p->id;
+    pthread_mutex_lock(&p->mutex);
+    w->offset = p->allocated;
+    p->allocated += e->wbuf_size;
+    w->next = p->wbufs;
+    p->wbufs = w;
+    pthread_mutex_unlock(&p->mutex);
+
+    e->wbuf = w;
+    return 0;
+}
+
+int extstore_write_request(void *ptr, obj_io *io) {
+    store_engine *e = (store_engine *)ptr;
+    unsigned int len = io->len;
+    _store_wbuf *w;
+
+    if (len % EXTSTORE_ALIGN)
+        len += EXTSTORE_ALIGN - (len % EXTSTORE_ALIGN);
+    if (len > e->wbuf_size)
+        return -1;
+
+    pthread_mutex_lock(&e->write_mutex);
+    if (e->wbuf == NULL || e->wbuf->free < len) {
+        if (_allocate_wbuf(e) != 0) {
+            pthread_mutex_unlock(&e->write_mutex);
+            return -1;
+        }
+    }
+
+    w = e->wbuf;
+    io->buf = w->buf_pos;
+    io->page_id = w->page_id;
+    io->page_version = e->page_writing->version;
+    io->offset = w->offset + (w->buf_pos - w->buf);
+    io->mode = OBJ_IO_WRITE;
+    w->buf_pos += len;
+    w->free -= len;
+    /* write_mutex stays held until extstore_write() */
+    return 0;
+}
+
+void extstore_write(void *ptr, obj_io *io) {
+    store_engine *e = (store_engine *)ptr;
+    store_page *p = &e->pages[io->page_id];
+
+    pthread_mutex_lock(&p->mutex);
+    p->obj_count++;
+    p->bytes_used += io->len;
+    pthread_mutex_unlock(&p->mutex);
+
+    pthread_mutex_lock(&e->mutex);
+    e->stats.objects_written++;
+    e->stats.bytes_written += io->len;
+    pthread_mutex_unlock(&e->mutex);
+
+    pthread_mutex_unlock(&e->write_mutex);
+}
+
+int extstore_submit(void *ptr, obj_io *io) {
+    store_engine *e = (store_engine *)ptr;
+    _queue_io(e, io);
+    return 0;
+}
+
+int extstore_delete(void *ptr, unsigned int page_id, uint64_t page_version,
+        unsigned int count, unsigned int bytes) {
+    store_engine *e = (store_engine *)ptr;
+    store_page *p;
+    int ret = 0;
+
+    if (page_id >= e->page_count)
+        return -1;
+    p = &e->pages[page_id];
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->version == page_version) {
+        p->obj_count = p->obj_count > count ? p->obj_count - count : 0;
+        p->bytes_used = p->bytes_used > bytes ? p->bytes_used - bytes : 0;
+        if (p->obj_count == 0 && p->closed && !p->compacting
+                && p->wbufs == NULL) {
+            pthread_mutex_lock(&e->mutex);
+            e->stats.page_reclaims++;
+            pthread_mutex_unlock(&e->mutex);
+            _free_page(e, p);
+        }
+    } else {
+        ret = -1;
+    }
+    pthread_mutex_unlock(&p->mutex);
+    return ret;
+}
+
+int extstore_check(void *ptr, unsigned int page_id, uint64_t page_version) {
+    store_engine *e = (store_engine *)ptr;
+    store_page *p;
+    int ret;
+
+    if (page_id >= e->page_count)
+        return -1;
+    p = &e->pages[page_id];
+    pthread_mutex_lock(&p->mutex);
+    ret = (p->version == page_version) ? 0 : -1;
+    pthread_mutex_unlock(&p->mutex);
+    return ret;
+}
+
+int extstore_compact_pick(void *ptr, double max_frag, unsigned int *page_id,
+        uint64_t *page_version, unsigned int *page_len) {
+    store_engine *e = (store_engine *)ptr;
+    store_page *pick = NULL;
+    uint64_t pick_bytes = e->page_size * max_frag;
+    unsigned int i;
+
+    for (i = 0; i < e->page_count; i++) {
+        store_page *p = &e->pages[i];
+        pthread_mutex_lock(&p->mutex);
+        if (p->closed && !p->compacting && p->wbufs == NULL
+                && p->bytes_used < pick_bytes) {
+            pick = p;
+            pick_bytes = p->bytes_used;
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    if (pick == NULL)
+        return -1;
+
+    pthread_mutex_lock(&pick->mutex);
+    if (!pick->closed || pick->compacting || pick->wbufs != NULL) {
+        /* raced with a reclaim or eviction; try again later. */
+        pthread_mutex_unlock(&pick->mutex);
+        return -1;
+    }
+    pick->compacting = true;
+    *page_id = pick->id;
+    *page_version = pick->version;
+    *page_len = pick->allocated;
+    pthread_mutex_unlock(&pick->mutex);
+    return 0;
+}
+
+void extstore_compact_done(void *ptr, unsigned int page_id, uint64_t page_version) {
+    store_engine *e = (store_engine *)ptr;
+    store_page *p = &e->pages[page_id];
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->version == page_version) {
+        pthread_mutex_lock(&e->mutex);
+        e->stats.page_reclaims++;
+        pthread_mutex_unlock(&e->mutex);
+        _free_page(e, p);
+    }
+    pthread_mutex_unlock(&p->mutex);
+}
+
+void extstore_get_stats(void *ptr, struct extstore_stats *st) {
+    store_engine *e = (store_engine *)ptr;
+    unsigned int i;
+    uint64_t objects_used = 0, bytes_used = 0, bytes_fragmented = 0;
+
+    for (i = 0; i < e->page_count; i++) {
+        store_page *p = &e->pages[i];
+        pthread_mutex_lock(&p->mutex);
+        if (p->version != 0) {
+            objects_used += p->obj_count;
+            bytes_used += p->bytes_used;
+            if (p->closed) {
+                bytes_fragmented += e->page_size - p->bytes_used;
+            }
+        }
+        pthread_mutex_unlock(&p->mutex);
+    }
+
+    pthread_mutex_lock(&e->mutex);
+    memcpy(st, &e->stats, sizeof(struct extstore_stats));
+    pthread_mutex_unlock(&e->mutex);
+    st->objects_used = objects_used;
+    st->bytes_used = bytes_used;
+    st->bytes_fragmented = bytes_fragmented;
+}
+
+/* Write buffer has hit the disk: readers must go to the file from now on. */
+static void _wbuf_cb(void *ep, obj_io *io, int ret) {
+    store_engine *e = (store_engine *)ep;
+    _store_wbuf *w = (_store_wbuf *)io->data;
+    store_page *p = &e->pages[w->page_id];
+    _store_wbuf **prev;
+
+    pthread_mutex_lock(&p->mutex);
+    for (prev = &p->wbufs; *prev != NULL; prev = &(*prev)->next) {
+        if (*prev == w) {
+            *prev = w->next;
+            break;
+        }
+    }
+    if (p->closed && p->wbufs == NULL && p->obj_count == 0
+            && !p->compacting) {
+        pthread_mutex_lock(&e->mutex);
+        e->stats.page_reclaims++;
+        pthread_mutex_unlock(&e->mutex);
+        _free_page(e, p);
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    pthread_mutex_lock(&e->mutex);
+    w->next = e->wbuf_stack;
+    e->wbuf_stack = w;
+    pthread_mutex_unlock(&e->mutex);
+}
+
+static int _read_io(store_engine *e, obj_io *io) {
+    store_page *p;
+    _store_wbuf *w;
+    off_t off;
+    ssize_t ret;
+
+    if (io->page_id >= e->page_count)
+        return -1;
+    p = &e->pages[io->page_id];
+
+    pthread_mutex_lock(&p->mutex);
+    if (p->version != io->page_version) {
+        pthread_mutex_unlock(&p->mutex);
+        return -1;
+    }
+    /* Objects in a write buffer that hasn't hit the disk yet. */
+    for (w = p->wbufs; w != NULL; w = w->next) {
+        if (io->offset >= w->offset
+                && io->offset + io->len <= w->offset + w->size) {
+            memcpy(io->buf, w->buf + (io->offset - w->offset), io->len);
+            pthread_mutex_unlock(&p->mutex);
+            ret = io->len;
+            goto done;
+        }
+    }
+    pthread_mutex_unlock(&p->mutex);
+
+    off = (off_t)io->page_id * e->page_size + io->offset;
+    do {
+        ret = pread(e->fd, io->buf, io->len, off);
+    } while (ret == -1 && errno == EINTR);
+
+    /* The page could have been reclaimed and rewritten under us. */
+    pthread_mutex_lock(&p->mutex);
+    if (p->version != io->page_version)
+        ret = -1;
+    pthread_mutex_unlock(&p->mutex);
+
+done:
+    if (ret > 0) {
+        pthread_mutex_lock(&e->mutex);
+        e->stats.objects_read++;
+        e->stats.bytes_read += ret;
+        pthread_mutex_unlock(&e->mutex);
+    }
+    return ret;
+}
+
+static int _write_io(store_engine *e, obj_io *io) {
+    off_t off = (off_t)io->page_id * e->page_size + io->offset;
+    unsigned int done = 0;
+    ssize_t ret;
+
+    while (done < io->len) {
+        ret = pwrite(e->fd, io->buf + done, io->len - done, off + done);
+        if (ret == -1 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return -1;
+        done += ret;
+    }
+    return done;
+}
+
+static void *extstore_io_thread(void *arg) {
+    store_io_thread *me = (store_io_thread *)arg;
+    store_engine *e = me->e;
+
+    while (1) {
+        obj_io *io, *next;
+        pthread_mutex_lock(&me->mutex);
+        while (me->queue == NULL) {
+            pthread_cond_wait(&me->cond, &me->mutex);
+        }
+        io = me->queue;
+        me->queue = me->queue_tail = NULL;
+        pthread_mutex_unlock(&me->mutex);
+
+        for (; io != NULL; io = next) {
+            int ret;
+            /* The callback may free or reuse the io. */
+            next = io->next;
+            if (io->mode == OBJ_IO_READ) {
+                ret = _read_io(e, io);
+            } else {
+                ret = _write_io(e, io);
+            }
+            io->cb(e, io, ret);
+        }
+    }
+
+    return NULL;
+}
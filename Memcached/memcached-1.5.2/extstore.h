@@ -0,0 +1,95 @@
+#ifndef EXTSTORE_H
+#define EXTSTORE_H
+
+/* A flash-backed append-only object store.
+ *
+ * Objects are copied into in-memory write buffers which are flushed
+ * sequentially into large pages of a single file. Callers remember the
+ * (page_id, page_version, offset) of each object; once a page is evicted,
+ * compacted or emptied its version changes and old references read back as
+ * misses. The store knows nothing about items or keys: indexing, validation
+ * and rescuing of live objects is up to the caller.
+ */
+
+struct extstore_stats {
+    uint64_t page_allocs;
+    uint64_t page_evictions; /* pages reclaimed with objects still in them */
+    uint64_t page_reclaims; /* pages freed because they became empty */
+    uint64_t pages_free;
+    uint64_t pages_used;
+    uint64_t objects_evicted;
+    uint64_t objects_read;
+    uint64_t objects_written;
+    uint64_t objects_used; /* live objects */
+    uint64_t bytes_evicted;
+    uint64_t bytes_written;
+    uint64_t bytes_read;
+    uint64_t bytes_used; /* bytes of live objects */
+    uint64_t bytes_fragmented; /* dead space in closed pages */
+};
+
+struct extstore_conf {
+    unsigned int page_size; /* ideally 64-256M in size */
+    unsigned int page_count;
+    unsigned int wbuf_size; /* must divide evenly into page_size */
+    unsigned int wbuf_count; /* write buffers which may be in flight */
+    unsigned int io_threadcount;
+};
+
+enum obj_io_mode {
+    OBJ_IO_READ = 0,
+    OBJ_IO_WRITE,
+};
+
+typedef struct _obj_io obj_io;
+typedef void (*obj_io_cb)(void *e, obj_io *io, int ret);
+
+/* An IO request. For reads, buf/len/offset/page_id/page_version and cb must
+ * be filled in by the caller; reads may be chained via next and submitted
+ * together. For writes, extstore_write_request() fills in everything but the
+ * data and len.
+ */
+struct _obj_io {
+    void *data; /* user supplied data pointer */
+    struct _obj_io *next;
+    char *buf; /* buffer of data to read into or write from */
+    unsigned int len; /* for both reads and writes */
+    unsigned int offset; /* offset into the page */
+    unsigned int page_id;
+    uint64_t page_version;
+    enum obj_io_mode mode;
+    obj_io_cb cb;
+};
+
+enum extstore_res {
+    EXTSTORE_INIT_BAD_WBUF_SIZE = 1,
+    EXTSTORE_INIT_NEED_MORE_WBUF,
+    EXTSTORE_INIT_NEED_MORE_PAGES,
+    EXTSTORE_INIT_OOM,
+    EXTSTORE_INIT_OPEN_FAIL,
+    EXTSTORE_INIT_THREAD_FAIL,
+};
+
+const char *extstore_err(enum extstore_res res);
+void *extstore_init(char *fn, struct extstore_conf *cf, enum extstore_res *res);
+/* Reserves len bytes in the current write buffer. On success the write lock
+ * is held until extstore_write() is called: copy the object into io->buf
+ * and commit it immediately. Returns -1 if no buffer space is available. */
+int extstore_write_request(void *ptr, obj_io *io);
+void extstore_write(void *ptr, obj_io *io);
+/* Queues a chain of reads. The callback's ret is the number of bytes read,
+ * or < 1 if the read failed or the page was reclaimed. Callbacks run from
+ * an IO thread. */
+int extstore_submit(void *ptr, obj_io *io);
+/* Informs the store that objects in a page are no longer referenced. */
+int extstore_delete(void *ptr, unsigned int page_id, uint64_t page_version,
+        unsigned int count, unsigned int bytes);
+int extstore_check(void *ptr, unsigned int page_id, uint64_t page_version);
+/* Picks the emptiest closed page below max_frag fill for compaction. The
+ * page is held until extstore_compact_done() frees it. */
+int extstore_compact_pick(void *ptr, double max_frag, unsigned int *page_id,
+        uint64_t *page_version, unsigned int *page_len);
+void extstore_compact_done(void *ptr, unsigned int page_id, uint64_t page_version);
+void extstore_get_stats(void *ptr, struct extstore_stats *st);
+
+#endif
@@ -0,0 +1,129 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Throughput of the hash table algorithms against key length.
+ *
+ *   ./hashbench [-n iterations] [-l len,len,...]
+ *
+ * Prints one row per key length with nanoseconds per hash and GB/s for each
+ * algorithm selectable with -o hash_algorithm. The keys are rotated through a
+ * small buffer so the loop isn't hashing the same bytes from L1 every time,
+ * but it's still a cache-resident microbenchmark; it says nothing about what
+ * the rest of a request costs.
+ */
+#include "config.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "jenkins_hash.h"
+#include "murmur3_hash.h"
+#include "xxh3_hash.h"
+
+typedef uint32_t (*hash_func)(const void *key, size_t length);
+
+static const struct {
+    const char *name;
+    hash_func func;
+} algos[] = {
+    { "jenkins", jenkins_hash },
+    { "murmur3", MurmurHash3_x86_32 },
+    { "xxh3", xxh3_hash },
+};
+#define ALGO_COUNT (sizeof(algos) / sizeof(algos[0]))
+
+#define KEY_SLOTS 64
+#define MAX_KEY_LEN 250
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double bench(hash_func func, const char *keys, size_t len,
+        unsigned long iterations) {
+    volatile uint32_t sink = 0;
+    uint32_t acc = 0;
+    unsigned long i;
+    uint64_t start = now_ns();
+    for (i = 0; i < iterations; i++) {
+        acc += func(keys + (i % KEY_SLOTS) * MAX_KEY_LEN, len);
+    }
+    sink = acc;
+    (void)sink;
+    return (double)(now_ns() - start) / iterations;
+}
+
+static void usage(void) {
+    fprintf(stderr, "Usage: hashbench [-n iterations] [-l len,len,...]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv) {
+    static const size_t default_lens[] = { 4, 8, 16, 32, 64, 128, 250 };
+    size_t lens[64];
+    size_t nlens = 0;
+    unsigned long iterations = 20000000;
+    char *keys;
+    size_t i, a;
+    int c;
+
+    while ((c = getopt(argc, argv, "n:l:h")) != -1) {
+        switch (c) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            if (iterations == 0)
+                usage();
+            break;
+        case 'l': {
+            char *tok = strtok(optarg, ",");
+            for (; tok != NULL && nlens < sizeof(lens) / sizeof(lens[0]);
+                    tok = strtok(NULL, ",")) {
+                long len = strtol(tok, NULL, 10);
+                if (len < 1 || len > MAX_KEY_LEN) {
+                    fprintf(stderr, "Key lengths must be 1-%d\n", MAX_KEY_LEN);
+                    exit(2);
+                }
+                lens[nlens++] = len;
+            }
+            break;
+        }
+        default:
+            usage();
+        }
+    }
+    if (nlens == 0) {
+        nlens = sizeof(default_lens) / sizeof(default_lens[0]);
+        memcpy(lens, default_lens, sizeof(default_lens));
+    }
+
+    keys = malloc(KEY_SLOTS * MAX_KEY_LEN);
+    if (keys == NULL) {
+        fprintf(stderr, "Failed to allocate keys\n");
+        return 2;
+    }
+    srand(1);
+    for (i = 0; i < KEY_SLOTS * MAX_KEY_LEN; i++) {
+        keys[i] = 'a' + rand() % 26;
+    }
+
+    printf("%6s", "keylen");
+    for (a = 0; a < ALGO_COUNT; a++) {
+        printf("  %9s ns  %6s", algos[a].name, "GB/s");
+    }
+    printf("\n");
+    for (i = 0; i < nlens; i++) {
+        printf("%6zu", lens[i]);
+        for (a = 0; a < ALGO_COUNT; a++) {
+            double ns = bench(algos[a].func, keys, lens[i], iterations);
+            printf("  %12.2f  %6.2f", ns, lens[i] / ns);
+        }
+        printf("\n");
+    }
+    free(keys);
+    return 0;
+}
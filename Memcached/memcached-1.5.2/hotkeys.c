@@ -0,0 +1,236 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hot key tracking: a count-min sketch estimates how often each sampled key
+ * was fetched, and a small min-heap keeps the keys with the highest
+ * estimates. Only the logger thread adds samples, so the lock is normally
+ * uncontended; "stats hotkeys" takes it briefly to copy the heap out.
+ */
+#include "memcached.h"
+#include "hotkeys.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define HOTKEYS_DEPTH 4
+#define HOTKEYS_WIDTH 4096 /* counters per row, power of two */
+#define HOTKEYS_TOP 32
+/* Halve every count after this many samples, so old hot keys fade out. */
+#define HOTKEYS_DECAY (1 << 16)
+
+typedef struct {
+    uint32_t count; /* estimated samples */
+    uint32_t hv;
+    uint8_t nkey;
+    char key[KEY_MAX_LENGTH + 1];
+} hotkey;
+
+static pthread_mutex_t hotkeys_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint32_t *hotkeys_sketch = NULL; /* NULL while disabled */
+static hotkey hotkeys_heap[HOTKEYS_TOP]; /* min-heap on count */
+static int hotkeys_used = 0;
+static unsigned int hotkeys_samples = 0;
+
+static void hotkeys_heap_swap(int a, int b) {
+    hotkey tmp = hotkeys_heap[a];
+    hotkeys_heap[a] = hotkeys_heap[b];
+    hotkeys_heap[b] = tmp;
+}
+
+static void hotkeys_heap_up(int i) {
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (hotkeys_heap[parent].count <= hotkeys_heap[i].count)
+            break;
+        hotkeys_heap_swap(parent, i);
+        i = parent;
+    }
+}
+
+static void hotkeys_heap_down(int i) {
+    while (1) {
+        int least = i;
+        int l = i * 2 + 1;
+        int r = l + 1;
+        if (l < hotkeys_used && hotkeys_heap[l].count < hotkeys_heap[least].count)
+            least = l;
+        if (r < hotkeys_used && hotkeys_heap[r].count < hotkeys_heap[least].count)
+            least = r;
+        if (least == i)
+            break;
+        hotkeys_heap_swap(least, i);
+        i = least;
+    }
+}
+
+static void hotkeys_decay(void) {
+    int x;
+    for (x = 0; x < HOTKEYS_DEPTH * HOTKEYS_WIDTH; x++) {
+        hotkeys_sketch[x] >>= 1;
+    }
+    /* Halving keeps the heap ordered. */
+    for (x = 0; x < hotkeys_used; x++) {
+        hotkeys_heap[x].count >>= 1;
+    }
+    hotkeys_samples = 0;
+}
+
+/* CALLED WITH hotkeys_lock HELD */
+static void do_hotkeys_reset(void) {
+    hotkeys_used = 0;
+    hotkeys_samples = 0;
+    if (hotkeys_sketch != NULL) {
+        memset(hotkeys_sketch, 0,
+                sizeof(uint32_t) * HOTKEYS_DEPTH * HOTKEYS_WIDTH);
+    }
+}
+
+/* CALLED WITH hotkeys_lock HELD */
+static bool do_hotkeys_alloc(void) {
+    if (hotkeys_sketch == NULL) {
+        hotkeys_sketch = calloc(HOTKEYS_DEPTH * HOTKEYS_WIDTH, sizeof(uint32_t));
+        if (hotkeys_sketch == NULL)
+            return false;
+        do_hotkeys_reset();
+    }
+    return true;
+}
+
+void hotkeys_init(void) {
+    pthread_mutex_lock(&hotkeys_lock);
+    if (!do_hotkeys_alloc()) {
+        fprintf(stderr, "Failed to allocate hot key tracker\n");
+    }
+    pthread_mutex_unlock(&hotkeys_lock);
+    logger_set_hotkeys(hotkeys_sketch != NULL);
+}
+
+bool hotkeys_status(void) {
+    bool ret;
+    pthread_mutex_lock(&hotkeys_lock);
+    ret = hotkeys_sketch != NULL;
+    pthread_mutex_unlock(&hotkeys_lock);
+    return ret;
+}
+
+void hotkeys_sample(const char *key, const int nkey) {
+    uint32_t hv, step, est = UINT32_MAX;
+    int x;
+
+    if (nkey > KEY_MAX_LENGTH)
+        return;
+    hv = hash(key, nkey);
+    /* Rows are indexed by hv + row * step, a cheap second hash. */
+    step = ((hv >> 16) | (hv << 16)) * 0x9E3779B1 | 1;
+
+    pthread_mutex_lock(&hotkeys_lock);
+    if (hotkeys_sketch == NULL) {
+        pthread_mutex_unlock(&hotkeys_lock);
+        return;
+    }
+    for (x = 0; x < HOTKEYS_DEPTH; x++) {
+        uint32_t *ctr = &hotkeys_sketch[x * HOTKEYS_WIDTH
+            + ((hv + x * step) & (HOTKEYS_WIDTH - 1))];
+        if (*ctr < UINT32_MAX)
+            (*ctr)++;
+        if (*ctr < est)
+            est = *ctr;
+    }
+
+    for (x = 0; x < hotkeys_used; x++) {
+        hotkey *hk = &hotkeys_heap[x];
+        if (hk->hv == hv && hk->nkey == nkey && memcmp(hk->key, key, nkey) == 0)
+            break;
+    }
+    if (x < hotkeys_used) {
+        hotkeys_heap[x].count = est;
+        hotkeys_heap_down(x);
+    } else if (hotkeys_used < HOTKEYS_TOP || est > hotkeys_heap[0].count) {
+        if (hotkeys_used < HOTKEYS_TOP) {
+            x = hotkeys_used++;
+        } else {
+            x = 0;
+        }
+        hotkeys_heap[x].count = est;
+        hotkeys_heap[x].hv = hv;
+        hotkeys_heap[x].nkey = nkey;
+        memcpy(hotkeys_heap[x].key, key, nkey);
+        hotkeys_heap[x].key[nkey] = '\0';
+        if (x == 0) {
+            hotkeys_heap_down(x);
+        } else {
+            hotkeys_heap_up(x);
+        }
+    }
+
+    if (++hotkeys_samples >= HOTKEYS_DECAY)
+        hotkeys_decay();
+    pthread_mutex_unlock(&hotkeys_lock);
+}
+
+static int hotkeys_cmp(const void *a, const void *b) {
+    const hotkey *ha = a;
+    const hotkey *hb = b;
+    if (ha->count == hb->count)
+        return 0;
+    return ha->count < hb->count ? 1 : -1;
+}
+
+/* Lists tracked keys, hottest first, with their estimated fetch counts. */
+void hotkeys_stats(ADD_STAT add_stats, void *c) {
+    hotkey top[HOTKEYS_TOP];
+    int used = 0;
+    int x;
+    bool enabled;
+
+    pthread_mutex_lock(&hotkeys_lock);
+    enabled = hotkeys_sketch != NULL;
+    if (enabled) {
+        used = hotkeys_used;
+        memcpy(top, hotkeys_heap, sizeof(hotkey) * used);
+    }
+    pthread_mutex_unlock(&hotkeys_lock);
+
+    if (enabled) {
+        /* Binary protocol keys may hold any byte, so encode them the same
+         * way metadump does before they go into a STAT line. */
+        char keybuf[KEY_MAX_LENGTH * 3 + 1];
+        qsort(top, used, sizeof(hotkey), hotkeys_cmp);
+        for (x = 0; x < used; x++) {
+            uriencode(top[x].key, keybuf, top[x].nkey, sizeof(keybuf));
+            APPEND_STAT(keybuf, "%llu", (unsigned long long)top[x].count
+                    * settings.hotkeys_sample);
+        }
+    } else {
+        APPEND_STAT("hotkeys_status", "disabled", "");
+    }
+
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
+void hotkeys_enable(ADD_STAT add_stats, void *c) {
+    bool ok;
+    pthread_mutex_lock(&hotkeys_lock);
+    ok = do_hotkeys_alloc();
+    pthread_mutex_unlock(&hotkeys_lock);
+
+    if (ok) {
+        logger_set_hotkeys(true);
+        APPEND_STAT("hotkeys_status", "enabled", "");
+    } else {
+        APPEND_STAT("hotkeys_status", "error", "");
+        APPEND_STAT("hotkeys_error", "no_memory", "");
+    }
+    add_stats(NULL, 0, NULL, 0, c);
+}
+
+void hotkeys_disable(ADD_STAT add_stats, void *c) {
+    /* Stop the workers first; samples already queued are then dropped. */
+    logger_set_hotkeys(false);
+    pthread_mutex_lock(&hotkeys_lock);
+    free(hotkeys_sketch);
+    hotkeys_sketch = NULL;
+    hotkeys_used = 0;
+    pthread_mutex_unlock(&hotkeys_lock);
+
+    APPEND_STAT("hotkeys_status", "disabled", "");
+    add_stats(NULL, 0, NULL, 0, c);
+}
@@ -0,0 +1,14 @@
+#ifndef HOTKEYS_H
+#define HOTKEYS_H
+
+/* Heavy hitter tracking for "stats hotkeys". Workers sample keys from fetches
+ * into their logger buffers; the logger thread feeds them to the sketch. */
+
+void hotkeys_init(void);
+bool hotkeys_status(void);
+void hotkeys_sample(const char *key, const int nkey);
+void hotkeys_stats(ADD_STAT add_stats, void *c);
+void hotkeys_enable(ADD_STAT add_stats, void *c);
+void hotkeys_disable(ADD_STAT add_stats, void *c);
+
+#endif
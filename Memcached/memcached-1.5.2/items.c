@@ -2,6 +2,9 @@
 #include "memcached.h"
 #include "bipbuffer.h"
 #include "slab_automove.h"
+#ifdef EXTSTORE
+#include "storage.h"
+#endif
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
@@ -16,6 +19,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <poll.h>
+#include <limits.h>
 
 /* Forward Declarations */
 static void item_link_q(item *it);
@@ -61,12 +65,53 @@ static int lru_maintainer_initialized = 0;
 static pthread_mutex_t lru_maintainer_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t cas_id_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t stats_sizes_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef EXTSTORE
+/* External storage engine, set when the LRU maintainer is started */
+static void *storage;
+#endif
+
+/* Ghosts of items evicted from a class, for -o lru_autotune. The key hashes
+ * go into one of two small bloom filters, by whether the item had been
+ * fetched since it was set, and are looked up when a missing key is stored
+ * again. Each filter has two generations, so a ghost is forgotten once
+ * another LRU_GHOST_MAX evictions of its kind have come along. */
+#define LRU_GHOST_BITS (1 << 15)
+#define LRU_GHOST_MAX (LRU_GHOST_BITS / 8)
+enum lru_ghost_kind {
+    GHOST_RECENT = 0, /* evicted without a fetch: HOT was too small */
+    GHOST_FREQUENT    /* evicted after a fetch: WARM was too small */
+};
+
+typedef struct {
+    uint8_t bits[2][2][LRU_GHOST_BITS / 8]; /* [kind][generation] */
+    unsigned int added[2];
+    int gen[2];
+} lru_ghosts;
+
+/* Per class split of HOT and WARM, moved by ghost hits. Guarded by the
+ * class's COLD_LRU lock, since that's where evictions happen. */
+typedef struct {
+    lru_ghosts *ghosts; /* allocated on the first eviction */
+    int hot_pct;
+    int warm_pct;
+    uint64_t window_hits[2];
+    uint64_t ghost_hits[2];
+    rel_time_t window_start;
+} lru_tune_t;
+
+static lru_tune_t lru_tune[MAX_NUMBER_OF_SLAB_CLASSES];
+/* Most HOT and WARM may move per window, in pct of slab memory */
+#define LRU_TUNE_MAX_STEP 5
 
 void item_stats_reset(void) {
     int i;
     for (i = 0; i < LARGEST_ID; i++) {
         pthread_mutex_lock(&lru_locks[i]);
         memset(&itemstats[i], 0, sizeof(itemstats_t));
+        if (GET_LRU(i) == COLD_LRU) {
+            memset(lru_tune[CLEAR_LRU(i)].ghost_hits, 0,
+                    sizeof(lru_tune[0].ghost_hits));
+        }
         pthread_mutex_unlock(&lru_locks[i]);
     }
 }
@@ -101,16 +146,25 @@ static pthread_mutex_t bump_buf_lock = PTHREAD_MUTEX_INITIALIZER;
 static bool lru_bump_async(lru_bump_buf *b, item *it, uint32_t hv);
 static uint64_t lru_total_bumps_dropped(void);
 
+static uint64_t cas_id = 0;
+
 /* Get the next CAS id for a new item. */
 /* TODO: refactor some atomics for this. */
 uint64_t get_cas_id(void) {
-    static uint64_t cas_id = 0;
     pthread_mutex_lock(&cas_id_lock);
     uint64_t next_id = ++cas_id;
     pthread_mutex_unlock(&cas_id_lock);
     return next_id;
 }
 
+/* Continue from a CAS counter saved before a warm restart. */
+void set_cas_id(uint64_t new_cas) {
+    pthread_mutex_lock(&cas_id_lock);
+    if (new_cas > cas_id)
+        cas_id = new_cas;
+    pthread_mutex_unlock(&cas_id_lock);
+}
+
 int item_is_flushed(item *it) {
     rel_time_t oldest_live = settings.oldest_live;
     uint64_t cas = ITEM_get_cas(it);
@@ -160,8 +214,9 @@ static unsigned int temp_lru_size(int slabs_clsid) {
 static size_t item_make_header(const uint8_t nkey, const unsigned int flags, const int nbytes,
                      char *suffix, uint8_t *nsuffix) {
     if (settings.inline_ascii_response) {
-        /* suffix is defined at 40 chars elsewhere.. */
-        *nsuffix = (uint8_t) snprintf(suffix, 40, " %u %d\r\n", flags, nbytes - 2);
+        /* suffix is defined at 40 chars elsewhere.. The separating space
+         * goes in the key's terminator byte; see do_item_alloc(). */
+        *nsuffix = (uint8_t) snprintf(suffix, 40, "%u %d\r\n", flags, nbytes - 2);
     } else {
         if (flags == 0) {
             *nsuffix = 0;
@@ -319,6 +374,9 @@ item *do_item_alloc(char *key, const size_t nkey, const unsigned int flags,
     memcpy(ITEM_key(it), key, nkey);
     it->exptime = exptime;
     if (settings.inline_ascii_response) {
+        /* "key flags bytes\r\ndata\r\n" is then one contiguous span, so an
+         * ASCII hit is sent as "VALUE " plus a single iovec. */
+        ITEM_key(it)[nkey] = ' ';
         memcpy(ITEM_suffix(it), suffix, (size_t)nsuffix);
     } else if (nsuffix > 0) {
         memcpy(ITEM_suffix(it), &flags, sizeof(flags));
@@ -352,6 +410,11 @@ void item_free(item *it) {
     /* so slab size changer can tell later if item is already free or not */
     clsid = ITEM_clsid(it);
     DEBUG_REFCNT(it, 'F');
+#ifdef EXTSTORE
+    if (it->it_flags & ITEM_HDR) {
+        storage_delete(storage, it);
+    }
+#endif
     slabs_free(it, ntotal, clsid);
 }
 
@@ -437,6 +500,13 @@ static void item_unlink_q(item *it) {
 int do_item_link(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_LINK(ITEM_key(it), it->nkey, it->nbytes);
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
+    /* The slab mover and the crawlers lock a linked item by its hv without
+     * holding any lock yet, so it has to be there before ITEM_LINKED is;
+     * otherwise they can pick up the previous owner's hv from the chunk. */
+    it->hv = hv;
+#ifdef HAVE_GCC_ATOMICS
+    __sync_synchronize();
+#endif
     it->it_flags |= ITEM_LINKED;
     it->time = current_time;
 
@@ -456,6 +526,29 @@ int do_item_link(item *it, const uint32_t hv) {
     return 1;
 }
 
+/* Relinks an item found in a reused slab page during a warm restart. Only
+ * called before the worker threads start, so nothing is locked. Returns false
+ * if the item is expired, flushed or a duplicate; the caller frees it. */
+bool do_item_restore(item *it) {
+    uint32_t hv = hash(ITEM_key(it), it->nkey);
+
+    if ((it->exptime != 0 && it->exptime <= current_time)
+            || item_is_flushed(it)
+            || assoc_find(ITEM_key(it), it->nkey, hv) != NULL) {
+        return false;
+    }
+
+    it->hv = hv;
+    it->refcount = 1;
+    stats_state.curr_bytes += ITEM_ntotal(it);
+    stats_state.curr_items += 1;
+    assoc_insert(it, hv);
+    do_item_link_q(it);
+    item_stats_sizes_add(it);
+
+    return true;
+}
+
 void do_item_unlink(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_UNLINK(ITEM_key(it), it->nkey, it->nbytes);
     if ((it->it_flags & ITEM_LINKED) != 0) {
@@ -696,9 +789,11 @@ void item_stats(ADD_STAT add_stats, void *c) {
     struct thread_stats thread_stats;
     threadlocal_stats_aggregate(&thread_stats);
     itemstats_t totals;
+    lru_tune_t tune;
     int n;
     for (n = 0; n < MAX_NUMBER_OF_SLAB_CLASSES; n++) {
         memset(&totals, 0, sizeof(itemstats_t));
+        memset(&tune, 0, sizeof(lru_tune_t));
         int x;
         int i;
         unsigned int size = 0;
@@ -737,8 +832,10 @@ void item_stats(ADD_STAT add_stats, void *c) {
             } else if (lru_type_map[x] == WARM_LRU && tails[i] != NULL) {
                 age_warm = current_time - tails[i]->time;
             }
-            if (lru_type_map[x] == COLD_LRU)
+            if (lru_type_map[x] == COLD_LRU) {
                 totals.evicted_time = itemstats[i].evicted_time;
+                tune = lru_tune[n];
+            }
             switch (lru_type_map[x]) {
                 case HOT_LRU:
                     totals.hits_to_hot = thread_stats.lru_hits[i];
@@ -817,6 +914,16 @@ void item_stats(ADD_STAT add_stats, void *c) {
                                 "%llu", (unsigned long long)totals.hits_to_temp);
 
         }
+        if (settings.lru_autotune) {
+            APPEND_NUM_FMT_STAT(fmt, n, "hot_lru_pct", "%d",
+                                tune.hot_pct ? tune.hot_pct : settings.hot_lru_pct);
+            APPEND_NUM_FMT_STAT(fmt, n, "warm_lru_pct", "%d",
+                                tune.warm_pct ? tune.warm_pct : settings.warm_lru_pct);
+            APPEND_NUM_FMT_STAT(fmt, n, "ghost_hits_recent", "%llu",
+                                (unsigned long long)tune.ghost_hits[GHOST_RECENT]);
+            APPEND_NUM_FMT_STAT(fmt, n, "ghost_hits_frequent", "%llu",
+                                (unsigned long long)tune.ghost_hits[GHOST_FREQUENT]);
+        }
     }
 
     /* getting here means both ascii and binary terminators fit */
@@ -916,6 +1023,36 @@ void item_stats_sizes(ADD_STAT add_stats, void *c) {
     mutex_unlock(&stats_sizes_lock);
 }
 
+/* Marks an item as fetched, and moves it up the LRU. Callers which look at
+ * an item's hit markers before bumping it fetch it with DONT_UPDATE and call
+ * this themselves. */
+void do_item_bump(conn *c, item *it, const uint32_t hv) {
+    /* We update the hit markers only during fetches.
+     * An item needs to be hit twice overall to be considered
+     * ACTIVE, but only needs a single hit to maintain activity
+     * afterward.
+     * FETCHED tells if an item has ever been active.
+     */
+    if (settings.lru_segmented) {
+        if ((it->it_flags & ITEM_ACTIVE) == 0) {
+            if ((it->it_flags & ITEM_FETCHED) == 0) {
+                it->it_flags |= ITEM_FETCHED;
+            } else {
+                it->it_flags |= ITEM_ACTIVE;
+                if (ITEM_lruid(it) != COLD_LRU) {
+                    do_item_update(it); // bump LA time
+                } else if (!lru_bump_async(c->thread->lru_bump_buf, it, hv)) {
+                    // add flag before async bump to avoid race.
+                    it->it_flags &= ~ITEM_ACTIVE;
+                }
+            }
+        }
+    } else {
+        it->it_flags |= ITEM_FETCHED;
+        do_item_update(it);
+    }
+}
+
 /** wrapper around assoc_find which does the lazy expiration logic */
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c, const bool do_update) {
     item *it = assoc_find(key, nkey, hv);
@@ -982,30 +1119,7 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c
             was_found = 3;
         } else {
             if (do_update) {
-                /* We update the hit markers only during fetches.
-                 * An item needs to be hit twice overall to be considered
-                 * ACTIVE, but only needs a single hit to maintain activity
-                 * afterward.
-                 * FETCHED tells if an item has ever been active.
-                 */
-                if (settings.lru_segmented) {
-                    if ((it->it_flags & ITEM_ACTIVE) == 0) {
-                        if ((it->it_flags & ITEM_FETCHED) == 0) {
-                            it->it_flags |= ITEM_FETCHED;
-                        } else {
-                            it->it_flags |= ITEM_ACTIVE;
-                            if (ITEM_lruid(it) != COLD_LRU) {
-                                do_item_update(it); // bump LA time
-                            } else if (!lru_bump_async(c->thread->lru_bump_buf, it, hv)) {
-                                // add flag before async bump to avoid race.
-                                it->it_flags &= ~ITEM_ACTIVE;
-                            }
-                        }
-                    }
-                } else {
-                    it->it_flags |= ITEM_FETCHED;
-                    do_item_update(it);
-                }
+                do_item_bump(c, it, hv);
             }
             DEBUG_REFCNT(it, '+');
         }
@@ -1016,6 +1130,9 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, conn *c
     /* For now this is in addition to the above verbose logging. */
     LOGGER_LOG(c->thread->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, was_found, key, nkey,
                (it) ? ITEM_clsid(it) : 0);
+    /* Stores and deletes look the key up too; only count fetches. */
+    if (do_update)
+        LOGGER_HOTKEY_SAMPLE(c->thread->l, key, nkey);
 
     return it;
 }
@@ -1029,6 +1146,75 @@ item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
     return it;
 }
 
+/* Called with the class's COLD_LRU lock held */
+static void lru_ghost_add(const int id, const uint32_t hv, const int kind) {
+    lru_tune_t *t = &lru_tune[id];
+    uint32_t b1 = hv & (LRU_GHOST_BITS - 1);
+    uint32_t b2 = (hv >> 16) & (LRU_GHOST_BITS - 1);
+    uint8_t *bits;
+
+    if (t->ghosts == NULL) {
+        t->ghosts = calloc(1, sizeof(lru_ghosts));
+        if (t->ghosts == NULL)
+            return;
+    }
+    if (t->ghosts->added[kind] >= LRU_GHOST_MAX) {
+        t->ghosts->gen[kind] ^= 1;
+        memset(t->ghosts->bits[kind][t->ghosts->gen[kind]], 0,
+                LRU_GHOST_BITS / 8);
+        t->ghosts->added[kind] = 0;
+    }
+    bits = t->ghosts->bits[kind][t->ghosts->gen[kind]];
+    bits[b1 / 8] |= 1 << (b1 % 8);
+    bits[b2 / 8] |= 1 << (b2 % 8);
+    t->ghosts->added[kind]++;
+}
+
+static bool lru_ghost_find(lru_ghosts *g, const uint32_t hv, const int kind) {
+    uint32_t b1 = hv & (LRU_GHOST_BITS - 1);
+    uint32_t b2 = (hv >> 16) & (LRU_GHOST_BITS - 1);
+    int x;
+
+    for (x = 0; x < 2; x++) {
+        uint8_t *bits = g->bits[kind][x];
+        if ((bits[b1 / 8] & (1 << (b1 % 8))) &&
+                (bits[b2 / 8] & (1 << (b2 % 8))))
+            return true;
+    }
+    return false;
+}
+
+/* A key which wasn't in the cache is being stored. If it was evicted not long
+ * ago, count that against the part of the LRU which let it go. */
+void item_lru_ghost_check(item *it, const uint32_t hv) {
+    int id = ITEM_clsid(it);
+    lru_tune_t *t = &lru_tune[id];
+
+    pthread_mutex_lock(&lru_locks[id|COLD_LRU]);
+    if (t->ghosts != NULL) {
+        if (lru_ghost_find(t->ghosts, hv, GHOST_FREQUENT)) {
+            t->window_hits[GHOST_FREQUENT]++;
+            t->ghost_hits[GHOST_FREQUENT]++;
+        } else if (lru_ghost_find(t->ghosts, hv, GHOST_RECENT)) {
+            t->window_hits[GHOST_RECENT]++;
+            t->ghost_hits[GHOST_RECENT]++;
+        }
+    }
+    pthread_mutex_unlock(&lru_locks[id|COLD_LRU]);
+}
+
+static int lru_hot_pct(const int id) {
+    if (settings.lru_autotune && lru_tune[id].hot_pct != 0)
+        return lru_tune[id].hot_pct;
+    return settings.hot_lru_pct;
+}
+
+static int lru_warm_pct(const int id) {
+    if (settings.lru_autotune && lru_tune[id].warm_pct != 0)
+        return lru_tune[id].warm_pct;
+    return settings.warm_lru_pct;
+}
+
 /*** LRU MAINTENANCE THREAD ***/
 
 /* Returns number of items remove, expired, or evicted.
@@ -1065,7 +1251,7 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
             tries++;
             continue;
         }
-        uint32_t hv = hash(ITEM_key(search), search->nkey);
+        uint32_t hv = search->hv;
         /* Attempt to hash item lock the "search" item. If locked, no
          * other callers can incr the refcount. Also skip ourselves. */
         if ((hold_lock = item_trylock(hv)) == NULL)
@@ -1111,10 +1297,10 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
          */
         switch (cur_lru) {
             case HOT_LRU:
-                limit = total_bytes * settings.hot_lru_pct / 100;
+                limit = total_bytes * lru_hot_pct(orig_id) / 100;
             case WARM_LRU:
                 if (limit == 0)
-                    limit = total_bytes * settings.warm_lru_pct / 100;
+                    limit = total_bytes * lru_warm_pct(orig_id) / 100;
                 /* Rescue ACTIVE items aggressively */
                 if ((search->it_flags & ITEM_ACTIVE) != 0) {
                     search->it_flags &= ~ITEM_ACTIVE;
@@ -1162,6 +1348,11 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
                         itemstats[id].evicted_active++;
                     }
                     LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EVICTION, search);
+                    if (settings.lru_autotune) {
+                        lru_ghost_add(orig_id, hv,
+                                (search->it_flags & ITEM_FETCHED) != 0 ?
+                                GHOST_FREQUENT : GHOST_RECENT);
+                    }
                     do_item_unlink_nolock(search, hv);
                     removed++;
                     if (settings.slab_automove == 2) {
@@ -1483,6 +1674,90 @@ static void lru_maintainer_crawler_check(struct crawler_expired_data *cdata, log
     }
 }
 
+#ifdef EXTSTORE
+/* Writes COLD tail items out to external storage. Runs when the class is
+ * about to start evicting, or when ext_item_age is set and the tail has been
+ * idle for longer than that.
+ */
+static int lru_maintainer_store(const int clsid) {
+    int i;
+    int did_moves = 0;
+    unsigned int item_age = settings.ext_item_age;
+    bool mem_limit_reached = false;
+    unsigned int chunks_free;
+    unsigned int chunks_perslab = 0;
+
+    if (slabs_size(clsid) < settings.ext_item_size) {
+        return 0;
+    }
+
+    chunks_free = slabs_available_chunks(clsid, &mem_limit_reached,
+            NULL, &chunks_perslab);
+    if (mem_limit_reached && chunks_free < chunks_perslab) {
+        item_age = 0;
+    } else if (item_age == UINT_MAX) {
+        return 0;
+    }
+
+    for (i = 0; i < 500; i++) {
+        if (storage_write(storage, clsid, item_age) == 0) {
+            break;
+        }
+        did_moves++;
+    }
+    return did_moves;
+}
+#endif
+
+/* Once a window, moves each class's split between HOT and WARM towards the
+ * side whose ghosts were hit more, the way ARC moves its target size. The
+ * two keep the share of memory given by hot_lru_pct + warm_lru_pct, and
+ * neither drops below a fifth of it.
+ */
+static void lru_maintainer_autotune(void) {
+    static int base_hot = 0;
+    static int base_warm = 0;
+    int sum = settings.hot_lru_pct + settings.warm_lru_pct;
+    int min = sum / 5 > 0 ? sum / 5 : 1;
+    bool reset = false;
+    int i;
+
+    /* Start over from the configured split if "lru tune" changed it */
+    if (base_hot != settings.hot_lru_pct || base_warm != settings.warm_lru_pct) {
+        base_hot = settings.hot_lru_pct;
+        base_warm = settings.warm_lru_pct;
+        reset = true;
+    }
+
+    for (i = POWER_SMALLEST; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        lru_tune_t *t = &lru_tune[i];
+        pthread_mutex_lock(&lru_locks[i|COLD_LRU]);
+        if (reset) {
+            t->hot_pct = base_hot;
+            t->warm_pct = base_warm;
+        } else if (current_time - t->window_start >= settings.lru_autotune_window) {
+            int64_t r = t->window_hits[GHOST_RECENT];
+            int64_t f = t->window_hits[GHOST_FREQUENT];
+            if (r + f > 0) {
+                int hot = t->hot_pct + (int)((r - f) * LRU_TUNE_MAX_STEP / (r + f));
+                if (hot < min)
+                    hot = min;
+                if (hot > sum - min)
+                    hot = sum - min;
+                t->hot_pct = hot;
+                t->warm_pct = sum - hot;
+            }
+        } else {
+            pthread_mutex_unlock(&lru_locks[i|COLD_LRU]);
+            continue;
+        }
+        t->window_start = current_time;
+        t->window_hits[GHOST_RECENT] = 0;
+        t->window_hits[GHOST_FREQUENT] = 0;
+        pthread_mutex_unlock(&lru_locks[i|COLD_LRU]);
+    }
+}
+
 static pthread_t lru_maintainer_tid;
 
 #define MAX_LRU_MAINTAINER_SLEEP 1000000
@@ -1494,6 +1769,7 @@ static void *lru_maintainer_thread(void *arg) {
     useconds_t last_sleep = MIN_LRU_MAINTAINER_SLEEP;
     rel_time_t last_crawler_check = 0;
     rel_time_t last_automove_check = 0;
+    rel_time_t last_autotune_check = 0;
     useconds_t next_juggles[MAX_NUMBER_OF_SLAB_CLASSES];
     useconds_t backoff_juggles[MAX_NUMBER_OF_SLAB_CLASSES];
     struct crawler_expired_data *cdata =
@@ -1543,6 +1819,11 @@ static void *lru_maintainer_thread(void *arg) {
             }
 
             int did_moves = lru_maintainer_juggle(i);
+#ifdef EXTSTORE
+            if (storage != NULL) {
+                did_moves += lru_maintainer_store(i);
+            }
+#endif
             if (did_moves == 0) {
                 if (backoff_juggles[i] != 0) {
                     backoff_juggles[i] += backoff_juggles[i] / 8;
@@ -1573,6 +1854,11 @@ static void *lru_maintainer_thread(void *arg) {
             last_crawler_check = current_time;
         }
 
+        if (settings.lru_autotune && last_autotune_check != current_time) {
+            lru_maintainer_autotune();
+            last_autotune_check = current_time;
+        }
+
         if (settings.slab_automove == 1 && last_automove_check != current_time) {
             if (last_ratio != settings.slab_automove_ratio) {
                 slab_automove_free(am);
@@ -1626,6 +1912,9 @@ int start_lru_maintainer_thread(void *arg) {
     pthread_mutex_lock(&lru_maintainer_lock);
     do_run_lru_maintainer_thread = 1;
     settings.lru_maintainer_thread = true;
+#ifdef EXTSTORE
+    storage = arg;
+#endif
     if ((ret = pthread_create(&lru_maintainer_tid, NULL,
         lru_maintainer_thread, arg)) != 0) {
         fprintf(stderr, "Can't create LRU maintainer thread: %s\n",
@@ -8,6 +8,7 @@
 
 /* See items.c */
 uint64_t get_cas_id(void);
+void set_cas_id(uint64_t new_cas);
 
 /*@null@*/
 item *do_item_alloc(char *key, const size_t nkey, const unsigned int flags, const rel_time_t exptime, const int nbytes);
@@ -21,8 +22,10 @@ void do_item_unlink(item *it, const uint32_t hv);
 void do_item_unlink_nolock(item *it, const uint32_t hv);
 void do_item_remove(item *it);
 void do_item_update(item *it);   /** update LRU time to current and reposition */
+void do_item_bump(conn *c, item *it, const uint32_t hv);
 void do_item_update_nolock(item *it);
 int  do_item_replace(item *it, item *new_it, const uint32_t hv);
+bool do_item_restore(item *it);
 
 int item_is_flushed(item *it);
 
@@ -31,6 +34,7 @@ void do_item_unlinktail_q(item *it);
 item *do_item_crawl_q(item *it);
 
 void *item_lru_bump_buf_create(void);
+void item_lru_ghost_check(item *it, const uint32_t hv);
 
 #define LRU_PULL_EVICT 1
 #define LRU_PULL_CRAWL_BLOCKS 2
@@ -13,6 +13,7 @@
 
 #include "memcached.h"
 #include "bipbuffer.h"
+#include "hotkeys.h"
 
 #ifdef LOGGER_DEBUG
 #define L_DEBUG(...) \
@@ -42,6 +43,8 @@ pthread_mutex_t logger_atomics_mutex = PTHREAD_MUTEX_INITIALIZER;
 logger_watcher *watchers[20];
 struct pollfd watchers_pollfds[20];
 int watcher_count = 0;
+/* flags set for every logger regardless of watchers */
+static uint16_t logger_internal_flags = 0;
 
 /* Should this go somewhere else? */
 static const entry_details default_entries[] = {
@@ -54,7 +57,9 @@ static const entry_details default_entries[] = {
     },
     [LOGGER_SLAB_MOVE] = {LOGGER_TEXT_ENTRY, 512, LOG_SYSEVENTS,
         "type=slab_move src=%d dst=%d"
-    }
+    },
+    [LOGGER_HOTKEY] = {LOGGER_HOTKEY_ENTRY,
+        sizeof(struct logentry_hotkey) + KEY_MAX_LENGTH, LOG_HOTKEYS, NULL},
 };
 
 #define WATCHER_ALL -1
@@ -88,6 +93,7 @@ static void logger_link_q(logger *l) {
     pthread_mutex_lock(&logger_stack_lock);
     assert(l != logger_stack_head);
 
+    l->eflags = logger_internal_flags;
     l->prev = 0;
     l->next = logger_stack_head;
     if (l->next) l->next->prev = l;
@@ -125,7 +131,7 @@ static void logger_link_q(logger *l) {
 static void logger_set_flags(void) {
     logger *l = NULL;
     int x = 0;
-    uint16_t f = 0; /* logger eflags */
+    uint16_t f = logger_internal_flags; /* logger eflags */
 
     for (x = 0; x < WATCHER_LIMIT; x++) {
         logger_watcher *w = watchers[x];
@@ -219,7 +225,9 @@ static enum logger_parse_entry_ret logger_thread_parse_entry(logentry *e, struct
         case LOGGER_ITEM_STORE_ENTRY:
             total = _logger_thread_parse_ise(e, scratch);
             break;
-
+        case LOGGER_HOTKEY_ENTRY:
+            /* Consumed by the hot key tracker, never shown to watchers. */
+            break;
     }
 
     if (total >= LOGGER_PARSE_SCRATCH || total <= 0) {
@@ -312,10 +320,19 @@ static int logger_thread_read(logger *l, struct logger_stats *ls) {
     L_DEBUG("LOGGER: Got %d bytes from bipbuffer\n", size);
 
     /* parse buffer */
-    while (pos < size && watcher_count > 0) {
+    while (pos < size && (watcher_count > 0 || logger_internal_flags)) {
         enum logger_parse_entry_ret ret;
         int scratch_len = 0;
         e = (logentry *) (data + pos);
+        if (e->event == LOGGER_HOTKEY_ENTRY) {
+            struct logentry_hotkey *le = (struct logentry_hotkey *) e->data;
+            hotkeys_sample(le->key, le->nkey);
+            pos += sizeof(logentry) + e->size;
+            continue;
+        } else if (watcher_count == 0) {
+            pos += sizeof(logentry) + e->size;
+            continue;
+        }
         ret = logger_thread_parse_entry(e, ls, scratch, &scratch_len);
         if (ret != LOGGER_PARSE_ENTRY_OK) {
             /* TODO: stats counter */
@@ -621,6 +638,13 @@ static void _logger_log_item_store(logentry *e, const enum store_item_type statu
     e->size = sizeof(struct logentry_item_store) + nkey;
 }
 
+static void _logger_log_hotkey(logentry *e, const char *key, const int nkey) {
+    struct logentry_hotkey *le = (struct logentry_hotkey *) e->data;
+    le->nkey = nkey;
+    memcpy(le->key, key, nkey);
+    e->size = sizeof(struct logentry_hotkey) + nkey;
+}
+
 /* Public function for logging an entry.
  * Tries to encapsulate as much of the formatting as possible to simplify the
  * caller's code.
@@ -688,6 +712,13 @@ enum logger_ret_type logger_log(logger *l, const enum log_entry_type event, cons
             uint8_t sclsid = va_arg(ap, int);
             _logger_log_item_store(e, status, comm, skey, snkey, sttl, sclsid);
             break;
+        case LOGGER_HOTKEY_ENTRY:
+            va_start(ap, entry);
+            char *hkey = va_arg(ap, char *);
+            size_t hnkey = va_arg(ap, size_t);
+            _logger_log_hotkey(e, hkey, hnkey);
+            va_end(ap);
+            break;
     }
 
     /* Push pointer forward by the actual amount required */
@@ -709,6 +740,18 @@ enum logger_ret_type logger_log(logger *l, const enum log_entry_type event, cons
     }
 }
 
+/* Turns key sampling for the hot key tracker on or off in every worker. */
+void logger_set_hotkeys(bool enabled) {
+    pthread_mutex_lock(&logger_stack_lock);
+    if (enabled) {
+        logger_internal_flags |= LOG_HOTKEYS;
+    } else {
+        logger_internal_flags &= ~LOG_HOTKEYS;
+    }
+    logger_set_flags();
+    pthread_mutex_unlock(&logger_stack_lock);
+}
+
 /* Passes a client connection socket from a primary worker thread to the
  * logger thread. Caller *must* event_del() the client before handing it over.
  * Presently there's no way to hand the client back to the worker thread.
@@ -20,13 +20,15 @@ enum log_entry_type {
     LOGGER_ITEM_STORE,
     LOGGER_CRAWLER_STATUS,
     LOGGER_SLAB_MOVE,
+    LOGGER_HOTKEY,
 };
 
 enum log_entry_subtype {
     LOGGER_TEXT_ENTRY = 0,
     LOGGER_EVICTION_ENTRY,
     LOGGER_ITEM_GET_ENTRY,
-    LOGGER_ITEM_STORE_ENTRY
+    LOGGER_ITEM_STORE_ENTRY,
+    LOGGER_HOTKEY_ENTRY
 };
 
 enum logger_ret_type {
@@ -74,6 +76,11 @@ struct logentry_item_store {
     char key[];
 };
 
+struct logentry_hotkey {
+    uint8_t nkey;
+    char key[];
+};
+
 /* end intermediary structures */
 
 typedef struct _logentry {
@@ -96,6 +103,7 @@ typedef struct _logentry {
 #define LOG_EVICTIONS  (1<<6) /* details of evicted items */
 #define LOG_STRICT     (1<<7) /* block worker instead of drop */
 #define LOG_RAWCMDS    (1<<9) /* raw ascii commands */
+#define LOG_HOTKEYS    (1<<10) /* sampled keys for the hot key tracker */
 
 typedef struct _logger {
     struct _logger *prev;
@@ -107,6 +115,7 @@ typedef struct _logger {
     uint16_t fetcher_ratio; /* log one out of every N fetches */
     uint16_t mutation_ratio; /* log one out of every N mutations */
     uint16_t eflags; /* flags this logger should log */
+    int hotkey_countdown; /* fetches until the next hot key sample */
     bipbuf_t *buf;
     const entry_details *entry_map;
 } logger;
@@ -151,7 +160,17 @@ logger *logger_create(void);
             logger_log(myl, type, __VA_ARGS__); \
     } while (0)
 
+/* Feeds one out of every hotkeys_sample keys to the hot key tracker. */
+#define LOGGER_HOTKEY_SAMPLE(l, key, nkey) \
+    do { \
+        if (((l)->eflags & LOG_HOTKEYS) && --(l)->hotkey_countdown <= 0) { \
+            (l)->hotkey_countdown = settings.hotkeys_sample; \
+            logger_log((l), LOGGER_HOTKEY, NULL, (key), (nkey)); \
+        } \
+    } while (0)
+
 enum logger_ret_type logger_log(logger *l, const enum log_entry_type event, const void *entry, ...);
+void logger_set_hotkeys(bool enabled);
 
 enum logger_add_watcher_ret {
     LOGGER_ADD_WATCHER_TOO_MANY = 0,
@@ -0,0 +1,1064 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * mcbench: a load generator for memcached.
+ *
+ * Every thread runs its own libevent loop over a few connections. Each
+ * connection writes a batch of requests (the pipeline depth) at once and
+ * sends the next batch when every response is in; a request's latency runs
+ * from the write that sent it to the read that completed it. Keys are drawn
+ * from a uniform or Zipf popularity distribution and value sizes from a
+ * fixed, uniform or bimodal one. Every connection has its own generator
+ * seeded from -S, so the same options replay the same request stream.
+ * Threads keep their own counters and latency histograms, merged at the end.
+ */
+#include "config.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <event.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_GETOPT_LONG
+#include <getopt.h>
+#endif
+
+#include "protocol_binary.h"
+
+#define KEY_PREFIX "mcb:"
+#define KEY_MAX 250
+#define RBUF_INITIAL (64 * 1024)
+#define PREFILL_BATCH 256
+
+/* Latency histogram: 16 linear sub-buckets per power of two of nanoseconds,
+ * so any bucket is within 1/16th of the values it holds. */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+enum key_dist { KEY_UNIFORM, KEY_ZIPF };
+enum value_dist { VALUE_FIXED, VALUE_UNIFORM, VALUE_BIMODAL };
+enum req_type { REQ_GET, REQ_SET };
+
+static struct {
+    const char *host;
+    const char *port;
+    int threads;
+    int conns;              /* per thread */
+    int depth;              /* requests in flight per connection */
+    int duration;           /* seconds, if requests is 0 */
+    uint64_t requests;      /* total across all connections */
+    uint32_t keys;
+    int key_len;
+    enum key_dist key_dist;
+    double zipf_s;
+    enum value_dist value_dist;
+    uint32_t value_min;
+    uint32_t value_max;
+    int value_pct;          /* bimodal: percent of values that are large */
+    int get_pct;
+    int multiget;
+    bool binary;
+    bool prefill;
+    bool histogram;
+    uint64_t seed;
+} opts = {
+    .host = "127.0.0.1",
+    .port = "11211",
+    .threads = 4,
+    .conns = 4,
+    .depth = 1,
+    .duration = 10,
+    .requests = 0,
+    .keys = 100000,
+    .key_len = 0,
+    .key_dist = KEY_UNIFORM,
+    .zipf_s = 0.99,
+    .value_dist = VALUE_FIXED,
+    .value_min = 100,
+    .value_max = 100,
+    .value_pct = 10,
+    .get_pct = 90,
+    .multiget = 1,
+    .binary = false,
+    .prefill = false,
+    .histogram = false,
+    .seed = 1,
+};
+
+typedef struct {
+    uint64_t requests;
+    uint64_t gets;
+    uint64_t sets;
+    uint64_t get_keys;
+    uint64_t get_hits;
+    uint64_t errors;
+    uint64_t lat_min;
+    uint64_t lat_max;
+    uint64_t hist[HIST_BUCKETS];
+} bench_stats;
+
+typedef struct {
+    enum req_type type;
+    int nkeys;
+    int hits;
+} request;
+
+struct bench_thread;
+
+typedef struct {
+    int fd;
+    struct event event;
+    short ev_flags;
+    struct bench_thread *thread;
+    uint64_t rng;
+    uint64_t quota;         /* requests left to send, if limited */
+    bool done;
+
+    char *wbuf;
+    size_t wsize;
+    size_t wlen;
+    size_t wpos;
+
+    char *rbuf;
+    size_t rsize;
+    size_t rlen;
+
+    request *reqs;          /* the batch in flight */
+    int nreqs;
+    int head;
+    uint64_t sent;          /* when the batch was written */
+} bench_conn;
+
+typedef struct bench_thread {
+    pthread_t tid;
+    int id;
+    struct event_base *base;
+    bench_conn *conns;
+    int active;
+    uint64_t deadline;
+    uint64_t finished;
+    bench_stats stats;
+} bench_thread;
+
+static double *zipf_cdf = NULL;
+static char *value_buf = NULL;
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int ready_threads = 0;
+static bool started = false;
+static uint64_t start_time;
+
+static void usage(void) {
+    printf("mcbench: load generator for memcached\n"
+           "-s, --server=<host>       server to connect to (default: 127.0.0.1)\n"
+           "-p, --port=<num>          TCP port (default: 11211)\n"
+           "-t, --threads=<num>       threads, each with its own event loop (default: 4)\n"
+           "-c, --conns=<num>         connections per thread (default: 4)\n"
+           "-d, --depth=<num>         requests pipelined per connection (default: 1)\n"
+           "-D, --duration=<sec>      how long to run (default: 10)\n"
+           "-n, --requests=<num>      run this many requests instead of for a duration\n"
+           "-k, --keys=<num>          size of the key space (default: 100000)\n"
+           "-K, --key-dist=<dist>     key popularity: uniform or zipf[:s]\n"
+           "                          (default: uniform; zipf exponent 0.99)\n"
+           "-l, --key-len=<num>       pad keys with zeros to this length\n"
+           "-V, --value-size=<dist>   <bytes>, uniform:<min>:<max> or\n"
+           "                          bimodal:<small>:<large>:<pct large> (default: 100)\n"
+           "-r, --get-ratio=<pct>     percent of requests that are gets (default: 90)\n"
+           "-m, --multiget=<num>      keys per get (default: 1)\n"
+           "-B, --protocol=<name>     ascii or binary (default: ascii)\n"
+           "-P, --prefill             set every key once before measuring\n"
+           "-H, --histogram           print the full latency histogram\n"
+           "-S, --seed=<num>          seed for the request stream (default: 1)\n"
+           "-h, --help                print this help and exit\n");
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*: small, fast and good enough to pick keys with. */
+static uint64_t rng_next(uint64_t *state) {
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static double rng_double(uint64_t *state) {
+    return (rng_next(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static uint64_t rng_seed(uint64_t seed, uint64_t stream) {
+    /* splitmix64 so neighbouring streams don't start out correlated */
+    uint64_t z = seed + (stream + 1) * 0x9E3779B97F4A7C15ULL;
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    return z ? z : 1;
+}
+
+static void zipf_init(void) {
+    double sum = 0;
+    uint32_t i;
+
+    zipf_cdf = malloc(sizeof(double) * opts.keys);
+    if (zipf_cdf == NULL) {
+        fprintf(stderr, "Failed to allocate Zipf table for %u keys\n", opts.keys);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < opts.keys; i++) {
+        sum += 1.0 / pow(i + 1, opts.zipf_s);
+        zipf_cdf[i] = sum;
+    }
+    for (i = 0; i < opts.keys; i++) {
+        zipf_cdf[i] /= sum;
+    }
+}
+
+static uint32_t key_pick(uint64_t *rng) {
+    if (opts.key_dist == KEY_ZIPF) {
+        double u = rng_double(rng);
+        uint32_t lo = 0, hi = opts.keys - 1;
+        while (lo < hi) {
+            uint32_t mid = lo + (hi - lo) / 2;
+            if (zipf_cdf[mid] < u) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return lo;
+    }
+    return rng_next(rng) % opts.keys;
+}
+
+static uint32_t value_pick(uint64_t *rng) {
+    switch (opts.value_dist) {
+    case VALUE_UNIFORM:
+        return opts.value_min + rng_next(rng) % (opts.value_max - opts.value_min + 1);
+    case VALUE_BIMODAL:
+        return (int)(rng_next(rng) % 100) < opts.value_pct
+            ? opts.value_max : opts.value_min;
+    default:
+        return opts.value_min;
+    }
+}
+
+static int key_format(char *buf, uint32_t id) {
+    int digits = opts.key_len - (int)strlen(KEY_PREFIX);
+    return snprintf(buf, KEY_MAX + 1, KEY_PREFIX "%0*u", digits > 0 ? digits : 1, id);
+}
+
+/*** HISTOGRAM ***/
+
+static int hist_index(uint64_t v) {
+    int msb, shift;
+    if (v < 2 * HIST_SUB)
+        return (int)v;
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB + (int)((v >> shift) & (HIST_SUB - 1));
+}
+
+static uint64_t hist_lower(int idx) {
+    int shift;
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    shift = idx / HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + idx % HIST_SUB) << shift;
+}
+
+static uint64_t hist_upper(int idx) {
+    if (idx < 2 * HIST_SUB)
+        return idx;
+    return hist_lower(idx) + ((uint64_t)1 << (idx / HIST_SUB - 1)) - 1;
+}
+
+static void stats_latency(bench_stats *st, uint64_t ns) {
+    st->hist[hist_index(ns)]++;
+    if (st->lat_min == 0 || ns < st->lat_min)
+        st->lat_min = ns;
+    if (ns > st->lat_max)
+        st->lat_max = ns;
+}
+
+/* Upper bound of the bucket holding the given fraction of samples. */
+static uint64_t hist_percentile(const bench_stats *st, double pct) {
+    uint64_t total = 0, seen = 0, want;
+    int i;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+        total += st->hist[i];
+    if (total == 0)
+        return 0;
+    want = (uint64_t)ceil(total * pct);
+    if (want == 0)
+        want = 1;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        seen += st->hist[i];
+        if (seen >= want) {
+            uint64_t up = hist_upper(i);
+            return up < st->lat_max ? up : st->lat_max;
+        }
+    }
+    return st->lat_max;
+}
+
+static void stats_merge(bench_stats *to, const bench_stats *from) {
+    int i;
+    to->requests += from->requests;
+    to->gets += from->gets;
+    to->sets += from->sets;
+    to->get_keys += from->get_keys;
+    to->get_hits += from->get_hits;
+    to->errors += from->errors;
+    if (to->lat_min == 0 || (from->lat_min != 0 && from->lat_min < to->lat_min))
+        to->lat_min = from->lat_min;
+    if (from->lat_max > to->lat_max)
+        to->lat_max = from->lat_max;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        to->hist[i] += from->hist[i];
+}
+
+/*** REQUESTS ***/
+
+static void wbuf_append(bench_conn *c, const void *data, size_t len) {
+    if (c->wlen + len > c->wsize) {
+        size_t size = c->wsize ? c->wsize : 4096;
+        while (size < c->wlen + len)
+            size *= 2;
+        c->wbuf = realloc(c->wbuf, size);
+        if (c->wbuf == NULL) {
+            fprintf(stderr, "Failed to grow write buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        c->wsize = size;
+    }
+    memcpy(c->wbuf + c->wlen, data, len);
+    c->wlen += len;
+}
+
+static void binary_header(bench_conn *c, uint8_t opcode, int nkey,
+        uint8_t extlen, uint32_t nbody) {
+    protocol_binary_request_header h;
+    memset(&h, 0, sizeof(h));
+    h.request.magic = PROTOCOL_BINARY_REQ;
+    h.request.opcode = opcode;
+    h.request.keylen = htons(nkey);
+    h.request.extlen = extlen;
+    h.request.bodylen = htonl(extlen + nkey + nbody);
+    wbuf_append(c, &h, sizeof(h));
+}
+
+static void request_get(bench_conn *c, request *r) {
+    char key[KEY_MAX + 1];
+    int i, nkey;
+
+    r->type = REQ_GET;
+    r->nkeys = opts.multiget;
+    if (!opts.binary)
+        wbuf_append(c, "get", 3);
+    for (i = 0; i < opts.multiget; i++) {
+        nkey = key_format(key, key_pick(&c->rng));
+        if (opts.binary) {
+            /* Quiet gets only answer hits; the last one always answers. */
+            binary_header(c, i == opts.multiget - 1
+                    ? PROTOCOL_BINARY_CMD_GET : PROTOCOL_BINARY_CMD_GETQ,
+                    nkey, 0, 0);
+            wbuf_append(c, key, nkey);
+        } else {
+            wbuf_append(c, " ", 1);
+            wbuf_append(c, key, nkey);
+        }
+    }
+    if (!opts.binary)
+        wbuf_append(c, "\r\n", 2);
+}
+
+static void request_set(bench_conn *c, request *r, uint32_t id, uint32_t nbytes) {
+    char key[KEY_MAX + 1];
+    int nkey = key_format(key, id);
+
+    r->type = REQ_SET;
+    r->nkeys = 1;
+    if (opts.binary) {
+        uint32_t extras[2] = { 0, 0 }; /* flags, expiration */
+        binary_header(c, PROTOCOL_BINARY_CMD_SET, nkey, sizeof(extras), nbytes);
+        wbuf_append(c, extras, sizeof(extras));
+        wbuf_append(c, key, nkey);
+        wbuf_append(c, value_buf, nbytes);
+    } else {
+        char line[KEY_MAX + 64];
+        int len = snprintf(line, sizeof(line), "set %s 0 0 %u\r\n", key, nbytes);
+        wbuf_append(c, line, len);
+        wbuf_append(c, value_buf, nbytes);
+        wbuf_append(c, "\r\n", 2);
+    }
+}
+
+/*** CONNECTIONS ***/
+
+static void conn_event_handler(const int fd, const short which, void *arg);
+
+static void conn_set_event(bench_conn *c, const short flags) {
+    if (c->ev_flags == flags)
+        return;
+    if (c->ev_flags != 0)
+        event_del(&c->event);
+    c->ev_flags = flags;
+    if (flags == 0)
+        return;
+    event_set(&c->event, c->fd, flags | EV_PERSIST, conn_event_handler, c);
+    event_base_set(c->thread->base, &c->event);
+    if (event_add(&c->event, 0) == -1) {
+        perror("event_add");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void conn_flush(bench_conn *c) {
+    while (c->wpos < c->wlen) {
+        ssize_t res = write(c->fd, c->wbuf + c->wpos, c->wlen - c->wpos);
+        if (res > 0) {
+            c->wpos += res;
+        } else if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            conn_set_event(c, EV_READ | EV_WRITE);
+            return;
+        } else if (res == -1 && errno == EINTR) {
+            continue;
+        } else {
+            perror("Failed writing to server");
+            exit(EXIT_FAILURE);
+        }
+    }
+    conn_set_event(c, EV_READ);
+}
+
+static void conn_finish(bench_conn *c) {
+    bench_thread *t = c->thread;
+    c->done = true;
+    conn_set_event(c, 0);
+    if (--t->active == 0) {
+        t->finished = now_ns();
+        event_base_loopbreak(t->base);
+    }
+}
+
+/* Sends the next batch, or finishes the connection once time or its share
+ * of requests is up. */
+static void conn_send_batch(bench_conn *c) {
+    int i;
+
+    if ((opts.requests == 0 && now_ns() >= c->thread->deadline)
+            || (opts.requests != 0 && c->quota == 0)) {
+        conn_finish(c);
+        return;
+    }
+
+    c->wlen = c->wpos = 0;
+    c->nreqs = 0;
+    c->head = 0;
+    for (i = 0; i < opts.depth; i++) {
+        request *r = &c->reqs[c->nreqs++];
+        r->hits = 0;
+        if ((int)(rng_next(&c->rng) % 100) < opts.get_pct) {
+            request_get(c, r);
+        } else {
+            uint32_t id = key_pick(&c->rng);
+            request_set(c, r, id, value_pick(&c->rng));
+        }
+        if (opts.requests != 0 && --c->quota == 0)
+            break;
+    }
+    c->sent = now_ns();
+    conn_flush(c);
+}
+
+static void request_done(bench_conn *c, request *r, bool error, uint64_t now) {
+    bench_stats *st = &c->thread->stats;
+
+    st->requests++;
+    if (r->type == REQ_GET) {
+        st->gets++;
+        st->get_keys += r->nkeys;
+        st->get_hits += r->hits;
+    } else {
+        st->sets++;
+    }
+    if (error)
+        st->errors++;
+    stats_latency(st, now - c->sent);
+    c->head++;
+}
+
+/* Consumes complete ASCII responses. Returns bytes used. */
+static size_t parse_ascii(bench_conn *c, uint64_t now) {
+    size_t pos = 0;
+
+    while (c->head < c->nreqs) {
+        request *r = &c->reqs[c->head];
+        char *line = c->rbuf + pos;
+        char *end = memchr(line, '\n', c->rlen - pos);
+        size_t llen;
+
+        if (end == NULL)
+            break;
+        llen = end - line + 1;
+
+        if (r->type == REQ_SET) {
+            request_done(c, r, strncmp(line, "STORED\r\n", 8) != 0, now);
+            pos += llen;
+        } else if (strncmp(line, "VALUE ", 6) == 0) {
+            /* VALUE <key> <flags> <bytes> [<cas>]\r\n<data>\r\n */
+            unsigned long nbytes;
+            char *p = line + 6;
+            p = strchr(p, ' ');
+            if (p == NULL || (p = strchr(p + 1, ' ')) == NULL
+                    || sscanf(p + 1, "%lu", &nbytes) != 1) {
+                fprintf(stderr, "Malformed response: %.*s", (int)llen, line);
+                exit(EXIT_FAILURE);
+            }
+            if (c->rlen - pos < llen + nbytes + 2)
+                break;
+            r->hits++;
+            pos += llen + nbytes + 2;
+        } else {
+            request_done(c, r, strncmp(line, "END\r\n", 5) != 0, now);
+            pos += llen;
+        }
+    }
+    return pos;
+}
+
+/* Consumes complete binary responses. Returns bytes used. */
+static size_t parse_binary(bench_conn *c, uint64_t now) {
+    size_t pos = 0;
+
+    while (c->head < c->nreqs) {
+        request *r = &c->reqs[c->head];
+        protocol_binary_response_header h;
+        uint32_t bodylen;
+        uint16_t status;
+
+        if (c->rlen - pos < sizeof(h))
+            break;
+        memcpy(&h, c->rbuf + pos, sizeof(h));
+        bodylen = ntohl(h.response.bodylen);
+        if (c->rlen - pos < sizeof(h) + bodylen)
+            break;
+        pos += sizeof(h) + bodylen;
+        status = ntohs(h.response.status);
+
+        if (h.response.magic != PROTOCOL_BINARY_RES) {
+            fprintf(stderr, "Malformed binary response\n");
+            exit(EXIT_FAILURE);
+        }
+        if (h.response.opcode == PROTOCOL_BINARY_CMD_GETQ) {
+            r->hits++;
+        } else if (h.response.opcode == PROTOCOL_BINARY_CMD_GET) {
+            if (status == PROTOCOL_BINARY_RESPONSE_SUCCESS)
+                r->hits++;
+            request_done(c, r, status != PROTOCOL_BINARY_RESPONSE_SUCCESS
+                    && status != PROTOCOL_BINARY_RESPONSE_KEY_ENOENT, now);
+        } else {
+            request_done(c, r, status != PROTOCOL_BINARY_RESPONSE_SUCCESS, now);
+        }
+    }
+    return pos;
+}
+
+static void conn_read(bench_conn *c) {
+    for (;;) {
+        ssize_t res;
+        size_t used;
+
+        if (c->rlen == c->rsize) {
+            c->rsize *= 2;
+            c->rbuf = realloc(c->rbuf, c->rsize);
+            if (c->rbuf == NULL) {
+                fprintf(stderr, "Failed to grow read buffer\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        res = read(c->fd, c->rbuf + c->rlen, c->rsize - c->rlen);
+        if (res == 0) {
+            fprintf(stderr, "Server closed the connection\n");
+            exit(EXIT_FAILURE);
+        } else if (res == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            perror("Failed reading from server");
+            exit(EXIT_FAILURE);
+        }
+        c->rlen += res;
+
+        used = opts.binary ? parse_binary(c, now_ns()) : parse_ascii(c, now_ns());
+        memmove(c->rbuf, c->rbuf + used, c->rlen - used);
+        c->rlen -= used;
+
+        if (c->head == c->nreqs) {
+            if (c->rlen != 0) {
+                fprintf(stderr, "Unexpected data from server\n");
+                exit(EXIT_FAILURE);
+            }
+            conn_send_batch(c);
+            if (c->done)
+                return;
+        }
+    }
+}
+
+static void conn_event_handler(const int fd, const short which, void *arg) {
+    bench_conn *c = arg;
+    if (which & EV_WRITE) {
+        conn_flush(c);
+    }
+    if (which & EV_READ) {
+        conn_read(c);
+    }
+}
+
+static int server_connect(void) {
+    struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+    struct addrinfo *ai, *next;
+    int fd = -1;
+    int error;
+
+    error = getaddrinfo(opts.host, opts.port, &hints, &ai);
+    if (error != 0) {
+        fprintf(stderr, "getaddrinfo(%s): %s\n", opts.host, gai_strerror(error));
+        exit(EXIT_FAILURE);
+    }
+    for (next = ai; next != NULL; next = next->ai_next) {
+        fd = socket(next->ai_family, next->ai_socktype, next->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, next->ai_addr, next->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(ai);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to connect to %s:%s: %s\n", opts.host,
+                opts.port, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    error = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &error, sizeof(error));
+    return fd;
+}
+
+/*** THREADS ***/
+
+static void *bench_thread_main(void *arg) {
+    bench_thread *t = arg;
+    int i;
+
+    t->base = event_init();
+    t->conns = calloc(opts.conns, sizeof(bench_conn));
+    if (t->base == NULL || t->conns == NULL) {
+        fprintf(stderr, "Failed to set up thread %d\n", t->id);
+        exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < opts.conns; i++) {
+        bench_conn *c = &t->conns[i];
+        int stream = t->id * opts.conns + i;
+        uint64_t share = opts.requests / ((uint64_t)opts.threads * opts.conns);
+
+        c->fd = server_connect();
+        if (fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK) < 0) {
+            perror("setting O_NONBLOCK");
+            exit(EXIT_FAILURE);
+        }
+        c->thread = t;
+        c->rng = rng_seed(opts.seed, stream);
+        /* Spread the remainder so exactly opts.requests are sent. */
+        c->quota = share + ((uint64_t)stream
+                < opts.requests % ((uint64_t)opts.threads * opts.conns) ? 1 : 0);
+        c->rsize = RBUF_INITIAL;
+        c->rbuf = malloc(c->rsize);
+        c->reqs = calloc(opts.depth, sizeof(request));
+        if (c->rbuf == NULL || c->reqs == NULL) {
+            fprintf(stderr, "Failed to allocate connection buffers\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    pthread_mutex_lock(&start_lock);
+    ready_threads++;
+    pthread_cond_broadcast(&start_cond);
+    while (!started)
+        pthread_cond_wait(&start_cond, &start_lock);
+    pthread_mutex_unlock(&start_lock);
+
+    t->deadline = start_time + (uint64_t)opts.duration * 1000000000ULL;
+    t->active = opts.conns;
+    for (i = 0; i < opts.conns; i++) {
+        conn_send_batch(&t->conns[i]);
+    }
+    if (t->active > 0)
+        event_base_loop(t->base, 0);
+
+    for (i = 0; i < opts.conns; i++) {
+        close(t->conns[i].fd);
+        free(t->conns[i].wbuf);
+        free(t->conns[i].rbuf);
+        free(t->conns[i].reqs);
+    }
+    free(t->conns);
+    return NULL;
+}
+
+/* Sets every key once over a single pipelined connection. Value sizes come
+ * from the run's size distribution, on a stream of their own so the same
+ * seed always prefills the same sizes without shifting the connections'
+ * request sequences. */
+static void prefill(void) {
+    bench_conn c;
+    uint32_t id = 0;
+    char line[64];
+
+    memset(&c, 0, sizeof(c));
+    c.fd = server_connect();
+    c.rng = rng_seed(opts.seed, (uint64_t)-1);
+    c.reqs = calloc(1, sizeof(request));
+    while (id < opts.keys) {
+        uint32_t last = id + PREFILL_BATCH < opts.keys ? id + PREFILL_BATCH : opts.keys;
+        size_t pos = 0;
+        ssize_t res;
+
+        /* noreply keeps the batch one round trip, ended by a version. */
+        c.wlen = 0;
+        for (; id < last; id++) {
+            char key[KEY_MAX + 1];
+            uint32_t nbytes = value_pick(&c.rng);
+            int len;
+            key_format(key, id);
+            len = snprintf(line, sizeof(line), "set %s 0 0 %u noreply\r\n", key, nbytes);
+            wbuf_append(&c, line, len);
+            wbuf_append(&c, value_buf, nbytes);
+            wbuf_append(&c, "\r\n", 2);
+        }
+        wbuf_append(&c, "version\r\n", 9);
+
+        while (pos < c.wlen) {
+            res = write(c.fd, c.wbuf + pos, c.wlen - pos);
+            if (res <= 0) {
+                perror("Failed to prefill");
+                exit(EXIT_FAILURE);
+            }
+            pos += res;
+        }
+        pos = 0;
+        while (pos < sizeof(line) - 1) {
+            res = read(c.fd, line + pos, sizeof(line) - 1 - pos);
+            if (res <= 0) {
+                perror("Failed to prefill");
+                exit(EXIT_FAILURE);
+            }
+            pos += res;
+            line[pos] = '\0';
+            if (strstr(line, "\r\n") != NULL)
+                break;
+        }
+        if (strncmp(line, "VERSION ", 8) != 0) {
+            fprintf(stderr, "Prefill failed: %s", line);
+            exit(EXIT_FAILURE);
+        }
+    }
+    close(c.fd);
+    free(c.wbuf);
+    free(c.reqs);
+}
+
+/*** OPTIONS AND REPORT ***/
+
+static bool parse_key_dist(const char *arg) {
+    if (strcmp(arg, "uniform") == 0) {
+        opts.key_dist = KEY_UNIFORM;
+        return true;
+    }
+    if (strncmp(arg, "zipf", 4) == 0) {
+        opts.key_dist = KEY_ZIPF;
+        if (arg[4] == ':')
+            return sscanf(arg + 5, "%lf", &opts.zipf_s) == 1 && opts.zipf_s > 0;
+        return arg[4] == '\0';
+    }
+    return false;
+}
+
+static bool parse_value_dist(const char *arg) {
+    if (strncmp(arg, "uniform:", 8) == 0) {
+        opts.value_dist = VALUE_UNIFORM;
+        return sscanf(arg + 8, "%u:%u", &opts.value_min, &opts.value_max) == 2
+            && opts.value_min <= opts.value_max;
+    }
+    if (strncmp(arg, "bimodal:", 8) == 0) {
+        opts.value_dist = VALUE_BIMODAL;
+        return sscanf(arg + 8, "%u:%u:%d", &opts.value_min, &opts.value_max,
+                &opts.value_pct) == 3
+            && opts.value_pct >= 0 && opts.value_pct <= 100;
+    }
+    opts.value_dist = VALUE_FIXED;
+    if (sscanf(arg, "%u", &opts.value_min) != 1)
+        return false;
+    opts.value_max = opts.value_min;
+    return true;
+}
+
+static void print_value_dist(void) {
+    switch (opts.value_dist) {
+    case VALUE_UNIFORM:
+        printf("uniform:%u:%u", opts.value_min, opts.value_max);
+        break;
+    case VALUE_BIMODAL:
+        printf("bimodal:%u:%u:%d", opts.value_min, opts.value_max, opts.value_pct);
+        break;
+    default:
+        printf("%u", opts.value_min);
+    }
+}
+
+static void report(const bench_stats *st, double secs) {
+    static const double pcts[] = { 0.5, 0.9, 0.99, 0.999 };
+    static const char *names[] = { "p50", "p90", "p99", "p99.9" };
+    int i;
+
+    printf("threads %d, connections %d, depth %d, protocol %s, seed %llu\n",
+            opts.threads, opts.threads * opts.conns, opts.depth,
+            opts.binary ? "binary" : "ascii", (unsigned long long)opts.seed);
+    printf("keys %u ", opts.keys);
+    if (opts.key_dist == KEY_ZIPF) {
+        printf("zipf:%.2f", opts.zipf_s);
+    } else {
+        printf("uniform");
+    }
+    printf(", values ");
+    print_value_dist();
+    printf(", gets %d%%, multiget %d\n\n", opts.get_pct, opts.multiget);
+
+    printf("%-12s %.2f s\n", "time", secs);
+    printf("%-12s %llu\n", "requests", (unsigned long long)st->requests);
+    printf("%-12s %.1f\n", "requests/s", secs > 0 ? st->requests / secs : 0);
+    printf("%-12s %llu (keys %llu, hits %llu, hit rate %.2f%%)\n", "gets",
+            (unsigned long long)st->gets, (unsigned long long)st->get_keys,
+            (unsigned long long)st->get_hits,
+            st->get_keys ? 100.0 * st->get_hits / st->get_keys : 0);
+    printf("%-12s %llu\n", "sets", (unsigned long long)st->sets);
+    printf("%-12s %llu\n", "errors", (unsigned long long)st->errors);
+    printf("%-12s min %.1f", "latency us", st->lat_min / 1000.0);
+    for (i = 0; i < 4; i++) {
+        printf(" %s %.1f", names[i], hist_percentile(st, pcts[i]) / 1000.0);
+    }
+    printf(" max %.1f\n", st->lat_max / 1000.0);
+
+    if (opts.histogram) {
+        printf("\n%-14s %-14s %s\n", "from us", "to us", "requests");
+        for (i = 0; i < HIST_BUCKETS; i++) {
+            if (st->hist[i] == 0)
+                continue;
+            printf("%-14.3f %-14.3f %llu\n", hist_lower(i) / 1000.0,
+                    hist_upper(i) / 1000.0, (unsigned long long)st->hist[i]);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    bench_thread *threads;
+    bench_stats total;
+    uint64_t end_time = 0;
+    int c, i;
+
+    const char *shortopts = "s:p:t:c:d:D:n:k:K:l:V:r:m:B:PHS:h";
+#ifdef HAVE_GETOPT_LONG
+    const struct option longopts[] = {
+        {"server", required_argument, 0, 's'},
+        {"port", required_argument, 0, 'p'},
+        {"threads", required_argument, 0, 't'},
+        {"conns", required_argument, 0, 'c'},
+        {"depth", required_argument, 0, 'd'},
+        {"duration", required_argument, 0, 'D'},
+        {"requests", required_argument, 0, 'n'},
+        {"keys", required_argument, 0, 'k'},
+        {"key-dist", required_argument, 0, 'K'},
+        {"key-len", required_argument, 0, 'l'},
+        {"value-size", required_argument, 0, 'V'},
+        {"get-ratio", required_argument, 0, 'r'},
+        {"multiget", required_argument, 0, 'm'},
+        {"protocol", required_argument, 0, 'B'},
+        {"prefill", no_argument, 0, 'P'},
+        {"histogram", no_argument, 0, 'H'},
+        {"seed", required_argument, 0, 'S'},
+        {"help", no_argument, 0, 'h'},
+        {0, 0, 0, 0}
+    };
+    int optindex;
+    while (-1 != (c = getopt_long(argc, argv, shortopts,
+                    longopts, &optindex))) {
+#else
+    while (-1 != (c = getopt(argc, argv, shortopts))) {
+#endif
+        switch (c) {
+        case 's':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = optarg;
+            break;
+        case 't':
+            opts.threads = atoi(optarg);
+            break;
+        case 'c':
+            opts.conns = atoi(optarg);
+            break;
+        case 'd':
+            opts.depth = atoi(optarg);
+            break;
+        case 'D':
+            opts.duration = atoi(optarg);
+            break;
+        case 'n':
+            opts.requests = strtoull(optarg, NULL, 10);
+            break;
+        case 'k':
+            opts.keys = strtoul(optarg, NULL, 10);
+            break;
+        case 'K':
+            if (!parse_key_dist(optarg)) {
+                fprintf(stderr, "Invalid key distribution: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'l':
+            opts.key_len = atoi(optarg);
+            break;
+        case 'V':
+            if (!parse_value_dist(optarg)) {
+                fprintf(stderr, "Invalid value size: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            opts.get_pct = atoi(optarg);
+            break;
+        case 'm':
+            opts.multiget = atoi(optarg);
+            break;
+        case 'B':
+            if (strcmp(optarg, "binary") == 0) {
+                opts.binary = true;
+            } else if (strcmp(optarg, "ascii") == 0) {
+                opts.binary = false;
+            } else {
+                fprintf(stderr, "Invalid protocol: %s\n", optarg);
+                return 1;
+            }
+            break;
+        case 'P':
+            opts.prefill = true;
+            break;
+        case 'H':
+            opts.histogram = true;
+            break;
+        case 'S':
+            opts.seed = strtoull(optarg, NULL, 10);
+            break;
+        case 'h':
+            usage();
+            return 0;
+        default:
+            fprintf(stderr, "Illegal argument \"%c\"\n", c);
+            return 1;
+        }
+    }
+
+    if (opts.threads < 1 || opts.conns < 1 || opts.depth < 1
+            || opts.multiget < 1 || opts.keys < 1
+            || (opts.requests == 0 && opts.duration < 1)) {
+        fprintf(stderr, "threads, conns, depth, multiget, keys and duration"
+                " must be at least 1\n");
+        return 1;
+    }
+    if (opts.get_pct < 0 || opts.get_pct > 100) {
+        fprintf(stderr, "get ratio must be a percentage\n");
+        return 1;
+    }
+    if (opts.key_len > KEY_MAX) {
+        fprintf(stderr, "keys can be at most %d bytes\n", KEY_MAX);
+        return 1;
+    }
+    if (opts.requests != 0 && opts.requests < (uint64_t)opts.threads * opts.conns) {
+        fprintf(stderr, "need at least one request per connection\n");
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    value_buf = malloc(opts.value_max ? opts.value_max : 1);
+    if (value_buf == NULL) {
+        fprintf(stderr, "Failed to allocate value buffer\n");
+        return 1;
+    }
+    memset(value_buf, 'x', opts.value_max);
+    if (opts.key_dist == KEY_ZIPF)
+        zipf_init();
+    if (opts.prefill)
+        prefill();
+
+    threads = calloc(opts.threads, sizeof(bench_thread));
+    if (threads == NULL) {
+        fprintf(stderr, "Failed to allocate threads\n");
+        return 1;
+    }
+    for (i = 0; i < opts.threads; i++) {
+        threads[i].id = i;
+        if (pthread_create(&threads[i].tid, NULL, bench_thread_main, &threads[i]) != 0) {
+            fprintf(stderr, "Failed to create thread\n");
+            return 1;
+        }
+    }
+
+    /* Everyone connects first, then the clock starts for all at once. */
+    pthread_mutex_lock(&start_lock);
+    while (ready_threads < opts.threads)
+        pthread_cond_wait(&start_cond, &start_lock);
+    start_time = now_ns();
+    started = true;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&start_lock);
+
+    memset(&total, 0, sizeof(total));
+    for (i = 0; i < opts.threads; i++) {
+        pthread_join(threads[i].tid, NULL);
+        stats_merge(&total, &threads[i].stats);
+        if (threads[i].finished > end_time)
+            end_time = threads[i].finished;
+    }
+
+    report(&total, (end_time - start_time) / 1e9);
+    free(threads);
+    free(zipf_cdf);
+    free(value_buf);
+    return total.errors ? 2 : 0;
+}
@@ -14,6 +14,9 @@
  *      Brad Fitzpatrick <brad@danga.com>
  */
 #include "memcached.h"
+#ifdef EXTSTORE
+#include "storage.h"
+#endif
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -98,16 +101,25 @@ static void settings_init(void);
 static void event_handler(const int fd, const short which, void *arg);
 static void conn_close(conn *c);
 static void conn_init(void);
-static bool update_event(conn *c, const int new_flags);
+static bool update_event(conn *c, int new_flags);
 static void complete_nread(conn *c);
+static void complete_nread_proxy(conn *c);
 static void process_command(conn *c, char *command);
 static void write_and_free(conn *c, char *buf, int bytes);
 static int ensure_iov_space(conn *c);
 static int add_iov(conn *c, const void *buf, int len);
 static int add_chunked_item_iovs(conn *c, item *it, int len);
 static int add_msghdr(conn *c);
+static bool batch_flush(conn *c, enum conn_states next);
+static bool batch_blocks_command(const char *cmd, const char *end);
 static void write_bin_error(conn *c, protocol_binary_response_status err,
                             const char *errstr, int swallow);
+static void write_bin_miss_response(conn *c, char *key, size_t nkey);
+static char *_meta_echo_flags(char *p, const char *opaque, const size_t nopaque,
+        const char *key, const size_t nkey);
+#ifdef EXTSTORE
+static void _get_extstore_finish(conn *c);
+#endif
 
 static void conn_free(conn *c);
 
@@ -226,7 +238,9 @@ static void settings_init(void) {
     settings.prefix_delimiter = ':';
     settings.detail_enabled = 0;
     settings.reqs_per_event = 20;
+    settings.reply_batch_size = 8192;
     settings.backlog = 1024;
+    settings.reuseport = false;
     settings.binding_protocol = negotiating_prot;
     settings.item_size_max = 1024 * 1024; /* The famous 1MB upper limit. */
     settings.slab_page_size = 1024 * 1024; /* chunks are split from 1MB pages. */
@@ -242,7 +256,12 @@ static void settings_init(void) {
     settings.warm_lru_pct = 40;
     settings.hot_max_factor = 0.2;
     settings.warm_max_factor = 2.0;
+    settings.lru_autotune = false;
+    settings.lru_autotune_window = 60;
     settings.inline_ascii_response = false;
+    settings.slab_thread_cache = false;
+    settings.slab_compact = false;
+    settings.hotkeys_sample = 100;
     settings.temp_lru = false;
     settings.temporary_ttl = 61;
     settings.idle_timeout = 0; /* disabled */
@@ -261,6 +280,37 @@ static void settings_init(void) {
     settings.drop_privileges = true;
 #ifdef MEMCACHED_DEBUG
     settings.relaxed_privileges = false;
+#endif
+    settings.memory_file = NULL;
+    settings.proxy_backends = NULL;
+    settings.proxy_timeout = 2;
+    settings.proxy_retry = 5;
+#ifdef EXTSTORE
+    settings.ext_item_size = 512;
+    settings.ext_item_age = UINT_MAX;
+    settings.ext_page_size = 1024 * 1024 * 64;
+    settings.ext_wbuf_size = 1024 * 1024 * 4;
+    settings.ext_compact_under = 0;
+    settings.ext_max_frag = 0.5;
+#endif
+#ifdef TLS
+    settings.ssl_enabled = false;
+    settings.ssl_ctx = NULL;
+    settings.ssl_chain_cert = NULL;
+    settings.ssl_key = NULL;
+    settings.ssl_ca_cert = NULL;
+    settings.ssl_verify_mode = 0;
+    settings.ssl_ciphers = NULL;
+    settings.ssl_session_cache = 1024 * 20;
+    settings.ssl_wbuf_size = 16 * 1024; /* one full TLS record */
+    settings.ssl_ktls = false;
+#endif
+#ifdef COMPRESSION
+    settings.compress_min = 0;
+    settings.compress_level = 1;
+#endif
+#ifdef NUMA
+    settings.numa = false;
 #endif
 }
 
@@ -475,7 +525,52 @@ void conn_worker_readd(conn *c) {
     if (event_add(&c->event, 0) == -1) {
         perror("event_add");
     }
+#ifdef EXTSTORE
+    /* Back from the storage IO threads: finish writing the response. */
+    if (c->io_queued) {
+        c->io_queued = false;
+        _get_extstore_finish(c);
+        drive_machine(c);
+    }
+#endif
+}
+
+#ifdef HAVE_RECVMMSG
+/* Datagrams pulled off a UDP socket by one recvmmsg() call, handed to the
+ * state machine one at a time. */
+typedef struct udp_batch {
+    struct mmsghdr msgs[UDP_BATCH_SIZE];
+    struct iovec iovs[UDP_BATCH_SIZE];
+    struct sockaddr_in6 addrs[UDP_BATCH_SIZE];
+    char *bufs[UDP_BATCH_SIZE];
+    int count; /* datagrams received by the last call */
+    int next;  /* next datagram to hand out */
+} udp_batch;
+
+static void udp_batch_free(udp_batch *b) {
+    int i;
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        free(b->bufs[i]);
+    }
+    free(b);
+}
+
+/* Each slot holds a whole datagram, since slots get swapped into rbuf. */
+static udp_batch *udp_batch_new(const int bufsize) {
+    udp_batch *b = calloc(1, sizeof(udp_batch));
+    int i;
+
+    if (b == NULL)
+        return NULL;
+    for (i = 0; i < UDP_BATCH_SIZE; i++) {
+        if ((b->bufs[i] = malloc(bufsize)) == NULL) {
+            udp_batch_free(b);
+            return NULL;
+        }
+    }
+    return b;
 }
+#endif
 
 conn *conn_new(const int sfd, enum conn_states init_state,
                 const int event_flags,
@@ -502,6 +597,7 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         c->iov = 0;
         c->msglist = 0;
         c->hdrbuf = 0;
+        c->bbuf = 0;
 
         c->rsize = read_buffer_size;
         c->wsize = DATA_BUFFER_SIZE;
@@ -538,6 +634,26 @@ conn *conn_new(const int sfd, enum conn_states init_state,
 
     c->transport = transport;
     c->protocol = settings.binding_protocol;
+    c->read = tcp_read;
+    c->sendmsg = tcp_sendmsg;
+#ifdef TLS
+    c->ssl = NULL;
+    if (settings.ssl_enabled && transport == tcp_transport
+            && init_state == conn_new_cmd && !ssl_conn_init(c)) {
+        fprintf(stderr, "Failed to set up TLS for connection\n");
+        return NULL;
+    }
+#endif
+
+#ifdef HAVE_RECVMMSG
+    if (IS_UDP(transport) && c->udp_batch == NULL) {
+        /* Without the batch we just read one datagram at a time. */
+        c->udp_batch = udp_batch_new(read_buffer_size);
+    }
+    if (c->udp_batch != NULL) {
+        c->udp_batch->count = c->udp_batch->next = 0;
+    }
+#endif
 
     /* unix socket mode doesn't need this, so zeroed out.  but why
      * is this done for every command?  presumably for UDP
@@ -595,9 +711,18 @@ conn *conn_new(const int sfd, enum conn_states init_state,
 
     c->write_and_go = init_state;
     c->write_and_free = 0;
+    c->bbytes = 0;
+    c->batch_check = false;
     c->item = 0;
 
     c->noreply = false;
+    c->mset_res = false;
+    c->loading = false;
+#ifdef EXTSTORE
+    c->io_wraplist = NULL;
+    c->io_wrapleft = 0;
+    c->io_queued = false;
+#endif
 
     event_set(&c->event, sfd, event_flags, event_handler, (void *)c);
     event_base_set(base, &c->event);
@@ -640,6 +765,17 @@ static void conn_release_items(conn *c) {
         }
     }
 
+#ifdef EXTSTORE
+    while (c->io_wraplist) {
+        io_wrap *tmp = c->io_wraplist->next;
+        /* header items are in ilist or c->item */
+        item_remove(c->io_wraplist->read_it);
+        do_cache_free(c->thread->io_cache, c->io_wraplist);
+        c->io_wraplist = tmp;
+    }
+    c->io_wrapleft = 0;
+#endif
+
     c->icurr = c->ilist;
     c->suffixcurr = c->suffixlist;
 }
@@ -679,10 +815,17 @@ void conn_free(conn *c) {
             free(c->hdrbuf);
         if (c->msglist)
             free(c->msglist);
+#ifdef HAVE_RECVMMSG
+        if (c->udp_batch)
+            udp_batch_free(c->udp_batch);
+#endif
         if (c->rbuf)
             free(c->rbuf);
         if (c->wbuf)
             free(c->wbuf);
+        if (c->bbuf)
+            free(c->bbuf);
+        proxy_conn_free(c->proxy);
         if (c->ilist)
             free(c->ilist);
         if (c->suffixlist)
@@ -706,6 +849,9 @@ static void conn_close(conn *c) {
 
     MEMCACHED_CONN_RELEASE(c->sfd);
     conn_set_state(c, conn_closed);
+#ifdef TLS
+    ssl_conn_close(c);
+#endif
     close(c->sfd);
 
     pthread_mutex_lock(&conn_lock);
@@ -792,7 +938,8 @@ static const char *state_text(enum conn_states state) {
                                        "conn_closing",
                                        "conn_mwrite",
                                        "conn_closed",
-                                       "conn_watch" };
+                                       "conn_watch",
+                                       "conn_proxy" };
     return statenames[state];
 }
 
@@ -814,6 +961,7 @@ static void conn_set_state(conn *c, enum conn_states state) {
 
         if (state == conn_write || state == conn_mwrite) {
             MEMCACHED_PROCESS_COMMAND_END(c->sfd, c->wbuf, c->wbytes);
+            c->batch_check = true;
         }
         c->state = state;
     }
@@ -1048,6 +1196,55 @@ static void out_of_memory(conn *c, char *ascii_error) {
  * we get here after reading the value in set/add/replace commands. The command
  * has been stored in c->cmd, and the item is ready in c->item.
  */
+/* The meta flavour of the store responses, with any flags echoed back. */
+static void out_mset_result(conn *c, const enum store_item_type ret, item *it) {
+    char resp[KEY_MAX_LENGTH + META_OPAQUE_MAX + 16];
+    char *p;
+
+    switch (ret) {
+    case STORED:
+        memcpy(resp, "HD", 2);
+        /* quiet mode only reports failures */
+        if (c->mset_quiet)
+            c->noreply = true;
+        break;
+    case EXISTS:
+        memcpy(resp, "EX", 2);
+        break;
+    case NOT_FOUND:
+        memcpy(resp, "NF", 2);
+        break;
+    case NOT_STORED:
+        memcpy(resp, "NS", 2);
+        break;
+    default:
+        out_string(c, "SERVER_ERROR Unhandled storage type.");
+        return;
+    }
+    p = _meta_echo_flags(resp + 2, c->mset_opaque, strlen(c->mset_opaque),
+            c->mset_key ? ITEM_key(it) : NULL, it->nkey);
+    *p = '\0';
+    out_string(c, resp);
+}
+
+#ifdef COMPRESSION
+/* Swaps c->item for a compressed copy when that takes less memory. What an
+ * append or prepend reads in is combined with the old value, so it's left
+ * alone. */
+static void _compress_nread_item(conn *c, const int comm) {
+    item *it;
+
+    if (settings.compress_min == 0 ||
+            comm == NREAD_APPEND || comm == NREAD_PREPEND)
+        return;
+    it = item_compress(c, c->item);
+    if (it != NULL) {
+        item_remove(c->item);
+        c->item = it;
+    }
+}
+#endif
+
 static void complete_nread_ascii(conn *c) {
     assert(c != NULL);
 
@@ -1091,6 +1288,10 @@ static void complete_nread_ascii(conn *c) {
     if (!is_valid) {
         out_string(c, "CLIENT_ERROR bad data chunk");
     } else {
+#ifdef COMPRESSION
+      _compress_nread_item(c, comm);
+      it = c->item;
+#endif
       ret = store_item(it, comm, c);
 
 #ifdef ENABLE_DTRACE
@@ -1123,7 +1324,9 @@ static void complete_nread_ascii(conn *c) {
       }
 #endif
 
-      switch (ret) {
+      if (c->mset_res) {
+          out_mset_result(c, ret, it);
+      } else switch (ret) {
       case STORED:
           out_string(c, "STORED");
           break;
@@ -1142,6 +1345,7 @@ static void complete_nread_ascii(conn *c) {
 
     }
 
+    c->mset_res = false;
     item_remove(c->item);       /* release the c->item reference */
     c->item = 0;
 }
@@ -1414,6 +1618,10 @@ static void complete_update_bin(conn *c) {
         ch->used += 2;
     }
 
+#ifdef COMPRESSION
+    _compress_nread_item(c, c->cmd);
+    it = c->item;
+#endif
     ret = store_item(it, c->cmd, c);
 
 #ifdef ENABLE_DTRACE
@@ -1470,6 +1678,176 @@ static void complete_update_bin(conn *c) {
     c->item = 0;
 }
 
+/* Writes a binary get miss, with the key for the GETK family. */
+static void write_bin_miss_response(conn *c, char *key, size_t nkey) {
+    if (nkey) {
+        char *ofs = c->wbuf + sizeof(protocol_binary_response_header);
+        add_bin_header(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
+                0, nkey, nkey);
+        memcpy(ofs, key, nkey);
+        add_iov(c, ofs, nkey);
+        conn_set_state(c, conn_mwrite);
+        c->write_and_go = conn_new_cmd;
+    } else {
+        write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
+                        NULL, 0);
+    }
+}
+
+#ifdef EXTSTORE
+static void _get_extstore_cb(void *e, obj_io *io, int ret) {
+    io_wrap *wrap = (io_wrap *)io->data;
+    conn *c = wrap->c;
+    if (ret < 1) {
+        wrap->miss = true;
+    }
+    /* All of a connection's reads are queued to the same IO thread. */
+    c->io_wrapleft--;
+    if (c->io_wrapleft == 0) {
+        assert(c->io_queued == true);
+        redispatch_conn(c);
+    }
+}
+
+/* Queues a read of the value behind an ITEM_HDR item into a freshly
+ * allocated item, and adds the iovec for the value. iovst is the first iovec
+ * of this item's part of the response, so a miss can blank it out later.
+ * The reads are submitted once the whole response has been built.
+ */
+static int _get_extstore(conn *c, item *it, int iovst, bool with_suffix) {
+    item_hdr *hdr = (item_hdr *)ITEM_data(it);
+    item *new_it;
+    io_wrap *io;
+    uint32_t flags;
+    int ret;
+
+    FLAGS_CONV(settings.inline_ascii_response, it, flags);
+    new_it = item_alloc(ITEM_key(it), it->nkey, flags, it->exptime, it->nbytes);
+    if (new_it == NULL || (new_it->it_flags & ITEM_CHUNKED)) {
+        if (new_it != NULL)
+            item_remove(new_it);
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.get_oom_extstore++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        return -1;
+    }
+
+    io = do_cache_alloc(c->thread->io_cache);
+    if (io == NULL) {
+        item_remove(new_it);
+        return -1;
+    }
+
+    if (c->protocol == binary_prot) {
+        ret = add_iov(c, ITEM_data(new_it), it->nbytes - 2);
+    } else if (with_suffix) {
+        /* The header item's suffix has its own length in it, not the
+         * value's, so send the new item's from the space after the key. */
+        ret = add_iov(c, ITEM_key(new_it) + new_it->nkey,
+                1 + new_it->nsuffix + new_it->nbytes);
+    } else {
+        ret = add_iov(c, ITEM_data(new_it), it->nbytes);
+    }
+    if (ret != 0) {
+        do_cache_free(c->thread->io_cache, io);
+        item_remove(new_it);
+        return -1;
+    }
+
+    io->c = c;
+    io->hdr_it = it;
+    io->read_it = new_it;
+    io->iovec_start = iovst;
+    io->iovec_count = c->iovused - iovst;
+    io->miss = false;
+    io->miss_res = NULL;
+
+    io->io.data = (void *)io;
+    io->io.buf = ITEM_data(new_it);
+    io->io.len = it->nbytes;
+    io->io.offset = hdr->offset;
+    io->io.page_id = hdr->page_id;
+    io->io.page_version = hdr->page_version;
+    io->io.mode = OBJ_IO_READ;
+    io->io.cb = _get_extstore_cb;
+
+    /* chain so the whole response is submitted at once */
+    io->io.next = c->io_wraplist ? &c->io_wraplist->io : NULL;
+    io->next = c->io_wraplist;
+    c->io_wraplist = io;
+    c->io_wrapleft++;
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.get_extstore++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    return 0;
+}
+
+/* Turns values which could not be read back into misses. */
+static void _get_extstore_finish(conn *c) {
+    io_wrap *io;
+    int i;
+
+    conn_set_state(c, conn_mwrite);
+    for (io = c->io_wraplist; io != NULL; io = io->next) {
+        if (!io->miss)
+            continue;
+
+        if (c->protocol == binary_prot) {
+            protocol_binary_response_header *rsp =
+                (protocol_binary_response_header *)c->wbuf;
+            if (c->noreply) {
+                /* quiet gets don't answer misses */
+                c->msgused = 0;
+                c->msgcurr = 0;
+            } else if (rsp->response.keylen != 0) {
+                write_bin_miss_response(c, ITEM_key(io->hdr_it),
+                        io->hdr_it->nkey);
+            } else {
+                write_bin_miss_response(c, NULL, 0);
+            }
+        } else {
+            const char *miss_res = io->miss_res;
+            for (i = 0; i < io->iovec_count; i++) {
+                struct iovec *v = &c->iov[io->iovec_start + i];
+                /* UDP frame headers must stay */
+                if (IS_UDP(c->transport)
+                        && (unsigned char *)v->iov_base >= c->hdrbuf
+                        && (unsigned char *)v->iov_base <
+                           c->hdrbuf + c->hdrsize * UDP_HEADER_SIZE) {
+                    continue;
+                }
+                if (miss_res != NULL) {
+                    /* meta gets answer a miss instead of skipping it */
+                    v->iov_base = (void *)miss_res;
+                    v->iov_len = strlen(miss_res);
+                    miss_res = NULL;
+                } else {
+                    v->iov_len = 0;
+                }
+            }
+        }
+
+        /* The stored copy is gone for good. */
+        item_unlink(io->hdr_it);
+
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.get_aborted_extstore++;
+        c->thread->stats.get_misses++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+
+    /* Blanked out responses may leave nothing in a msghdr to send. */
+    for (i = c->msgcurr; i < c->msgused; i++) {
+        struct msghdr *m = &c->msglist[i];
+        while (m->msg_iovlen > 0 && m->msg_iov->iov_len == 0) {
+            m->msg_iovlen--;
+            m->msg_iov++;
+        }
+    }
+}
+#endif
+
 static void process_bin_get_or_touch(conn *c) {
     item *it;
 
@@ -1497,6 +1875,10 @@ static void process_bin_get_or_touch(conn *c) {
     } else {
         it = item_get(key, nkey, c, DO_UPDATE);
     }
+#ifdef COMPRESSION
+    if (it && should_return_value && (it->it_flags & ITEM_COMPRESSED))
+        it = item_decompress(c, it);
+#endif
 
     if (it) {
         /* the length has two unnecessary bytes ("\r\n") */
@@ -1547,6 +1929,16 @@ static void process_bin_get_or_touch(conn *c) {
 
         if (should_return_value) {
             /* Add the data minus the CRLF */
+#ifdef EXTSTORE
+            if (it->it_flags & ITEM_HDR) {
+                if (_get_extstore(c, it, 0, false) != 0) {
+                    item_remove(it);
+                    write_bin_error(c, PROTOCOL_BINARY_RESPONSE_ENOMEM,
+                                    NULL, 0);
+                    return;
+                }
+            } else
+#endif
             if ((it->it_flags & ITEM_CHUNKED) == 0) {
                 add_iov(c, ITEM_data(it), it->nbytes - 2);
             } else {
@@ -1578,18 +1970,8 @@ static void process_bin_get_or_touch(conn *c) {
         if (c->noreply) {
             conn_set_state(c, conn_new_cmd);
         } else {
-            if (should_return_key) {
-                char *ofs = c->wbuf + sizeof(protocol_binary_response_header);
-                add_bin_header(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
-                        0, nkey, nkey);
-                memcpy(ofs, key, nkey);
-                add_iov(c, ofs, nkey);
-                conn_set_state(c, conn_mwrite);
-                c->write_and_go = conn_new_cmd;
-            } else {
-                write_bin_error(c, PROTOCOL_BINARY_RESPONSE_KEY_ENOENT,
-                                NULL, 0);
-            }
+            write_bin_miss_response(c, should_return_key ? key : NULL,
+                    should_return_key ? nkey : 0);
         }
     }
 
@@ -2526,12 +2908,52 @@ static void reset_cmd_handler(conn *c) {
     }
 }
 
+/* Stores a record read in by "load", then goes on to the next one. */
+static void complete_nread_load(conn *c) {
+    item *it = c->item;
+    char crlf[2];
+
+    if ((it->it_flags & ITEM_CHUNKED) == 0) {
+        memcpy(crlf, ITEM_data(it) + it->nbytes - 2, 2);
+    } else {
+        /* The last two bytes may be split over two chunks */
+        item_chunk *ch = (item_chunk *) c->ritem;
+        if (ch->used > 1) {
+            memcpy(crlf, ch->data + ch->used - 2, 2);
+        } else {
+            crlf[0] = ch->prev->data[ch->prev->used - 1];
+            crlf[1] = ch->data[0];
+        }
+    }
+
+    if (memcmp(crlf, "\r\n", 2) != 0) {
+        /* Lost track of where records start */
+        c->loading = false;
+        out_string(c, "CLIENT_ERROR bad data chunk");
+        c->write_and_go = conn_closing;
+    } else {
+        if (store_item(it, c->load_add ? NREAD_ADD : NREAD_SET, c) == STORED) {
+            c->load_stored++;
+        } else {
+            c->load_skipped++;
+        }
+        conn_set_state(c, conn_new_cmd);
+    }
+
+    item_remove(c->item);
+    c->item = 0;
+}
+
 static void complete_nread(conn *c) {
     assert(c != NULL);
     assert(c->protocol == ascii_prot
            || c->protocol == binary_prot);
 
-    if (c->protocol == ascii_prot) {
+    if (c->loading) {
+        complete_nread_load(c);
+    } else if (settings.proxy_backends) {
+        complete_nread_proxy(c);
+    } else if (c->protocol == ascii_prot) {
         complete_nread_ascii(c);
     } else if (c->protocol == binary_prot) {
         complete_nread_binary(c);
@@ -2610,7 +3032,25 @@ static int _store_item_copy_chunks(item *d_it, item *s_it, const int len) {
     return 0;
 }
 
-static int _store_item_copy_data(int comm, item *old_it, item *new_it, item *add_it) {
+static int _store_item_copy_data(conn *c, int comm, item *old_it, item *new_it, item *add_it) {
+#ifdef COMPRESSION
+    if (old_it->it_flags & ITEM_COMPRESSED) {
+        /* The old value is inflated straight into place; the result is
+         * stored uncompressed. */
+        int nraw = item_raw_nbytes(old_it) - 2;
+        char *p = ITEM_data(new_it);
+        if ((new_it->it_flags | add_it->it_flags) & ITEM_CHUNKED)
+            return -1;
+        if (comm == NREAD_APPEND) {
+            memcpy(p + nraw, ITEM_data(add_it), add_it->nbytes);
+        } else {
+            memcpy(p, ITEM_data(add_it), add_it->nbytes - 2);
+            p += add_it->nbytes - 2;
+            memcpy(p + nraw, "\r\n", 2);
+        }
+        return item_decompress_to(c, old_it, p);
+    }
+#endif
     if (comm == NREAD_APPEND) {
         if (new_it->it_flags & ITEM_CHUNKED) {
             if (_store_item_copy_chunks(new_it, old_it, old_it->nbytes - 2) == -1 ||
@@ -2704,7 +3144,14 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
                     stored = EXISTS;
                 }
             }
-
+#ifdef EXTSTORE
+            if ((old_it->it_flags & ITEM_HDR) != 0) {
+                /* block append/prepend from working with extstore-d items.
+                 * the value isn't in memory to combine with.
+                 */
+                failed_alloc = 1;
+            } else
+#endif
             if (stored == NOT_STORED) {
                 /* we have it and old_it here - alloc memory to hold both */
                 /* flags was already lost - so recover them from ITEM_suffix(it) */
@@ -2717,10 +3164,15 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
                     flags = 0;
                 }
 
-                new_it = do_item_alloc(key, it->nkey, flags, old_it->exptime, it->nbytes + old_it->nbytes - 2 /* CRLF */);
+                int old_nbytes = old_it->nbytes;
+#ifdef COMPRESSION
+                if (old_it->it_flags & ITEM_COMPRESSED)
+                    old_nbytes = item_raw_nbytes(old_it);
+#endif
+                new_it = do_item_alloc(key, it->nkey, flags, old_it->exptime, it->nbytes + old_nbytes - 2 /* CRLF */);
 
                 /* copy data from it and old_it to new_it */
-                if (new_it == NULL || _store_item_copy_data(comm, old_it, new_it, it) == -1) {
+                if (new_it == NULL || _store_item_copy_data(c, comm, old_it, new_it, it) == -1) {
                     failed_alloc = 1;
                     stored = NOT_STORED;
                     // failed data copy, free up.
@@ -2738,6 +3190,9 @@ enum store_item_type do_store_item(item *it, int comm, conn *c, const uint32_t h
             else
                 do_item_link(it, hv);
 
+            if (old_it == NULL && settings.lru_autotune)
+                item_lru_ghost_check(it, hv);
+
             c->cas = ITEM_get_cas(it);
 
             stored = STORED;
@@ -2767,7 +3222,7 @@ typedef struct token_s {
 #define SUBCOMMAND_TOKEN 1
 #define KEY_TOKEN 1
 
-#define MAX_TOKENS 8
+#define MAX_TOKENS 24
 
 /*
  * Tokenize the command string by replacing whitespace with '\0' and update
@@ -2949,6 +3404,13 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("get_misses", "%llu", (unsigned long long)thread_stats.get_misses);
     APPEND_STAT("get_expired", "%llu", (unsigned long long)thread_stats.get_expired);
     APPEND_STAT("get_flushed", "%llu", (unsigned long long)thread_stats.get_flushed);
+#ifdef EXTSTORE
+    if (c->thread->storage) {
+        APPEND_STAT("get_extstore", "%llu", (unsigned long long)thread_stats.get_extstore);
+        APPEND_STAT("get_aborted_extstore", "%llu", (unsigned long long)thread_stats.get_aborted_extstore);
+        APPEND_STAT("get_oom_extstore", "%llu", (unsigned long long)thread_stats.get_oom_extstore);
+    }
+#endif
     APPEND_STAT("delete_misses", "%llu", (unsigned long long)thread_stats.delete_misses);
     APPEND_STAT("delete_hits", "%llu", (unsigned long long)slab_stats.delete_hits);
     APPEND_STAT("incr_misses", "%llu", (unsigned long long)thread_stats.incr_misses);
@@ -2965,6 +3427,19 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     if (settings.idle_timeout) {
         APPEND_STAT("idle_kicks", "%llu", (unsigned long long)thread_stats.idle_kicks);
     }
+    if (settings.proxy_backends) {
+        APPEND_STAT("proxy_requests", "%llu", (unsigned long long)thread_stats.proxy_requests);
+        APPEND_STAT("proxy_errors", "%llu", (unsigned long long)thread_stats.proxy_errors);
+    }
+#ifdef COMPRESSION
+    if (settings.compress_min > 0) {
+        APPEND_STAT("compress_sets", "%llu", (unsigned long long)thread_stats.compress_sets);
+        APPEND_STAT("compress_skipped", "%llu", (unsigned long long)thread_stats.compress_skipped);
+        APPEND_STAT("compress_bytes_saved", "%llu", (unsigned long long)thread_stats.compress_bytes_saved);
+        APPEND_STAT("decompress_gets", "%llu", (unsigned long long)thread_stats.decompress_gets);
+        APPEND_STAT("decompress_errors", "%llu", (unsigned long long)thread_stats.decompress_errors);
+    }
+#endif
     APPEND_STAT("bytes_read", "%llu", (unsigned long long)thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%llu", (unsigned long long)thread_stats.bytes_written);
     APPEND_STAT("limit_maxbytes", "%llu", (unsigned long long)settings.maxbytes);
@@ -2973,6 +3448,7 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("time_in_listen_disabled_us", "%llu", stats.time_in_listen_disabled_us);
     APPEND_STAT("threads", "%d", settings.num_threads);
     APPEND_STAT("conn_yields", "%llu", (unsigned long long)thread_stats.conn_yields);
+    APPEND_STAT("responses_batched", "%llu", (unsigned long long)thread_stats.responses_batched);
     APPEND_STAT("hash_power_level", "%u", stats_state.hash_power_level);
     APPEND_STAT("hash_bytes", "%llu", (unsigned long long)stats_state.hash_bytes);
     APPEND_STAT("hash_is_expanding", "%u", stats_state.hash_is_expanding);
@@ -2999,7 +3475,20 @@ static void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("log_worker_written", "%llu", (unsigned long long)stats.log_worker_written);
     APPEND_STAT("log_watcher_skipped", "%llu", (unsigned long long)stats.log_watcher_skipped);
     APPEND_STAT("log_watcher_sent", "%llu", (unsigned long long)stats.log_watcher_sent);
+#ifdef TLS
+    if (settings.ssl_enabled) {
+        APPEND_STAT("ssl_handshake_errors", "%llu", (unsigned long long)stats.ssl_handshake_errors);
+        APPEND_STAT("ssl_new_sessions", "%llu", (unsigned long long)stats.ssl_new_sessions);
+        APPEND_STAT("ssl_session_reuses", "%llu", (unsigned long long)stats.ssl_session_reuses);
+        APPEND_STAT("ssl_ktls_conns", "%llu", (unsigned long long)stats.ssl_ktls_conns);
+    }
+#endif
     STATS_UNLOCK();
+#ifdef EXTSTORE
+    if (c->thread->storage) {
+        storage_stats(add_stats, c);
+    }
+#endif
 }
 
 static void process_stat_settings(ADD_STAT add_stats, void *c) {
@@ -3023,8 +3512,12 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("detail_enabled", "%s",
                 settings.detail_enabled ? "yes" : "no");
     APPEND_STAT("reqs_per_event", "%d", settings.reqs_per_event);
+    APPEND_STAT("reply_batch_size", "%d", settings.reply_batch_size);
     APPEND_STAT("cas_enabled", "%s", settings.use_cas ? "yes" : "no");
     APPEND_STAT("tcp_backlog", "%d", settings.backlog);
+    if (settings.reuseport) {
+        APPEND_STAT("reuseport", "%s", "yes");
+    }
     APPEND_STAT("binding_protocol", "%s",
                 prot_text(settings.binding_protocol));
     APPEND_STAT("auth_enabled_sasl", "%s", settings.sasl ? "yes" : "no");
@@ -3036,6 +3529,8 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("slab_automove_ratio", "%.2f", settings.slab_automove_ratio);
     APPEND_STAT("slab_automove_window", "%.2f", settings.slab_automove_window);
     APPEND_STAT("slab_chunk_max", "%d", settings.slab_chunk_size_max);
+    APPEND_STAT("slab_thread_cache", "%s", settings.slab_thread_cache ? "yes" : "no");
+    APPEND_STAT("slab_compact", "%s", settings.slab_compact ? "yes" : "no");
     APPEND_STAT("lru_crawler", "%s", settings.lru_crawler ? "yes" : "no");
     APPEND_STAT("lru_crawler_sleep", "%d", settings.lru_crawler_sleep);
     APPEND_STAT("lru_crawler_tocrawl", "%lu", (unsigned long)settings.lru_crawler_tocrawl);
@@ -3049,13 +3544,64 @@ static void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("warm_lru_pct", "%d", settings.warm_lru_pct);
     APPEND_STAT("hot_max_factor", "%.2f", settings.hot_max_factor);
     APPEND_STAT("warm_max_factor", "%.2f", settings.warm_max_factor);
+    if (settings.lru_autotune) {
+        APPEND_STAT("lru_autotune", "%s", "yes");
+        APPEND_STAT("lru_autotune_window", "%d", settings.lru_autotune_window);
+    }
     APPEND_STAT("temp_lru", "%s", settings.temp_lru ? "yes" : "no");
     APPEND_STAT("temporary_ttl", "%u", settings.temporary_ttl);
     APPEND_STAT("idle_timeout", "%d", settings.idle_timeout);
     APPEND_STAT("watcher_logbuf_size", "%u", settings.logger_watcher_buf_size);
     APPEND_STAT("worker_logbuf_size", "%u", settings.logger_buf_size);
     APPEND_STAT("track_sizes", "%s", item_stats_sizes_status() ? "yes" : "no");
+    APPEND_STAT("hotkeys", "%s", hotkeys_status() ? "yes" : "no");
+    APPEND_STAT("hotkeys_sample", "%u", settings.hotkeys_sample);
     APPEND_STAT("inline_ascii_response", "%s", settings.inline_ascii_response ? "yes" : "no");
+    if (settings.memory_file) {
+        APPEND_STAT("memory_file", "%s", settings.memory_file);
+    }
+    if (settings.proxy_backends) {
+        APPEND_STAT("proxy_backends", "%s", settings.proxy_backends);
+        APPEND_STAT("proxy_timeout", "%d", settings.proxy_timeout);
+        APPEND_STAT("proxy_retry", "%d", settings.proxy_retry);
+    }
+#ifdef EXTSTORE
+    if (((conn *)c)->thread->storage) {
+        APPEND_STAT("ext_item_size", "%u", settings.ext_item_size);
+        APPEND_STAT("ext_item_age", "%u", settings.ext_item_age);
+        APPEND_STAT("ext_page_size", "%u", settings.ext_page_size);
+        APPEND_STAT("ext_wbuf_size", "%u", settings.ext_wbuf_size);
+        APPEND_STAT("ext_compact_under", "%u", settings.ext_compact_under);
+        APPEND_STAT("ext_max_frag", "%.2f", settings.ext_max_frag);
+    }
+#endif
+#ifdef TLS
+    if (settings.ssl_enabled) {
+        APPEND_STAT("ssl_enabled", "%s", "yes");
+        APPEND_STAT("ssl_chain_cert", "%s", settings.ssl_chain_cert);
+        APPEND_STAT("ssl_key", "%s", settings.ssl_key);
+        APPEND_STAT("ssl_ca_cert", "%s",
+                settings.ssl_ca_cert ? settings.ssl_ca_cert : "NULL");
+        APPEND_STAT("ssl_verify_mode", "%d", settings.ssl_verify_mode);
+        APPEND_STAT("ssl_ciphers", "%s",
+                settings.ssl_ciphers ? settings.ssl_ciphers : "NULL");
+        APPEND_STAT("ssl_session_cache", "%u", settings.ssl_session_cache);
+        APPEND_STAT("ssl_wbuf_size", "%u", settings.ssl_wbuf_size);
+        APPEND_STAT("ssl_ktls", "%s", settings.ssl_ktls ? "yes" : "no");
+    }
+#endif
+#ifdef COMPRESSION
+    if (settings.compress_min > 0) {
+        APPEND_STAT("compress_min", "%d", settings.compress_min);
+        APPEND_STAT("compress_level", "%d", settings.compress_level);
+    }
+#endif
+#ifdef NUMA
+    if (settings.numa) {
+        APPEND_STAT("numa", "%s", "yes");
+        APPEND_STAT("numa_nodes", "%d", slabs_numa_nodes());
+    }
+#endif
 }
 
 static void conn_to_str(const conn *c, char *buf) {
@@ -3276,8 +3822,8 @@ static inline int make_ascii_get_suffix(char *suffix, item *it, bool return_cas,
 }
 
 #define IT_REFCOUNT_LIMIT 60000
-static inline item* limited_get(char *key, size_t nkey, conn *c) {
-    item *it = item_get(key, nkey, c, DO_UPDATE);
+static inline item* limited_get(char *key, size_t nkey, const uint32_t hv, conn *c) {
+    item *it = item_get_hv(key, nkey, hv, c, DO_UPDATE);
     if (it && it->refcount > IT_REFCOUNT_LIMIT) {
         item_remove(it);
         it = NULL;
@@ -3329,6 +3875,20 @@ static inline char *_ascii_get_suffix_buf(conn *c, int i) {
     *(c->suffixlist + i) = suffix;
     return suffix;
 }
+/* Hashes every key in this batch of tokens and prefetches their hash buckets
+ * and item headers before any of them are looked up. */
+static inline void _ascii_get_prefetch(token_t *key_token, uint32_t *hvs) {
+    int n;
+
+    for (n = 0; key_token[n].length != 0; n++) {
+        hvs[n] = hash(key_token[n].value, key_token[n].length);
+        assoc_prefetch_bucket(hvs[n]);
+    }
+    while (n-- > 0) {
+        assoc_prefetch_item(hvs[n]);
+    }
+}
+
 // FIXME: the 'breaks' around memory malloc's should break all the way down,
 // fill ileft/suffixleft, then run conn_releaseitems()
 /* ntokens is overwritten here... shrug.. */
@@ -3339,10 +3899,14 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     int si = 0;
     item *it;
     token_t *key_token = &tokens[KEY_TOKEN];
+    uint32_t hvs[MAX_TOKENS];
+    uint32_t *hv;
     char *suffix;
     assert(c != NULL);
 
     do {
+        _ascii_get_prefetch(key_token, hvs);
+        hv = hvs;
         while(key_token->length != 0) {
 
             key = key_token->value;
@@ -3356,25 +3920,40 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                         do_cache_free(c->thread->suffix_cache, *(c->suffixlist + i));
                     }
                 }
+#ifdef EXTSTORE
+                /* drop any reads which were queued up */
+                conn_release_items(c);
+#endif
                 return;
             }
 
-            it = limited_get(key, nkey, c);
+            it = limited_get(key, nkey, *hv, c);
+#ifdef COMPRESSION
+            if (it && (it->it_flags & ITEM_COMPRESSED))
+                it = item_decompress(c, it);
+#endif
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
             if (it) {
+#ifdef EXTSTORE
+                int iovst = c->iovused;
+#endif
                 if (_ascii_get_expand_ilist(c, i) != 0) {
                     item_remove(it);
                     break; // FIXME: Should bail down to error.
                 }
 
                 /*
-                 * Construct the response. Each hit adds three elements to the
+                 * Construct the response. Each hit adds these elements to the
                  * outgoing data list:
                  *   "VALUE "
                  *   key
-                 *   " " + flags + " " + data length + "\r\n" + data (with \r\n)
+                 *   " " + flags + " " + data length [+ " " + cas] + "\r\n"
+                 *   data (with \r\n)
+                 * With inline_ascii_response the item already holds everything
+                 * from the key to the end of the data in one piece, so unless
+                 * a CAS goes in the middle that is a single element.
                  */
 
                 if (return_cas || !settings.inline_ascii_response)
@@ -3390,14 +3969,24 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                   si++;
                   nbytes = it->nbytes;
                   int suffix_len = make_ascii_get_suffix(suffix, it, return_cas, nbytes);
+                  /* Inline: key, space and stored suffix minus its "\r\n". */
+                  int key_len = settings.inline_ascii_response ?
+                      it->nkey + 1 + it->nsuffix - 2 : it->nkey;
                   if (add_iov(c, "VALUE ", 6) != 0 ||
-                      add_iov(c, ITEM_key(it), it->nkey) != 0 ||
-                      (settings.inline_ascii_response && add_iov(c, ITEM_suffix(it), it->nsuffix - 2) != 0) ||
+                      add_iov(c, ITEM_key(it), key_len) != 0 ||
                       add_iov(c, suffix, suffix_len) != 0)
                       {
                           item_remove(it);
                           break;
                       }
+#ifdef EXTSTORE
+                  if (it->it_flags & ITEM_HDR) {
+                      if (_get_extstore(c, it, iovst, false) != 0) {
+                          item_remove(it);
+                          break;
+                      }
+                  } else
+#endif
                   if ((it->it_flags & ITEM_CHUNKED) == 0) {
                       add_iov(c, ITEM_data(it), it->nbytes);
                   } else if (add_chunked_item_iovs(c, it, it->nbytes) != 0) {
@@ -3409,20 +3998,27 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 {
                   MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
                                         it->nbytes, ITEM_get_cas(it));
-                  if (add_iov(c, "VALUE ", 6) != 0 ||
-                      add_iov(c, ITEM_key(it), it->nkey) != 0)
-                      {
+                  if (add_iov(c, "VALUE ", 6) != 0) {
+                      item_remove(it);
+                      break;
+                  }
+#ifdef EXTSTORE
+                  if (it->it_flags & ITEM_HDR) {
+                      if (add_iov(c, ITEM_key(it), it->nkey) != 0 ||
+                          _get_extstore(c, it, iovst, true) != 0) {
                           item_remove(it);
                           break;
                       }
+                  } else
+#endif
                   if ((it->it_flags & ITEM_CHUNKED) == 0)
                       {
-                          if (add_iov(c, ITEM_suffix(it), it->nsuffix + it->nbytes) != 0)
+                          if (add_iov(c, ITEM_key(it), it->nkey + 1 + it->nsuffix + it->nbytes) != 0)
                           {
                               item_remove(it);
                               break;
                           }
-                      } else if (add_iov(c, ITEM_suffix(it), it->nsuffix) != 0 ||
+                      } else if (add_iov(c, ITEM_key(it), it->nkey + 1 + it->nsuffix) != 0 ||
                                  add_chunked_item_iovs(c, it, it->nbytes) != 0) {
                           item_remove(it);
                           break;
@@ -3456,6 +4052,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
             }
 
             key_token++;
+            hv++;
         }
 
         /*
@@ -3486,6 +4083,10 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     */
     if (key_token->value != NULL || add_iov(c, "END\r\n", 5) != 0
         || (IS_UDP(c->transport) && build_udp_headers(c) != 0)) {
+#ifdef EXTSTORE
+        /* the response is abandoned, so are its reads */
+        conn_release_items(c);
+#endif
         out_of_memory(c, "SERVER_ERROR out of memory writing get response");
     }
     else {
@@ -3630,37 +4231,544 @@ static void process_touch_command(conn *c, token_t *tokens, const size_t ntokens
     }
 }
 
-static void process_arithmetic_command(conn *c, token_t *tokens, const size_t ntokens, const bool incr) {
-    char temp[INCR_MAX_STORAGE_LEN];
-    uint64_t delta;
+/* Meta commands: mg, ms, md and mn. A key is followed by single character
+ * flags, some of which carry a value ("T30"). The response is a two letter
+ * code followed by whichever flags the client asked to have returned.
+ */
+struct _meta_flags {
+    bool value;        /* v: return the value */
+    bool ttl;          /* t: return the remaining TTL, -1 if none */
+    bool cas;          /* c: return the CAS */
+    bool flags;        /* f: return the client flags */
+    bool size;         /* s: return the size of the value */
+    bool key;          /* k: return the key */
+    bool hit;          /* h: return whether it had been fetched before */
+    bool la;           /* l: return seconds since it was last accessed */
+    bool quiet;        /* q: only respond with something interesting */
+    bool no_update;    /* u: don't bump the item in the LRU */
+    bool compressed;   /* z: take the value as stored, even if compressed */
+    bool set_stale;    /* I: invalidate instead of removing */
+    bool new_ttl;      /* T(token): update the TTL */
+    bool vivify;       /* N(token): create a placeholder on miss */
+    bool recache;      /* R(token): win a recache below this TTL */
+    bool has_cas;      /* C(token): compare CAS */
+    int32_t exptime;
+    int32_t autoviv_exptime;
+    int32_t recache_time;
+    uint64_t req_cas_id;
+    uint32_t client_flags; /* F(token) */
+    char mode;         /* M(token): E, A, P, R or S(et) */
+    char *opaque;      /* O(token): echoed back */
+    size_t nopaque;
+};
+
+/* Parses the flags from tokens[start] on. Only flags named in allowed are
+ * accepted. Returns -1 on anything malformed. */
+static int _meta_flag_preparse(token_t *tokens, const size_t start,
+        const char *allowed, struct _meta_flags *of) {
+    token_t *t;
+
+    memset(of, 0, sizeof(*of));
+    of->mode = 'S';
+
+    for (t = &tokens[start]; t->length != 0; t++) {
+        char *v = t->value + 1;
+        if (strchr(allowed, t->value[0]) == NULL)
+            return -1;
+        /* flags without a token are one character long */
+        if (strchr("vtcfskhlquzI", t->value[0]) != NULL && t->length != 1)
+            return -1;
+        switch (t->value[0]) {
+            case 'v': of->value = true; break;
+            case 't': of->ttl = true; break;
+            case 'c': of->cas = true; break;
+            case 'f': of->flags = true; break;
+            case 's': of->size = true; break;
+            case 'k': of->key = true; break;
+            case 'h': of->hit = true; break;
+            case 'l': of->la = true; break;
+            case 'q': of->quiet = true; break;
+            case 'u': of->no_update = true; break;
+            case 'z': of->compressed = true; break;
+            case 'I': of->set_stale = true; break;
+            case 'T':
+                if (!safe_strtol(v, &of->exptime))
+                    return -1;
+                /* Same as for set: negative TTLs expire immediately. */
+                if (of->exptime < 0)
+                    of->exptime = REALTIME_MAXDELTA + 1;
+                of->new_ttl = true;
+                break;
+            case 'N':
+                if (!safe_strtol(v, &of->autoviv_exptime))
+                    return -1;
+                if (of->autoviv_exptime < 0)
+                    of->autoviv_exptime = REALTIME_MAXDELTA + 1;
+                of->vivify = true;
+                break;
+            case 'R':
+                if (!safe_strtol(v, &of->recache_time))
+                    return -1;
+                of->recache = true;
+                break;
+            case 'C':
+                if (!safe_strtoull(v, &of->req_cas_id))
+                    return -1;
+                of->has_cas = true;
+                break;
+            case 'F':
+                if (!safe_strtoul(v, &of->client_flags))
+                    return -1;
+                break;
+            case 'M':
+                if (t->length != 2 || strchr("EAPRS", v[0]) == NULL)
+                    return -1;
+                of->mode = v[0];
+                break;
+            case 'O':
+                if (t->length - 1 > META_OPAQUE_MAX)
+                    return -1;
+                of->opaque = v;
+                of->nopaque = t->length - 1;
+                break;
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+/* Appends the flags which are echoed back as given: the opaque and, if key
+ * isn't NULL, the key. */
+static char *_meta_echo_flags(char *p, const char *opaque, const size_t nopaque,
+        const char *key, const size_t nkey) {
+    if (nopaque > 0) {
+        memcpy(p, " O", 2);
+        memcpy(p + 2, opaque, nopaque);
+        p += nopaque + 2;
+    }
+    if (key != NULL) {
+        memcpy(p, " k", 2);
+        memcpy(p + 2, key, nkey);
+        p += nkey + 2;
+    }
+    return p;
+}
+
+/* Responds "EN" on a miss, or "VA <size> <flags>" followed by the value if
+ * asked for it with v, else "HD <flags>".
+ *
+ * For thundering herd protection, the first client to see an item which is
+ * missing (N), stale (I) or about to expire (R) is told it won (W) and
+ * should recache it; until then everyone else sees Z. Stale items are
+ * served with X.
+ *
+ * Compressed values are inflated for the client unless it sent z, in which
+ * case they come as stored and are marked z.
+ */
+static void process_mget_command(conn *c, token_t *tokens, const size_t ntokens) {
     char *key;
     size_t nkey;
+    struct _meta_flags of;
+    uint32_t hv;
+    item *it;
+    bool item_created = false;
+    bool won = false;
+    char *p = c->wbuf;
+    char resp[KEY_MAX_LENGTH + META_OPAQUE_MAX + 16];
+#ifdef EXTSTORE
+    int iovst = c->iovused;
+#endif
 
     assert(c != NULL);
 
-    set_noreply_maybe(c, tokens, ntokens);
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
 
-    if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+    if (nkey > KEY_MAX_LENGTH || tokens[ntokens - 1].value != NULL ||
+            _meta_flag_preparse(tokens, KEY_TOKEN + 1, "vtcfskhlquzNRTO", &of) != 0) {
         out_string(c, "CLIENT_ERROR bad command line format");
         return;
     }
 
-    key = tokens[KEY_TOKEN].value;
-    nkey = tokens[KEY_TOKEN].length;
-
-    if (!safe_strtoull(tokens[2].value, &delta)) {
-        out_string(c, "CLIENT_ERROR invalid numeric delta argument");
-        return;
+    hv = hash(key, nkey);
+    item_lock(hv);
+    it = do_item_get(key, nkey, hv, c, DONT_UPDATE);
+    /* Fetched without a bump so the flags decide it; sample it here. */
+    LOGGER_HOTKEY_SAMPLE(c->thread->l, key, nkey);
+    if (it == NULL && of.vivify) {
+        /* Nobody has this key: store an empty placeholder, and tell this
+         * client it won the right to fill it in. */
+        it = do_item_alloc(key, nkey, 0, realtime(of.autoviv_exptime), 2);
+        if (it != NULL) {
+            memcpy(ITEM_data(it), "\r\n", 2);
+            if (do_store_item(it, NREAD_ADD, c, hv) == STORED) {
+                item_created = true;
+            } else {
+                do_item_remove(it);
+                it = NULL;
+            }
+        }
     }
 
-    switch(add_delta(c, key, nkey, incr, delta, temp, NULL)) {
-    case OK:
-        out_string(c, temp);
-        break;
-    case NON_NUMERIC:
-        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
-        break;
-    case EOM:
+    if (it) {
+        /* Size of the value as it will be sent. */
+        int nbytes = it->nbytes;
+#ifdef COMPRESSION
+        if ((it->it_flags & ITEM_COMPRESSED) && !of.compressed)
+            nbytes = item_raw_nbytes(it);
+#endif
+        /* The response is built under the item lock so the flags are
+         * consistent with each other. */
+        if (item_created) {
+            won = true;
+        } else if ((it->it_flags & ITEM_TOKEN_SENT) == 0) {
+            if (it->it_flags & ITEM_STALE) {
+                won = true;
+            } else if (of.recache && it->exptime != 0 &&
+                    (int32_t)(it->exptime - current_time) < of.recache_time) {
+                won = true;
+            }
+        }
+
+        if (of.value) {
+            p += sprintf(p, "VA %d", nbytes - 2);
+        } else {
+            memcpy(p, "HD", 2);
+            p += 2;
+        }
+        if (of.cas)
+            p += sprintf(p, " c%llu", (unsigned long long)ITEM_get_cas(it));
+        if (of.flags) {
+            uint32_t flags;
+            FLAGS_CONV(settings.inline_ascii_response, it, flags);
+            p += sprintf(p, " f%u", flags);
+        }
+        if (of.hit)
+            p += sprintf(p, " h%d", (it->it_flags & ITEM_FETCHED) ? 1 : 0);
+        if (of.la)
+            p += sprintf(p, " l%u", current_time - it->time);
+        if (of.size)
+            p += sprintf(p, " s%d", nbytes - 2);
+        if (of.new_ttl)
+            it->exptime = realtime(of.exptime);
+        if (of.ttl) {
+            p += sprintf(p, " t%d", it->exptime == 0 ? -1 :
+                    (int)(it->exptime - current_time));
+        }
+        p = _meta_echo_flags(p, of.opaque, of.nopaque,
+                of.key ? ITEM_key(it) : NULL, it->nkey);
+        if (won) {
+            it->it_flags |= ITEM_TOKEN_SENT;
+            memcpy(p, " W", 2);
+            p += 2;
+        } else if (it->it_flags & ITEM_TOKEN_SENT) {
+            memcpy(p, " Z", 2);
+            p += 2;
+        }
+        if (it->it_flags & ITEM_STALE) {
+            memcpy(p, " X", 2);
+            p += 2;
+        }
+        if ((it->it_flags & ITEM_COMPRESSED) && of.compressed) {
+            memcpy(p, " z", 2);
+            p += 2;
+        }
+        memcpy(p, "\r\n", 2);
+        p += 2;
+
+        if (!of.no_update)
+            do_item_bump(c, it, hv);
+    }
+    item_unlock(hv);
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(key, nkey, NULL != it);
+    }
+
+    if (it) {
+        MEMCACHED_COMMAND_GET(c->sfd, ITEM_key(it), it->nkey,
+                              it->nbytes, ITEM_get_cas(it));
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        if (of.new_ttl) {
+            c->thread->stats.touch_cmds++;
+            c->thread->stats.slab_stats[ITEM_clsid(it)].touch_hits++;
+        }
+        c->thread->stats.lru_hits[it->slabs_clsid]++;
+        c->thread->stats.get_cmds++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+
+#ifdef COMPRESSION
+        if (of.value && (it->it_flags & ITEM_COMPRESSED) && !of.compressed) {
+            it = item_decompress(c, it);
+            if (it == NULL) {
+                out_string(c, "SERVER_ERROR failed to decompress value");
+                return;
+            }
+        }
+#endif
+        /* item_get() has incremented it->refcount for us */
+        *(c->ilist) = it;
+        c->icurr = c->ilist;
+        c->ileft = 1;
+
+        if (add_iov(c, c->wbuf, p - c->wbuf) != 0)
+            goto oom;
+        if (of.value) {
+#ifdef EXTSTORE
+            if (it->it_flags & ITEM_HDR) {
+                if (_get_extstore(c, it, iovst, false) != 0)
+                    goto oom;
+                c->io_wraplist->miss_res = NULL;
+                if (!of.quiet) {
+                    /* Goes in wbuf after the header, which stays in use. */
+                    char *miss = p;
+                    memcpy(miss, "EN", 2);
+                    p = _meta_echo_flags(miss + 2, of.opaque, of.nopaque,
+                            of.key ? key : NULL, nkey);
+                    memcpy(p, "\r\n", 3);
+                    c->io_wraplist->miss_res = miss;
+                }
+            } else
+#endif
+            if ((it->it_flags & ITEM_CHUNKED) == 0) {
+                if (add_iov(c, ITEM_data(it), it->nbytes) != 0)
+                    goto oom;
+            } else if (add_chunked_item_iovs(c, it, it->nbytes) != 0) {
+                goto oom;
+            }
+        }
+
+        if (IS_UDP(c->transport) && build_udp_headers(c) != 0)
+            goto oom;
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+    } else {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        if (of.new_ttl) {
+            c->thread->stats.touch_cmds++;
+            c->thread->stats.touch_misses++;
+        }
+        c->thread->stats.get_misses++;
+        c->thread->stats.get_cmds++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+        MEMCACHED_COMMAND_GET(c->sfd, key, nkey, -1, 0);
+
+        if (of.quiet)
+            c->noreply = true;
+        memcpy(resp, "EN", 2);
+        p = _meta_echo_flags(resp + 2, of.opaque, of.nopaque,
+                of.key ? key : NULL, nkey);
+        *p = '\0';
+        out_string(c, resp);
+    }
+    return;
+oom:
+    conn_release_items(c);
+    out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+}
+
+/* ms <key> <datalen> <flags>*: stores like set, or per the M(ode) flag as
+ * add, append, prepend or replace, and compares the CAS if given one.
+ * Responds HD if stored, NS if not stored, EX if the CAS didn't match or NF
+ * if there was nothing to compare it with.
+ */
+static void process_mset_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key;
+    size_t nkey;
+    struct _meta_flags of;
+    int32_t vlen;
+    int comm = NREAD_SET;
+    item *it;
+
+    assert(c != NULL);
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+
+    if (nkey > KEY_MAX_LENGTH || !safe_strtol(tokens[2].value, &vlen)
+            || vlen < 0 || vlen > (INT_MAX - 2)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    vlen += 2;
+
+    if (tokens[ntokens - 1].value != NULL ||
+            _meta_flag_preparse(tokens, 3, "CFkMOqT", &of) != 0) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        /* swallow the data line */
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+        return;
+    }
+
+    switch (of.mode) {
+        case 'E': comm = NREAD_ADD; break;
+        case 'A': comm = NREAD_APPEND; break;
+        case 'P': comm = NREAD_PREPEND; break;
+        case 'R': comm = NREAD_REPLACE; break;
+    }
+    if (of.has_cas) {
+        if (comm != NREAD_SET) {
+            out_string(c, "CLIENT_ERROR CAS is only valid in set mode");
+            c->write_and_go = conn_swallow;
+            c->sbytes = vlen;
+            return;
+        }
+        comm = NREAD_CAS;
+    }
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_set(key, nkey);
+    }
+
+    it = item_alloc(key, nkey, of.client_flags, realtime(of.exptime), vlen);
+
+    if (it == 0) {
+        enum store_item_type status;
+        if (! item_size_ok(nkey, of.client_flags, vlen)) {
+            out_string(c, "SERVER_ERROR object too large for cache");
+            status = TOO_LARGE;
+        } else {
+            out_of_memory(c, "SERVER_ERROR out of memory storing object");
+            status = NO_MEMORY;
+        }
+        LOGGER_LOG(c->thread->l, LOG_MUTATIONS, LOGGER_ITEM_STORE,
+                NULL, status, comm, key, nkey, 0, 0);
+        /* swallow the data line */
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+
+        /* Avoid stale data persisting in cache because we failed alloc. */
+        if (comm == NREAD_SET) {
+            it = item_get(key, nkey, c, DONT_UPDATE);
+            if (it) {
+                item_unlink(it);
+                item_remove(it);
+            }
+        }
+
+        return;
+    }
+    ITEM_set_cas(it, of.req_cas_id);
+
+    c->mset_res = true;
+    c->mset_quiet = of.quiet;
+    c->mset_key = of.key;
+    if (of.nopaque)
+        memcpy(c->mset_opaque, of.opaque, of.nopaque);
+    c->mset_opaque[of.nopaque] = '\0';
+
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = it->nbytes;
+    c->cmd = comm;
+    conn_set_state(c, conn_nread);
+}
+
+/* md <key> <flags>*: removes an item, or with I marks it stale so the next
+ * mg wins the right to recache it while others are still served the old
+ * value. Responds HD, NF if missing or EX if the CAS didn't match.
+ */
+static void process_mdelete_command(conn *c, token_t *tokens, const size_t ntokens) {
+    char *key;
+    size_t nkey;
+    struct _meta_flags of;
+    uint32_t hv;
+    item *it;
+    const char *code;
+    char resp[KEY_MAX_LENGTH + META_OPAQUE_MAX + 16];
+    char *p;
+
+    assert(c != NULL);
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+
+    if (nkey > KEY_MAX_LENGTH || tokens[ntokens - 1].value != NULL ||
+            _meta_flag_preparse(tokens, KEY_TOKEN + 1, "CIkOqT", &of) != 0) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_delete(key, nkey);
+    }
+
+    hv = hash(key, nkey);
+    item_lock(hv);
+    it = do_item_get(key, nkey, hv, c, DONT_UPDATE);
+    if (it) {
+        MEMCACHED_COMMAND_DELETE(c->sfd, ITEM_key(it), it->nkey);
+
+        if (of.has_cas && ITEM_get_cas(it) != of.req_cas_id) {
+            code = "EX";
+        } else {
+            pthread_mutex_lock(&c->thread->stats.mutex);
+            c->thread->stats.slab_stats[ITEM_clsid(it)].delete_hits++;
+            pthread_mutex_unlock(&c->thread->stats.mutex);
+
+            if (of.set_stale) {
+                it->it_flags |= ITEM_STALE;
+                it->it_flags &= ~ITEM_TOKEN_SENT;
+                ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
+                if (of.new_ttl)
+                    it->exptime = realtime(of.exptime);
+            } else {
+                do_item_unlink(it, hv);
+            }
+            code = "HD";
+        }
+        do_item_remove(it);      /* release our reference */
+    } else {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.delete_misses++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+
+        code = "NF";
+    }
+    item_unlock(hv);
+
+    memcpy(resp, code, 2);
+    p = _meta_echo_flags(resp + 2, of.opaque, of.nopaque,
+            of.key ? key : NULL, nkey);
+    *p = '\0';
+    if (of.quiet && code[0] == 'H')
+        c->noreply = true;
+    out_string(c, resp);
+}
+
+static void process_arithmetic_command(conn *c, token_t *tokens, const size_t ntokens, const bool incr) {
+    char temp[INCR_MAX_STORAGE_LEN];
+    uint64_t delta;
+    char *key;
+    size_t nkey;
+
+    assert(c != NULL);
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+
+    key = tokens[KEY_TOKEN].value;
+    nkey = tokens[KEY_TOKEN].length;
+
+    if (!safe_strtoull(tokens[2].value, &delta)) {
+        out_string(c, "CLIENT_ERROR invalid numeric delta argument");
+        return;
+    }
+
+    switch(add_delta(c, key, nkey, incr, delta, temp, NULL)) {
+    case OK:
+        out_string(c, temp);
+        break;
+    case NON_NUMERIC:
+        out_string(c, "CLIENT_ERROR cannot increment or decrement non-numeric value");
+        break;
+    case EOM:
         out_of_memory(c, "SERVER_ERROR out of memory");
         break;
     case DELTA_ITEM_NOT_FOUND:
@@ -3706,7 +4814,13 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
 
     /* Can't delta zero byte values. 2-byte are the "\r\n" */
     /* Also can't delta for chunked items. Too large to be a number */
+#ifdef EXTSTORE
+    /* Nor for values which live in external storage */
+    if (it->nbytes <= 2 || (it->it_flags & (ITEM_CHUNKED|ITEM_HDR)) != 0) {
+#else
     if (it->nbytes <= 2 || (it->it_flags & ITEM_CHUNKED) != 0) {
+#endif
+        do_item_remove(it);
         return NON_NUMERIC;
     }
 
@@ -3763,7 +4877,7 @@ enum delta_result_type do_add_delta(conn *c, const char *key, const size_t nkey,
         item *new_it;
         uint32_t flags;
         if (settings.inline_ascii_response) {
-            flags = (uint32_t) strtoul(ITEM_suffix(it)+1, (char **) NULL, 10);
+            flags = (uint32_t) strtoul(ITEM_suffix(it), (char **) NULL, 10);
         } else if (it->nsuffix > 0) {
             flags = *((uint32_t *)ITEM_suffix(it));
         } else {
@@ -3919,6 +5033,14 @@ static void process_slabs_automove_command(conn *c, token_t *tokens, const size_
 }
 
 /* TODO: decide on syntax for sampling? */
+#ifdef TLS
+/* Watchers and crawler dumps are written by side threads straight to the
+ * socket, which would bypass the TLS layer and break the session. */
+#define CONN_IS_TLS(c) ((c)->ssl != NULL)
+#else
+#define CONN_IS_TLS(c) false
+#endif
+
 static void process_watch_command(conn *c, token_t *tokens, const size_t ntokens) {
     uint16_t f = 0;
     int x;
@@ -3946,6 +5068,11 @@ static void process_watch_command(conn *c, token_t *tokens, const size_t ntokens
         f |= LOG_FETCHERS;
     }
 
+    if (CONN_IS_TLS(c)) {
+        out_string(c, "ERROR watch not allowed over TLS");
+        return;
+    }
+
     switch(logger_add_watcher(c, c->sfd, f)) {
         case LOGGER_ADD_WATCHER_TOO_MANY:
             out_string(c, "WATCHER_TOO_MANY log watcher limit reached");
@@ -3987,6 +5114,27 @@ static void process_memlimit_command(conn *c, token_t *tokens, const size_t ntok
     }
 }
 
+/* "load" takes the rest of the input as a stream from "lru_crawler dump",
+ * read straight into items by try_read_load() until the end record. */
+static void process_load_command(conn *c, token_t *tokens, const size_t ntokens) {
+    if (IS_UDP(c->transport)) {
+        out_string(c, "CLIENT_ERROR load needs a stream connection");
+        return;
+    }
+    c->load_add = false;
+    if (ntokens == 3) {
+        if (strcmp(tokens[1].value, "add") != 0) {
+            out_string(c, "CLIENT_ERROR bad command line format");
+            return;
+        }
+        c->load_add = true;
+    }
+    c->loading = true;
+    c->load_stored = 0;
+    c->load_skipped = 0;
+    conn_set_state(c, conn_new_cmd);
+}
+
 static void process_lru_command(conn *c, token_t *tokens, const size_t ntokens) {
     uint32_t pct_hot;
     uint32_t pct_warm;
@@ -4040,8 +5188,328 @@ static void process_lru_command(conn *c, token_t *tokens, const size_t ntokens)
             out_string(c, "OK");
         }
     } else {
-        out_string(c, "ERROR");
+        out_string(c, "ERROR");
+    }
+}
+
+/*
+ * Proxy mode (-x). Commands on keys are forwarded to the backend the key
+ * hashes to; the connection is parked until the answers are in, see
+ * proxy.c. Everything else (stats, version, ...) is answered locally.
+ */
+enum proxy_cmds {
+    PROXY_CMD_GET,      /* VALUEs from every backend asked, then END */
+    PROXY_CMD_LINE,     /* the backend's one line answer */
+    PROXY_CMD_FLUSH     /* OK if every backend said OK */
+};
+
+static proxy_conn *proxy_conn_get(conn *c) {
+    if (c->proxy == NULL) {
+        c->proxy = proxy_conn_new();
+        if (c->proxy == NULL)
+            return NULL;
+    }
+    proxy_conn_reset(c->proxy);
+    return c->proxy;
+}
+
+/* Rebuilds a request line from its tokens, leaving out "noreply": the
+ * proxy always reads the answer to keep the connection in step. */
+static int proxy_add_line(proxy_buf *b, token_t *tokens, size_t ntokens,
+        bool noreply) {
+    size_t i, n = ntokens - 1;
+
+    if (noreply)
+        n--;
+    for (i = 0; i < n; i++) {
+        if ((i > 0 && proxy_buf_add(b, " ", 1) != 0)
+                || proxy_buf_add(b, tokens[i].value, tokens[i].length) != 0)
+            return -1;
+    }
+    return proxy_buf_add(b, "\r\n", 2);
+}
+
+static void proxy_respond(conn *c) {
+    proxy_conn *pc = c->proxy;
+    char *line, *end;
+
+    switch (pc->cmd) {
+    case PROXY_CMD_GET:
+        /* Keys on a backend that failed are misses. */
+        if (proxy_buf_add(&pc->resp, "END\r\n", 5) != 0
+                || add_iov(c, pc->resp.buf, pc->resp.len) != 0) {
+            out_of_memory(c, "SERVER_ERROR out of memory writing get response");
+            return;
+        }
+        conn_set_state(c, conn_mwrite);
+        c->msgcurr = 0;
+        break;
+    case PROXY_CMD_LINE:
+        if (pc->errors || pc->resp.len < 2) {
+            out_string(c, "SERVER_ERROR backend unavailable");
+            return;
+        }
+        pc->resp.buf[pc->resp.len - 2] = '\0';
+        out_string(c, pc->resp.buf);
+        break;
+    case PROXY_CMD_FLUSH:
+        if (pc->errors) {
+            out_string(c, "SERVER_ERROR backend unavailable");
+            return;
+        }
+        /* Pass on the first answer that wasn't OK. */
+        line = pc->resp.buf;
+        end = line + pc->resp.len;
+        while (line < end) {
+            char *el = memchr(line, '\n', end - line);
+            if (el - line != 3 || strncmp(line, "OK\r", 3) != 0) {
+                el[-1] = '\0';
+                out_string(c, line);
+                return;
+            }
+            line = el + 1;
+        }
+        out_string(c, "OK");
+        break;
+    }
+}
+
+/* Parks the connection until the backends answer, or answers right away
+ * if nothing could be sent. */
+static void proxy_wait(conn *c) {
+    if (c->proxy->pending == 0) {
+        proxy_respond(c);
+        return;
+    }
+    conn_set_state(c, conn_proxy);
+    event_del(&c->event);
+    c->ev_flags = 0;
+}
+
+/* Called by proxy.c once the last backend has answered for c. */
+void conn_proxy_done(conn *c) {
+    assert(c->state == conn_proxy);
+    if (!update_event(c, EV_READ | EV_PERSIST)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't update event\n");
+        conn_set_state(c, conn_closing);
+    } else {
+        proxy_respond(c);
+    }
+    drive_machine(c);
+}
+
+static void process_proxy_get(conn *c, token_t *tokens, size_t ntokens) {
+    proxy_conn *pc = c->proxy;
+    token_t *key_token = &tokens[KEY_TOKEN];
+    token_t cmd = tokens[COMMAND_TOKEN];
+    int b, nb = proxy_backend_count();
+
+    do {
+        while (key_token->length != 0) {
+            proxy_buf *req;
+
+            if (key_token->length > KEY_MAX_LENGTH) {
+                out_string(c, "CLIENT_ERROR bad command line format");
+                return;
+            }
+            b = proxy_route(key_token->value, key_token->length);
+            if (b >= 0) {
+                req = &pc->reqs[b];
+                if ((req->len == 0 && proxy_buf_add(req, cmd.value, cmd.length) != 0)
+                        || proxy_buf_add(req, " ", 1) != 0
+                        || proxy_buf_add(req, key_token->value, key_token->length) != 0) {
+                    out_of_memory(c, "SERVER_ERROR out of memory preparing request");
+                    return;
+                }
+            }
+            key_token++;
+        }
+
+        /*
+         * If the command string hasn't been fully processed, get the next set
+         * of tokens.
+         */
+        if (key_token->value != NULL) {
+            ntokens = tokenize_command(key_token->value, tokens, MAX_TOKENS);
+            key_token = tokens;
+        }
+    } while (key_token->value != NULL);
+
+    pc->cmd = PROXY_CMD_GET;
+    for (b = 0; b < nb; b++) {
+        proxy_buf *req = &pc->reqs[b];
+        if (req->len == 0)
+            continue;
+        if (proxy_buf_add(req, "\r\n", 2) != 0
+                || proxy_send(c, b, req->buf, req->len, PROXY_RESP_VALUES) != 0) {
+            pc->errors++;
+        }
+    }
+    proxy_wait(c);
+}
+
+/* incr, decr, delete and touch: one key, one line back. */
+static void process_proxy_key_command(conn *c, token_t *tokens, size_t ntokens) {
+    proxy_conn *pc = c->proxy;
+    int b;
+
+    set_noreply_maybe(c, tokens, ntokens);
+    if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    b = proxy_route(tokens[KEY_TOKEN].value, tokens[KEY_TOKEN].length);
+    if (b < 0) {
+        out_string(c, "SERVER_ERROR backend unavailable");
+        return;
+    }
+    if (proxy_add_line(&pc->val, tokens, ntokens, c->noreply) != 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory preparing request");
+        return;
+    }
+    pc->cmd = PROXY_CMD_LINE;
+    if (proxy_send(c, b, pc->val.buf, pc->val.len, PROXY_RESP_LINE) != 0)
+        pc->errors++;
+    proxy_wait(c);
+}
+
+/* Storage commands: the value is read in after the line, then both are
+ * sent on in complete_nread_proxy(). */
+static void process_proxy_update(conn *c, token_t *tokens, size_t ntokens,
+        bool handle_cas) {
+    proxy_conn *pc = c->proxy;
+    uint32_t flags;
+    int32_t exptime;
+    int vlen;
+    uint64_t req_cas_id;
+
+    set_noreply_maybe(c, tokens, ntokens);
+    if (tokens[KEY_TOKEN].length > KEY_MAX_LENGTH
+            || !safe_strtoul(tokens[2].value, &flags)
+            || !safe_strtol(tokens[3].value, &exptime)
+            || !safe_strtol(tokens[4].value, (int32_t *)&vlen)
+            || (handle_cas && !safe_strtoull(tokens[5].value, &req_cas_id))
+            || vlen < 0 || vlen > (INT_MAX - 2)) {
+        out_string(c, "CLIENT_ERROR bad command line format");
+        return;
+    }
+    vlen += 2;
+
+    if (vlen > settings.item_size_max) {
+        out_string(c, "SERVER_ERROR object too large for cache");
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+        return;
+    }
+    if (proxy_add_line(&pc->val, tokens, ntokens, c->noreply) != 0
+            || proxy_buf_grow(&pc->val, vlen) != 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory storing object");
+        c->write_and_go = conn_swallow;
+        c->sbytes = vlen;
+        return;
+    }
+
+    c->ritem = pc->val.buf + pc->val.len;
+    c->rlbytes = vlen;
+    pc->val.len += vlen;
+    conn_set_state(c, conn_nread);
+}
+
+static void complete_nread_proxy(conn *c) {
+    proxy_conn *pc = c->proxy;
+    char *key, *end;
+    int b;
+
+    if (strncmp(pc->val.buf + pc->val.len - 2, "\r\n", 2) != 0) {
+        out_string(c, "CLIENT_ERROR bad data chunk");
+        return;
+    }
+    key = (char *)memchr(pc->val.buf, ' ', pc->val.len) + 1;
+    end = memchr(key, ' ', pc->val.len - (key - pc->val.buf));
+    b = proxy_route(key, end - key);
+    if (b < 0) {
+        out_string(c, "SERVER_ERROR backend unavailable");
+        return;
+    }
+    pc->cmd = PROXY_CMD_LINE;
+    if (proxy_send(c, b, pc->val.buf, pc->val.len, PROXY_RESP_LINE) != 0)
+        pc->errors++;
+    proxy_wait(c);
+}
+
+static void process_proxy_flush(conn *c, token_t *tokens, size_t ntokens) {
+    proxy_conn *pc = c->proxy;
+    int b, nb = proxy_backend_count();
+
+    set_noreply_maybe(c, tokens, ntokens);
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.flush_cmds++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+
+    if (!settings.flush_enabled) {
+        out_string(c, "CLIENT_ERROR flush_all not allowed");
+        return;
+    }
+    if (proxy_add_line(&pc->val, tokens, ntokens, c->noreply) != 0) {
+        out_of_memory(c, "SERVER_ERROR out of memory preparing request");
+        return;
+    }
+    pc->cmd = PROXY_CMD_FLUSH;
+    for (b = 0; b < nb; b++) {
+        if (!proxy_backend_alive(b)
+                || proxy_send(c, b, pc->val.buf, pc->val.len, PROXY_RESP_LINE) != 0)
+            pc->errors++;
+    }
+    proxy_wait(c);
+}
+
+/* Returns false for commands that are handled locally. */
+static bool process_proxy_command(conn *c, token_t *tokens, size_t ntokens) {
+    const char *cmd = tokens[COMMAND_TOKEN].value;
+
+    if (!((ntokens >= 3 && (strcmp(cmd, "get") == 0 || strcmp(cmd, "bget") == 0
+                        || strcmp(cmd, "gets") == 0))
+            || ((ntokens == 6 || ntokens == 7) && (strcmp(cmd, "set") == 0
+                    || strcmp(cmd, "add") == 0 || strcmp(cmd, "replace") == 0
+                    || strcmp(cmd, "append") == 0 || strcmp(cmd, "prepend") == 0))
+            || ((ntokens == 7 || ntokens == 8) && strcmp(cmd, "cas") == 0)
+            || ((ntokens == 4 || ntokens == 5) && (strcmp(cmd, "incr") == 0
+                    || strcmp(cmd, "decr") == 0 || strcmp(cmd, "touch") == 0))
+            || (ntokens >= 3 && ntokens <= 5 && strcmp(cmd, "delete") == 0)
+            || (ntokens >= 2 && ntokens <= 4 && strcmp(cmd, "flush_all") == 0)
+            || (ntokens >= 2 && (strcmp(cmd, "mg") == 0
+                    || strcmp(cmd, "ms") == 0 || strcmp(cmd, "md") == 0)))) {
+        return false;
+    }
+
+    if (proxy_conn_get(c) == NULL) {
+        out_of_memory(c, "SERVER_ERROR out of memory preparing request");
+        return true;
+    }
+
+    if (cmd[0] == 'm') {
+        /* Quiet mode leaves no answer to match up, so meta commands
+         * aren't forwarded. */
+        int32_t vlen;
+        out_string(c, "CLIENT_ERROR meta commands not supported by proxy");
+        if (strcmp(cmd, "ms") == 0 && ntokens >= 4
+                && safe_strtol(tokens[2].value, &vlen) && vlen >= 0) {
+            c->write_and_go = conn_swallow;
+            c->sbytes = vlen + 2;
+        }
+    } else if (strcmp(cmd, "get") == 0 || strcmp(cmd, "bget") == 0
+            || strcmp(cmd, "gets") == 0) {
+        process_proxy_get(c, tokens, ntokens);
+    } else if (strcmp(cmd, "flush_all") == 0) {
+        process_proxy_flush(c, tokens, ntokens);
+    } else if (ntokens >= 6 && strcmp(cmd, "delete") != 0) {
+        process_proxy_update(c, tokens, ntokens, strcmp(cmd, "cas") == 0);
+    } else {
+        process_proxy_key_command(c, tokens, ntokens);
     }
+    return true;
 }
 
 static void process_command(conn *c, char *command) {
@@ -4071,6 +5539,9 @@ static void process_command(conn *c, char *command) {
     }
 
     ntokens = tokenize_command(command, tokens, MAX_TOKENS);
+    if (settings.proxy_backends && process_proxy_command(c, tokens, ntokens)) {
+        return;
+    }
     if (ntokens >= 3 &&
         ((strcmp(tokens[COMMAND_TOKEN].value, "get") == 0) ||
          (strcmp(tokens[COMMAND_TOKEN].value, "bget") == 0))) {
@@ -4098,6 +5569,22 @@ static void process_command(conn *c, char *command) {
 
         process_get_command(c, tokens, ntokens, true);
 
+    } else if (ntokens >= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "mg") == 0)) {
+
+        process_mget_command(c, tokens, ntokens);
+
+    } else if (ntokens >= 4 && (strcmp(tokens[COMMAND_TOKEN].value, "ms") == 0)) {
+
+        process_mset_command(c, tokens, ntokens);
+
+    } else if (ntokens >= 3 && (strcmp(tokens[COMMAND_TOKEN].value, "md") == 0)) {
+
+        process_mdelete_command(c, tokens, ntokens);
+
+    } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "mn") == 0)) {
+
+        out_string(c, "MN");
+
     } else if ((ntokens == 4 || ntokens == 5) && (strcmp(tokens[COMMAND_TOKEN].value, "decr") == 0)) {
 
         process_arithmetic_command(c, tokens, ntokens, 0);
@@ -4255,6 +5742,10 @@ static void process_command(conn *c, char *command) {
                 out_string(c, "ERROR metadump not allowed");
                 return;
             }
+            if (CONN_IS_TLS(c)) {
+                out_string(c, "ERROR metadump not allowed over TLS");
+                return;
+            }
 
             int rv = lru_crawler_crawl(tokens[2].value, CRAWLER_METADUMP,
                     c, c->sfd);
@@ -4279,6 +5770,42 @@ static void process_command(conn *c, char *command) {
                     break;
             }
             return;
+        } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "dump") == 0) {
+            if (settings.lru_crawler == false) {
+                out_string(c, "CLIENT_ERROR lru crawler disabled");
+                return;
+            }
+            if (!settings.dump_enabled) {
+                out_string(c, "ERROR dump not allowed");
+                return;
+            }
+            if (CONN_IS_TLS(c)) {
+                out_string(c, "ERROR dump not allowed over TLS");
+                return;
+            }
+
+            int rv = lru_crawler_crawl(tokens[2].value, CRAWLER_DUMP,
+                    c, c->sfd);
+            switch(rv) {
+                case CRAWLER_OK:
+                    /* The crawler sends the "OK" ahead of the stream */
+                    conn_set_state(c, conn_watch);
+                    event_del(&c->event);
+                    break;
+                case CRAWLER_RUNNING:
+                    out_string(c, "BUSY currently processing crawler request");
+                    break;
+                case CRAWLER_BADCLASS:
+                    out_string(c, "BADCLASS invalid class id");
+                    break;
+                case CRAWLER_NOTSTARTED:
+                    out_string(c, "NOTSTARTED no items to crawl");
+                    break;
+                case CRAWLER_ERROR:
+                    out_string(c, "ERROR an unknown error happened");
+                    break;
+            }
+            return;
         } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "tocrawl") == 0) {
             uint32_t tocrawl;
              if (!safe_strtoul(tokens[2].value, &tocrawl)) {
@@ -4329,6 +5856,8 @@ static void process_command(conn *c, char *command) {
         process_verbosity_command(c, tokens, ntokens);
     } else if (ntokens >= 3 && strcmp(tokens[COMMAND_TOKEN].value, "lru") == 0) {
         process_lru_command(c, tokens, ntokens);
+    } else if ((ntokens == 2 || ntokens == 3) && strcmp(tokens[COMMAND_TOKEN].value, "load") == 0) {
+        process_load_command(c, tokens, ntokens);
 #ifdef MEMCACHED_DEBUG
     // commands which exist only for testing the memcached's security protection
     } else if (ntokens == 2 && (strcmp(tokens[COMMAND_TOKEN].value, "misbehave") == 0)) {
@@ -4347,6 +5876,78 @@ static void process_command(conn *c, char *command) {
 /*
  * if we have a complete line in the buffer, process it.
  */
+/*
+ * Starts reading the next record of a "load" stream. Like the binary
+ * protocol, the header and key are taken from the read buffer and the value
+ * is read straight into the new item by conn_nread. Returns 0 if the whole
+ * header isn't in yet.
+ */
+static int try_read_load(conn *c) {
+    unsigned char *p = (unsigned char *)c->rcurr;
+    uint32_t flags, exptime, nbytes;
+    int nkey, dflags;
+    bool keep;
+    item *it = NULL;
+
+    if (c->rbytes < DUMP_HDR_LEN || c->rbytes < DUMP_HDR_LEN + p[0])
+        return 0;
+
+    nkey = p[0];
+    dflags = p[1];
+    memcpy(&flags, p + 2, 4);
+    memcpy(&exptime, p + 6, 4);
+    memcpy(&nbytes, p + 10, 4);
+    flags = ntohl(flags);
+    exptime = ntohl(exptime);
+    nbytes = ntohl(nbytes);
+    c->rcurr += DUMP_HDR_LEN + nkey;
+    c->rbytes -= DUMP_HDR_LEN + nkey;
+
+    if (nkey == 0) {
+        char buf[64];
+        c->loading = false;
+        snprintf(buf, sizeof(buf), "LOADED %llu %llu",
+                (unsigned long long)c->load_stored,
+                (unsigned long long)c->load_skipped);
+        out_string(c, buf);
+        return 1;
+    }
+    if (nkey > KEY_MAX_LENGTH || nbytes < 2 || nbytes > INT_MAX
+            || (dflags & ~DUMP_COMPRESSED) != 0) {
+        c->loading = false;
+        out_string(c, "CLIENT_ERROR bad load record");
+        c->write_and_go = conn_closing;
+        return 1;
+    }
+
+    keep = exptime == 0 || exptime > process_started + current_time;
+#ifndef COMPRESSION
+    /* Compressed by a server built with it; no way to read it back out */
+    if (dflags & DUMP_COMPRESSED)
+        keep = false;
+#endif
+    if (keep) {
+        it = item_alloc((char *)p + DUMP_HDR_LEN, nkey, flags,
+                realtime(exptime), nbytes);
+    }
+    if (it == NULL) {
+        c->load_skipped++;
+        c->sbytes = nbytes;
+        conn_set_state(c, conn_swallow);
+        return 1;
+    }
+#ifdef COMPRESSION
+    if (dflags & DUMP_COMPRESSED)
+        it->it_flags |= ITEM_COMPRESSED;
+#endif
+
+    c->item = it;
+    c->ritem = ITEM_data(it);
+    c->rlbytes = it->nbytes;
+    conn_set_state(c, conn_nread);
+    return 1;
+}
+
 static int try_read_command(conn *c) {
     assert(c != NULL);
     assert(c->rcurr <= (c->rbuf + c->rsize));
@@ -4365,7 +5966,9 @@ static int try_read_command(conn *c) {
         }
     }
 
-    if (c->protocol == binary_prot) {
+    if (c->loading) {
+        return try_read_load(c);
+    } else if (c->protocol == binary_prot) {
         /* Do we have the complete packet header? */
         if (c->rbytes < sizeof(c->binary_header)) {
             /* need more data! */
@@ -4459,6 +6062,11 @@ static int try_read_command(conn *c) {
 
             return 0;
         }
+        /* Send the batch the usual way; the line is read again after. */
+        if (c->bbytes > 0 && batch_blocks_command(c->rcurr, el)
+                && batch_flush(c, conn_new_cmd)) {
+            return 1;
+        }
         cont = el + 1;
         if ((el - c->rcurr) > 1 && *(el - 1) == '\r') {
             el--;
@@ -4479,6 +6087,52 @@ static int try_read_command(conn *c) {
     return 1;
 }
 
+#ifdef HAVE_RECVMMSG
+#define UDP_BATCH_PENDING(c) ((c)->udp_batch != NULL && \
+        (c)->udp_batch->next < (c)->udp_batch->count)
+
+/*
+ * Hands out the next datagram read ahead by recvmmsg(), refilling the batch
+ * with a single call once it runs dry. The datagram's buffer is swapped in
+ * as c->rbuf; UDP read buffers are never resized, so they're interchangeable.
+ * Returns the datagram length, or -1 if nothing could be read.
+ */
+static int udp_batch_read(conn *c) {
+    udp_batch *b = c->udp_batch;
+    char *buf;
+    int i;
+
+    if (b->next == b->count) {
+        for (i = 0; i < UDP_BATCH_SIZE; i++) {
+            struct msghdr *m = &b->msgs[i].msg_hdr;
+            b->iovs[i].iov_base = b->bufs[i];
+            b->iovs[i].iov_len = c->rsize;
+            memset(m, 0, sizeof(*m));
+            m->msg_name = &b->addrs[i];
+            m->msg_namelen = sizeof(b->addrs[i]);
+            m->msg_iov = &b->iovs[i];
+            m->msg_iovlen = 1;
+        }
+        b->next = 0;
+        b->count = recvmmsg(c->sfd, b->msgs, UDP_BATCH_SIZE, 0, NULL);
+        if (b->count <= 0) {
+            b->count = 0;
+            return -1;
+        }
+    }
+
+    i = b->next++;
+    buf = c->rbuf;
+    c->rbuf = b->bufs[i];
+    b->bufs[i] = buf;
+    c->request_addr_size = b->msgs[i].msg_hdr.msg_namelen;
+    memcpy(&c->request_addr, &b->addrs[i], c->request_addr_size);
+    return b->msgs[i].msg_len;
+}
+#else
+#define UDP_BATCH_PENDING(c) false
+#endif
+
 /*
  * read a UDP request.
  */
@@ -4488,6 +6142,11 @@ static enum try_read_result try_read_udp(conn *c) {
     assert(c != NULL);
 
     c->request_addr_size = sizeof(c->request_addr);
+#ifdef HAVE_RECVMMSG
+    if (c->udp_batch != NULL)
+        res = udp_batch_read(c);
+    else
+#endif
     res = recvfrom(c->sfd, c->rbuf, c->rsize,
                    0, (struct sockaddr *)&c->request_addr,
                    &c->request_addr_size);
@@ -4517,6 +6176,24 @@ static enum try_read_result try_read_udp(conn *c) {
     return READ_NO_DATA_RECEIVED;
 }
 
+/* Plain socket IO for connections that aren't encrypted. */
+ssize_t tcp_read(conn *c, void *buf, size_t count) {
+    assert(c != NULL);
+    return read(c->sfd, buf, count);
+}
+
+ssize_t tcp_sendmsg(conn *c, struct msghdr *msg, int flags) {
+    assert(c != NULL);
+    return sendmsg(c->sfd, msg, flags);
+}
+
+#ifdef TLS
+/* Decrypted bytes OpenSSL holds that the socket won't signal for. */
+#define SSL_DATA_PENDING(c) ((c)->ssl != NULL && SSL_pending((c)->ssl) > 0)
+#else
+#define SSL_DATA_PENDING(c) false
+#endif
+
 /*
  * read from network as much as we can, handle buffer overflow and connection
  * close.
@@ -4565,7 +6242,7 @@ static enum try_read_result try_read_network(conn *c) {
         }
 
         int avail = c->rsize - c->rbytes;
-        res = read(c->sfd, c->rbuf + c->rbytes, avail);
+        res = c->read(c, c->rbuf + c->rbytes, avail);
         if (res > 0) {
             pthread_mutex_lock(&c->thread->stats.mutex);
             c->thread->stats.bytes_read += res;
@@ -4591,10 +6268,15 @@ static enum try_read_result try_read_network(conn *c) {
     return gotdata;
 }
 
-static bool update_event(conn *c, const int new_flags) {
+static bool update_event(conn *c, int new_flags) {
     assert(c != NULL);
 
     struct event_base *base = c->event.ev_base;
+#ifdef TLS
+    /* Wait for whatever the blocked SSL call needs instead. */
+    if (c->ssl != NULL && c->ssl_wait && (new_flags & (EV_READ | EV_WRITE)))
+        new_flags = c->ssl_wait | (new_flags & EV_PERSIST);
+#endif
     if (c->ev_flags == new_flags)
         return true;
     if (event_del(&c->event) == -1) return false;
@@ -4648,6 +6330,94 @@ void do_accept_new_conns(const bool do_accept) {
     }
 }
 
+static void listener_resume(const int fd, const short which, void *arg);
+
+static void listener_retry(conn *c) {
+    struct timeval t = {.tv_sec = 0, .tv_usec = 10000};
+
+    if (event_base_once(c->thread->base, -1, EV_TIMEOUT, listener_resume,
+                        c, &t) != 0) {
+        fprintf(stderr, "Couldn't schedule listener %d\n", c->sfd);
+    }
+}
+
+static void listener_resume(const int fd, const short which, void *arg) {
+    conn *c = arg;
+
+    if (allow_new_conns == false) {
+        listener_retry(c);
+        return;
+    }
+    if (!update_event(c, EV_READ | EV_PERSIST)) {
+        fprintf(stderr, "Couldn't resume listener %d\n", c->sfd);
+        return;
+    }
+
+    /* As do_accept_new_conns(); other listeners may have paused too, and
+     * only the first to resume ends the time spent disabled. */
+    STATS_LOCK();
+    if (!stats_state.accepting_conns) {
+        struct timeval maxconns_exited;
+        gettimeofday(&maxconns_exited,NULL);
+        stats.time_in_listen_disabled_us +=
+            (maxconns_exited.tv_sec - stats.maxconns_entered.tv_sec) * 1000000
+            + (maxconns_exited.tv_usec - stats.maxconns_entered.tv_usec);
+        stats_state.accepting_conns = true;
+    }
+    STATS_UNLOCK();
+}
+
+/*
+ * Out of fds on a worker's reuseport listener. Only that listener stops, as
+ * the others belong to other threads; like maxconns_handler it polls every
+ * 10ms until a connection has been closed.
+ */
+static void listener_pause(conn *c) {
+    update_event(c, 0);
+    pthread_mutex_lock(&conn_lock);
+    STATS_LOCK();
+    if (stats_state.accepting_conns) {
+        stats_state.accepting_conns = false;
+        gettimeofday(&stats.maxconns_entered,NULL);
+    }
+    stats.listen_disabled_num++;
+    STATS_UNLOCK();
+    allow_new_conns = false;
+    pthread_mutex_unlock(&conn_lock);
+    listener_retry(c);
+}
+
+#ifdef HAVE_SENDMMSG
+/*
+ * Sends as many of the remaining UDP reply datagrams as fit in one batch
+ * with a single sendmmsg(). Datagrams go out whole or not at all, so the
+ * sent ones are simply marked done. Returns bytes written, or what
+ * sendmmsg() returned if nothing was sent.
+ */
+static ssize_t transmit_udp_batch(conn *c) {
+    struct mmsghdr mmsgs[UDP_BATCH_SIZE];
+    ssize_t written = 0;
+    int i, n, res;
+
+    n = c->msgused - c->msgcurr;
+    if (n > UDP_BATCH_SIZE)
+        n = UDP_BATCH_SIZE;
+    for (i = 0; i < n; i++) {
+        mmsgs[i].msg_hdr = c->msglist[c->msgcurr + i];
+        mmsgs[i].msg_len = 0;
+    }
+
+    res = sendmmsg(c->sfd, mmsgs, n, 0);
+    if (res <= 0)
+        return res;
+    for (i = 0; i < res; i++) {
+        written += mmsgs[i].msg_len;
+        c->msglist[c->msgcurr + i].msg_iovlen = 0;
+    }
+    return written;
+}
+#endif
+
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
  *
@@ -4660,7 +6430,7 @@ void do_accept_new_conns(const bool do_accept) {
 static enum transmit_result transmit(conn *c) {
     assert(c != NULL);
 
-    if (c->msgcurr < c->msgused &&
+    while (c->msgcurr < c->msgused &&
             c->msglist[c->msgcurr].msg_iovlen == 0) {
         /* Finished writing the current msg; advance to the next. */
         c->msgcurr++;
@@ -4669,12 +6439,21 @@ static enum transmit_result transmit(conn *c) {
         ssize_t res;
         struct msghdr *m = &c->msglist[c->msgcurr];
 
-        res = sendmsg(c->sfd, m, 0);
+#ifdef HAVE_SENDMMSG
+        if (IS_UDP(c->transport) && c->msgused - c->msgcurr > 1)
+            res = transmit_udp_batch(c);
+        else
+#endif
+        res = c->sendmsg(c, m, 0);
         if (res > 0) {
             pthread_mutex_lock(&c->thread->stats.mutex);
             c->thread->stats.bytes_written += res;
             pthread_mutex_unlock(&c->thread->stats.mutex);
 
+            /* A batch only ever sends whole datagrams. */
+            if (m->msg_iovlen == 0)
+                return TRANSMIT_INCOMPLETE;
+
             /* We've written some of the data. Remove the completed
                iovec entries from the list of pending writes. */
             while (m->msg_iovlen > 0 && res >= m->msg_iov->iov_len) {
@@ -4765,7 +6544,7 @@ static int read_into_chunked_item(conn *c) {
             }
         } else {
             /*  now try reading from the socket */
-            res = read(c->sfd, ch->data + ch->used,
+            res = c->read(c, ch->data + ch->used,
                     (unused > c->rlbytes ? c->rlbytes : unused));
             if (res > 0) {
                 pthread_mutex_lock(&c->thread->stats.mutex);
@@ -4799,6 +6578,147 @@ static int read_into_chunked_item(conn *c) {
     return total;
 }
 
+/*
+ * Reply batching. When a client pipelines requests, the next one is often
+ * already in the read buffer by the time a response is ready. Instead of
+ * sending each response on its own, a small one is copied into the
+ * connection's batch buffer and goes out in front of a later response, so a
+ * whole pipeline can be answered with a single sendmsg(). The buffer is
+ * bounded by reply_batch_size, and anything in it is flushed before the
+ * connection waits for more input.
+ */
+
+/* Returns true if the response now being written was batched instead. */
+static bool batch_response(conn *c, int nreqs) {
+    enum conn_states next;
+    int i, total = 0;
+    char *p;
+
+    /* The next request has to be there and handled in this same pass. */
+    if (settings.reply_batch_size == 0 || IS_UDP(c->transport)
+            || c->rbytes == 0 || nreqs <= 0)
+        return false;
+#ifdef EXTSTORE
+    if (c->io_wraplist != NULL)
+        return false;
+#endif
+    if (c->state == conn_mwrite && c->protocol != binary_prot) {
+        next = conn_new_cmd;
+    } else {
+        next = c->write_and_go;
+    }
+    if (next != conn_new_cmd)
+        return false;
+
+    for (i = 0; i < c->iovused; i++) {
+        total += c->iov[i].iov_len;
+        if (c->bbytes + total > settings.reply_batch_size)
+            return false;
+    }
+    if (c->bbuf == NULL) {
+        c->bbuf = malloc(settings.reply_batch_size);
+        if (c->bbuf == NULL)
+            return false;
+    }
+
+    p = c->bbuf + c->bbytes;
+    for (i = 0; i < c->iovused; i++) {
+        memcpy(p, c->iov[i].iov_base, c->iov[i].iov_len);
+        p += c->iov[i].iov_len;
+    }
+    c->bbytes += total;
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.responses_batched++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    return true;
+}
+
+/* Puts the batched responses in front of the one about to be sent. */
+static int batch_attach(conn *c) {
+    int i;
+
+    if (ensure_iov_space(c) != 0)
+        return -1;
+    if (c->msglist[0].msg_iovlen == IOV_MAX) {
+        /* No room in the first message; give the batch its own. */
+        if (add_msghdr(c) != 0)
+            return -1;
+        memmove(&c->msglist[1], &c->msglist[0],
+                (c->msgused - 1) * sizeof(struct msghdr));
+        memset(&c->msglist[0], 0, sizeof(struct msghdr));
+        c->msglist[0].msg_iov = c->iov;
+    }
+    memmove(&c->iov[1], &c->iov[0], c->iovused * sizeof(struct iovec));
+    c->iov[0].iov_base = c->bbuf;
+    c->iov[0].iov_len = c->bbytes;
+    c->iovused++;
+    c->msglist[0].msg_iovlen++;
+    for (i = 1; i < c->msgused; i++) {
+        c->msglist[i].msg_iov++;
+    }
+    c->bbytes = 0;
+    return 0;
+}
+
+/* Sends anything batched before the connection blocks on a read or closes,
+ * then continues in state next. Returns false if there was nothing to send. */
+static bool batch_flush(conn *c, enum conn_states next) {
+    int bytes = c->bbytes;
+
+    if (bytes == 0)
+        return false;
+
+    c->bbytes = 0;
+    c->msgcurr = 0;
+    c->msgused = 0;
+    c->iovused = 0;
+    if (add_msghdr(c) != 0 || add_iov(c, c->bbuf, bytes) != 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't build response\n");
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    c->write_and_go = next;
+    conn_set_state(c, conn_write);
+    return true;
+}
+
+/* "watch" and the lru_crawler dumps hand the connection to a side thread,
+ * which writes to the socket directly from then on. Anything batched has to
+ * be sent first; erring on the side of flushing for other lru_crawler
+ * commands costs nothing. */
+static bool batch_blocks_command(const char *cmd, const char *end) {
+    while (cmd < end && *cmd == ' ') {
+        cmd++;
+    }
+    return (end - cmd >= 5 && strncmp(cmd, "watch", 5) == 0)
+        || (end - cmd >= 11 && strncmp(cmd, "lru_crawler", 11) == 0);
+}
+
+/* The response has been sent or batched; move on. */
+static void write_complete(conn *c) {
+    if (c->state == conn_mwrite) {
+        conn_release_items(c);
+        /* XXX:  I don't know why this wasn't the general case */
+        if(c->protocol == binary_prot) {
+            conn_set_state(c, c->write_and_go);
+        } else {
+            conn_set_state(c, conn_new_cmd);
+        }
+    } else if (c->state == conn_write) {
+        if (c->write_and_free) {
+            free(c->write_and_free);
+            c->write_and_free = 0;
+        }
+        conn_set_state(c, c->write_and_go);
+    } else {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Unexpected state %d\n", c->state);
+        conn_set_state(c, conn_closing);
+    }
+}
+
 static void drive_machine(conn *c) {
     bool stop = false;
     int sfd;
@@ -4841,7 +6761,11 @@ static void drive_machine(conn *c) {
                 } else if (errno == EMFILE) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Too many open connections\n");
-                    accept_new_conns(false);
+                    if (c->thread != NULL) {
+                        listener_pause(c);
+                    } else {
+                        accept_new_conns(false);
+                    }
                     stop = true;
                 } else {
                     perror("accept()");
@@ -4865,6 +6789,21 @@ static void drive_machine(conn *c) {
                 STATS_LOCK();
                 stats.rejected_conns++;
                 STATS_UNLOCK();
+            } else if (c->thread != NULL) {
+                /* A worker's own reuseport listener: the connection stays
+                 * on this thread. */
+                conn *nc = conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                                    DATA_BUFFER_SIZE, c->transport,
+                                    c->thread->base);
+                if (nc == NULL) {
+                    if (settings.verbose > 0) {
+                        fprintf(stderr, "Can't listen for events on fd %d\n",
+                            sfd);
+                    }
+                    close(sfd);
+                } else {
+                    nc->thread = c->thread;
+                }
             } else {
                 dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
                                      DATA_BUFFER_SIZE, c->transport);
@@ -4874,6 +6813,8 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_waiting:
+            if (batch_flush(c, conn_waiting))
+                break;
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -4882,7 +6823,10 @@ static void drive_machine(conn *c) {
             }
 
             conn_set_state(c, conn_read);
-            stop = true;
+            /* Datagrams left over from a batched read, or the rest of a TLS
+             * record, are already here. */
+            if (!UDP_BATCH_PENDING(c) && !SSL_DATA_PENDING(c))
+                stop = true;
             break;
 
         case conn_read:
@@ -4923,12 +6867,13 @@ static void drive_machine(conn *c) {
                 pthread_mutex_lock(&c->thread->stats.mutex);
                 c->thread->stats.conn_yields++;
                 pthread_mutex_unlock(&c->thread->stats.mutex);
-                if (c->rbytes > 0) {
+                if (c->rbytes > 0 || UDP_BATCH_PENDING(c) || c->bbytes > 0) {
                     /* We have already read in data into the input buffer,
                        so libevent will most likely not signal read events
                        on the socket (unless more data is available. As a
                        hack we should just put in a request to write data,
                        because that should be possible ;-)
+                       Batched responses also need us to come back.
                     */
                     if (!update_event(c, EV_WRITE | EV_PERSIST)) {
                         if (settings.verbose > 0)
@@ -4973,7 +6918,7 @@ static void drive_machine(conn *c) {
                 }
 
                 /*  now try reading from the socket */
-                res = read(c->sfd, c->ritem, c->rlbytes);
+                res = c->read(c, c->ritem, c->rlbytes);
                 if (res > 0) {
                     pthread_mutex_lock(&c->thread->stats.mutex);
                     c->thread->stats.bytes_read += res;
@@ -4997,6 +6942,8 @@ static void drive_machine(conn *c) {
             }
 
             if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (batch_flush(c, conn_nread))
+                    break;
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't update event\n");
@@ -5043,7 +6990,7 @@ static void drive_machine(conn *c) {
             }
 
             /*  now try reading from the socket */
-            res = read(c->sfd, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
+            res = c->read(c, c->rbuf, c->rsize > c->sbytes ? c->sbytes : c->rsize);
             if (res > 0) {
                 pthread_mutex_lock(&c->thread->stats.mutex);
                 c->thread->stats.bytes_read += res;
@@ -5056,6 +7003,8 @@ static void drive_machine(conn *c) {
                 break;
             }
             if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                if (batch_flush(c, conn_swallow))
+                    break;
                 if (!update_event(c, EV_READ | EV_PERSIST)) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Couldn't update event\n");
@@ -5089,6 +7038,35 @@ static void drive_machine(conn *c) {
             /* fall through... */
 
         case conn_mwrite:
+#ifdef EXTSTORE
+            /* Values have to be read back from storage before the response
+             * can go out. Park the connection until the IO threads hand it
+             * back via conn_worker_readd().
+             */
+            if (c->io_wrapleft && c->state == conn_mwrite) {
+                assert(c->io_queued == false);
+                assert(c->io_wraplist != NULL);
+                conn_set_state(c, conn_watch);
+                event_del(&c->event);
+                c->io_queued = true;
+                extstore_submit(c->thread->storage, &c->io_wraplist->io);
+                stop = true;
+                break;
+            }
+#endif
+            if (c->batch_check) {
+                c->batch_check = false;
+                if (batch_response(c, nreqs)) {
+                    write_complete(c);
+                    break;
+                }
+                if (c->bbytes > 0 && batch_attach(c) != 0) {
+                    if (settings.verbose > 0)
+                        fprintf(stderr, "Couldn't build response\n");
+                    conn_set_state(c, conn_closing);
+                    break;
+                }
+            }
           if (IS_UDP(c->transport) && c->msgcurr == 0 && build_udp_headers(c) != 0) {
             if (settings.verbose > 0)
               fprintf(stderr, "Failed to build UDP headers\n");
@@ -5097,25 +7075,7 @@ static void drive_machine(conn *c) {
           }
             switch (transmit(c)) {
             case TRANSMIT_COMPLETE:
-                if (c->state == conn_mwrite) {
-                    conn_release_items(c);
-                    /* XXX:  I don't know why this wasn't the general case */
-                    if(c->protocol == binary_prot) {
-                        conn_set_state(c, c->write_and_go);
-                    } else {
-                        conn_set_state(c, conn_new_cmd);
-                    }
-                } else if (c->state == conn_write) {
-                    if (c->write_and_free) {
-                        free(c->write_and_free);
-                        c->write_and_free = 0;
-                    }
-                    conn_set_state(c, c->write_and_go);
-                } else {
-                    if (settings.verbose > 0)
-                        fprintf(stderr, "Unexpected state %d\n", c->state);
-                    conn_set_state(c, conn_closing);
-                }
+                write_complete(c);
                 break;
 
             case TRANSMIT_INCOMPLETE:
@@ -5129,6 +7089,9 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_closing:
+            /* Answer everything before a "quit" */
+            if (batch_flush(c, conn_closing))
+                break;
             if (IS_UDP(c->transport))
                 conn_cleanup(c);
             else
@@ -5145,6 +7108,10 @@ static void drive_machine(conn *c) {
             /* We handed off our connection to the logger thread. */
             stop = true;
             break;
+        case conn_proxy:
+            /* Picked up again by conn_proxy_done() */
+            stop = true;
+            break;
         case conn_max_state:
             assert(false);
             break;
@@ -5224,9 +7191,79 @@ static void maximize_sndbuf(const int sfd) {
         }
     }
 
-    if (settings.verbose > 1)
-        fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
+    if (settings.verbose > 1)
+        fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
+}
+
+/*
+ * Sets the options every TCP listener gets; accepted sockets inherit them.
+ */
+static void set_tcp_listener_opts(const int sfd) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int error;
+
+#ifdef SO_REUSEPORT
+    if (settings.reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0)
+            perror("setsockopt");
+    }
+#endif
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+    if (error != 0)
+        perror("setsockopt");
+
+    error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    if (error != 0)
+        perror("setsockopt");
+
+    error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    if (error != 0)
+        perror("setsockopt");
+}
+
+#ifdef SO_REUSEPORT
+/*
+ * Opens another listener on the address sfd is bound to, for a worker
+ * thread. The address is read back from sfd so an ephemeral port is shared.
+ */
+static int reuseport_listener(struct addrinfo *ai, const int sfd) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    int flags = 1;
+    int lfd;
+
+    if (getsockname(sfd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("getsockname()");
+        return -1;
+    }
+    if ((lfd = new_socket(ai)) == -1) {
+        perror("socket()");
+        return -1;
+    }
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        setsockopt(lfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+    }
+#endif
+    setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    set_tcp_listener_opts(lfd);
+
+    if (bind(lfd, (struct sockaddr *)&addr, len) == -1) {
+        perror("bind()");
+        close(lfd);
+        return -1;
+    }
+    if (listen(lfd, settings.backlog) == -1) {
+        perror("listen()");
+        close(lfd);
+        return -1;
+    }
+    return lfd;
 }
+#endif
 
 /**
  * Create a socket and bind it to a specific port number
@@ -5242,7 +7279,6 @@ static int server_socket(const char *interface,
                          enum network_transport transport,
                          FILE *portnumber_file) {
     int sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints = { .ai_flags = AI_PASSIVE,
@@ -5296,17 +7332,7 @@ static int server_socket(const char *interface,
         if (IS_UDP(transport)) {
             maximize_sndbuf(sfd);
         } else {
-            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
-
-            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-            if (error != 0)
-                perror("setsockopt");
-
-            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
+            set_tcp_listener_opts(sfd);
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
@@ -5365,6 +7391,24 @@ static int server_socket(const char *interface,
                                   EV_READ | EV_PERSIST,
                                   UDP_READ_BUFFER_SIZE, transport);
             }
+#ifdef SO_REUSEPORT
+        } else if (settings.reuseport) {
+            int t;
+
+            /* Likewise one listener per worker thread. The kernel spreads
+             * incoming connections over them, so each worker accepts and
+             * sets up its own without going through the main thread.
+             */
+            for (t = 0; t < settings.num_threads; t++) {
+                int lfd = t ? reuseport_listener(next, sfd) : sfd;
+                if (lfd == -1) {
+                    fprintf(stderr, "failed to create reuseport listener\n");
+                    exit(EXIT_FAILURE);
+                }
+                dispatch_conn_new(lfd, conn_listening, EV_READ | EV_PERSIST,
+                                  1, transport);
+            }
+#endif
         } else {
             if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                              EV_READ | EV_PERSIST, 1,
@@ -5533,6 +7577,8 @@ static int server_socket_unix(const char *path, int access_mask) {
  */
 volatile rel_time_t current_time;
 static struct event clockevent;
+/* Set by SIGUSR1 to stop gracefully, saving the memory file if there is one. */
+static volatile sig_atomic_t stop_main_loop = 0;
 
 /* libevent uses a monotonic clock when available for event scheduling. Aside
  * from jitter, simply ticking our internal timer here is accurate enough.
@@ -5546,18 +7592,24 @@ static void clock_handler(const int fd, const short which, void *arg) {
     static time_t monotonic_start;
 #endif
 
+    if (stop_main_loop) {
+        event_base_loopbreak(main_base);
+        return;
+    }
+
     if (initialized) {
         /* only delete the event if it's actually there. */
         evtimer_del(&clockevent);
     } else {
         initialized = true;
         /* process_started is initialized to time() - 2. We initialize to 1 so
-         * flush_all won't underflow during tests. */
+         * flush_all won't underflow during tests. A warm restart carries on
+         * from the previous process_started instead. */
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
         struct timespec ts;
         if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0) {
             monotonic = true;
-            monotonic_start = ts.tv_sec - ITEM_UPDATE_INTERVAL - 2;
+            monotonic_start = ts.tv_sec - (time(0) - process_started);
         }
 #endif
     }
@@ -5594,6 +7646,8 @@ static void usage(void) {
            "-r, --enable-coredumps    maximize core file limit\n"
            "-u, --user=<user>         assume identity of <username> (only when run as root)\n"
            "-m, --memory-limit=<num>  item memory in megabytes (default: 64 MB)\n"
+           "-e, --memory-file=<file>  keep item memory in <file>; after a graceful\n"
+           "                          shutdown (SIGUSR1) the next start reuses it\n"
            "-M, --disable-evictions   return error on memory exhausted instead of evicting\n"
            "-c, --conn-limit=<num>    max simultaneous connections (default: 1024)\n"
            "-k, --lock-memory         lock down all paged memory\n"
@@ -5626,6 +7680,12 @@ static void usage(void) {
 #endif
     printf("-F, --disable-flush-all   disable flush_all command\n");
     printf("-X, --disable-dumping     disable stats cachedump and lru_crawler metadump\n");
+    printf("-x, --proxy=<servers>     forward requests to these memcached servers\n"
+           "                          (host:port,host:port,...), picked by consistent\n"
+           "                          hashing of the key. ASCII protocol only.\n");
+#ifdef TLS
+    printf("-Z, --enable-ssl          enable TLS for TCP connections\n");
+#endif
     printf("-o, --extended            comma separated list of extended options\n"
            "                          most options have a 'no_' prefix to disable\n"
            "   - maxconns_fast:       immediately close new connections after limit\n"
@@ -5636,7 +7696,7 @@ static void usage(void) {
            "                          forcefully killing LRU tail item.\n"
            "                          disabled by default; very dangerous option.\n"
            "   - hash_algorithm:      the hash table algorithm\n"
-           "                          default is murmur3 hash. options: jenkins, murmur3\n"
+           "                          default is murmur3 hash. options: jenkins, murmur3, xxh3\n"
            "   - lru_crawler:         enable LRU Crawler background thread\n"
            "   - lru_crawler_sleep:   microseconds to sleep between items\n"
            "                          default is 100.\n"
@@ -5652,17 +7712,66 @@ static void usage(void) {
            "   - temporary_ttl:       TTL's below get separate LRU, can't be evicted.\n"
            "                          (requires lru_maintainer)\n"
            "   - idle_timeout:        timeout for idle connections\n"
+           );
+    printf("   - lru_autotune:        move the split of memory between hot and warm\n"
+           "                          lru per class, by hits on recently evicted keys.\n"
+           "                          (requires lru_maintainer)\n"
+           "   - lru_autotune_window: seconds between lru_autotune moves. (60)\n"
+           "   - reply_batch_size:    bytes of responses to pipelined requests held\n"
+           "                          back and sent with a later one. 0 disables.\n"
+           "                          (8192)\n"
+           "   - reuseport:           every worker thread accepts TCP connections on\n"
+           "                          its own SO_REUSEPORT listener.\n"
+           "   - proxy_timeout:       seconds a proxy backend may take to answer\n"
+           "                          before it's marked down. 0 waits forever. (2)\n"
+           "   - proxy_retry:         seconds a down proxy backend is left out of\n"
+           "                          the hash ring. (5)\n"
            "   - slab_chunk_max:      (EXPERIMENTAL) maximum slab size. use extreme care.\n"
+           "   - slab_thread_cache:   worker threads keep small caches of free chunks,\n"
+           "                          taking the slab lock only to refill or drain them.\n"
+           "   - slab_compact:        page moves take the emptiest of up to 64 sampled\n"
+           "                          pages, not the oldest. (requires slab_reassign)\n"
            "   - watcher_logbuf_size: size in kilobytes of per-watcher write buffer.\n"
            "   - worker_logbuf_size:  size in kilobytes of per-worker-thread buffer\n"
            "                          read by background thread, then written to watchers.\n"
            "   - track_sizes:         enable dynamic reports for 'stats sizes' command.\n"
+           "   - hotkeys:             track the most fetched keys for 'stats hotkeys'.\n"
+           "   - hotkeys_sample:      hot key tracker samples one of this many fetches.\n"
+           "                          (100)\n"
            "   - no_inline_ascii_resp: save up to 24 bytes per item.\n"
            "                           small perf hit in ASCII, no perf difference in\n"
            "                           binary protocol. speeds up all sets.\n"
+           "   - inline_ascii_resp:   keep the VALUE line preformatted in each item,\n"
+           "                          so ASCII hits are sent without formatting.\n"
            "   - modern:              enables options which will be default in future.\n"
            "             currently: nothing\n"
            "   - no_modern:           uses defaults of previous major version (1.4.x)\n"
+#ifdef EXTSTORE
+           "   - ext_path:            file to write to for external storage.\n"
+           "                          ie: ext_path=/mnt/d1/extstore:1G\n"
+           "   - ext_page_size:       size in megabytes of storage pages. (64)\n"
+           "   - ext_wbuf_size:       size in megabytes of page write buffers. (4)\n"
+           "   - ext_threads:         number of IO threads to run. (1)\n"
+           "   - ext_item_size:       store items larger than this (bytes, 512)\n"
+           "   - ext_item_age:        store items idle at least this long (seconds)\n"
+           "                          default: only store when memory is full.\n"
+           "   - ext_compact_under:   compact when fewer than this many free pages\n"
+           "                          default: 1/4th of the assigned storage.\n"
+           "   - ext_max_frag:        max page fragmentation to tolerate (0.5)\n"
+#endif
+#ifdef TLS
+           "   - ssl_chain_cert:      certificate chain file in PEM format\n"
+           "   - ssl_key:             private key file in PEM format\n"
+           "   - ssl_ca_cert:         CA certificates for verifying clients\n"
+           "   - ssl_verify_mode:     client certificates: 0 ignore, 1 request,\n"
+           "                          2 require (0)\n"
+           "   - ssl_ciphers:         TLSv1.2 cipher list (library default)\n"
+           "   - ssl_session_cache:   TLSv1.2 sessions cached for resumption; 0 turns\n"
+           "                          off resumption, including tickets (20480)\n"
+           "   - ssl_wbuf_size:       kilobytes of per-thread TLS write buffer (16)\n"
+           "   - ssl_ktls:            let the kernel encrypt sends (kTLS) when the\n"
+           "                          kernel and cipher allow it\n"
+#endif
 #ifdef HAVE_DROP_PRIVILEGES
            "   - no_drop_privileges: Disable drop_privileges in case it causes issues with\n"
            "                          some customisation.\n"
@@ -5671,6 +7780,19 @@ static void usage(void) {
 #endif
 #endif
            );
+#ifdef COMPRESSION
+    printf("   - compress_min:        compress values of at least this many bytes\n"
+           "                          when that saves memory. 0 disables. (0)\n"
+           "   - compress_level:      zlib level, 1 (fastest) to 9 (smallest). (1)\n");
+#endif
+#ifdef NUMA
+    printf("   - numa:                pin worker threads to NUMA nodes, hand them\n"
+           "                          connections arriving on their node (round-robin\n"
+           "                          while one node gets most of them), and carve\n"
+           "                          slab pages from node-local memory.\n"
+           "   - numa_prealloc:       numa, with each node's share of memory faulted\n"
+           "                          in at startup.\n");
+#endif
     return;
 }
 
@@ -5799,6 +7921,11 @@ static void sig_handler(const int sig) {
     exit(EXIT_SUCCESS);
 }
 
+/* Graceful shutdown: the clock event breaks the main loop on its next tick. */
+static void sig_usrhandler(const int sig) {
+    stop_main_loop = 1;
+}
+
 #ifndef HAVE_SIGIGNORE
 static int sigignore(int sig) {
     struct sigaction sa = { .sa_handler = SIG_IGN, .sa_flags = 0 };
@@ -5919,6 +8046,8 @@ int main (int argc, char **argv) {
     bool lock_memory = false;
     bool do_daemonize = false;
     bool preallocate = false;
+    void *mem_base = NULL;
+    bool reuse_mem = false;
     int maxcore = 0;
     char *username = NULL;
     char *pid_file = NULL;
@@ -5944,6 +8073,12 @@ int main (int argc, char **argv) {
     bool use_slab_sizes = false;
     char *slab_sizes_unparsed = NULL;
     bool slab_chunk_size_changed = false;
+#ifdef EXTSTORE
+    void *storage = NULL;
+    char *storage_file = NULL;
+    uint64_t storage_size = 0;
+    struct extstore_conf ext_cf;
+#endif
 
     char *subopts, *subopts_orig;
     char *subopts_value;
@@ -5965,12 +8100,22 @@ int main (int argc, char **argv) {
         HOT_MAX_FACTOR,
         WARM_MAX_FACTOR,
         TEMPORARY_TTL,
+        LRU_AUTOTUNE,
+        LRU_AUTOTUNE_WINDOW,
         IDLE_TIMEOUT,
+        REPLY_BATCH_SIZE,
+        REUSEPORT,
+        PROXY_TIMEOUT,
+        PROXY_RETRY,
         WATCHER_LOGBUF_SIZE,
         WORKER_LOGBUF_SIZE,
         SLAB_SIZES,
         SLAB_CHUNK_MAX,
+        SLAB_THREAD_CACHE,
+        SLAB_COMPACT,
         TRACK_SIZES,
+        HOTKEYS,
+        HOTKEYS_SAMPLE,
         NO_INLINE_ASCII_RESP,
         MODERN,
         NO_MODERN,
@@ -5984,6 +8129,34 @@ int main (int argc, char **argv) {
         NO_DROP_PRIVILEGES,
 #ifdef MEMCACHED_DEBUG
         RELAXED_PRIVILEGES,
+#endif
+#ifdef EXTSTORE
+        EXT_PAGE_SIZE,
+        EXT_WBUF_SIZE,
+        EXT_THREADS,
+        EXT_PATH,
+        EXT_ITEM_SIZE,
+        EXT_ITEM_AGE,
+        EXT_COMPACT_UNDER,
+        EXT_MAX_FRAG,
+#endif
+#ifdef TLS
+        SSL_CERT,
+        SSL_KEY,
+        SSL_CA_CERT,
+        SSL_VERIFY_MODE,
+        SSL_CIPHERS,
+        SSL_SESSION_CACHE,
+        SSL_WBUF_SIZE,
+        SSL_KTLS,
+#endif
+#ifdef COMPRESSION
+        COMPRESS_MIN,
+        COMPRESS_LEVEL,
+#endif
+#ifdef NUMA
+        NUMA_AWARE,
+        NUMA_PREALLOC,
 #endif
     };
     char *const subopts_tokens[] = {
@@ -6004,12 +8177,22 @@ int main (int argc, char **argv) {
         [HOT_MAX_FACTOR] = "hot_max_factor",
         [WARM_MAX_FACTOR] = "warm_max_factor",
         [TEMPORARY_TTL] = "temporary_ttl",
+        [LRU_AUTOTUNE] = "lru_autotune",
+        [LRU_AUTOTUNE_WINDOW] = "lru_autotune_window",
         [IDLE_TIMEOUT] = "idle_timeout",
+        [REPLY_BATCH_SIZE] = "reply_batch_size",
+        [REUSEPORT] = "reuseport",
+        [PROXY_TIMEOUT] = "proxy_timeout",
+        [PROXY_RETRY] = "proxy_retry",
         [WATCHER_LOGBUF_SIZE] = "watcher_logbuf_size",
         [WORKER_LOGBUF_SIZE] = "worker_logbuf_size",
         [SLAB_SIZES] = "slab_sizes",
         [SLAB_CHUNK_MAX] = "slab_chunk_max",
+        [SLAB_THREAD_CACHE] = "slab_thread_cache",
+        [SLAB_COMPACT] = "slab_compact",
         [TRACK_SIZES] = "track_sizes",
+        [HOTKEYS] = "hotkeys",
+        [HOTKEYS_SAMPLE] = "hotkeys_sample",
         [NO_INLINE_ASCII_RESP] = "no_inline_ascii_resp",
         [MODERN] = "modern",
         [NO_MODERN] = "no_modern",
@@ -6023,6 +8206,34 @@ int main (int argc, char **argv) {
         [NO_DROP_PRIVILEGES] = "no_drop_privileges",
 #ifdef MEMCACHED_DEBUG
         [RELAXED_PRIVILEGES] = "relaxed_privileges",
+#endif
+#ifdef EXTSTORE
+        [EXT_PAGE_SIZE] = "ext_page_size",
+        [EXT_WBUF_SIZE] = "ext_wbuf_size",
+        [EXT_THREADS] = "ext_threads",
+        [EXT_PATH] = "ext_path",
+        [EXT_ITEM_SIZE] = "ext_item_size",
+        [EXT_ITEM_AGE] = "ext_item_age",
+        [EXT_COMPACT_UNDER] = "ext_compact_under",
+        [EXT_MAX_FRAG] = "ext_max_frag",
+#endif
+#ifdef TLS
+        [SSL_CERT] = "ssl_chain_cert",
+        [SSL_KEY] = "ssl_key",
+        [SSL_CA_CERT] = "ssl_ca_cert",
+        [SSL_VERIFY_MODE] = "ssl_verify_mode",
+        [SSL_CIPHERS] = "ssl_ciphers",
+        [SSL_SESSION_CACHE] = "ssl_session_cache",
+        [SSL_WBUF_SIZE] = "ssl_wbuf_size",
+        [SSL_KTLS] = "ssl_ktls",
+#endif
+#ifdef COMPRESSION
+        [COMPRESS_MIN] = "compress_min",
+        [COMPRESS_LEVEL] = "compress_level",
+#endif
+#ifdef NUMA
+        [NUMA_AWARE] = "numa",
+        [NUMA_PREALLOC] = "numa_prealloc",
 #endif
         NULL
     };
@@ -6034,9 +8245,17 @@ int main (int argc, char **argv) {
     /* handle SIGINT and SIGTERM */
     signal(SIGINT, sig_handler);
     signal(SIGTERM, sig_handler);
+    signal(SIGUSR1, sig_usrhandler);
 
     /* init settings */
     settings_init();
+#ifdef EXTSTORE
+    ext_cf.page_size = settings.ext_page_size;
+    ext_cf.page_count = 0;
+    ext_cf.wbuf_size = settings.ext_wbuf_size;
+    ext_cf.wbuf_count = 4;
+    ext_cf.io_threadcount = 1;
+#endif
 
     /* Run regardless of initializing it later */
     init_lru_crawler(NULL);
@@ -6052,6 +8271,7 @@ int main (int argc, char **argv) {
           "s:"  /* unix socket path to listen on */
           "U:"  /* UDP port number to listen on */
           "m:"  /* max memory to use for items in megabytes 分配给Memcached使用的内存数量，单位是MB*/
+          "e:"  /* mmap'd file for item memory, for warm restarts */
           "M"   /* return error on memory exhausted */
           "c:"  /* max simultaneous connections 最大运行的并发连接数*/
           "k"   /* lock down all paged memory */
@@ -6075,7 +8295,9 @@ int main (int argc, char **argv) {
           "S"   /* Sasl ON */
           "F"   /* Disable flush_all */
           "X"   /* Disable dump commands */
+          "x:"  /* proxy to these backends */
           "o:"  /* Extended generic options */
+          "Z"   /* enable TLS */
           ;
 
     /* process arguments */
@@ -6087,6 +8309,7 @@ int main (int argc, char **argv) {
         {"unix-socket", required_argument, 0, 's'},
         {"udp-port", required_argument, 0, 'U'},
         {"memory-limit", required_argument, 0, 'm'},
+        {"memory-file", required_argument, 0, 'e'},
         {"disable-evictions", no_argument, 0, 'M'},
         {"conn-limit", required_argument, 0, 'c'},
         {"lock-memory", no_argument, 0, 'k'},
@@ -6111,7 +8334,9 @@ int main (int argc, char **argv) {
         {"enable-sasl", no_argument, 0, 'S'},
         {"disable-flush-all", no_argument, 0, 'F'},
         {"disable-dumping", no_argument, 0, 'X'},
+        {"proxy", required_argument, 0, 'x'},
         {"extended", required_argument, 0, 'o'},
+        {"enable-ssl", no_argument, 0, 'Z'},
         {0, 0, 0, 0}
     };
     int optindex;
@@ -6145,6 +8370,9 @@ int main (int argc, char **argv) {
         case 'm':
             settings.maxbytes = ((size_t)atoi(optarg)) * 1024 * 1024;
             break;
+        case 'e':
+            settings.memory_file = strdup(optarg);
+            break;
         case 'M':
             settings.evict_to_free = 0;
             break;
@@ -6323,6 +8551,17 @@ int main (int argc, char **argv) {
        case 'X' :
             settings.dump_enabled = false;
             break;
+        case 'x':
+            settings.proxy_backends = strdup(optarg);
+            break;
+        case 'Z':
+#ifndef TLS
+            fprintf(stderr, "This server is not built with TLS support.\n");
+            exit(EX_USAGE);
+#else
+            settings.ssl_enabled = true;
+#endif
+            break;
         case 'o': /* It's sub-opts time! */
             subopts_orig = subopts = strdup(optarg); /* getsubopt() changes the original args */
 
@@ -6405,8 +8644,10 @@ int main (int argc, char **argv) {
                     hash_type = JENKINS_HASH;
                 } else if (strcmp(subopts_value, "murmur3") == 0) {
                     hash_type = MURMUR3_HASH;
+                } else if (strcmp(subopts_value, "xxh3") == 0) {
+                    hash_type = XXH3_HASH;
                 } else {
-                    fprintf(stderr, "Unknown hash_algorithm option (jenkins, murmur3)\n");
+                    fprintf(stderr, "Unknown hash_algorithm option (jenkins, murmur3, xxh3)\n");
                     return 1;
                 }
                 break;
@@ -6491,6 +8732,20 @@ int main (int argc, char **argv) {
                 settings.temp_lru = true;
                 settings.temporary_ttl = atoi(subopts_value);
                 break;
+            case LRU_AUTOTUNE:
+                settings.lru_autotune = true;
+                break;
+            case LRU_AUTOTUNE_WINDOW:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing lru_autotune_window argument\n");
+                    return 1;
+                }
+                settings.lru_autotune_window = atoi(subopts_value);
+                if (settings.lru_autotune_window < 1) {
+                    fprintf(stderr, "lru_autotune_window must be at least 1\n");
+                    return 1;
+                }
+                break;
             case IDLE_TIMEOUT:
                 if (subopts_value == NULL) {
                     fprintf(stderr, "Missing numeric argument for idle_timeout\n");
@@ -6498,6 +8753,47 @@ int main (int argc, char **argv) {
                 }
                 settings.idle_timeout = atoi(subopts_value);
                 break;
+            case REPLY_BATCH_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing reply_batch_size argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, (int32_t *)&settings.reply_batch_size)
+                        || settings.reply_batch_size < 0) {
+                    fprintf(stderr, "could not parse argument to reply_batch_size\n");
+                    return 1;
+                }
+                break;
+            case REUSEPORT:
+#ifdef SO_REUSEPORT
+                settings.reuseport = true;
+                break;
+#else
+                fprintf(stderr, "reuseport is not supported on this platform\n");
+                return 1;
+#endif
+            case PROXY_TIMEOUT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing proxy_timeout argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, (int32_t *)&settings.proxy_timeout)
+                        || settings.proxy_timeout < 0) {
+                    fprintf(stderr, "could not parse argument to proxy_timeout\n");
+                    return 1;
+                }
+                break;
+            case PROXY_RETRY:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing proxy_retry argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, (int32_t *)&settings.proxy_retry)
+                        || settings.proxy_retry < 0) {
+                    fprintf(stderr, "could not parse argument to proxy_retry\n");
+                    return 1;
+                }
+                break;
             case WATCHER_LOGBUF_SIZE:
                 if (subopts_value == NULL) {
                     fprintf(stderr, "Missing watcher_logbuf_size argument\n");
@@ -6531,9 +8827,29 @@ int main (int argc, char **argv) {
                 }
                 slab_chunk_size_changed = true;
                 break;
+            case SLAB_THREAD_CACHE:
+                settings.slab_thread_cache = true;
+                break;
+            case SLAB_COMPACT:
+                settings.slab_compact = true;
+                break;
             case TRACK_SIZES:
                 item_stats_sizes_init();
                 break;
+            case HOTKEYS:
+                hotkeys_init();
+                break;
+            case HOTKEYS_SAMPLE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing hotkeys_sample argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.hotkeys_sample)
+                        || settings.hotkeys_sample == 0) {
+                    fprintf(stderr, "could not parse argument to hotkeys_sample\n");
+                    return 1;
+                }
+                break;
             case NO_INLINE_ASCII_RESP:
                 settings.inline_ascii_response = false;
                 break;
@@ -6582,6 +8898,216 @@ int main (int argc, char **argv) {
             case RELAXED_PRIVILEGES:
                 settings.relaxed_privileges = true;
                 break;
+#endif
+#ifdef EXTSTORE
+            case EXT_PAGE_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_page_size argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &ext_cf.page_size)) {
+                    fprintf(stderr, "could not parse argument to ext_page_size\n");
+                    return 1;
+                }
+                ext_cf.page_size *= 1024 * 1024; /* megabytes */
+                break;
+            case EXT_WBUF_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_wbuf_size argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &ext_cf.wbuf_size)) {
+                    fprintf(stderr, "could not parse argument to ext_wbuf_size\n");
+                    return 1;
+                }
+                ext_cf.wbuf_size *= 1024 * 1024; /* megabytes */
+                settings.ext_wbuf_size = ext_cf.wbuf_size;
+                break;
+            case EXT_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_threads argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &ext_cf.io_threadcount)) {
+                    fprintf(stderr, "could not parse argument to ext_threads\n");
+                    return 1;
+                }
+                break;
+            case EXT_ITEM_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_item_size argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.ext_item_size)) {
+                    fprintf(stderr, "could not parse argument to ext_item_size\n");
+                    return 1;
+                }
+                break;
+            case EXT_ITEM_AGE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_item_age argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.ext_item_age)) {
+                    fprintf(stderr, "could not parse argument to ext_item_age\n");
+                    return 1;
+                }
+                break;
+            case EXT_COMPACT_UNDER:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_compact_under argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.ext_compact_under)) {
+                    fprintf(stderr, "could not parse argument to ext_compact_under\n");
+                    return 1;
+                }
+                break;
+            case EXT_MAX_FRAG:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_max_frag argument\n");
+                    return 1;
+                }
+                if (!safe_strtod(subopts_value, &settings.ext_max_frag)) {
+                    fprintf(stderr, "could not parse argument to ext_max_frag\n");
+                    return 1;
+                }
+                break;
+            case EXT_PATH:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ext_path argument\n");
+                    return 1;
+                } else {
+                    /* path:size, where size takes a K/M/G/T unit */
+                    char *sep = strrchr(subopts_value, ':');
+                    char unit;
+                    if (sep == NULL || sep[1] == '\0') {
+                        fprintf(stderr, "ext_path must be in the form of path:size\n");
+                        return 1;
+                    }
+                    *sep = '\0';
+                    sep++;
+                    unit = tolower(sep[strlen(sep)-1]);
+                    if (unit == 'k' || unit == 'm' || unit == 'g' || unit == 't') {
+                        sep[strlen(sep)-1] = '\0';
+                    }
+                    if (!safe_strtoull(sep, &storage_size)) {
+                        fprintf(stderr, "could not parse size of ext_path\n");
+                        return 1;
+                    }
+                    switch (unit) {
+                        case 't':
+                            storage_size *= 1024;
+                        case 'g':
+                            storage_size *= 1024;
+                        case 'm':
+                            storage_size *= 1024;
+                        case 'k':
+                            storage_size *= 1024;
+                    }
+                    storage_file = strdup(subopts_value);
+                }
+                break;
+#endif
+#ifdef TLS
+            case SSL_CERT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_chain_cert argument\n");
+                    return 1;
+                }
+                settings.ssl_chain_cert = strdup(subopts_value);
+                break;
+            case SSL_KEY:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_key argument\n");
+                    return 1;
+                }
+                settings.ssl_key = strdup(subopts_value);
+                break;
+            case SSL_CA_CERT:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_ca_cert argument\n");
+                    return 1;
+                }
+                settings.ssl_ca_cert = strdup(subopts_value);
+                break;
+            case SSL_VERIFY_MODE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_verify_mode argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.ssl_verify_mode)
+                        || settings.ssl_verify_mode < 0
+                        || settings.ssl_verify_mode > 2) {
+                    fprintf(stderr, "ssl_verify_mode must be 0, 1 or 2\n");
+                    return 1;
+                }
+                break;
+            case SSL_CIPHERS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_ciphers argument\n");
+                    return 1;
+                }
+                settings.ssl_ciphers = strdup(subopts_value);
+                break;
+            case SSL_SESSION_CACHE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_session_cache argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.ssl_session_cache)) {
+                    fprintf(stderr, "could not parse argument to ssl_session_cache\n");
+                    return 1;
+                }
+                break;
+            case SSL_WBUF_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing ssl_wbuf_size argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.ssl_wbuf_size)
+                        || settings.ssl_wbuf_size == 0) {
+                    fprintf(stderr, "could not parse argument to ssl_wbuf_size\n");
+                    return 1;
+                }
+                settings.ssl_wbuf_size *= 1024; /* kilobytes */
+                break;
+            case SSL_KTLS:
+                settings.ssl_ktls = true;
+                break;
+#endif
+#ifdef COMPRESSION
+            case COMPRESS_MIN:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing compress_min argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, (int32_t *)&settings.compress_min)
+                        || settings.compress_min < 0) {
+                    fprintf(stderr, "could not parse argument to compress_min\n");
+                    return 1;
+                }
+                break;
+            case COMPRESS_LEVEL:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing compress_level argument\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, (int32_t *)&settings.compress_level)
+                        || settings.compress_level < 1 || settings.compress_level > 9) {
+                    fprintf(stderr, "compress_level must be between 1 and 9\n");
+                    return 1;
+                }
+                break;
+#endif
+#ifdef NUMA
+            case NUMA_AWARE:
+                settings.numa = true;
+                break;
+            case NUMA_PREALLOC:
+                settings.numa = true;
+                preallocate = true;
+                break;
 #endif
             default:
                 printf("Illegal suboption \"%s\"\n", subopts_value);
@@ -6639,6 +9165,52 @@ int main (int argc, char **argv) {
         exit(EX_USAGE);
     }
 
+    if (settings.lru_autotune && !start_lru_maintainer) {
+        fprintf(stderr, "lru_autotune requires lru_maintainer to be enabled\n");
+        exit(EX_USAGE);
+    }
+
+    /* Restoring relies on every page in the file being slab_page_size. */
+    if (settings.memory_file && !settings.slab_reassign) {
+        fprintf(stderr, "memory_file requires slab_reassign to be enabled\n");
+        exit(EX_USAGE);
+    }
+
+#ifdef NUMA
+    /* The arena in the file can't be split across nodes. */
+    if (settings.numa && settings.memory_file) {
+        fprintf(stderr, "numa can't be used with memory_file\n");
+        exit(EX_USAGE);
+    }
+#endif
+
+#ifdef EXTSTORE
+    if (storage_file) {
+        if (!start_lru_maintainer) {
+            fprintf(stderr, "ext_path requires lru_maintainer to be enabled\n");
+            exit(EX_USAGE);
+        }
+        if (ext_cf.wbuf_size < settings.slab_chunk_size_max) {
+            fprintf(stderr, "ext_wbuf_size must be at least slab_chunk_max\n");
+            exit(EX_USAGE);
+        }
+        if (ext_cf.page_size == 0) {
+            fprintf(stderr, "ext_page_size must be at least 1\n");
+            exit(EX_USAGE);
+        }
+        if (ext_cf.page_size % ext_cf.wbuf_size != 0) {
+            fprintf(stderr, "ext_page_size must be divisible by ext_wbuf_size\n");
+            exit(EX_USAGE);
+        }
+        settings.ext_page_size = ext_cf.page_size;
+        /* Worked out here, so ext_page_size can come after ext_path. */
+        ext_cf.page_count = storage_size / ext_cf.page_size;
+        if (settings.ext_compact_under == 0) {
+            settings.ext_compact_under = ext_cf.page_count / 4;
+        }
+    }
+#endif
+
     if (hash_init(hash_type) != 0) {
         fprintf(stderr, "Failed to initialize hash_algorithm!\n");
         exit(EX_USAGE);
@@ -6671,6 +9243,22 @@ int main (int argc, char **argv) {
         settings.port = settings.udpport;
     }
 
+    if (settings.proxy_backends) {
+        if (settings.binding_protocol == binary_prot) {
+            fprintf(stderr, "ERROR: Proxy mode only speaks the ASCII protocol.\n");
+            exit(EX_USAGE);
+        }
+        settings.binding_protocol = ascii_prot;
+        if (udp_specified && settings.udpport) {
+            fprintf(stderr, "ERROR: Proxy mode doesn't support UDP.\n");
+            exit(EX_USAGE);
+        }
+        settings.udpport = 0;
+        if (proxy_init(settings.proxy_backends) != 0) {
+            exit(EX_USAGE);
+        }
+    }
+
     if (maxcore != 0) {
         struct rlimit rlim_new;
         /*
@@ -6735,6 +9323,13 @@ int main (int argc, char **argv) {
         init_sasl();
     }
 
+#ifdef TLS
+    /* Load certificates before daemonizing changes directory. */
+    if (settings.ssl_enabled && ssl_init() != 0) {
+        exit(EX_USAGE);
+    }
+#endif
+
     /* daemonize if requested */
     /* if we want to ensure our ability to dump core, don't chdir to / */
     if (do_daemonize) {
@@ -6766,10 +9361,31 @@ int main (int argc, char **argv) {
     /* initialize other stuff */
     logger_init();
     stats_init();
+    if (settings.memory_file) {
+        /* May restore the clock and hash power of the previous process. */
+        mem_base = restart_mmap(&reuse_mem);
+    }
     assoc_init(settings.hashpower_init);
     conn_init();
     slabs_init(settings.maxbytes, settings.factor, preallocate,
-            use_slab_sizes ? slab_sizes : NULL);
+            use_slab_sizes ? slab_sizes : NULL, mem_base, reuse_mem);
+    if (reuse_mem) {
+        restart_rebuild();
+    }
+#ifdef EXTSTORE
+    if (storage_file) {
+        enum extstore_res eres;
+        storage = extstore_init(storage_file, &ext_cf, &eres);
+        if (storage == NULL) {
+            fprintf(stderr, "Failed to initialize external storage: %s\n",
+                    extstore_err(eres));
+            if (eres == EXTSTORE_INIT_OPEN_FAIL) {
+                perror("extstore open");
+            }
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
 
     /*
      * ignore SIGPIPE signals; we can use errno == EPIPE if we
@@ -6780,7 +9396,11 @@ int main (int argc, char **argv) {
         exit(EX_OSERR);
     }
     /* start up worker threads if MT mode */
+#ifdef EXTSTORE
+    memcached_thread_init(settings.num_threads, storage);
+#else
     memcached_thread_init(settings.num_threads, NULL);
+#endif
 
     if (start_assoc_maintenance_thread() == -1) {
         exit(EXIT_FAILURE);
@@ -6791,11 +9411,22 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
+#ifdef EXTSTORE
+    if (start_lru_maintainer && start_lru_maintainer_thread(storage) != 0) {
+#else
     if (start_lru_maintainer && start_lru_maintainer_thread(NULL) != 0) {
+#endif
         fprintf(stderr, "Failed to enable LRU maintainer thread\n");
         return 1;
     }
 
+#ifdef EXTSTORE
+    if (storage && start_storage_compact_thread(storage) != 0) {
+        fprintf(stderr, "Failed to start storage compaction thread\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     if (settings.slab_reassign &&
         start_slab_maintenance_thread() == -1) {
         exit(EXIT_FAILURE);
@@ -6893,6 +9524,13 @@ int main (int argc, char **argv) {
         retval = EXIT_FAILURE;
     }
 
+    if (stop_main_loop) {
+        pause_threads(PAUSE_ALL_THREADS);
+        if (settings.memory_file) {
+            restart_save();
+        }
+    }
+
     stop_assoc_maintenance_thread();
 
     /* remove the PID file if we're a daemon */
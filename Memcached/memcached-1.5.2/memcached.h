@@ -25,6 +25,12 @@
 #include "logger.h"
 
 #include "sasl_defs.h"
+#ifdef EXTSTORE
+#include "extstore.h"
+#endif
+#ifdef TLS
+#include <openssl/ssl.h>
+#endif
 
 /** Maximum length of a key. */
 #define KEY_MAX_LENGTH 250
@@ -33,7 +39,11 @@
 #define INCR_MAX_STORAGE_LEN 24
 
 #define DATA_BUFFER_SIZE 2048
+/* Longest opaque token a meta command may carry */
+#define META_OPAQUE_MAX 32
 #define UDP_READ_BUFFER_SIZE 65536
+/* Datagrams moved per recvmmsg()/sendmmsg() call */
+#define UDP_BATCH_SIZE 8
 #define UDP_MAX_PAYLOAD_SIZE 1400
 #define UDP_HEADER_SIZE 8
 #define MAX_SENDBUF_SIZE (256 * 1024 * 1024)
@@ -110,13 +120,33 @@
          + (item)->nsuffix \
          + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
 
+#ifdef EXTSTORE
+/* Header items keep the stored value's nbytes for responses, but only hold
+ * an item_hdr in memory. */
+#define ITEM_ntotal(item) (sizeof(struct _stritem) + (item)->nkey + 1 \
+         + (item)->nsuffix \
+         + (((item)->it_flags & ITEM_HDR) ? sizeof(item_hdr) : (item)->nbytes) \
+         + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
+#else
 #define ITEM_ntotal(item) (sizeof(struct _stritem) + (item)->nkey + 1 \
          + (item)->nsuffix + (item)->nbytes \
          + (((item)->it_flags & ITEM_CAS) ? sizeof(uint64_t) : 0))
+#endif
 
 #define ITEM_clsid(item) ((item)->slabs_clsid & ~(3<<6))
 #define ITEM_lruid(item) ((item)->slabs_clsid & (3<<6))
 
+/* Recover client flags from an item's suffix */
+#define FLAGS_CONV(iar, it, flag) { \
+    if ((iar)) { \
+        flag = (uint32_t) strtoul(ITEM_suffix((it)), (char **) NULL, 10); \
+    } else if ((it)->nsuffix > 0) { \
+        flag = *((uint32_t *)ITEM_suffix((it))); \
+    } else { \
+        flag = 0; \
+    } \
+}
+
 #define STAT_KEY_LEN 128
 #define STAT_VAL_LEN 128
 
@@ -167,6 +197,7 @@ enum conn_states {
     conn_mwrite,     /**< writing out many items sequentially */
     conn_closed,     /**< connection is closed */
     conn_watch,      /**< held by the logger thread as a watcher */
+    conn_proxy,      /**< waiting on proxy backends to answer */
     conn_max_state   /**< Max state value (used for assertion) */
 };
 
@@ -262,9 +293,28 @@ struct slab_stats {
     X(bytes_written) \
     X(flush_cmds) \
     X(conn_yields) /* # of yields for connections (-R option)*/ \
+    X(responses_batched) /* held back to go out with a later response */ \
     X(auth_cmds) \
     X(auth_errors) \
-    X(idle_kicks) /* idle connections killed */
+    X(idle_kicks) /* idle connections killed */ \
+    X(proxy_requests) /* requests sent to proxy backends */ \
+    X(proxy_errors) /* proxy requests a backend failed to answer */
+
+#ifdef EXTSTORE
+#define EXTSTORE_THREAD_STATS_FIELDS \
+    X(get_extstore) /* values read back from external storage */ \
+    X(get_aborted_extstore) /* lost before they could be read */ \
+    X(get_oom_extstore) /* no memory to read the value into */
+#endif
+
+#ifdef COMPRESSION
+#define COMPRESSION_THREAD_STATS_FIELDS \
+    X(compress_sets) /* values stored compressed */ \
+    X(compress_skipped) /* values which didn't shrink into a smaller class */ \
+    X(compress_bytes_saved) /* slab memory saved by compressed sets */ \
+    X(decompress_gets) /* compressed values inflated for a client */ \
+    X(decompress_errors) /* no memory to inflate into, or a bad stream */
+#endif
 
 /**
  * Stats stored per-thread.
@@ -273,6 +323,12 @@ struct thread_stats {
     pthread_mutex_t   mutex;
 #define X(name) uint64_t    name;
     THREAD_STATS_FIELDS
+#ifdef EXTSTORE
+    EXTSTORE_THREAD_STATS_FIELDS
+#endif
+#ifdef COMPRESSION
+    COMPRESSION_THREAD_STATS_FIELDS
+#endif
 #undef X
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
     uint64_t lru_hits[POWER_LARGEST];
@@ -301,6 +357,17 @@ struct stats {
     uint64_t      log_worker_written; /* logs written by worker threads */
     uint64_t      log_watcher_skipped; /* logs watchers missed */
     uint64_t      log_watcher_sent; /* logs sent to watcher buffers */
+#ifdef EXTSTORE
+    uint64_t      extstore_compact_lost; /* items lost because they were locked */
+    uint64_t      extstore_compact_rescues; /* items re-written during compaction */
+    uint64_t      extstore_compact_skipped; /* unhit items skipped during compaction */
+#endif
+#ifdef TLS
+    uint64_t      ssl_handshake_errors; /* connections closed by a failed handshake */
+    uint64_t      ssl_new_sessions; /* full handshakes completed */
+    uint64_t      ssl_session_reuses; /* handshakes resuming a cached session or ticket */
+    uint64_t      ssl_ktls_conns; /* connections whose sends the kernel encrypts */
+#endif
     struct timeval maxconns_entered;  /* last time maxconns entered */
 };
 
@@ -348,9 +415,13 @@ struct settings {
     int detail_enabled;     /* nonzero if we're collecting detailed stats */
     int reqs_per_event;     /* Maximum number of io to process on each
                                io-event. */
+    int reply_batch_size;   /* bytes of pipelined responses a connection
+                               may hold back and send together */
     bool use_cas;
     enum protocol binding_protocol;
     int backlog;
+    bool reuseport;         /* each worker accepts on its own SO_REUSEPORT
+                               listener instead of the main thread */
     int item_size_max;        /* Maximum item size */
     int slab_chunk_size_max;  /* Upper end for chunks within slab pages. */
     int slab_page_size;     /* Slab's page units. */
@@ -375,8 +446,13 @@ struct settings {
     int warm_lru_pct; /* percentage of slab space for WARM_LRU */
     double hot_max_factor; /* HOT tail age relative to COLD tail */
     double warm_max_factor; /* WARM tail age relative to COLD tail */
+    bool lru_autotune; /* move HOT/WARM split per class by ghost hits */
+    int lru_autotune_window; /* seconds of ghost hits behind each move */
     int crawls_persleep; /* Number of LRU crawls to run before sleeping */
     bool inline_ascii_response; /* pre-format the VALUE line for ASCII responses */
+    bool slab_thread_cache; /* per-worker caches of free slab chunks */
+    bool slab_compact; /* slab mover takes the emptiest sampled page */
+    unsigned int hotkeys_sample; /* hot key tracker samples 1 of N fetches */
     bool temp_lru; /* TTL < temporary_ttl uses TEMP_LRU */
     uint32_t temporary_ttl; /* temporary LRU threshold */
     int idle_timeout;       /* Number of seconds to let connections idle */
@@ -384,6 +460,37 @@ struct settings {
     unsigned int logger_buf_size; /* size of per-thread logger buffer */
     bool drop_privileges;   /* Whether or not to drop unnecessary process privileges */
     bool relaxed_privileges;   /* Relax process restrictions when running testapp */
+    char *memory_file; /* mmap'd file holding the slab arena across restarts */
+    char *proxy_backends; /* forward requests to these servers; NULL if not a proxy */
+    int proxy_timeout; /* seconds a backend may take to answer */
+    int proxy_retry; /* seconds a failed backend is left out of the ring */
+#ifdef EXTSTORE
+    unsigned int ext_item_size; /* minimum size of items to store externally */
+    unsigned int ext_item_age; /* max age of tail item before storing ext. */
+    unsigned int ext_page_size; /* size of extstore pages */
+    unsigned int ext_wbuf_size; /* read only note for the engine */
+    unsigned int ext_compact_under; /* when fewer than this many pages, compact */
+    double ext_max_frag; /* ideal maximum page fragmentation */
+#endif
+#ifdef TLS
+    bool ssl_enabled; /* TCP connections speak TLS */
+    SSL_CTX *ssl_ctx; /* shared by every connection, so tickets work across threads */
+    char *ssl_chain_cert; /* path to the server certificate chain (PEM) */
+    char *ssl_key; /* path to the server private key (PEM) */
+    char *ssl_ca_cert; /* path to CA certificates for verifying clients */
+    int ssl_verify_mode; /* 0 none, 1 request, 2 require client certificates */
+    char *ssl_ciphers; /* TLSv1.2 cipher list, NULL for the library default */
+    unsigned int ssl_session_cache; /* resumable sessions kept; 0 disables resumption */
+    unsigned int ssl_wbuf_size; /* per-thread buffer responses are encrypted from */
+    bool ssl_ktls; /* ask the kernel to encrypt sends where it can */
+#endif
+#ifdef COMPRESSION
+    int compress_min; /* values at least this large are compressed; 0 disables */
+    int compress_level; /* zlib compression level, 1 (fastest) to 9 */
+#endif
+#ifdef NUMA
+    bool numa; /* pin workers to nodes and give each node its own slab arena */
+#endif
 };
 
 extern struct stats stats;
@@ -404,6 +511,15 @@ extern struct settings settings;
 /* If an item's storage are chained chunks. */
 #define ITEM_CHUNKED 32
 #define ITEM_CHUNK 64
+/* ITEM_data bulk is external to item */
+#define ITEM_HDR 128
+/* additional 8 bits for the meta protocol */
+/* a client has been told it won the right to recache this item */
+#define ITEM_TOKEN_SENT 256
+/* item has been invalidated but may still be served as stale */
+#define ITEM_STALE 512
+/* value is deflated; see compress.h */
+#define ITEM_COMPRESSED 1024
 
 /**
  * Structure for storing items within memcached.
@@ -419,9 +535,10 @@ typedef struct _stritem {
     int             nbytes;     /* size of data */
     unsigned short  refcount;
     uint8_t         nsuffix;    /* length of flags-and-length string */
-    uint8_t         it_flags;   /* ITEM_* above */
+    uint16_t        it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
+    uint32_t        hv;         /* hash of the key, set when linked */
     /* this odd type prevents type-punning issues when we do
      * the little shuffle to save space when not using CAS. */
     union {
@@ -436,7 +553,7 @@ typedef struct _stritem {
 
 // TODO: If we eventually want user loaded modules, we can't use an enum :(
 enum crawler_run_type {
-    CRAWLER_AUTOEXPIRE=0, CRAWLER_EXPIRED, CRAWLER_METADUMP
+    CRAWLER_AUTOEXPIRE=0, CRAWLER_EXPIRED, CRAWLER_METADUMP, CRAWLER_DUMP
 };
 
 typedef struct {
@@ -448,7 +565,7 @@ typedef struct {
     int             nbytes;     /* size of data */
     unsigned short  refcount;
     uint8_t         nsuffix;    /* length of flags-and-length string */
-    uint8_t         it_flags;   /* ITEM_* above */
+    uint16_t        it_flags;   /* ITEM_* above */
     uint8_t         slabs_clsid;/* which slab class we're in */
     uint8_t         nkey;       /* key length, w/terminating null and padding */
     uint32_t        remaining;  /* Max keys to crawl per slab per invocation */
@@ -467,11 +584,21 @@ typedef struct _strchunk {
     int              nbytes;    /* used. */
     unsigned short   refcount;  /* used? */
     uint8_t          orig_clsid; /* For obj hdr chunks slabs_clsid is fake. */
-    uint8_t          it_flags;  /* ITEM_* above. */
+    uint16_t         it_flags;  /* ITEM_* above. */
     uint8_t          slabs_clsid; /* Same as above. */
     char data[];
 } item_chunk;
 
+#ifdef EXTSTORE
+/* The data of an ITEM_HDR item: where in external storage its value lives */
+typedef struct {
+    uint64_t page_version; /* from IO header */
+    unsigned int page_id; /* from IO header */
+    unsigned int offset; /* of the value within the page */
+    unsigned int ntotal; /* size of the whole object in the page */
+} item_hdr;
+#endif
+
 typedef struct {
     pthread_t thread_id;        /* unique ID of this thread */
     struct event_base *base;    /* libevent handle this thread uses */
@@ -483,12 +610,39 @@ typedef struct {
     cache_t *suffix_cache;      /* suffix cache */
     logger *l;                  /* logger buffer */
     void *lru_bump_buf;         /* async LRU bump buffer */
+#ifdef EXTSTORE
+    cache_t *io_cache;          /* IO objects */
+    void *storage;              /* data object for storage system */
+#endif
+#ifdef TLS
+    char *ssl_wbuf;             /* responses are staged here for SSL_write */
+#endif
+#ifdef COMPRESSION
+    void *compress;             /* zlib streams and scratch buffer */
+#endif
+#ifdef NUMA
+    int numa_node;              /* slab arena this thread is bound to */
+#endif
+    void *proxy;                /* backend connections, NULL unless proxying */
 } LIBEVENT_THREAD;
 
 /**
  * The structure representing a connection into memcached.
  */
 typedef struct conn conn;
+#ifdef EXTSTORE
+typedef struct _io_wrap {
+    obj_io io;
+    struct _io_wrap *next;
+    conn *c;
+    item *hdr_it;             /* original header item. */
+    item *read_it;            /* unlinked item the value is read into */
+    unsigned int iovec_start; /* start of the iovecs for this IO */
+    unsigned int iovec_count; /* total number of iovecs */
+    bool miss;                /* signal a miss to unlink hdr_it */
+    const char *miss_res;     /* replaces the response on a miss, or NULL */
+} io_wrap;
+#endif
 struct conn {
     int    sfd;
     sasl_conn_t *sasl_conn;
@@ -512,6 +666,9 @@ struct conn {
     /** which state to go into after finishing current write */
     enum conn_states  write_and_go;
     void   *write_and_free; /** free this memory after finishing writing */
+    char   *bbuf;   /** responses batched to go out ahead of a later one */
+    int    bbytes;
+    bool   batch_check; /** current response not yet considered for bbuf */
 
     char   *ritem;  /** when we read in an item's value, it goes here */
     int    rlbytes;
@@ -549,6 +706,11 @@ struct conn {
     int    suffixsize;
     char   **suffixcurr;
     int    suffixleft;
+#ifdef EXTSTORE
+    int io_wrapleft;          /* reads still outstanding */
+    bool io_queued;           /* reads handed off to the IO threads */
+    io_wrap *io_wraplist;     /* linked list of io_wraps */
+#endif
 
     enum protocol protocol;   /* which protocol this connection speaks */
     enum network_transport transport; /* what transport is used by this connection */
@@ -559,8 +721,30 @@ struct conn {
     socklen_t request_addr_size;
     unsigned char *hdrbuf; /* udp packet headers */
     int    hdrsize;   /* number of headers' worth of space is allocated */
+#ifdef HAVE_RECVMMSG
+    struct udp_batch *udp_batch; /* datagrams read ahead, NULL if not batching */
+#endif
+#ifdef TLS
+    SSL    *ssl;      /* NULL unless this connection is encrypted */
+    bool   ssl_handshaked; /* handshake finished and accounted for */
+    short  ssl_wait; /* EV_READ or EV_WRITE a blocked SSL call needs, or 0 */
+#endif
+    /* socket IO; replaced by the TLS layer for encrypted connections */
+    ssize_t (*read)(conn *c, void *buf, size_t count);
+    ssize_t (*sendmsg)(conn *c, struct msghdr *msg, int flags);
 
+    struct proxy_conn *proxy; /* forwarded command state, NULL until needed */
     bool   noreply;   /* True if the reply should not be sent. */
+    /* meta set state, kept while the value is read in */
+    bool   mset_res;  /* respond to the store in meta format */
+    bool   mset_quiet; /* only respond if the store failed */
+    bool   mset_key;  /* echo the key back */
+    char   mset_opaque[META_OPAQUE_MAX + 1]; /* echoed back if not empty */
+    /* bulk load state, while the rest of the input is a dump stream */
+    bool   loading;
+    bool   load_add;  /* only store keys which aren't there yet */
+    uint64_t load_stored;
+    uint64_t load_skipped;
     /* current stats command */
     struct {
         char *buffer;
@@ -616,7 +800,10 @@ enum delta_result_type do_add_delta(conn *c, const char *key,
                                     uint64_t *cas, const uint32_t hv);
 enum store_item_type do_store_item(item *item, int comm, conn* c, const uint32_t hv);
 conn *conn_new(const int sfd, const enum conn_states init_state, const int event_flags, const int read_buffer_size, enum network_transport transport, struct event_base *base);
+ssize_t tcp_read(conn *c, void *buf, size_t count);
+ssize_t tcp_sendmsg(conn *c, struct msghdr *msg, int flags);
 void conn_worker_readd(conn *c);
+void conn_proxy_done(conn *c);
 extern int daemonize(int nochdir, int noclose);
 
 #define mutex_lock(x) pthread_mutex_lock(x)
@@ -627,6 +814,15 @@ extern int daemonize(int nochdir, int noclose);
 #include "assoc.h"
 #include "items.h"
 #include "crawler.h"
+#include "hotkeys.h"
+#include "restart.h"
+#include "proxy.h"
+#ifdef TLS
+#include "tls.h"
+#endif
+#ifdef COMPRESSION
+#include "compress.h"
+#endif
 #include "trace.h"
 #include "hash.h"
 #include "util.h"
@@ -655,6 +851,7 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
 #define DO_UPDATE true
 #define DONT_UPDATE false
 item *item_get(const char *key, const size_t nkey, conn *c, const bool do_update);
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, conn *c, const bool do_update);
 item *item_touch(const char *key, const size_t nkey, uint32_t exptime, conn *c);
 int   item_link(item *it);
 void  item_remove(item *it);
@@ -699,3 +896,10 @@ extern void drop_worker_privileges(void);
 
 #define likely(x)       __builtin_expect((x),1)
 #define unlikely(x)     __builtin_expect((x),0)
+
+/* If supported, hint that memory is about to be read. */
+#if defined(__GNUC__)
+#define prefetch(addr)  __builtin_prefetch((addr), 0)
+#else
+#define prefetch(addr)
+#endif
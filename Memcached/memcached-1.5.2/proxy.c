@@ -0,0 +1,661 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Proxy mode: forwards ASCII requests to a pool of backend servers.
+ *
+ * Keys are mapped to backends with a consistent hash ring (PROXY_POINTS
+ * points per backend, hashed with the configured hash_algorithm), so adding
+ * or removing a backend only moves the keys next to its points. A backend
+ * that fails is left out of the ring for proxy_retry seconds and its keys
+ * fall through to the next point, as ketama clients with auto-eject do.
+ *
+ * Every worker thread has one connection to each backend, driven by the
+ * worker's own event base, so the backends see threads * proxies
+ * connections however many clients there are. Requests from all of the
+ * thread's clients are appended to the connection's write buffer and go
+ * out together the next time the socket is writable. memcached answers in
+ * order on a connection, so responses are matched to requests with a FIFO.
+ * A client connection is parked while its requests are out; once the last
+ * one is answered (or failed) conn_proxy_done() hands it back to the state
+ * machine.
+ */
+#include "memcached.h"
+#include "proxy.h"
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROXY_POINTS 160
+/* A response line longer than this can't be anything we asked for. */
+#define PROXY_LINE_MAX 2048
+#define PROXY_BUF_INIT 4096
+/* Buffers grown past this are freed once they're drained. */
+#define PROXY_BUF_KEEP (256 * 1024)
+
+typedef struct {
+    char *name;                     /* host:port as configured */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    volatile rel_time_t dead_until; /* out of the ring until then */
+} proxy_backend;
+
+typedef struct {
+    uint32_t point;
+    int backend;
+} proxy_point;
+
+static proxy_backend *backends = NULL;
+static int backend_count = 0;
+static proxy_point *ring = NULL;
+static int ring_size = 0;
+
+typedef struct _proxy_req {
+    struct _proxy_req *next;
+    conn *c;
+    enum proxy_resp_type type;
+    struct timeval sent;    /* when it was queued, for proxy_timeout */
+} proxy_req;
+
+struct proxy_thread;
+
+typedef struct {
+    int fd;                 /* -1 while not connected */
+    int backend;
+    bool connecting;
+    struct event event;
+    short ev_flags;
+    struct proxy_thread *pt;
+    proxy_buf wbuf;         /* requests to write */
+    int wsent;              /* bytes of wbuf already written */
+    proxy_buf rbuf;         /* responses read but not parsed */
+    int rneed;              /* rbuf must grow to hold a whole value */
+    proxy_req *head;        /* sent, waiting on a response; oldest first */
+    proxy_req *tail;
+} proxy_bconn;
+
+typedef struct proxy_thread {
+    LIBEVENT_THREAD *t;
+    proxy_bconn *conns;     /* one per backend */
+    proxy_req *free_reqs;
+} proxy_thread;
+
+/* Makes room for len more bytes. */
+int proxy_buf_grow(proxy_buf *b, const int len) {
+    if (b->len + len > b->size) {
+        int size = b->size ? b->size : PROXY_BUF_INIT;
+        char *buf;
+        while (size < b->len + len)
+            size *= 2;
+        buf = realloc(b->buf, size);
+        if (buf == NULL)
+            return -1;
+        b->buf = buf;
+        b->size = size;
+    }
+    return 0;
+}
+
+int proxy_buf_add(proxy_buf *b, const void *data, const int len) {
+    if (proxy_buf_grow(b, len) != 0)
+        return -1;
+    memcpy(b->buf + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+static void proxy_buf_drained(proxy_buf *b) {
+    b->len = 0;
+    if (b->size > PROXY_BUF_KEEP) {
+        free(b->buf);
+        b->buf = NULL;
+        b->size = 0;
+    }
+}
+
+static int point_cmp(const void *a, const void *b) {
+    const proxy_point *pa = a;
+    const proxy_point *pb = b;
+    return pa->point < pb->point ? -1 : pa->point > pb->point;
+}
+
+/* Parses "host:port", "[v6addr]:port" or "host" (port 11211). */
+static int backend_resolve(proxy_backend *be, const char *spec) {
+    struct addrinfo hints, *ai;
+    char host[256];
+    const char *port = "11211";
+    const char *sep;
+    size_t hlen;
+    int error;
+
+    if (spec[0] == '[') {
+        const char *end = strchr(spec, ']');
+        if (end == NULL)
+            return -1;
+        hlen = end - spec - 1;
+        spec++;
+        sep = end[1] == ':' ? end + 1 : NULL;
+    } else {
+        sep = strrchr(spec, ':');
+        hlen = sep ? (size_t)(sep - spec) : strlen(spec);
+    }
+    if (hlen == 0 || hlen >= sizeof(host))
+        return -1;
+    memcpy(host, spec, hlen);
+    host[hlen] = '\0';
+    if (sep != NULL)
+        port = sep + 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    error = getaddrinfo(host, port, &hints, &ai);
+    if (error != 0) {
+        fprintf(stderr, "proxy backend %s: %s\n", spec, gai_strerror(error));
+        return -1;
+    }
+    memcpy(&be->addr, ai->ai_addr, ai->ai_addrlen);
+    be->addrlen = ai->ai_addrlen;
+    freeaddrinfo(ai);
+    return 0;
+}
+
+/* backends is a comma separated list of host:port. */
+int proxy_init(const char *spec) {
+    char *list, *tok, *save;
+    int i, b;
+
+    list = strdup(spec);
+    if (list == NULL)
+        return -1;
+    for (tok = strtok_r(list, ",", &save); tok != NULL;
+            tok = strtok_r(NULL, ",", &save)) {
+        proxy_backend *be = realloc(backends,
+                sizeof(proxy_backend) * (backend_count + 1));
+        if (be == NULL) {
+            free(list);
+            return -1;
+        }
+        backends = be;
+        be = &backends[backend_count];
+        memset(be, 0, sizeof(*be));
+        if (backend_resolve(be, tok) != 0) {
+            fprintf(stderr, "Bad proxy backend: %s\n", tok);
+            free(list);
+            return -1;
+        }
+        be->name = strdup(tok);
+        if (be->name == NULL) {
+            free(list);
+            return -1;
+        }
+        backend_count++;
+    }
+    free(list);
+    if (backend_count == 0) {
+        fprintf(stderr, "No proxy backends given\n");
+        return -1;
+    }
+
+    ring = calloc(backend_count * PROXY_POINTS, sizeof(proxy_point));
+    if (ring == NULL)
+        return -1;
+    for (b = 0; b < backend_count; b++) {
+        for (i = 0; i < PROXY_POINTS; i++) {
+            char buf[300];
+            int len = snprintf(buf, sizeof(buf), "%s-%d", backends[b].name, i);
+            ring[ring_size].point = hash(buf, len);
+            ring[ring_size].backend = b;
+            ring_size++;
+        }
+    }
+    qsort(ring, ring_size, sizeof(proxy_point), point_cmp);
+    return 0;
+}
+
+void *proxy_thread_init(LIBEVENT_THREAD *t) {
+    proxy_thread *pt = calloc(1, sizeof(proxy_thread));
+    int b;
+
+    if (pt == NULL)
+        return NULL;
+    pt->t = t;
+    pt->conns = calloc(backend_count, sizeof(proxy_bconn));
+    if (pt->conns == NULL) {
+        free(pt);
+        return NULL;
+    }
+    for (b = 0; b < backend_count; b++) {
+        pt->conns[b].fd = -1;
+        pt->conns[b].backend = b;
+        pt->conns[b].pt = pt;
+    }
+    return pt;
+}
+
+int proxy_backend_count(void) {
+    return backend_count;
+}
+
+bool proxy_backend_alive(const int backend) {
+    return backends[backend].dead_until <= current_time;
+}
+
+static void backend_dead(const int backend) {
+    /* Racy, but every thread writing it would write about the same value. */
+    backends[backend].dead_until = current_time + settings.proxy_retry;
+}
+
+/* Returns the live backend for a key, or -1 if every backend is down. */
+int proxy_route(const char *key, const size_t nkey) {
+    uint32_t hv = hash(key, nkey);
+    int lo = 0, hi = ring_size;
+    int i;
+
+    /* first point at or after the key's hash, wrapping around */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ring[mid].point < hv) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (i = 0; i < ring_size; i++) {
+        int b = ring[(lo + i) % ring_size].backend;
+        if (proxy_backend_alive(b))
+            return b;
+    }
+    return -1;
+}
+
+proxy_conn *proxy_conn_new(void) {
+    proxy_conn *pc = calloc(1, sizeof(proxy_conn));
+    if (pc == NULL)
+        return NULL;
+    pc->reqs = calloc(backend_count, sizeof(proxy_buf));
+    if (pc->reqs == NULL) {
+        free(pc);
+        return NULL;
+    }
+    return pc;
+}
+
+/* Ready for the next command, dropping any oversized buffers. */
+void proxy_conn_reset(proxy_conn *pc) {
+    int b;
+    assert(pc->pending == 0);
+    pc->errors = 0;
+    proxy_buf_drained(&pc->resp);
+    proxy_buf_drained(&pc->val);
+    for (b = 0; b < backend_count; b++) {
+        proxy_buf_drained(&pc->reqs[b]);
+    }
+}
+
+void proxy_conn_free(proxy_conn *pc) {
+    int b;
+    if (pc == NULL)
+        return;
+    free(pc->resp.buf);
+    free(pc->val.buf);
+    for (b = 0; b < backend_count; b++) {
+        free(pc->reqs[b].buf);
+    }
+    free(pc->reqs);
+    free(pc);
+}
+
+static void req_done(conn *c, const bool failed) {
+    proxy_conn *pc = c->proxy;
+    if (failed) {
+        pc->errors++;
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.proxy_errors++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+    if (--pc->pending == 0)
+        conn_proxy_done(c);
+}
+
+static void bconn_handler(const int fd, const short which, void *arg);
+
+/* Time left before the oldest request waiting on bc is overdue, if any. The
+ * timeout runs from when that request was queued, so a backend that hangs
+ * is given up on even while new requests keep coming in. */
+static bool bconn_time_left(proxy_bconn *bc, struct timeval *left) {
+    struct timeval now;
+
+    if (bc->head == NULL || settings.proxy_timeout <= 0)
+        return false;
+    gettimeofday(&now, NULL);
+    left->tv_sec = bc->head->sent.tv_sec + settings.proxy_timeout - now.tv_sec;
+    left->tv_usec = bc->head->sent.tv_usec - now.tv_usec;
+    if (left->tv_usec < 0) {
+        left->tv_sec--;
+        left->tv_usec += 1000000;
+    }
+    if (left->tv_sec < 0)
+        left->tv_sec = left->tv_usec = 0;
+    return true;
+}
+
+static void bconn_update(proxy_bconn *bc) {
+    struct timeval tv;
+    short flags = EV_READ | EV_PERSIST;
+
+    if (bc->connecting || bc->wsent < bc->wbuf.len)
+        flags |= EV_WRITE;
+    if (flags != bc->ev_flags) {
+        if (bc->ev_flags != 0)
+            event_del(&bc->event);
+        event_set(&bc->event, bc->fd, flags, bconn_handler, bc);
+        event_base_set(bc->pt->t->base, &bc->event);
+        bc->ev_flags = flags;
+    }
+    /* Re-adding replaces the timeout with one for the current oldest
+     * request; an idle connection's leftover timeout is ignored by the
+     * handler. */
+    if (event_add(&bc->event, bconn_time_left(bc, &tv) ? &tv : NULL) == -1) {
+        perror("event_add");
+    }
+}
+
+static int bconn_connect(proxy_bconn *bc) {
+    proxy_backend *be = &backends[bc->backend];
+    int flags = 1;
+    int fd;
+
+    fd = socket(be->addr.ss_family, SOCK_STREAM, 0);
+    if (fd == -1)
+        return -1;
+    if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+    if (connect(fd, (struct sockaddr *)&be->addr, be->addrlen) == 0) {
+        bc->connecting = false;
+    } else if (errno == EINPROGRESS) {
+        bc->connecting = true;
+    } else {
+        if (settings.verbose > 0)
+            fprintf(stderr, "proxy backend %s: %s\n", be->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    bc->fd = fd;
+    bc->ev_flags = 0;
+    return 0;
+}
+
+/* Drops the connection and fails everything that was waiting on it. */
+static void bconn_fail(proxy_bconn *bc, const char *why) {
+    proxy_req *r, *next;
+
+    if (settings.verbose > 0)
+        fprintf(stderr, "proxy backend %s: %s\n",
+                backends[bc->backend].name, why);
+    if (bc->ev_flags != 0)
+        event_del(&bc->event);
+    close(bc->fd);
+    bc->fd = -1;
+    bc->ev_flags = 0;
+    bc->connecting = false;
+    bc->wsent = 0;
+    bc->rneed = 0;
+    proxy_buf_drained(&bc->wbuf);
+    proxy_buf_drained(&bc->rbuf);
+    backend_dead(bc->backend);
+
+    /* Detach the list first: finishing a client can send it new requests. */
+    r = bc->head;
+    bc->head = bc->tail = NULL;
+    while (r != NULL) {
+        conn *c = r->c;
+        next = r->next;
+        r->next = bc->pt->free_reqs;
+        bc->pt->free_reqs = r;
+        req_done(c, true);
+        r = next;
+    }
+}
+
+static void bconn_pop(proxy_bconn *bc, const bool failed) {
+    proxy_req *r = bc->head;
+    conn *c = r->c;
+
+    bc->head = r->next;
+    if (bc->head == NULL)
+        bc->tail = NULL;
+    r->next = bc->pt->free_reqs;
+    bc->pt->free_reqs = r;
+    req_done(c, failed);
+}
+
+/* Length of the value announced by "VALUE <key> <flags> <bytes>[ <cas>]",
+ * or -1. */
+static int value_len(const char *line, const int llen) {
+    const char *p = line + 6;
+    const char *end = line + llen;
+    unsigned long len;
+    char *e;
+    int field;
+
+    for (field = 0; field < 2; field++) {
+        while (p < end && *p != ' ')
+            p++;
+        if (p == end)
+            return -1;
+        p++;
+    }
+    len = strtoul(p, &e, 10);
+    if (e == p || (*e != ' ' && *e != '\r') || len > INT_MAX - 2)
+        return -1;
+    return len;
+}
+
+static bool error_line(const char *line, const int llen) {
+    return (llen >= 7 && strncmp(line, "ERROR\r\n", 7) == 0)
+        || (llen >= 13 && strncmp(line, "CLIENT_ERROR ", 13) == 0)
+        || (llen >= 13 && strncmp(line, "SERVER_ERROR ", 13) == 0);
+}
+
+/* Matches complete responses to the requests waiting on them. Returns -1 if
+ * the backend sent something we can't make sense of. */
+static int bconn_parse(proxy_bconn *bc) {
+    int pos = 0;
+
+    bc->rneed = 0;
+    while (bc->head != NULL) {
+        char *line = bc->rbuf.buf + pos;
+        int avail = bc->rbuf.len - pos;
+        char *el = memchr(line, '\n', avail);
+        proxy_req *r = bc->head;
+        proxy_conn *pc = r->c->proxy;
+        int llen;
+
+        if (el == NULL) {
+            if (avail > PROXY_LINE_MAX)
+                return -1;
+            break;
+        }
+        llen = el - line + 1;
+
+        if (r->type == PROXY_RESP_LINE) {
+            bool failed = proxy_buf_add(&pc->resp, line, llen) != 0;
+            pos += llen;
+            bconn_pop(bc, failed);
+        } else if (llen > 6 && strncmp(line, "VALUE ", 6) == 0) {
+            /* Only whole values are copied out, so responses from several
+             * backends to one multiget don't interleave. */
+            int vlen = value_len(line, llen);
+            int need;
+            if (vlen < 0)
+                return -1;
+            need = llen + vlen + 2;
+            if (avail < need) {
+                bc->rneed = need;
+                break;
+            }
+            if (memcmp(line + need - 2, "\r\n", 2) != 0)
+                return -1;
+            if (proxy_buf_add(&pc->resp, line, need) != 0)
+                pc->errors++;
+            pos += need;
+        } else if (llen == 5 && strncmp(line, "END\r\n", 5) == 0) {
+            pos += llen;
+            bconn_pop(bc, false);
+        } else if (error_line(line, llen)) {
+            pos += llen;
+            bconn_pop(bc, true);
+        } else {
+            return -1;
+        }
+    }
+
+    if (pos < bc->rbuf.len) {
+        if (bc->head == NULL)
+            return -1; /* nobody asked for this */
+        memmove(bc->rbuf.buf, bc->rbuf.buf + pos, bc->rbuf.len - pos);
+        bc->rbuf.len -= pos;
+    } else {
+        proxy_buf_drained(&bc->rbuf);
+    }
+    return 0;
+}
+
+static int bconn_read(proxy_bconn *bc) {
+    proxy_buf *b = &bc->rbuf;
+    int want = bc->rneed > b->len + PROXY_BUF_INIT
+        ? bc->rneed - b->len : PROXY_BUF_INIT;
+    ssize_t res;
+
+    if (b->size - b->len < want) {
+        char *buf = realloc(b->buf, b->len + want);
+        if (buf == NULL)
+            return -1;
+        b->buf = buf;
+        b->size = b->len + want;
+    }
+    res = read(bc->fd, b->buf + b->len, b->size - b->len);
+    if (res == 0)
+        return -1;
+    if (res < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    b->len += res;
+    return bconn_parse(bc);
+}
+
+static int bconn_write(proxy_bconn *bc) {
+    while (bc->wsent < bc->wbuf.len) {
+        ssize_t res = write(bc->fd, bc->wbuf.buf + bc->wsent,
+                bc->wbuf.len - bc->wsent);
+        if (res > 0) {
+            bc->wsent += res;
+        } else if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        } else {
+            return -1;
+        }
+    }
+    bc->wsent = 0;
+    proxy_buf_drained(&bc->wbuf);
+    return 0;
+}
+
+static void bconn_handler(const int fd, const short which, void *arg) {
+    proxy_bconn *bc = arg;
+
+    if (which & EV_TIMEOUT) {
+        struct timeval left;
+        if (bconn_time_left(bc, &left) && left.tv_sec == 0
+                && left.tv_usec == 0) {
+            bconn_fail(bc, "timed out");
+            return;
+        }
+    }
+    if (bc->connecting && (which & EV_WRITE)) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) != 0 || err != 0) {
+            bconn_fail(bc, err ? strerror(err) : "connect failed");
+            return;
+        }
+        bc->connecting = false;
+    }
+    if (!bc->connecting && (which & EV_WRITE) && bconn_write(bc) != 0) {
+        bconn_fail(bc, "write failed");
+        return;
+    }
+    if ((which & EV_READ) && bconn_read(bc) != 0) {
+        bconn_fail(bc, "read failed or bad response");
+        return;
+    }
+    bconn_update(bc);
+}
+
+/* Queues a request for c on a backend; it is written out with whatever else
+ * is queued when the socket is next writable. Returns -1 if the backend is
+ * unreachable, otherwise the answer arrives by conn_proxy_done(). */
+int proxy_send(conn *c, const int backend, const char *req, const int len,
+        const enum proxy_resp_type type) {
+    proxy_thread *pt = c->thread->proxy;
+    proxy_bconn *bc = &pt->conns[backend];
+    proxy_req *r;
+
+    if (bc->fd == -1 && bconn_connect(bc) != 0) {
+        backend_dead(backend);
+        return -1;
+    }
+    if (pt->free_reqs != NULL) {
+        r = pt->free_reqs;
+        pt->free_reqs = r->next;
+    } else if ((r = malloc(sizeof(proxy_req))) == NULL) {
+        return -1;
+    }
+    if (proxy_buf_add(&bc->wbuf, req, len) != 0) {
+        r->next = pt->free_reqs;
+        pt->free_reqs = r;
+        return -1;
+    }
+    r->c = c;
+    r->type = type;
+    r->next = NULL;
+    gettimeofday(&r->sent, NULL);
+    if (bc->tail) {
+        bc->tail->next = r;
+    } else {
+        bc->head = r;
+    }
+    bc->tail = r;
+    c->proxy->pending++;
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.proxy_requests++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+
+    bconn_update(bc);
+    return 0;
+}
+
+void proxy_stats(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+    int b;
+
+    APPEND_STAT("backends", "%d", backend_count);
+    for (b = 0; b < backend_count; b++) {
+        APPEND_NUM_FMT_STAT("backend:%d:%s", b, "address", "%s",
+                backends[b].name);
+        APPEND_NUM_FMT_STAT("backend:%d:%s", b, "alive", "%s",
+                proxy_backend_alive(b) ? "yes" : "no");
+    }
+    add_stats(NULL, 0, NULL, 0, c);
+}
@@ -0,0 +1,45 @@
+#ifndef PROXY_H
+#define PROXY_H
+
+/* Proxy mode (-x): ASCII requests are forwarded to a pool of backend
+ * memcached servers picked by consistent hashing of the key. Each worker
+ * thread keeps one connection per backend on its own event base. */
+
+enum proxy_resp_type {
+    PROXY_RESP_LINE,    /* one line: STORED, DELETED, a number... */
+    PROXY_RESP_VALUES   /* VALUE blocks up to an END */
+};
+
+typedef struct {
+    char *buf;
+    int len;
+    int size;
+} proxy_buf;
+
+/* Proxy state of a client connection. Only one command is forwarded at a
+ * time; the connection is parked in conn_proxy until every backend it was
+ * sent to has answered or failed, then conn_proxy_done() is called. */
+typedef struct proxy_conn {
+    int pending;        /* requests still waiting on a backend */
+    int errors;         /* requests a backend failed to answer */
+    int cmd;            /* what the responses are for, see memcached.c */
+    proxy_buf resp;     /* responses collected so far */
+    proxy_buf val;      /* storage command being read in, line and value */
+    proxy_buf *reqs;    /* a multiget being split up, one per backend */
+} proxy_conn;
+
+int proxy_init(const char *backends);
+void *proxy_thread_init(LIBEVENT_THREAD *t);
+int proxy_backend_count(void);
+bool proxy_backend_alive(const int backend);
+int proxy_route(const char *key, const size_t nkey);
+int proxy_send(conn *c, const int backend, const char *req, const int len,
+        const enum proxy_resp_type type);
+proxy_conn *proxy_conn_new(void);
+void proxy_conn_reset(proxy_conn *pc);
+void proxy_conn_free(proxy_conn *pc);
+int proxy_buf_grow(proxy_buf *b, const int len);
+int proxy_buf_add(proxy_buf *b, const void *data, const int len);
+void proxy_stats(ADD_STAT add_stats, void *c);
+
+#endif
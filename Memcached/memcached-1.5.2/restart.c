@@ -0,0 +1,273 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Warm restarts. With -e the slab arena is a shared mapping of a file rather
+ * than malloc'd memory, so its contents outlive the process. A graceful
+ * shutdown (SIGUSR1) pauses every thread and writes a small text file next to
+ * it recording which class owns each page, the clock and the CAS counter.
+ * The next start with the same settings maps the file again and rebuilds the
+ * hash table and LRUs by scanning the pages. If anything doesn't line up the
+ * cache simply starts cold.
+ */
+#include "memcached.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PAGE_UNMAPPED 0xff
+
+static void *mem_base = NULL;
+static uint32_t meta_sizes[MAX_NUMBER_OF_SLAB_CLASSES];
+static uint8_t *meta_map = NULL; /* owning class of each page, while restoring */
+static unsigned int meta_pages = 0;
+
+static char *meta_path(const char *suffix) {
+    size_t len = strlen(settings.memory_file) + strlen(".meta") + strlen(suffix) + 1;
+    char *path = malloc(len);
+    if (path == NULL) {
+        fprintf(stderr, "Failed to allocate memory file path\n");
+        exit(EXIT_FAILURE);
+    }
+    snprintf(path, len, "%s.meta%s", settings.memory_file, suffix);
+    return path;
+}
+
+/* Reads the metadata of the last graceful shutdown. Nothing is applied unless
+ * the whole file is there and was written by a server laid out like this one. */
+static bool restart_meta_load(void) {
+    char *path = meta_path("");
+    FILE *f = fopen(path, "r");
+    unsigned int max_pages = settings.maxbytes / settings.slab_page_size;
+    unsigned long long started = 0, oldest_live = 0, oldest_cas = 0, cas = 0;
+    unsigned long long hashpower_saved = 0;
+    char line[256];
+    bool done = false;
+    bool ok = true;
+    unsigned int x;
+
+    free(path);
+    if (f == NULL)
+        return false;
+
+    meta_map = malloc(max_pages);
+    if (meta_map == NULL) {
+        fclose(f);
+        return false;
+    }
+    memset(meta_map, PAGE_UNMAPPED, max_pages);
+    memset(meta_sizes, 0, sizeof(meta_sizes));
+
+    while (ok && !done && fgets(line, sizeof(line), f) != NULL) {
+        char key[64], val[64];
+        unsigned long long arg = 0;
+        uint64_t num;
+        if (sscanf(line, "%63s %63s %llu", key, val, &arg) < 2) {
+            ok = (sscanf(line, "%63s", key) == 1 && strcmp(key, "end") == 0);
+            done = ok;
+            continue;
+        }
+        if (strcmp(key, "version") == 0) {
+            ok = (strcmp(val, VERSION) == 0);
+            continue;
+        }
+        if (!safe_strtoull(val, &num)) {
+            ok = false;
+        } else if (strcmp(key, "item_header") == 0) {
+            ok = (num == sizeof(item));
+        } else if (strcmp(key, "maxbytes") == 0) {
+            ok = (num == settings.maxbytes);
+        } else if (strcmp(key, "page_size") == 0) {
+            ok = (num == settings.slab_page_size);
+        } else if (strcmp(key, "chunk_max") == 0) {
+            ok = (num == settings.slab_chunk_size_max);
+        } else if (strcmp(key, "item_size_max") == 0) {
+            ok = (num == settings.item_size_max);
+        } else if (strcmp(key, "use_cas") == 0) {
+            ok = (num == settings.use_cas);
+        } else if (strcmp(key, "inline_ascii_response") == 0) {
+            ok = (num == settings.inline_ascii_response);
+        } else if (strcmp(key, "process_started") == 0) {
+            started = num;
+        } else if (strcmp(key, "oldest_live") == 0) {
+            oldest_live = num;
+        } else if (strcmp(key, "oldest_cas") == 0) {
+            oldest_cas = num;
+        } else if (strcmp(key, "cas") == 0) {
+            cas = num;
+        } else if (strcmp(key, "hashpower") == 0) {
+            hashpower_saved = num;
+        } else if (strcmp(key, "class") == 0) {
+            ok = (num < MAX_NUMBER_OF_SLAB_CLASSES);
+            if (ok)
+                meta_sizes[num] = arg;
+        } else if (strcmp(key, "pages") == 0) {
+            ok = (num <= max_pages);
+            meta_pages = num;
+        } else if (strcmp(key, "page") == 0) {
+            ok = (num < meta_pages && meta_map[num] == PAGE_UNMAPPED
+                    && arg < MAX_NUMBER_OF_SLAB_CLASSES);
+            if (ok)
+                meta_map[num] = arg;
+        } else {
+            ok = false;
+        }
+    }
+    fclose(f);
+
+    for (x = 0; ok && x < meta_pages; x++) {
+        ok = (meta_map[x] != PAGE_UNMAPPED);
+    }
+    if (!ok || !done || started == 0 || hashpower_saved > HASHPOWER_MAX) {
+        free(meta_map);
+        meta_map = NULL;
+        return false;
+    }
+
+    /* Items keep their times relative to the old start, so keep it. */
+    process_started = started;
+    current_time = (rel_time_t)(time(0) - process_started);
+    settings.oldest_live = oldest_live;
+    settings.oldest_cas = oldest_cas;
+    set_cas_id(cas);
+    /* Sized up front; the expansion thread isn't running while we insert. */
+    if (settings.hashpower_init < hashpower_saved)
+        settings.hashpower_init = hashpower_saved;
+    return true;
+}
+
+/* Maps the memory file as the slab arena. Sets *reuse if its pages can be
+ * restored by restart_rebuild() once the slab classes are set up. */
+void *restart_mmap(bool *reuse) {
+    struct stat st;
+    char *path;
+    int fd;
+
+    *reuse = false;
+    fd = open(settings.memory_file, O_RDWR|O_CREAT, 0600);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open memory file %s: %s\n",
+                settings.memory_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    if ((size_t)st.st_size == settings.maxbytes) {
+        *reuse = restart_meta_load();
+    } else if (ftruncate(fd, settings.maxbytes) != 0) {
+        fprintf(stderr, "Failed to size memory file %s: %s\n",
+                settings.memory_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+
+    mem_base = mmap(NULL, settings.maxbytes, PROT_READ|PROT_WRITE, MAP_SHARED,
+            fd, 0);
+    if (mem_base == MAP_FAILED) {
+        fprintf(stderr, "Failed to mmap memory file %s: %s\n",
+                settings.memory_file, strerror(errno));
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    /* From here on the pages stop matching it; a crash must start cold. */
+    path = meta_path("");
+    unlink(path);
+    free(path);
+
+    if (settings.verbose > 0) {
+        fprintf(stderr, "Memory file %s: %s start\n", settings.memory_file,
+                *reuse ? "warm" : "cold");
+    }
+    return mem_base;
+}
+
+void restart_rebuild(void) {
+    uint64_t restored = 0;
+
+    if (meta_map == NULL)
+        return;
+    if (slabs_restore(meta_sizes, meta_map, meta_pages, &restored)) {
+        if (settings.verbose > 0) {
+            fprintf(stderr, "Restored %llu items from %u pages\n",
+                    (unsigned long long)restored, meta_pages);
+        }
+    } else {
+        fprintf(stderr, "Slab classes changed since the memory file was saved;"
+                " starting cold\n");
+    }
+    free(meta_map);
+    meta_map = NULL;
+}
+
+/* Called with every other thread paused. The arena is flushed first and the
+ * metadata renamed into place last, so a crash halfway leaves a cold start. */
+void restart_save(void) {
+    unsigned int max_pages = settings.maxbytes / settings.slab_page_size;
+    char *tmp_path = meta_path(".tmp");
+    char *path = meta_path("");
+    unsigned int npages, x;
+    uint8_t *map;
+    FILE *f;
+    int id;
+
+    map = malloc(max_pages);
+    if (map == NULL) {
+        fprintf(stderr, "Failed to allocate page map; not saving memory file\n");
+        goto out;
+    }
+    memset(map, PAGE_UNMAPPED, max_pages);
+    npages = slabs_page_map(map, max_pages);
+
+    if (msync(mem_base, settings.maxbytes, MS_SYNC) != 0) {
+        fprintf(stderr, "Failed to sync memory file %s: %s\n",
+                settings.memory_file, strerror(errno));
+        goto out;
+    }
+
+    f = fopen(tmp_path, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to write %s: %s\n", tmp_path, strerror(errno));
+        goto out;
+    }
+    fprintf(f, "version %s\n", VERSION);
+    fprintf(f, "item_header %lu\n", (unsigned long)sizeof(item));
+    fprintf(f, "maxbytes %llu\n", (unsigned long long)settings.maxbytes);
+    fprintf(f, "page_size %d\n", settings.slab_page_size);
+    fprintf(f, "chunk_max %d\n", settings.slab_chunk_size_max);
+    fprintf(f, "item_size_max %d\n", settings.item_size_max);
+    fprintf(f, "use_cas %d\n", settings.use_cas ? 1 : 0);
+    fprintf(f, "inline_ascii_response %d\n", settings.inline_ascii_response ? 1 : 0);
+    fprintf(f, "process_started %llu\n", (unsigned long long)process_started);
+    fprintf(f, "oldest_live %u\n", settings.oldest_live);
+    fprintf(f, "oldest_cas %llu\n", (unsigned long long)settings.oldest_cas);
+    fprintf(f, "cas %llu\n", (unsigned long long)get_cas_id());
+    fprintf(f, "hashpower %u\n", stats_state.hash_power_level);
+    for (id = POWER_SMALLEST; id < MAX_NUMBER_OF_SLAB_CLASSES; id++) {
+        if (slabs_size(id) == 0)
+            break;
+        fprintf(f, "class %d %u\n", id, slabs_size(id));
+    }
+    fprintf(f, "pages %u\n", npages);
+    for (x = 0; x < npages; x++) {
+        if (map[x] != PAGE_UNMAPPED)
+            fprintf(f, "page %u %u\n", x, map[x]);
+    }
+    fprintf(f, "end\n");
+
+    if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+        fprintf(stderr, "Failed to write %s: %s\n", tmp_path, strerror(errno));
+        fclose(f);
+        unlink(tmp_path);
+        goto out;
+    }
+    fclose(f);
+    if (rename(tmp_path, path) != 0) {
+        fprintf(stderr, "Failed to rename %s: %s\n", tmp_path, strerror(errno));
+        unlink(tmp_path);
+    }
+out:
+    free(map);
+    free(tmp_path);
+    free(path);
+}
@@ -0,0 +1,10 @@
+#ifndef RESTART_H
+#define RESTART_H
+
+/* Warm restarts from a file-backed slab arena (-e). */
+
+void *restart_mmap(bool *reuse);
+void restart_rebuild(void);
+void restart_save(void);
+
+#endif
@@ -20,6 +20,12 @@
 #include <signal.h>
 #include <assert.h>
 #include <pthread.h>
+#ifdef NUMA
+#include <numa.h>
+#define MAX_NUMA_NODES 8
+#else
+#define MAX_NUMA_NODES 1
+#endif
 
 //#define DEBUG_SLAB_MOVER
 /* powers-of-N allocation structures */
@@ -28,8 +34,8 @@ typedef struct {
     unsigned int size;      /* sizes of items */
     unsigned int perslab;   /* how many items per slab */
 
-    void *slots;           /* list of item ptrs */
-    unsigned int sl_curr;   /* total free items in list */
+    void *slots[MAX_NUMA_NODES]; /* list of item ptrs, by node of their page */
+    unsigned int sl_curr;   /* total free items in lists */
 
     unsigned int slabs;     /* how many slabs were allocated for this class */
 
@@ -50,6 +56,25 @@ static int power_largest;
 static void *mem_base = NULL;
 static void *mem_current = NULL;
 static size_t mem_avail = 0;
+/* Preallocation waits for slabs_restore() when the arena may be reused. */
+static bool mem_prealloc_deferred = false;
+
+#ifdef NUMA
+/* With -o numa every node gets an arena of its own, reserved up front so the
+ * node a chunk lives on can be told from its address. */
+typedef struct {
+    int node;              /* node id as the kernel knows it */
+    char *base;
+    char *current;
+    size_t size;
+    size_t avail;
+} numa_arena;
+
+static numa_arena numa_arenas[MAX_NUMA_NODES];
+/* Arena index of the calling thread; unset (0) for non-worker threads. */
+static pthread_key_t slab_node_key;
+#endif
+static int numa_nodes = 0; /* arenas in use; 0 unless -o numa */
 
 /**
  * Access to the slab allocator is protected by this lock
@@ -57,6 +82,32 @@ static size_t mem_avail = 0;
 static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t slabs_rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/* Per-thread caches of free chunks, traded with the global freelists in
+ * batches so most allocations and frees don't touch slabs_lock.
+ * Lock order is slab_caches_lock -> slab_cache.lock -> slabs_lock.
+ */
+#define SLAB_CACHE_MAX 32   /* drain once a class holds more than this */
+/* ...or more than this many bytes. Classes too large to cache two chunks
+ * skip the cache; a thread holds at most this much per class. */
+#define SLAB_CACHE_BYTES (64 * 1024)
+
+typedef struct {
+    void *slots;           /* free chunks, linked through it->next */
+    unsigned int count;
+    int64_t requested;     /* requested bytes not yet folded into the class */
+    uint64_t total_bytes;  /* class's requested bytes as of the last fold */
+} slab_cache_class;
+
+typedef struct _slab_cache {
+    pthread_mutex_t lock;  /* only contended while the slab mover drains */
+    struct _slab_cache *next;
+    slab_cache_class classes[MAX_NUMBER_OF_SLAB_CLASSES];
+} slab_cache;
+
+static pthread_key_t slab_cache_key;
+static slab_cache *slab_caches = NULL;
+static pthread_mutex_t slab_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+
 /*
  * Forward Declarations
  */
@@ -91,17 +142,131 @@ unsigned int slabs_clsid(const size_t size) {
     return res;
 }
 
+unsigned int slabs_size(const int clsid) {
+    return slabclass[clsid].size;
+}
+
+/* Arena index of the page a chunk was carved from. */
+static inline int slabs_page_node(const void *ptr) {
+#ifdef NUMA
+    int n;
+    for (n = 1; n < numa_nodes; n++) {
+        if ((char *)ptr >= numa_arenas[n].base
+                && (char *)ptr < numa_arenas[n].base + numa_arenas[n].size)
+            return n;
+    }
+#endif
+    return 0;
+}
+
+/* Arena index the calling thread allocates from first. */
+static inline int slab_thread_node(void) {
+#ifdef NUMA
+    if (numa_nodes > 1)
+        return (int)(intptr_t)pthread_getspecific(slab_node_key);
+#endif
+    return 0;
+}
+
+#ifdef NUMA
+/* Reserves an arena on every node which has both memory and CPUs. Pages are
+ * only faulted in as slabs get carved out of them, unless preallocating. */
+static void slabs_numa_init(const size_t limit, const bool prealloc) {
+    struct bitmask *cpus;
+    int id, n;
+
+    if (numa_available() < 0) {
+        fprintf(stderr, "NUMA is not available on this system\n");
+        exit(EXIT_FAILURE);
+    }
+    cpus = numa_allocate_cpumask();
+    for (id = 0; id <= numa_max_node() && numa_nodes < MAX_NUMA_NODES; id++) {
+        if (!numa_bitmask_isbitset(numa_all_nodes_ptr, id)
+                || numa_node_to_cpus(id, cpus) != 0
+                || numa_bitmask_weight(cpus) == 0)
+            continue;
+        numa_arenas[numa_nodes++].node = id;
+    }
+    numa_free_cpumask(cpus);
+    if (numa_nodes == 0) {
+        fprintf(stderr, "No NUMA nodes with both memory and CPUs found\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Prefer the node, but spill over rather than fail if it runs short. */
+    numa_set_bind_policy(0);
+    for (n = 0; n < numa_nodes; n++) {
+        numa_arena *a = &numa_arenas[n];
+        size_t share = limit / numa_nodes;
+        /* The first page of a class is allowed past the limit. */
+        size_t size = share
+            + (size_t)MAX_NUMBER_OF_SLAB_CLASSES * settings.slab_page_size;
+        a->base = numa_alloc_onnode(size, a->node);
+        if (a->base == NULL) {
+            fprintf(stderr, "Failed to reserve %llu bytes on NUMA node %d\n",
+                    (unsigned long long)size, a->node);
+            exit(EXIT_FAILURE);
+        }
+        if (prealloc) {
+            /* Claim the node's share now, before anything else does. */
+            memset(a->base, 0, share);
+        }
+        a->current = a->base;
+        a->size = size;
+        a->avail = size;
+    }
+    pthread_key_create(&slab_node_key, NULL);
+}
+
+int slabs_numa_nodes(void) {
+    return numa_nodes;
+}
+
+/* Runs the calling thread on an arena's node and has it allocate slab pages,
+ * and its own memory, there first. */
+void slabs_numa_thread_init(const int n) {
+    if (numa_run_on_node(numa_arenas[n].node) != 0) {
+        perror("Failed to bind thread to NUMA node");
+    }
+    numa_set_localalloc();
+    pthread_setspecific(slab_node_key, (void *)(intptr_t)n);
+}
+
+/* Arena index for a CPU, or -1 if it is on none of them. */
+int slabs_numa_cpu_node(const int cpu) {
+    int id = numa_node_of_cpu(cpu);
+    int n;
+    for (n = 0; id >= 0 && n < numa_nodes; n++) {
+        if (numa_arenas[n].node == id)
+            return n;
+    }
+    return -1;
+}
+#endif
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
  */
-void slabs_init(const size_t limit, const double factor, const bool prealloc, const uint32_t *slab_sizes) {
+void slabs_init(const size_t limit, const double factor, const bool prealloc,
+        const uint32_t *slab_sizes, void *mem_base_external, bool reuse_mem) {
     int i = POWER_SMALLEST - 1;
     unsigned int size = sizeof(item) + settings.chunk_size;
 
     mem_limit = limit;
 
-    if (prealloc) {
+#ifdef NUMA
+    if (settings.numa) {
+        /* The arenas stand in for -L's single chunk. */
+        slabs_numa_init(mem_limit, prealloc);
+    } else
+#endif
+    if (mem_base_external != NULL) {
+        /* Pages are carved out of memory the caller mapped for us. */
+        mem_base = mem_base_external;
+        mem_current = mem_base;
+        mem_avail = mem_limit;
+    } else if (prealloc) {
         /* Allocate everything in a big chunk with malloc */
         mem_base = malloc(mem_limit);
         if (mem_base != NULL) {
@@ -138,6 +303,7 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
     }
 
     power_largest = i;
+    pthread_key_create(&slab_cache_key, NULL);
     slabclass[power_largest].size = settings.slab_chunk_size_max;
     slabclass[power_largest].perslab = settings.slab_page_size / settings.slab_chunk_size_max;
     if (settings.verbose > 1) {
@@ -154,7 +320,25 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
 
     }
 
-    if (prealloc) {
+    if (prealloc && reuse_mem) {
+        mem_prealloc_deferred = true;
+#ifdef NUMA
+    } else if (prealloc && numa_nodes > 0) {
+        /* Every node gets the first page of each class, which is allowed
+         * past the limit like without NUMA; each arena has room for them. */
+        size_t limit = mem_limit;
+        int n;
+        mem_limit = 0;
+        for (n = 0; n < numa_nodes; n++) {
+            pthread_setspecific(slab_node_key, (void *)(intptr_t)n);
+            slabs_preallocate(power_largest);
+        }
+        pthread_setspecific(slab_node_key, NULL);
+        mem_limit = limit;
+        if (mem_limit && mem_malloced >= mem_limit)
+            mem_limit_reached = true;
+#endif
+    } else if (prealloc) {
         slabs_preallocate(power_largest);
     }
 }
@@ -206,20 +390,59 @@ static void split_slab_page_into_freelist(char *ptr, const unsigned int id) {
 /* Fast FIFO queue */
 static void *get_page_from_global_pool(void) {
     slabclass_t *p = &slabclass[SLAB_GLOBAL_PAGE_POOL];
+    unsigned int x;
     if (p->slabs < 1) {
         return NULL;
     }
-    char *ret = p->slab_list[p->slabs - 1];
+    x = p->slabs - 1;
+    if (numa_nodes > 1) {
+        /* Take a page on our own node if there is one. */
+        int node = slab_thread_node();
+        unsigned int i;
+        for (i = p->slabs; i-- > 0;) {
+            if (slabs_page_node(p->slab_list[i]) == node) {
+                x = i;
+                break;
+            }
+        }
+    }
+    char *ret = p->slab_list[x];
+    p->slab_list[x] = p->slab_list[p->slabs - 1];
     p->slabs--;
     return ret;
 }
 
+/* Bytes of a new page for a class. */
+static inline int slab_page_len(const slabclass_t *p) {
+    return (settings.slab_reassign || settings.slab_chunk_size_max != settings.slab_page_size)
+        ? settings.slab_page_size
+        : p->size * p->perslab;
+}
+
+#ifdef NUMA
+/* Whether do_slabs_newslab() would get a page on the given node: from the
+ * global pool if it holds one there (any other page in it would be taken
+ * first), or carved from the node's arena within the memory limit. */
+static bool local_page_available(const int node, const int len) {
+    slabclass_t *g = &slabclass[SLAB_GLOBAL_PAGE_POOL];
+    unsigned int i;
+
+    if (g->slabs > 0) {
+        for (i = 0; i < g->slabs; i++) {
+            if (slabs_page_node(g->slab_list[i]) == node)
+                return true;
+        }
+        return false;
+    }
+    return (!mem_limit || mem_malloced + len <= mem_limit)
+        && (size_t)len <= numa_arenas[node].avail;
+}
+#endif
+
 static int do_slabs_newslab(const unsigned int id) {
     slabclass_t *p = &slabclass[id];
     slabclass_t *g = &slabclass[SLAB_GLOBAL_PAGE_POOL];
-    int len = (settings.slab_reassign || settings.slab_chunk_size_max != settings.slab_page_size)
-        ? settings.slab_page_size
-        : p->size * p->perslab;
+    int len = slab_page_len(p);
     char *ptr;
 
     if ((mem_limit && mem_malloced + len > mem_limit && p->slabs > 0
@@ -252,28 +475,39 @@ static void *do_slabs_alloc(const size_t size, unsigned int id, uint64_t *total_
     slabclass_t *p;
     void *ret = NULL;
     item *it = NULL;
+    int node = slab_thread_node();
 
     if (id < POWER_SMALLEST || id > power_largest) {
         MEMCACHED_SLABS_ALLOCATE_FAILED(size, 0);
         return NULL;
     }
     p = &slabclass[id];
-    assert(p->sl_curr == 0 || ((item *)p->slots)->slabs_clsid == 0);
+    assert(p->slots[node] == NULL || ((item *)p->slots[node])->slabs_clsid == 0);
     if (total_bytes != NULL) {
         *total_bytes = p->requested;
     }
 
     assert(size <= p->size);
     /* fail unless we have space at the end of a recently allocated page,
-       we have something on our freelist, or we could allocate a new page */
-    if (p->sl_curr == 0 && flags != SLABS_ALLOC_NO_NEWPAGE) {
+       we have something on our freelist, or we could allocate a new page.
+       With NUMA arenas a new page is preferred over remote free chunks
+       only if it would be a local one. */
+    if (flags != SLABS_ALLOC_NO_NEWPAGE && (p->sl_curr == 0
+#ifdef NUMA
+            || (p->slots[node] == NULL && numa_nodes > 1
+                && local_page_available(node, slab_page_len(p)))
+#endif
+            )) {
         do_slabs_newslab(id);
     }
 
     if (p->sl_curr != 0) {
+        while (p->slots[node] == NULL) {
+            node = (node + 1) % MAX_NUMA_NODES;
+        }
         /* return off our freelist */
-        it = (item *)p->slots;
-        p->slots = it->next;
+        it = (item *)p->slots[node];
+        p->slots[node] = it->next;
         if (it->next) it->next->prev = 0;
         /* Kill flag and initialize refcount here for lock safety in slab
          * mover's freeness detection. */
@@ -298,6 +532,7 @@ static void *do_slabs_alloc(const size_t size, unsigned int id, uint64_t *total_
 static void do_slabs_free_chunked(item *it, const size_t size) {
     item_chunk *chunk = (item_chunk *) ITEM_data(it);
     slabclass_t *p;
+    int node;
 
     it->it_flags = ITEM_SLABBED;
     it->slabs_clsid = 0;
@@ -314,10 +549,11 @@ static void do_slabs_free_chunked(item *it, const size_t size) {
 
     // return the header object.
     // TODO: This is in three places, here and in do_slabs_free().
+    node = slabs_page_node(it);
     it->prev = 0;
-    it->next = p->slots;
+    it->next = p->slots[node];
     if (it->next) it->next->prev = it;
-    p->slots = it;
+    p->slots[node] = it;
     p->sl_curr++;
     // TODO: macro
     p->requested -= it->nkey + 1 + it->nsuffix + sizeof(item) + sizeof(item_chunk);
@@ -333,10 +569,11 @@ static void do_slabs_free_chunked(item *it, const size_t size) {
         chunk->slabs_clsid = 0;
         next_chunk = chunk->next;
 
+        node = slabs_page_node(chunk);
         chunk->prev = 0;
-        chunk->next = p->slots;
+        chunk->next = p->slots[node];
         if (chunk->next) chunk->next->prev = chunk;
-        p->slots = chunk;
+        p->slots[node] = chunk;
         p->sl_curr++;
         p->requested -= chunk->size + sizeof(item_chunk);
 
@@ -360,12 +597,13 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
 
     it = (item *)ptr;
     if ((it->it_flags & ITEM_CHUNKED) == 0) {
+        int node = slabs_page_node(it);
         it->it_flags = ITEM_SLABBED;
         it->slabs_clsid = 0;
         it->prev = 0;
-        it->next = p->slots;
+        it->next = p->slots[node];
         if (it->next) it->next->prev = it;
-        p->slots = it;
+        p->slots[node] = it;
 
         p->sl_curr++;
         p->requested -= size;
@@ -423,6 +661,14 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
             item_stats_sizes_enable(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "sizes_disable") == 0) {
             item_stats_sizes_disable(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "hotkeys") == 0) {
+            hotkeys_stats(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "hotkeys_enable") == 0) {
+            hotkeys_enable(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "hotkeys_disable") == 0) {
+            hotkeys_disable(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "proxy") == 0 && settings.proxy_backends) {
+            proxy_stats(add_stats, c);
         } else {
             ret = false;
         }
@@ -487,12 +733,46 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
 
     APPEND_STAT("active_slabs", "%d", total);
     APPEND_STAT("total_malloced", "%llu", (unsigned long long)mem_malloced);
+#ifdef NUMA
+    for (i = 0; i < numa_nodes; i++) {
+        char key_str[STAT_KEY_LEN];
+        char val_str[STAT_VAL_LEN];
+        int klen = 0, vlen = 0;
+        numa_arena *a = &numa_arenas[i];
+        APPEND_NUM_FMT_STAT("node%d:%s", a->node, "total_malloced", "%llu",
+                (unsigned long long)(a->current - a->base));
+    }
+#endif
     add_stats(NULL, 0, NULL, 0, c);
 }
 
+#ifdef NUMA
+/* Carves from the calling thread's arena, or any other with room left. */
+static void *numa_memory_allocate(size_t size) {
+    int node = slab_thread_node();
+    int x;
+
+    for (x = 0; x < numa_nodes; x++) {
+        numa_arena *a = &numa_arenas[(node + x) % numa_nodes];
+        if (size <= a->avail) {
+            void *ret = a->current;
+            a->current += size;
+            a->avail -= size;
+            mem_malloced += size;
+            return ret;
+        }
+    }
+    return NULL;
+}
+#endif
+
 static void *memory_allocate(size_t size) {
     void *ret;
 
+#ifdef NUMA
+    if (numa_nodes > 0)
+        return numa_memory_allocate(size);
+#endif
     if (mem_base == NULL) {
         /* We are not using a preallocated large memory chunk */
         ret = malloc(size);
@@ -523,7 +803,7 @@ static void *memory_allocate(size_t size) {
 /* Must only be used if all pages are item_size_max */
 static void memory_release() {
     void *p = NULL;
-    if (mem_base != NULL)
+    if (mem_base != NULL || numa_nodes > 0)
         return;
 
     if (!settings.slab_reassign)
@@ -536,9 +816,158 @@ static void memory_release() {
     }
 }
 
+/*** PER-THREAD CACHES ***/
+
+/* The class being emptied by the slab mover can't have chunks hiding in
+ * thread caches, so it bypasses them until the move is finished.
+ * CALLED WITH the cache's lock HELD */
+#define SLAB_CACHE_USABLE(id) \
+    (slab_rebalance_signal == 0 || slab_rebal.s_clsid != (id))
+
+/* Chunks a thread may keep for a class: refills and drains move half. */
+static inline unsigned int slab_cache_limit(const unsigned int id) {
+    unsigned int limit = SLAB_CACHE_BYTES / slabclass[id].size;
+    return limit < SLAB_CACHE_MAX ? limit : SLAB_CACHE_MAX;
+}
+
+void slabs_thread_cache_init(void) {
+    slab_cache *sc = calloc(1, sizeof(slab_cache));
+    if (sc == NULL) {
+        fprintf(stderr, "Failed to allocate slab thread cache\n");
+        abort();
+    }
+    pthread_mutex_init(&sc->lock, NULL);
+
+    pthread_mutex_lock(&slab_caches_lock);
+    sc->next = slab_caches;
+    slab_caches = sc;
+    pthread_mutex_unlock(&slab_caches_lock);
+
+    pthread_setspecific(slab_cache_key, sc);
+}
+
+/* CALLED WITH slabs_lock HELD */
+static void do_slab_cache_fold(slab_cache_class *cc, const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    p->requested += cc->requested;
+    cc->requested = 0;
+    cc->total_bytes = p->requested;
+}
+
+/* CALLED WITH slabs_lock HELD */
+static void do_slab_cache_refill(slab_cache_class *cc, const unsigned int id) {
+    int x;
+    do_slab_cache_fold(cc, id);
+    for (x = slab_cache_limit(id) / 2; x > 0; x--) {
+        item *it = do_slabs_alloc(0, id, NULL, 0);
+        if (it == NULL)
+            break;
+        it->next = cc->slots;
+        cc->slots = it;
+        cc->count++;
+    }
+}
+
+/* CALLED WITH slabs_lock HELD */
+static void do_slab_cache_drain(slab_cache_class *cc, const unsigned int id,
+        unsigned int count) {
+    do_slab_cache_fold(cc, id);
+    while (count-- > 0 && cc->slots != NULL) {
+        item *it = cc->slots;
+        cc->slots = it->next;
+        cc->count--;
+        do_slabs_free(it, 0, id);
+    }
+}
+
+/* Hands every cached chunk of a class back to the global freelist, so the
+ * slab mover finds the whole page. */
+static void slab_caches_drain_class(const unsigned int id) {
+    slab_cache *sc;
+    pthread_mutex_lock(&slab_caches_lock);
+    for (sc = slab_caches; sc != NULL; sc = sc->next) {
+        pthread_mutex_lock(&sc->lock);
+        pthread_mutex_lock(&slabs_lock);
+        do_slab_cache_drain(&sc->classes[id], id, sc->classes[id].count);
+        pthread_mutex_unlock(&slabs_lock);
+        pthread_mutex_unlock(&sc->lock);
+    }
+    pthread_mutex_unlock(&slab_caches_lock);
+}
+
+/* Returns false if the class can't be cached right now. */
+static bool slab_cache_alloc(slab_cache *sc, const size_t size,
+        const unsigned int id, uint64_t *total_bytes, void **ret) {
+    slab_cache_class *cc = &sc->classes[id];
+    item *it = NULL;
+
+    pthread_mutex_lock(&sc->lock);
+    if (!SLAB_CACHE_USABLE(id)) {
+        pthread_mutex_unlock(&sc->lock);
+        return false;
+    }
+    if (cc->count == 0) {
+        pthread_mutex_lock(&slabs_lock);
+        do_slab_cache_refill(cc, id);
+        pthread_mutex_unlock(&slabs_lock);
+    }
+    if (total_bytes != NULL) {
+        *total_bytes = cc->total_bytes + cc->requested;
+    }
+    if (cc->count != 0) {
+        it = cc->slots;
+        cc->slots = it->next;
+        cc->count--;
+        it->next = 0;
+        it->refcount = 1;
+        cc->requested += size;
+    }
+    pthread_mutex_unlock(&sc->lock);
+
+    *ret = it;
+    return true;
+}
+
+/* Returns false if the chunk should go straight to the global freelist. */
+static bool slab_cache_free(slab_cache *sc, void *ptr, const size_t size,
+        const unsigned int id) {
+    slab_cache_class *cc = &sc->classes[id];
+    item *it = (item *)ptr;
+
+    pthread_mutex_lock(&sc->lock);
+    if (!SLAB_CACHE_USABLE(id)) {
+        pthread_mutex_unlock(&sc->lock);
+        return false;
+    }
+    /* Neither slabbed nor linked: the mover would treat it as busy. */
+    it->it_flags = 0;
+    it->slabs_clsid = 0;
+    it->prev = 0;
+    it->next = cc->slots;
+    cc->slots = it;
+    cc->count++;
+    cc->requested -= size;
+    if (cc->count > slab_cache_limit(id)) {
+        pthread_mutex_lock(&slabs_lock);
+        do_slab_cache_drain(cc, id, cc->count - slab_cache_limit(id) / 2);
+        pthread_mutex_unlock(&slabs_lock);
+    }
+    pthread_mutex_unlock(&sc->lock);
+    return true;
+}
+
 void *slabs_alloc(size_t size, unsigned int id, uint64_t *total_bytes,
         unsigned int flags) {
     void *ret;
+    slab_cache *sc;
+
+    if (settings.slab_thread_cache && flags == 0
+            && id >= POWER_SMALLEST && id <= power_largest
+            && slab_cache_limit(id) >= 2
+            && (sc = pthread_getspecific(slab_cache_key)) != NULL
+            && slab_cache_alloc(sc, size, id, total_bytes, &ret)) {
+        return ret;
+    }
 
     pthread_mutex_lock(&slabs_lock);
     ret = do_slabs_alloc(size, id, total_bytes, flags);
@@ -547,6 +976,18 @@ void *slabs_alloc(size_t size, unsigned int id, uint64_t *total_bytes,
 }
 
 void slabs_free(void *ptr, size_t size, unsigned int id) {
+    slab_cache *sc;
+
+    /* Chunked items span several classes; they take the slow path. */
+    if (settings.slab_thread_cache
+            && (((item *)ptr)->it_flags & ITEM_CHUNKED) == 0
+            && id >= POWER_SMALLEST && id <= power_largest
+            && slab_cache_limit(id) >= 2
+            && (sc = pthread_getspecific(slab_cache_key)) != NULL
+            && slab_cache_free(sc, ptr, size, id)) {
+        return;
+    }
+
     pthread_mutex_lock(&slabs_lock);
     do_slabs_free(ptr, size, id);
     pthread_mutex_unlock(&slabs_lock);
@@ -560,7 +1001,7 @@ void slabs_stats(ADD_STAT add_stats, void *c) {
 
 static bool do_slabs_adjust_mem_limit(size_t new_mem_limit) {
     /* Cannot adjust memory limit at runtime if prealloc'ed */
-    if (mem_base != NULL)
+    if (mem_base != NULL || numa_nodes > 0)
         return false;
     settings.maxbytes = new_mem_limit;
     mem_limit = new_mem_limit;
@@ -577,6 +1018,100 @@ bool slabs_adjust_mem_limit(size_t new_mem_limit) {
     return ret;
 }
 
+/*** WARM RESTART ***/
+
+/* Records which class owns each page of a file-backed arena; 0 is the global
+ * page pool. Returns how many pages have been carved out of it so far. */
+unsigned int slabs_page_map(uint8_t *map, unsigned int max_pages) {
+    unsigned int npages, i;
+    int id;
+
+    pthread_mutex_lock(&slabs_lock);
+    npages = ((char *)mem_current - (char *)mem_base) / settings.slab_page_size;
+    for (id = 0; id <= power_largest; id++) {
+        slabclass_t *p = &slabclass[id];
+        for (i = 0; i < p->slabs; i++) {
+            size_t idx = ((char *)p->slab_list[i] - (char *)mem_base)
+                / settings.slab_page_size;
+            if (idx < max_pages)
+                map[idx] = id;
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return npages;
+}
+
+/* Chunked items point at their chunks by address and extstore headers at a
+ * file we don't keep, so only plain items that were linked come back. */
+static bool slab_chunk_restorable(item *it, const unsigned int id) {
+    return (it->it_flags & (ITEM_LINKED|ITEM_SLABBED|ITEM_CHUNKED|ITEM_CHUNK|ITEM_HDR))
+            == ITEM_LINKED
+        && ITEM_clsid(it) == id
+        && it->nkey > 0
+        && ITEM_ntotal(it) <= slabclass[id].size;
+}
+
+/*
+ * Rebuilds the page lists and freelists of a reused arena from a map written
+ * by slabs_page_map(), relinking every item that is still good. Fails without
+ * touching anything if the slab classes changed since; the arena is then
+ * carved up from scratch. Called before the worker threads start.
+ */
+bool slabs_restore(const uint32_t *sizes, const uint8_t *map,
+        unsigned int npages, uint64_t *restored) {
+    size_t used = (size_t)npages * settings.slab_page_size;
+    unsigned int x, c;
+    int id;
+
+    *restored = 0;
+    for (id = POWER_SMALLEST; id < MAX_NUMBER_OF_SLAB_CLASSES; id++) {
+        if (sizes[id] != slabclass[id].size)
+            break;
+    }
+    for (x = 0; id == MAX_NUMBER_OF_SLAB_CLASSES && x < npages; x++) {
+        if (map[x] > power_largest)
+            break;
+    }
+    if (id != MAX_NUMBER_OF_SLAB_CLASSES || x != npages || used > mem_limit) {
+        if (mem_prealloc_deferred)
+            slabs_preallocate(power_largest);
+        mem_prealloc_deferred = false;
+        return false;
+    }
+
+    pthread_mutex_lock(&slabs_lock);
+    for (x = 0; x < npages; x++) {
+        char *page = (char *)mem_base + (size_t)x * settings.slab_page_size;
+        slabclass_t *p = &slabclass[map[x]];
+
+        if (grow_slab_list(map[x]) == 0) {
+            fprintf(stderr, "Failed to allocate slab lists while restoring\n");
+            exit(EXIT_FAILURE);
+        }
+        p->slab_list[p->slabs++] = page;
+        if (map[x] == SLAB_GLOBAL_PAGE_POOL)
+            continue;
+
+        for (c = 0; c < p->perslab; c++) {
+            item *it = (item *)(page + (size_t)c * p->size);
+            if (slab_chunk_restorable(it, map[x]) && do_item_restore(it)) {
+                p->requested += ITEM_ntotal(it);
+                (*restored)++;
+            } else {
+                /* Flags could send do_slabs_free() chasing stale chunks. */
+                it->it_flags = 0;
+                do_slabs_free(it, 0, map[x]);
+            }
+        }
+    }
+    mem_current = (char *)mem_base + used;
+    mem_avail = mem_limit - used;
+    mem_malloced = used;
+    mem_prealloc_deferred = false;
+    pthread_mutex_unlock(&slabs_lock);
+    return true;
+}
+
 void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal)
 {
     pthread_mutex_lock(&slabs_lock);
@@ -630,6 +1165,61 @@ static volatile int do_run_slab_rebalance_thread = 1;
 #define DEFAULT_SLAB_BULK_CHECK 1
 int slab_bulk_check = DEFAULT_SLAB_BULK_CHECK;
 
+/* Pages looked at when picking the emptiest one to move, and chunks read
+ * across all of them: this runs under slabs_lock, so it has to stay cheap
+ * for classes with thousands of chunks per page. */
+#define SLAB_COMPACT_MAX_SCAN 64
+#define SLAB_COMPACT_MAX_CHUNKS 1024
+
+/* Counts free chunks among every stride'th chunk of a page.
+ * CALLED WITH slabs_lock HELD */
+static unsigned int slab_page_free_chunks(slabclass_t *p, char *page,
+        const unsigned int stride) {
+    unsigned int x;
+    unsigned int free_chunks = 0;
+    for (x = 0; x < p->perslab; x += stride) {
+        item *it = (item *)(page + x * p->size);
+        if (it->it_flags & ITEM_SLABBED)
+            free_chunks++;
+    }
+    return free_chunks;
+}
+
+/* Moves the page that looks emptiest to the front of the slab list, where
+ * the mover takes pages from, so a move rescues or evicts as few items as
+ * possible. Pages are sampled rather than counted exactly.
+ * CALLED WITH slabs_lock HELD
+ */
+static void slab_compact_pick(slabclass_t *p) {
+    static unsigned int cursor = 0;
+    unsigned int x, scan, stride, samples, best = 0, best_free = 0;
+    void *page;
+
+    scan = p->slabs < SLAB_COMPACT_MAX_SCAN ? p->slabs : SLAB_COMPACT_MAX_SCAN;
+    stride = (p->perslab * scan + SLAB_COMPACT_MAX_CHUNKS - 1)
+        / SLAB_COMPACT_MAX_CHUNKS;
+    if (stride == 0)
+        stride = 1;
+    samples = (p->perslab + stride - 1) / stride;
+    /* Rotate through large classes over successive moves. */
+    cursor += scan;
+    for (x = 0; x < scan; x++) {
+        unsigned int idx = (cursor + x) % p->slabs;
+        unsigned int free_chunks = slab_page_free_chunks(p,
+                p->slab_list[idx], stride);
+        if (free_chunks > best_free) {
+            best = idx;
+            best_free = free_chunks;
+            if (free_chunks == samples)
+                break;
+        }
+    }
+
+    page = p->slab_list[0];
+    p->slab_list[0] = p->slab_list[best];
+    p->slab_list[best] = page;
+}
+
 static int slab_rebalance_start(void) {
     slabclass_t *s_cls;
     int no_go = 0;
@@ -660,6 +1250,9 @@ static int slab_rebalance_start(void) {
     /* Always kill the first available slab page as it is most likely to
      * contain the oldest items
      */
+    if (settings.slab_compact) {
+        slab_compact_pick(s_cls);
+    }
     slab_rebal.slab_start = s_cls->slab_list[0];
     slab_rebal.slab_end   = (char *)slab_rebal.slab_start +
         (s_cls->size * s_cls->perslab);
@@ -675,6 +1268,11 @@ static int slab_rebalance_start(void) {
 
     pthread_mutex_unlock(&slabs_lock);
 
+    /* Workers now bypass their caches for this class; flush what they hold */
+    if (settings.slab_thread_cache) {
+        slab_caches_drain_class(slab_rebal.s_clsid);
+    }
+
     STATS_LOCK();
     stats_state.slab_reassign_running = true;
     STATS_UNLOCK();
@@ -719,9 +1317,10 @@ static void *slab_rebalance_alloc(const size_t size, unsigned int id) {
 /* detaches item/chunk from freelist. */
 static void slab_rebalance_cut_free(slabclass_t *s_cls, item *it) {
     /* Ensure this was on the freelist and nothing else. */
+    int node = slabs_page_node(it);
     assert(it->it_flags == ITEM_SLABBED);
-    if (s_cls->slots == it) {
-        s_cls->slots = it->next;
+    if (s_cls->slots[node] == it) {
+        s_cls->slots[node] = it->next;
     }
     if (it->next) it->next->prev = it->prev;
     if (it->prev) it->prev->next = it->next;
@@ -739,7 +1338,7 @@ enum move_status {
  * threads. instead, note we found a busy one and bail. logic in do_item_get
  * will prevent busy items from continuing to be busy
  * NOTE: This is checking it_flags outside of an item lock. I believe this
- * works since it_flags is 8 bits, and we're only ever comparing a single bit
+ * works since it_flags is 16 bits, and we're only ever comparing a single bit
  * regardless. ITEM_SLABBED bit will always be correct since we're holding the
  * lock which modifies that bit. ITEM_LINKED won't exist if we're between an
  * item having ITEM_SLABBED removed, and the key hasn't been added to the item
@@ -795,7 +1394,7 @@ static int slab_rebalance_move(void) {
                  * ITEM_SLABBED, but it's had ITEM_LINKED, it must be active
                  * and have the key written to it already.
                  */
-                hv = hash(ITEM_key(it), it->nkey);
+                hv = it->hv;
                 if ((hold_lock = item_trylock(hv)) == NULL) {
                     status = MOVE_LOCKED;
                 } else {
@@ -1011,8 +1610,9 @@ static void slab_rebalance_finish(void) {
 #endif
 
     /* At this point the stolen slab is completely clear.
-     * We always kill the "first"/"oldest" slab page in the slab_list, so
-     * shuffle the page list backwards and decrement.
+     * We always kill the "first"/"oldest" slab page in the slab_list (or the
+     * emptiest, with slab_compact), so shuffle the page list backwards and
+     * decrement.
      */
     s_cls->slabs--;
     for (x = 0; x < s_cls->slabs; x++) {
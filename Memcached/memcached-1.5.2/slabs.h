@@ -7,8 +7,11 @@
     size equal to the previous slab's chunk size times this factor.
     3rd argument specifies if the slab allocator should allocate all memory
     up front (if true), or allocate memory in chunks as it is needed (if false)
+    5th argument, if set, is memory to carve pages from instead of malloc'ing
+    it; if reuse_mem is true, preallocation waits for slabs_restore()
 */
-void slabs_init(const size_t limit, const double factor, const bool prealloc, const uint32_t *slab_sizes);
+void slabs_init(const size_t limit, const double factor, const bool prealloc,
+        const uint32_t *slab_sizes, void *mem_base_external, bool reuse_mem);
 
 
 /**
@@ -18,6 +21,9 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
 
 unsigned int slabs_clsid(const size_t size);
 
+/** Return the chunk size of a slab class */
+unsigned int slabs_size(const int clsid);
+
 /** Allocate object of given length. 0 on error */ /*@null@*/
 #define SLABS_ALLOC_NO_NEWPAGE 1
 void *slabs_alloc(const size_t size, unsigned int id, uint64_t *total_bytes, unsigned int flags);
@@ -25,12 +31,28 @@ void *slabs_alloc(const size_t size, unsigned int id, uint64_t *total_bytes, uns
 /** Free previously allocated object */
 void slabs_free(void *ptr, size_t size, unsigned int id);
 
+/** Give the calling thread its own cache of free chunks (-o slab_thread_cache) */
+void slabs_thread_cache_init(void);
+
+#ifdef NUMA
+/** Node-local slab arenas (-o numa): how many there are, binding a worker to
+ * one, and which one a CPU belongs to (-1 if none) */
+int slabs_numa_nodes(void);
+void slabs_numa_thread_init(const int n);
+int slabs_numa_cpu_node(const int cpu);
+#endif
+
 /** Adjust the stats for memory requested */
 void slabs_adjust_mem_requested(unsigned int id, size_t old, size_t ntotal);
 
 /** Adjust global memory limit up or down */
 bool slabs_adjust_mem_limit(size_t new_mem_limit);
 
+/** Warm restart: save which class owns each page, and rebuild from that */
+unsigned int slabs_page_map(uint8_t *map, unsigned int max_pages);
+bool slabs_restore(const uint32_t *sizes, const uint8_t *map,
+        unsigned int npages, uint64_t *restored);
+
 /** Return a datum for stats in binary protocol */
 bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c);
 
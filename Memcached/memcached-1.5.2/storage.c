@@ -0,0 +1,322 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Glue between the item cache and the external storage engine: writes COLD
+ * items out to extstore, releases their space again once their header items
+ * are freed, and compacts fragmented pages in the background.
+ */
+#include "memcached.h"
+#ifdef EXTSTORE
+
+#include "storage.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*** WRITE FLUSH THREAD ***/
+
+/* Pulls an item off the tail of the COLD LRU and writes it out to storage,
+ * replacing it with a header item. Called from the LRU maintainer.
+ * Returns 1 if an item was written.
+ */
+int storage_write(void *storage, const int clsid, const int item_age) {
+    int did_moves = 0;
+    struct lru_pull_tail_return it_info;
+
+    it_info.it = NULL;
+    lru_pull_tail(clsid, COLD_LRU, 0, LRU_PULL_RETURN_ITEM, 0, &it_info);
+    /* Item is locked, and we have a reference to it. */
+    if (it_info.it == NULL) {
+        return did_moves;
+    }
+
+    obj_io io;
+    item *it = it_info.it;
+    /* Only flush items nobody else is looking at; chunked items are larger
+     * than a write buffer and stay in memory. So do compressed ones, as
+     * reads from storage don't inflate what they bring back. */
+    if ((it->it_flags & (ITEM_CHUNKED|ITEM_HDR|ITEM_COMPRESSED)) == 0 &&
+            it->refcount == 2 &&
+            (item_age == 0 || current_time - it->time > item_age)) {
+        uint32_t flags;
+        FLAGS_CONV(settings.inline_ascii_response, it, flags);
+        item *hdr_it = do_item_alloc(ITEM_key(it), it->nkey, flags,
+                it->exptime, sizeof(item_hdr));
+        io.len = ITEM_ntotal(it);
+        io.mode = OBJ_IO_WRITE;
+        if (hdr_it != NULL && extstore_write_request(storage, &io) == 0) {
+            /* The whole item goes out so compaction can find its key. */
+            memcpy(io.buf, it, io.len);
+            extstore_write(storage, &io);
+
+            item_hdr *hdr = (item_hdr *) ITEM_data(hdr_it);
+            hdr->page_version = io.page_version;
+            hdr->page_id = io.page_id;
+            hdr->offset = io.offset + (ITEM_data(it) - (char *)it);
+            hdr->ntotal = io.len;
+            hdr_it->it_flags |= ITEM_HDR;
+            hdr_it->it_flags |= it->it_flags & (ITEM_TOKEN_SENT|ITEM_STALE);
+            hdr_it->nbytes = it->nbytes;
+            item_replace(it, hdr_it, it_info.hv);
+            /* Keep the original's identity so CAS and flush_all still
+             * apply to the stored value. */
+            ITEM_set_cas(hdr_it, ITEM_get_cas(it));
+            hdr_it->time = it->time;
+            do_item_remove(hdr_it);
+            did_moves = 1;
+        } else if (hdr_it != NULL) {
+            do_item_remove(hdr_it);
+        }
+    }
+    do_item_remove(it);
+    item_unlock(it_info.hv);
+    return did_moves;
+}
+
+/* Called when a header item is freed: its object is now dead space. */
+void storage_delete(void *e, item *it) {
+    item_hdr *hdr = (item_hdr *) ITEM_data(it);
+    if (e == NULL)
+        return;
+    extstore_delete(e, hdr->page_id, hdr->page_version, 1, hdr->ntotal);
+}
+
+/*** COMPACTOR ***/
+
+#define MAX_STORAGE_COMPACT_SLEEP 1000000
+#define MIN_STORAGE_COMPACT_SLEEP 10000
+
+struct storage_compact_wrap {
+    obj_io io;
+    pthread_mutex_t lock; /* gates the bools */
+    pthread_cond_t cond;
+    bool done;
+    bool miss;
+};
+
+static void _storage_compact_cb(void *e, obj_io *io, int ret) {
+    struct storage_compact_wrap *wrap = (struct storage_compact_wrap *)io->data;
+    pthread_mutex_lock(&wrap->lock);
+    if (ret < 1) {
+        wrap->miss = true;
+    }
+    wrap->done = true;
+    pthread_cond_signal(&wrap->cond);
+    pthread_mutex_unlock(&wrap->lock);
+}
+
+/* Walks a buffer's worth of objects read back from a page being compacted,
+ * re-writing any which are still referenced by a header item.
+ */
+static void storage_compact_readback(void *storage, char *readback_buf,
+        unsigned int len, unsigned int offset, unsigned int page_id,
+        uint64_t page_version) {
+    char *pos = readback_buf;
+    char *end = readback_buf + len;
+    uint64_t rescued = 0;
+    uint64_t lost = 0;
+    uint64_t skipped = 0;
+
+    while (pos + sizeof(item) <= end) {
+        item *it = (item *)pos;
+        unsigned int ntotal;
+        if (it->nkey == 0)
+            break; /* rest of the buffer is unused */
+        ntotal = ITEM_ntotal(it);
+        if (pos + ntotal > end)
+            break;
+
+        unsigned int data_offset = offset + (pos - readback_buf)
+            + (ITEM_data(it) - (char *)it);
+        uint32_t hv = (uint32_t)hash(ITEM_key(it), it->nkey);
+        item_lock(hv);
+        item *hdr_it = assoc_find(ITEM_key(it), it->nkey, hv);
+        if (hdr_it != NULL && (hdr_it->it_flags & ITEM_HDR)) {
+            item_hdr *hdr = (item_hdr *) ITEM_data(hdr_it);
+            if (hdr->page_id == page_id && hdr->page_version == page_version
+                    && hdr->offset == data_offset) {
+                if ((hdr_it->exptime != 0 && hdr_it->exptime <= current_time)
+                        || item_is_flushed(hdr_it)) {
+                    /* Will be reclaimed when next seen; don't copy it. */
+                    skipped++;
+                } else {
+                    uint32_t flags;
+                    obj_io io;
+                    refcount_incr(hdr_it);
+                    FLAGS_CONV(settings.inline_ascii_response, hdr_it, flags);
+                    item *new_it = do_item_alloc(ITEM_key(hdr_it),
+                            hdr_it->nkey, flags, hdr_it->exptime,
+                            sizeof(item_hdr));
+                    io.len = ntotal;
+                    io.mode = OBJ_IO_WRITE;
+                    if (new_it != NULL
+                            && extstore_write_request(storage, &io) == 0) {
+                        memcpy(io.buf, it, io.len);
+                        extstore_write(storage, &io);
+
+                        item_hdr *new_hdr = (item_hdr *) ITEM_data(new_it);
+                        new_hdr->page_version = io.page_version;
+                        new_hdr->page_id = io.page_id;
+                        new_hdr->offset = io.offset + (ITEM_data(it) - (char *)it);
+                        new_hdr->ntotal = io.len;
+                        new_it->it_flags |= ITEM_HDR;
+                        new_it->it_flags |= hdr_it->it_flags
+                            & (ITEM_TOKEN_SENT|ITEM_STALE);
+                        new_it->nbytes = hdr_it->nbytes;
+                        item_replace(hdr_it, new_it, hv);
+                        ITEM_set_cas(new_it, ITEM_get_cas(hdr_it));
+                        new_it->time = hdr_it->time;
+                        do_item_remove(new_it);
+                        rescued++;
+                    } else {
+                        if (new_it != NULL)
+                            do_item_remove(new_it);
+                        lost++;
+                    }
+                    do_item_remove(hdr_it);
+                }
+            }
+        }
+        item_unlock(hv);
+
+        pos += ntotal;
+        if (ntotal % 8)
+            pos += 8 - (ntotal % 8);
+    }
+
+    STATS_LOCK();
+    stats.extstore_compact_rescues += rescued;
+    stats.extstore_compact_lost += lost;
+    stats.extstore_compact_skipped += skipped;
+    STATS_UNLOCK();
+}
+
+static void storage_compact_page(void *storage, char *readback_buf,
+        unsigned int page_id, uint64_t page_version, unsigned int page_len) {
+    struct storage_compact_wrap wrap;
+    unsigned int offset;
+
+    memset(&wrap, 0, sizeof(wrap));
+    pthread_mutex_init(&wrap.lock, NULL);
+    pthread_cond_init(&wrap.cond, NULL);
+
+    for (offset = 0; offset < page_len; offset += settings.ext_wbuf_size) {
+        wrap.done = false;
+        wrap.miss = false;
+        wrap.io.data = &wrap;
+        wrap.io.next = NULL;
+        wrap.io.buf = readback_buf;
+        wrap.io.len = settings.ext_wbuf_size;
+        wrap.io.offset = offset;
+        wrap.io.page_id = page_id;
+        wrap.io.page_version = page_version;
+        wrap.io.mode = OBJ_IO_READ;
+        wrap.io.cb = _storage_compact_cb;
+        extstore_submit(storage, &wrap.io);
+
+        pthread_mutex_lock(&wrap.lock);
+        while (!wrap.done) {
+            pthread_cond_wait(&wrap.cond, &wrap.lock);
+        }
+        pthread_mutex_unlock(&wrap.lock);
+
+        if (wrap.miss)
+            break;
+        storage_compact_readback(storage, readback_buf, settings.ext_wbuf_size,
+                offset, page_id, page_version);
+    }
+
+    pthread_mutex_destroy(&wrap.lock);
+    pthread_cond_destroy(&wrap.cond);
+}
+
+static pthread_t storage_compact_tid;
+
+static void *storage_compact_thread(void *arg) {
+    void *storage = arg;
+    useconds_t to_sleep = MAX_STORAGE_COMPACT_SLEEP;
+    char *readback_buf = malloc(settings.ext_wbuf_size);
+
+    if (readback_buf == NULL) {
+        fprintf(stderr, "Failed to allocate extstore compaction buffer\n");
+        return NULL;
+    }
+
+    if (settings.verbose > 2)
+        fprintf(stderr, "Starting storage compaction thread\n");
+
+    while (1) {
+        struct extstore_stats st;
+        unsigned int page_id;
+        unsigned int page_len;
+        uint64_t page_version;
+
+        usleep(to_sleep);
+
+        extstore_get_stats(storage, &st);
+        if (st.pages_free >= settings.ext_compact_under ||
+                extstore_compact_pick(storage, settings.ext_max_frag,
+                    &page_id, &page_version, &page_len) != 0) {
+            to_sleep += to_sleep / 2;
+            if (to_sleep > MAX_STORAGE_COMPACT_SLEEP)
+                to_sleep = MAX_STORAGE_COMPACT_SLEEP;
+            continue;
+        }
+
+        storage_compact_page(storage, readback_buf, page_id, page_version,
+                page_len);
+        extstore_compact_done(storage, page_id, page_version);
+        to_sleep = MIN_STORAGE_COMPACT_SLEEP;
+    }
+
+    free(readback_buf);
+    return NULL;
+}
+
+int start_storage_compact_thread(void *arg) {
+    int ret;
+
+    if ((ret = pthread_create(&storage_compact_tid, NULL,
+        storage_compact_thread, arg)) != 0) {
+        fprintf(stderr, "Can't create storage_compact thread: %s\n",
+            strerror(ret));
+        return -1;
+    }
+
+    return 0;
+}
+
+/*** STATS ***/
+
+void storage_stats(ADD_STAT add_stats, conn *c) {
+    struct extstore_stats st;
+    void *storage = c->thread->storage;
+
+    STATS_LOCK();
+    APPEND_STAT("extstore_compact_lost", "%llu",
+            (unsigned long long)stats.extstore_compact_lost);
+    APPEND_STAT("extstore_compact_rescues", "%llu",
+            (unsigned long long)stats.extstore_compact_rescues);
+    APPEND_STAT("extstore_compact_skipped", "%llu",
+            (unsigned long long)stats.extstore_compact_skipped);
+    STATS_UNLOCK();
+
+    extstore_get_stats(storage, &st);
+#define STAT(name) \
+    APPEND_STAT("extstore_" #name, "%llu", (unsigned long long)st.name);
+    STAT(page_allocs);
+    STAT(page_evictions);
+    STAT(page_reclaims);
+    STAT(pages_free);
+    STAT(pages_used);
+    STAT(objects_evicted);
+    STAT(objects_read);
+    STAT(objects_written);
+    STAT(objects_used);
+    STAT(bytes_evicted);
+    STAT(bytes_written);
+    STAT(bytes_read);
+    STAT(bytes_used);
+    STAT(bytes_fragmented);
+#undef STAT
+}
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+int storage_write(void *storage, const int clsid, const int item_age);
+void storage_delete(void *e, item *it);
+int start_storage_compact_thread(void *arg);
+void storage_stats(ADD_STAT add_stats, conn *c);
+
+#endif
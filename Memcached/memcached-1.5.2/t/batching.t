@@ -0,0 +1,178 @@
+#!/usr/bin/perl
+# Responses to pipelined requests are held back and sent together. Whatever
+# is held back has to come out, in order, before the server waits on the
+# client again.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-o reply_batch_size=256');
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{reply_batch_size}, 256, 'batch size set');
+}
+
+for my $i (0 .. 9) {
+    print $sock "set k$i 0 0 2\r\nv$i\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored k$i");
+}
+
+sub batched {
+    my $stats = mem_stats($sock);
+    return $stats->{responses_batched};
+}
+
+{
+    my $before = batched();
+    print $sock join('', map { "get k$_\r\n" } 0 .. 9);
+    for my $i (0 .. 9) {
+        is(scalar <$sock>, "VALUE k$i 0 2\r\n", "pipelined k$i header");
+        is(scalar <$sock>, "v$i\r\n", "pipelined k$i value");
+        is(scalar <$sock>, "END\r\n", "pipelined k$i end");
+    }
+    cmp_ok(batched(), '>', $before, 'responses were batched');
+}
+
+{
+    # Last request in the pipeline sends nothing back.
+    print $sock "set a 0 0 1 noreply\r\na\r\nget a\r\nincr n 1\r\n"
+        . "delete zz noreply\r\n";
+    is(scalar <$sock>, "VALUE a 0 1\r\n", "get after noreply set");
+    is(scalar <$sock>, "a\r\n", "value after noreply set");
+    is(scalar <$sock>, "END\r\n", "end after noreply set");
+    is(scalar <$sock>, "NOT_FOUND\r\n", "incr before trailing noreply");
+    mem_get_is($sock, "a", "a");
+}
+
+{
+    # The next command is only half there.
+    print $sock "get k1\r\nget k2\r\nget k";
+    is(scalar <$sock>, "VALUE k1 0 2\r\n", "partial pipeline k1");
+    is(scalar <$sock>, "v1\r\n", "partial pipeline k1 value");
+    is(scalar <$sock>, "END\r\n", "partial pipeline k1 end");
+    is(scalar <$sock>, "VALUE k2 0 2\r\n", "partial pipeline k2");
+    is(scalar <$sock>, "v2\r\n", "partial pipeline k2 value");
+    is(scalar <$sock>, "END\r\n", "partial pipeline k2 end");
+    print $sock "3\r\n";
+    is(scalar <$sock>, "VALUE k3 0 2\r\n", "rest of the pipeline");
+    is(scalar <$sock>, "v3\r\n", "rest of the pipeline value");
+    is(scalar <$sock>, "END\r\n", "rest of the pipeline end");
+}
+
+{
+    # A value still on its way, and one too large to swallow.
+    print $sock "get k4\r\nset big 0 0 10\r\n12345";
+    is(scalar <$sock>, "VALUE k4 0 2\r\n", "get before short value");
+    is(scalar <$sock>, "v4\r\n", "get before short value value");
+    is(scalar <$sock>, "END\r\n", "get before short value end");
+    print $sock "67890\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored value sent in two parts");
+    mem_get_is($sock, "big", "1234567890");
+
+    my $len = 1024 * 1024 * 2;
+    print $sock "get k5\r\nset huge 0 0 $len\r\n" . ("x" x 1000);
+    is(scalar <$sock>, "VALUE k5 0 2\r\n", "get before swallow");
+    is(scalar <$sock>, "v5\r\n", "get before swallow value");
+    is(scalar <$sock>, "END\r\n", "get before swallow end");
+    is(scalar <$sock>, "SERVER_ERROR object too large for cache\r\n",
+       "too large");
+    print $sock ("x" x ($len - 1000)) . "\r\n";
+    mem_get_is($sock, "k6", "v6", "swallowed the value");
+}
+
+{
+    # Responses larger than the buffer go out with the batch in front.
+    my $val = "y" x 400;
+    print $sock "set large 0 0 400\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored large");
+    print $sock "get k7\r\nget large\r\nget k8\r\n";
+    is(scalar <$sock>, "VALUE k7 0 2\r\n", "small before large");
+    is(scalar <$sock>, "v7\r\n", "small before large value");
+    is(scalar <$sock>, "END\r\n", "small before large end");
+    is(scalar <$sock>, "VALUE large 0 400\r\n", "large");
+    is(scalar <$sock>, "$val\r\n", "large value");
+    is(scalar <$sock>, "END\r\n", "large end");
+    is(scalar <$sock>, "VALUE k8 0 2\r\n", "small after large");
+    is(scalar <$sock>, "v8\r\n", "small after large value");
+    is(scalar <$sock>, "END\r\n", "small after large end");
+}
+
+{
+    # Binary pipeline; the responses must come back in request order.
+    my $bsock = $server->new_sock;
+    my $req = '';
+    for my $i (0 .. 4) {
+        $req .= pack('CCnCCnNNNN', 0x80, 0x00, 2, 0, 0, 0, 2, $i, 0, 0)
+            . "k$i";
+    }
+    $req .= pack('CCnCCnNNNN', 0x80, 0x0a, 0, 0, 0, 0, 0, 99, 0, 0);
+    print $bsock $req;
+    for my $i (0 .. 4, 99) {
+        my $hdr = '';
+        read($bsock, $hdr, 24);
+        my ($magic, $op, $keylen, $extlen, $dtype, $status, $bodylen,
+            $opaque) = unpack('CCnCCnNN', $hdr);
+        is($magic, 0x81, "binary response $i");
+        is($opaque, $i, "binary response $i in order");
+        my $body = '';
+        read($bsock, $body, $bodylen) if $bodylen;
+        is(substr($body, $extlen), "v$i", "binary value $i") if $i != 99;
+    }
+}
+
+{
+    my $sock2 = $server->new_sock;
+    print $sock2 "get k9\r\nquit\r\n";
+    is(scalar <$sock2>, "VALUE k9 0 2\r\n", "answered before quit");
+    is(scalar <$sock2>, "v9\r\n", "answered before quit value");
+    is(scalar <$sock2>, "END\r\n", "answered before quit end");
+    is(scalar <$sock2>, undef, "closed after quit");
+}
+
+{
+    # Connections handed to a side thread get their batch first.
+    my $sock2 = $server->new_sock;
+    print $sock2 "get k9\r\nlru_crawler metadump all\r\n";
+    is(scalar <$sock2>, "VALUE k9 0 2\r\n", "answered before metadump");
+    is(scalar <$sock2>, "v9\r\n", "answered before metadump value");
+    is(scalar <$sock2>, "END\r\n", "answered before metadump end");
+    like(scalar <$sock2>, qr/^key=\S+ /, "then the metadump");
+
+    my $sock3 = $server->new_sock;
+    print $sock3 "get k9\r\nwatch\r\n";
+    is(scalar <$sock3>, "VALUE k9 0 2\r\n", "answered before watch");
+    is(scalar <$sock3>, "v9\r\n", "answered before watch value");
+    is(scalar <$sock3>, "END\r\n", "answered before watch end");
+    is(scalar <$sock3>, "OK\r\n", "then the watch");
+
+    # The flush goes through the normal write path: a command behind the
+    # batch is answered in order, and one after it still runs.
+    my $sock4 = $server->new_sock;
+    print $sock4 "get k9\r\nlru_crawler dump all\r\n";
+    is(scalar <$sock4>, "VALUE k9 0 2\r\n", "answered before dump");
+    is(scalar <$sock4>, "v9\r\n", "answered before dump value");
+    is(scalar <$sock4>, "END\r\n", "answered before dump end");
+    is(scalar <$sock4>, "OK\r\n", "then the dump");
+}
+
+{
+    my $server = new_memcached('-o reply_batch_size=0');
+    my $sock = $server->sock;
+    print $sock "set k 0 0 1\r\nk\r\nget k\r\nget k\r\n";
+    is(scalar <$sock>, "STORED\r\n", "unbatched set");
+    for (1 .. 2) {
+        is(scalar <$sock>, "VALUE k 0 1\r\n", "unbatched get");
+        is(scalar <$sock>, "k\r\n", "unbatched get value");
+        is(scalar <$sock>, "END\r\n", "unbatched get end");
+    }
+    my $stats = mem_stats($sock);
+    is($stats->{responses_batched}, 0, 'nothing batched when disabled');
+}
+
+done_testing();
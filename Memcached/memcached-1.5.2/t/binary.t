@@ -2,7 +2,7 @@
 
 use strict;
 use warnings;
-use Test::More tests => 4981;
+use Test::More tests => 5008;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
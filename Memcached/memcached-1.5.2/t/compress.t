@@ -0,0 +1,132 @@
+#!/usr/bin/perl
+# Large values are stored compressed when that takes less memory, and come
+# back as they were sent unless the client asks for them as stored.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_compression()) {
+    plan skip_all => 'compression not enabled';
+    exit 0;
+}
+
+my $server = new_memcached('-o compress_min=256');
+my $sock = $server->sock;
+
+my $json = '[' . join(',', map { "{\"id\":$_,\"name\":\"user$_\","
+                                 . "\"active\":true,\"tags\":[\"a\",\"b\"]}" }
+                      (1 .. 60)) . ']';
+my $len = length($json);
+
+sub stat_of {
+    my $stats = mem_stats($sock);
+    return $stats->{$_[0]};
+}
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{compress_min}, 256, 'compress_min set');
+    is($settings->{compress_level}, 1, 'default compress_level');
+}
+
+{
+    print $sock "set json 5 0 $len\r\n$json\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored json");
+    is(stat_of('compress_sets'), 1, 'stored compressed');
+    cmp_ok(stat_of('compress_bytes_saved'), '>', 0, 'saved memory');
+    mem_get_is({ sock => $sock, flags => 5 }, "json", $json);
+    is(stat_of('decompress_gets'), 1, 'inflated for get');
+
+    print $sock "get json nokey json\r\n";
+    for (1 .. 2) {
+        is(scalar <$sock>, "VALUE json 5 $len\r\n", "multiget header");
+        is(scalar <$sock>, "$json\r\n", "multiget value");
+    }
+    is(scalar <$sock>, "END\r\n", "multiget end");
+}
+
+{
+    print $sock "mg json s v\r\n";
+    is(scalar <$sock>, "VA $len s$len\r\n", "meta get inflates");
+    is(scalar <$sock>, "$json\r\n", "meta get value");
+
+    print $sock "mg json s v z\r\n";
+    my $line = <$sock>;
+    my ($clen) = $line =~ /^VA (\d+) s\1 z\r\n$/;
+    ok(defined $clen, "meta get z returns it as stored");
+    cmp_ok($clen, '<', $len / 2, "stored smaller");
+    my $data;
+    read($sock, $data, $clen + 2);
+    my $raw = unpack('N', substr($data, 0, 4));
+    is($raw, $len, "stored length prefix");
+    require Compress::Zlib;
+    is(Compress::Zlib::uncompress(substr($data, 4, $clen - 4)), $json,
+       "stored zlib stream");
+
+    print $sock "mg json s z\r\n";
+    is(scalar <$sock>, "HD s$clen z\r\n", "size as stored");
+}
+
+{
+    my ($cas, $val) = mem_gets($sock, "json");
+    is($val, $json, "gets inflates");
+    my $new = $json . $json;
+    my $nlen = length($new);
+    print $sock "cas json 0 0 $nlen $cas\r\n$new\r\n";
+    is(scalar <$sock>, "STORED\r\n", "cas against a compressed item");
+    print $sock "cas json 0 0 $nlen $cas\r\n$new\r\n";
+    is(scalar <$sock>, "EXISTS\r\n", "cas kept on the compressed copy");
+    mem_get_is($sock, "json", $new);
+
+    print $sock "append json 0 0 3\r\n!!!\r\nprepend json 0 0 3\r\n<<<\r\n";
+    is(scalar <$sock>, "STORED\r\n", "append to compressed");
+    is(scalar <$sock>, "STORED\r\n", "prepend to compressed");
+    mem_get_is($sock, "json", "<<<$new!!!");
+}
+
+{
+    # Values which don't shrink into a smaller slab class stay as they are.
+    my $skipped = stat_of('compress_skipped');
+    my $noise = join('', map { chr(11 + int(rand(245))) } (1 .. 600));
+    print $sock "set noise 0 0 600\r\n$noise\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored noise");
+    is(stat_of('compress_skipped'), $skipped + 1, 'noise not compressed');
+    print $sock "mg noise s z\r\n";
+    is(scalar <$sock>, "HD s600\r\n", "noise stored as is");
+    mem_get_is($sock, "noise", $noise);
+
+    print $sock "set small 0 0 5\r\nsmall\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored small");
+    is(stat_of('compress_skipped'), $skipped + 1, 'small values not tried');
+}
+
+{
+    my $bsock = $server->new_sock;
+    print $bsock pack('CCnCCnNNNN', 0x80, 0x00, 4, 0, 0, 0, 4, 7, 0, 0)
+        . "json";
+    my $hdr = '';
+    read($bsock, $hdr, 24);
+    my ($magic, $op, $keylen, $extlen, $dtype, $status, $bodylen, $opaque)
+        = unpack('CCnCCnNN', $hdr);
+    is($status, 0, "binary get hit");
+    my $body = '';
+    read($bsock, $body, $bodylen);
+    is(substr($body, $extlen), "<<<$json$json!!!", "binary get inflates");
+}
+
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    print $sock "set json 0 0 $len\r\n$json\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored without compress_min");
+    print $sock "mg json s z\r\n";
+    is(scalar <$sock>, "HD s$len\r\n", "not compressed when off");
+    my $stats = mem_stats($sock);
+    ok(!exists $stats->{compress_sets}, 'no compression stats when off');
+}
+
+done_testing();
@@ -0,0 +1,153 @@
+#!/usr/bin/perl
+# "lru_crawler dump" writes out whole items, and "load" reads them back into
+# another server.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-m 32');
+my $sock = $server->sock;
+
+my $big = join('', map { chr(97 + $_ % 26) } (1 .. 700 * 1024));
+my $blen = length($big);
+
+for my $i (1 .. 100) {
+    print $sock "set key$i $i 0 6\r\nval$i" . ("x" x (6 - length("val$i")))
+        . "\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$i");
+}
+print $sock "set big 7 0 $blen\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored chunked value");
+print $sock "set ttl 0 1000 3\r\nttl\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored item with ttl");
+print $sock "set gone 0 1 4\r\ngone\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored item about to expire");
+sleep 2;
+
+sub read_fully {
+    my ($s, $len) = @_;
+    my $data = '';
+    while (length($data) < $len) {
+        my $r = read($s, $data, $len - length($data), length($data));
+        last unless $r;
+    }
+    return $data;
+}
+
+# Returns the raw dump, and the records keyed by name.
+sub dump_all {
+    my $s = shift;
+    my $raw = '';
+    my %items;
+    # Retry while a previous crawl is still finishing.
+    for (1 .. 10) {
+        print $s "lru_crawler dump all\r\n";
+        my $res = <$s>;
+        last if $res eq "OK\r\n";
+        sleep 1;
+    }
+    while (1) {
+        my $hdr = read_fully($s, 14);
+        $raw .= $hdr;
+        my ($nkey, $dflags, $flags, $exp, $nbytes) = unpack('CCNNN', $hdr);
+        last if $nkey == 0;
+        my $rest = read_fully($s, $nkey + $nbytes);
+        $raw .= $rest;
+        my $key = substr($rest, 0, $nkey);
+        $items{$key} = { flags => $flags, exp => $exp, dflags => $dflags,
+                         value => substr($rest, $nkey, $nbytes - 2),
+                         end => substr($rest, -2) };
+    }
+    return ($raw, \%items);
+}
+
+my ($raw, $items) = dump_all($server->new_sock);
+
+{
+    is($items->{key42}{value}, "val42x", "dumped value");
+    is($items->{key42}{flags}, 42, "dumped flags");
+    is($items->{key42}{exp}, 0, "no expiry");
+    is($items->{key42}{dflags}, 0, "not compressed");
+    is($items->{key42}{end}, "\r\n", "value ends in crlf");
+    is($items->{big}{value}, $big, "chunked value dumped whole");
+    my $exp = $items->{ttl}{exp};
+    cmp_ok($exp, '>', time + 900, "ttl dumped as unix time");
+    cmp_ok($exp, '<=', time + 1000, "ttl in range");
+    ok(!exists $items->{gone}, "expired item skipped");
+    is(scalar(grep { /^key\d+$/ } keys %$items), 100, "all keys dumped");
+}
+
+{
+    my $dst = new_memcached('-m 32');
+    my $dsock = $dst->sock;
+    print $dsock "set key1 0 0 3\r\nold\r\nload\r\n";
+    is(scalar <$dsock>, "STORED\r\n", "command before load");
+    print $dsock $raw;
+    like(scalar <$dsock>, qr/^LOADED \d+ 0\r\n$/, "loaded dump");
+    mem_get_is({ sock => $dsock, flags => 42 }, "key42", "val42x");
+    mem_get_is({ sock => $dsock, flags => 1 }, "key1", "val1xx");
+    mem_get_is({ sock => $dsock, flags => 7 }, "big", $big);
+    print $dsock "mg ttl t\r\n";
+    like(scalar <$dsock>, qr/^HD t9\d\d\r\n$/, "ttl carried over");
+    mem_get_is($dsock, "gone", undef);
+
+    print $dsock "set key2 0 0 3\r\nnew\r\n";
+    is(scalar <$dsock>, "STORED\r\n", "overwrote key2");
+    print $dsock "load add\r\n$raw";
+    like(scalar <$dsock>, qr/^LOADED 0 \d+\r\n$/, "load add skips existing");
+    mem_get_is($dsock, "key2", "new");
+
+    print $dsock "version\r\n";
+    like(scalar <$dsock>, qr/^VERSION /, "back to commands after load");
+}
+
+{
+    my $dst = new_memcached();
+    my $dsock = $dst->sock;
+    print $dsock "load\r\n" . pack('CCNNN', 3, 0, 0, 0, 1) . "abcx";
+    is(scalar <$dsock>, "CLIENT_ERROR bad load record\r\n", "bad record");
+    is(scalar <$dsock>, undef, "connection closed");
+
+    # The key length byte can go past KEY_MAX_LENGTH.
+    $dsock = $dst->new_sock;
+    print $dsock "load\r\n" . pack('CCNNN', 255, 0, 0, 0, 3)
+        . ("k" x 255) . "v\r\n";
+    is(scalar <$dsock>, "CLIENT_ERROR bad load record\r\n", "key too long");
+    is(scalar <$dsock>, undef, "connection closed");
+
+    $dsock = $dst->new_sock;
+    print $dsock "load\r\n" . pack('CCNNN', 3, 0, 0, 0, 4) . "abcxx\r\r";
+    is(scalar <$dsock>, "CLIENT_ERROR bad data chunk\r\n", "bad data");
+    is(scalar <$dsock>, undef, "connection closed");
+}
+
+{
+    my $dst = new_memcached('-X');
+    my $dsock = $dst->sock;
+    print $dsock "lru_crawler dump all\r\n";
+    is(scalar <$dsock>, "ERROR dump not allowed\r\n", "dump disabled by -X");
+}
+
+if (supports_compression()) {
+    my $src = new_memcached('-o compress_min=256');
+    my $ssock = $src->sock;
+    my $json = join(',', map { "{\"id\":$_,\"name\":\"user$_\"}" } (1 .. 60));
+    my $len = length($json);
+    print $ssock "set json 3 0 $len\r\n$json\r\n";
+    is(scalar <$ssock>, "STORED\r\n", "stored compressed");
+    my ($craw, $citems) = dump_all($src->new_sock);
+    is($citems->{json}{dflags}, 1, "dumped as stored");
+    cmp_ok(length($citems->{json}{value}), '<', $len, "dumped compressed");
+
+    my $dst = new_memcached();
+    my $dsock = $dst->sock;
+    print $dsock "load\r\n$craw";
+    is(scalar <$dsock>, "LOADED 1 0\r\n", "loaded compressed");
+    mem_get_is({ sock => $dsock, flags => 3 }, "json", $json);
+}
+
+done_testing();
@@ -0,0 +1,164 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use Data::Dumper qw/Dumper/;
+
+my $ext_path;
+
+if (!supports_extstore()) {
+    plan skip_all => 'extstore not enabled';
+    exit 0;
+}
+
+$ext_path = "/tmp/extstore.$$";
+
+my $server = new_memcached("-m 64 -U 0 -o ext_page_size=8,ext_wbuf_size=2,ext_threads=1,ext_item_size=512,ext_item_age=2,slab_automove=0,ext_path=$ext_path:32m");
+my $sock = $server->sock;
+
+my $value;
+{
+    my @chars = ("C".."Z");
+    for (1 .. 20000) {
+        $value .= $chars[rand @chars];
+    }
+}
+
+# fill a small object
+print $sock "set foo 0 0 2\r\nhi\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored small value");
+# fetch
+mem_get_is($sock, "foo", "hi");
+# check extstore counters
+{
+    my $stats = mem_stats($sock);
+    is($stats->{extstore_objects_written}, 0, "nothing written yet");
+}
+
+# fill some larger objects
+{
+    # interleave sets with 0 ttl vs long ttl's.
+    for (1 .. 10) {
+        print $sock "set nfoo$_ 0 0 20000 noreply\r\n$value\r\n";
+        print $sock "set lfoo$_ 0 5 20000 noreply\r\n$value\r\n";
+    }
+    # wait for a flush
+    sleep 4;
+    # fetch
+    for (1 .. 10) {
+        mem_get_is($sock, "nfoo$_", $value, "nfoo$_ read back from storage");
+    }
+    # check extstore counters
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{extstore_page_allocs}, '>', 0, 'at least one page allocated');
+    cmp_ok($stats->{extstore_objects_written}, '>', 0, 'some objects written');
+    cmp_ok($stats->{extstore_bytes_written}, '>', 0, 'some bytes written');
+    cmp_ok($stats->{get_extstore}, '>', 0, 'one object was fetched');
+    cmp_ok($stats->{extstore_objects_read}, '>', 0, 'one object read');
+    cmp_ok($stats->{extstore_bytes_read}, '>', 0, 'some bytes read');
+    is($stats->{get_aborted_extstore}, 0, 'no reads were aborted');
+
+    # multiget with values in storage and in memory mixed in.
+    print $sock "get nfoo2 foo nfoo3 missing nfoo4\r\n";
+    for my $k ("nfoo2", "foo", "nfoo3", "nfoo4") {
+        my $v = $k eq "foo" ? "hi" : $value;
+        is(scalar <$sock>, "VALUE $k 0 " . length($v) . "\r\n", "header for $k");
+        is(scalar <$sock>, "$v\r\n", "value for $k");
+    }
+    is(scalar <$sock>, "END\r\n", "end of multiget");
+
+    # meta get of a stored value
+    print $sock "mg nfoo2 s v\r\n";
+    is(scalar <$sock>, "VA 20000 s20000\r\n", "meta get header");
+    is(scalar <$sock>, "$value\r\n", "meta get value");
+
+    # gets returns the same cas as before the value was stored.
+    my ($cas) = (mem_gets($sock, "nfoo5"))[0];
+    print $sock "cas nfoo5 0 0 2 $cas\r\nho\r\n";
+    is(scalar <$sock>, "STORED\r\n", "cas on stored item");
+    mem_get_is($sock, "nfoo5", "ho");
+
+    # Check append/prepend/incr on stored items
+    print $sock "append nfoo6 0 0 2\r\nhi\r\n";
+    is(scalar <$sock>, "NOT_STORED\r\n", "append fails on stored item");
+    print $sock "incr nfoo6 1\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "incr fails on stored item");
+    mem_get_is($sock, "nfoo6", $value, "nfoo6 read back after failed append");
+
+    # Deleting drops the stored copy
+    print $sock "delete nfoo7\r\n";
+    is(scalar <$sock>, "DELETED\r\n", "deleted stored item");
+    mem_get_is($sock, "nfoo7", undef);
+
+    # Expired values read back as misses
+    sleep 2;
+    mem_get_is($sock, "lfoo1", undef);
+}
+
+# flush_all applies to stored values too
+{
+    print $sock "flush_all\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed");
+    mem_get_is($sock, "nfoo8", undef);
+}
+
+# fill to eviction
+{
+    my $keycount = 8000;
+    for (1 .. $keycount) {
+        print $sock "set mfoo$_ 0 0 20000 noreply\r\n$value\r\n";
+        # wait to avoid evictions
+        select(undef, undef, undef, 0.01) if ($_ % 50 == 0);
+    }
+    sleep 6;
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{extstore_page_evictions}, '>', 0, 'at least one page evicted');
+    cmp_ok($stats->{extstore_objects_evicted}, '>', 0, 'at least one object evicted');
+    cmp_ok($stats->{extstore_bytes_evicted}, '>', 0, 'some bytes evicted');
+
+    my $hits = 0;
+    my $bad = 0;
+    for (1 .. $keycount) {
+        print $sock "get mfoo$_\r\n";
+        my $line = scalar <$sock>;
+        next if $line eq "END\r\n";
+        $hits++;
+        my $got = scalar <$sock>;
+        $bad++ if $got ne "$value\r\n";
+        <$sock>; # END
+    }
+    cmp_ok($hits, '>', 0, 'some values survived');
+    is($bad, 0, 'no corrupt values read back');
+    $stats = mem_stats($sock);
+    cmp_ok($stats->{get_aborted_extstore}, '>', 0, 'evicted pages turn into misses');
+}
+
+# ext_page_size applies even when given after ext_path.
+{
+    my $path = "$ext_path.order";
+    my $srv = new_memcached("-m 64 -U 0 -o ext_path=$path:32m,ext_wbuf_size=2,ext_page_size=8");
+    my $settings = mem_stats($srv->sock, ' settings');
+    is($settings->{ext_page_size}, 8 * 1024 * 1024, 'page size after ext_path');
+    is($settings->{ext_compact_under}, 1, 'page count uses that size');
+    $srv->stop;
+    unlink $path;
+}
+
+{
+    my $path = "$ext_path.zero";
+    my $root = $< == 0 ? '-u root' : '';
+    my $out = `./memcached-debug $root -o ext_path=$path:32m,ext_page_size=0 2>&1`;
+    is($? >> 8, 64, 'ext_page_size=0 rejected');
+    like($out, qr/ext_page_size must be at least 1/, 'with an error');
+    unlink $path;
+}
+
+done_testing();
+
+END {
+    unlink $ext_path if $ext_path;
+}
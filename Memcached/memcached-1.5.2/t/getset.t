@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 539;
+use Test::More tests => 591;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -76,6 +76,29 @@ is(scalar <$sock>, "DELETED\r\n", "pipeline delete");
 is(scalar <$sock>, "STORED\r\n",  "pipeline set");
 is(scalar <$sock>, "DELETED\r\n", "pipeline delete");
 
+# multiget spanning several batches of keys, with hits and misses mixed in.
+{
+    my @keys = map { "mget$_" } (1 .. 100);
+    my $expect = '';
+    for my $k (1 .. 100) {
+        next if $k % 2;
+        print $sock "set mget$k 0 0 " . length("v$k") . "\r\nv$k\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored mget$k");
+        $expect .= "VALUE mget$k 0 " . length("v$k") . "\r\nv$k\r\n";
+    }
+    print $sock "get @keys\r\n";
+    my $got = '';
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        $got .= $line;
+    }
+    is($got, $expect, "multiget returns hits in request order");
+
+    my $toolong = "a" x 251;
+    print $sock "get @keys[0 .. 59] $toolong @keys[60 .. 99]\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR bad command line format\r\n",
+       "multiget with a bad key in a later batch");
+}
 
 # Test sets up to a large size around 1MB.
 # Everything up to 1MB - 1k should succeed, everything 1MB +1k should fail.
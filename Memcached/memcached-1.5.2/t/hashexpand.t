@@ -0,0 +1,88 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Start small so the table has to grow a few times. Buckets are split using
+# the hash stored in each item, so run it under each algorithm.
+sub expand_test {
+    my $algo = shift;
+    my $server = new_memcached("-m 64 -o hashpower=13,hash_algorithm=$algo");
+    my $sock = $server->sock;
+    my $sock2 = $server->new_sock;
+
+    {
+        my $stats = mem_stats($sock);
+        is($stats->{hash_power_level}, 13, "starts at hashpower 13");
+        my $settings = mem_stats($sock, ' settings');
+        is($settings->{hash_algorithm}, $algo, "using $algo");
+    }
+
+    # Keep reading back earlier keys while the table expands underneath us.
+    my $count = 20000;
+    my $missing = 0;
+    for my $k (1 .. $count) {
+        my $val = "val$k";
+        print $sock "set key$k 0 0 " . length($val) . " noreply\r\n$val\r\n";
+        if ($k % 500 == 0) {
+            mem_get_is($sock, "key$k", "val$k", "key$k readable after set");
+            my $j = int(rand($k)) + 1;
+            print $sock2 "get key$j\r\n";
+            my $line = <$sock2>;
+            if ($line =~ /^VALUE/) {
+                <$sock2>;
+                <$sock2>;
+            } else {
+                $missing++;
+            }
+        }
+    }
+    is($missing, 0, "no keys went missing during expansion");
+
+    # Wait for expansion to finish.
+    my $stats;
+    for (1 .. 10) {
+        $stats = mem_stats($sock);
+        last unless $stats->{hash_is_expanding};
+        sleep 1;
+    }
+    is($stats->{hash_is_expanding}, 0, "expansion finished");
+    cmp_ok($stats->{hash_power_level}, '>=', 14, "table grew");
+    is($stats->{curr_items}, $count, "all items stored");
+
+    # Every key must still be found in its (possibly split) bucket.
+    $missing = 0;
+    for (my $k = 1; $k <= $count; $k += 100) {
+        my @keys = map { "key$_" } ($k .. $k + 99);
+        print $sock "get @keys\r\n";
+        my %got;
+        while (my $line = <$sock>) {
+            last if $line eq "END\r\n";
+            if ($line =~ /^VALUE (\S+) 0 \d+/) {
+                my $key = $1;
+                my $val = <$sock>;
+                $got{$key} = 1 if $val eq "val" . substr($key, 3) . "\r\n";
+            }
+        }
+        $missing += grep { ! $got{$_} } @keys;
+    }
+    is($missing, 0, "all keys found after expansion");
+
+    # Deletes have to find the right bucket too.
+    for my $k (1 .. 100) {
+        print $sock "delete key$k\r\n";
+        is(scalar <$sock>, "DELETED\r\n", "deleted key$k");
+    }
+    mem_get_is($sock, "key50", undef);
+    mem_get_is($sock, "key150", "val150");
+}
+
+foreach my $algo (qw(jenkins murmur3 xxh3)) {
+    expand_test($algo);
+}
+
+done_testing();
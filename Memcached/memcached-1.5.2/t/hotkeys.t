@@ -0,0 +1,79 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 13;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-o hotkeys,hotkeys_sample=1');
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hotkeys}, 'yes', 'hot key tracking enabled');
+    is($settings->{hotkeys_sample}, 1, 'sampling every fetch');
+}
+
+print $sock "set hot 0 0 1\r\nh\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored hot key");
+
+for (1 .. 200) {
+    print $sock "get hot\r\n";
+    print $sock "get cold$_\r\n" if $_ % 20 == 0;
+}
+print $sock "version\r\n";
+while (my $line = <$sock>) {
+    last if $line =~ /^VERSION/;
+}
+pass("fetches done");
+
+# Samples are counted by the logger thread in the background.
+my @top;
+for (my $tries = 10; $tries > 0; $tries--) {
+    @top = hotkeys($sock);
+    last if @top && $top[0][0] eq 'hot' && $top[0][1] >= 150;
+    sleep 1;
+}
+is($top[0][0], 'hot', 'hottest key listed first');
+cmp_ok($top[0][1], '>=', 150, 'hot key count estimated');
+ok(scalar(grep { $_->[0] =~ /^cold/ } @top) > 0, 'cold keys tracked too');
+
+# Writes look keys up as well, but must not make them look hot.
+for (1 .. 200) {
+    print $sock "set written 0 0 1\r\nw\r\n";
+    print $sock "delete written\r\n";
+}
+print $sock "get odd%key\r\n";
+print $sock "version\r\n";
+while (my $line = <$sock>) {
+    last if $line =~ /^VERSION/;
+}
+for (my $tries = 10; $tries > 0; $tries--) {
+    @top = hotkeys($sock);
+    last if grep { $_->[0] eq 'odd%25key' } @top;
+    sleep 1;
+}
+ok(scalar(grep { $_->[0] eq 'odd%25key' } @top), 'keys are URI encoded');
+ok(!scalar(grep { $_->[0] eq 'odd%key' } @top), 'raw key not listed');
+ok(!scalar(grep { $_->[0] eq 'written' } @top), 'stores and deletes not sampled');
+
+print $sock "stats hotkeys_disable\r\n";
+is(scalar <$sock>, "STAT hotkeys_status disabled\r\n", "disabled");
+is(scalar <$sock>, "END\r\n", "end of disable");
+
+print $sock "stats hotkeys_enable\r\n";
+is(join('', scalar <$sock>, scalar <$sock>),
+    "STAT hotkeys_status enabled\r\nEND\r\n", "re-enabled");
+
+sub hotkeys {
+    my $sock = shift;
+    my @keys;
+    print $sock "stats hotkeys\r\n";
+    while (my $line = <$sock>) {
+        last if $line =~ /^END/;
+        push @keys, [$1, $2] if $line =~ /^STAT (\S+) (\d+)/;
+    }
+    return @keys;
+}
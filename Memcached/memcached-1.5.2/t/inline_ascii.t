@@ -0,0 +1,91 @@
+#!/usr/bin/perl
+# With inline_ascii_response the VALUE line is stored in the item and a hit
+# is sent straight from it. Make sure every path that reads or rewrites that
+# stored header still agrees with what was set.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-o inline_ascii_resp,slab_chunk_max=16384');
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{inline_ascii_response}, 'yes', 'inlining enabled');
+}
+
+print $sock "set empty 0 0 0\r\n\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored empty value");
+mem_get_is($sock, "empty", "");
+
+for my $flags (0, 123, 2**16-1, 2**31, 2**32-1) {
+    print $sock "set foo $flags 0 6\r\nfooval\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored foo");
+    mem_get_is({ sock => $sock,
+                 flags => $flags }, "foo", "fooval", "got flags $flags back");
+    my @res = mem_gets($sock, "foo");
+    mem_gets_is({ sock => $sock,
+                  flags => $flags }, $res[0], "foo", "fooval", "gets with flags $flags");
+}
+
+# Raw response bytes for a multiget, including a miss in the middle.
+print $sock "set a 5 0 1\r\n1\r\nset bb 77 0 3\r\n222\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a");
+is(scalar <$sock>, "STORED\r\n", "stored bb");
+print $sock "get a nope bb\r\n";
+my $resp = '';
+while (my $line = <$sock>) {
+    $resp .= $line;
+    last if $line eq "END\r\n";
+}
+is($resp, "VALUE a 5 1\r\n1\r\nVALUE bb 77 3\r\n222\r\nEND\r\n", "multiget bytes");
+
+# Length changes rebuild the header.
+print $sock "append bb 0 0 2\r\n33\r\n";
+is(scalar <$sock>, "STORED\r\n", "appended");
+mem_get_is({ sock => $sock, flags => 77 }, "bb", "22233", "append kept flags");
+print $sock "prepend bb 0 0 1\r\n1\r\n";
+is(scalar <$sock>, "STORED\r\n", "prepended");
+mem_get_is({ sock => $sock, flags => 77 }, "bb", "122233", "prepend kept flags");
+
+print $sock "set num 9 0 2\r\n99\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored num");
+print $sock "incr num 1\r\n";
+is(scalar <$sock>, "100\r\n", "incr grew the value");
+mem_get_is({ sock => $sock, flags => 9 }, "num", "100", "incr kept flags");
+print $sock "decr num 95\r\n";
+is(scalar <$sock>, "5\r\n", "decr");
+mem_get_is({ sock => $sock, flags => 9 }, "num", "5  ", "decr pads in place");
+
+# Chunked items keep the header in the first chunk.
+my $big = "x" x 100000;
+print $sock "set big 42 0 " . length($big) . "\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored chunked item");
+mem_get_is({ sock => $sock, flags => 42 }, "big", $big, "chunked item");
+my @res = mem_gets($sock, "big");
+is($res[1], $big, "chunked item via gets");
+
+# Binary protocol reads the flags out of the stored header.
+{
+    my $bsock = $server->new_sock;
+    my $key = "foo";
+    my $req = pack('CCnCCnNNNN', 0x80, 0x00, length($key), 0, 0, 0,
+            length($key), 0, 0, 0) . $key;
+    print $bsock $req;
+    my $hdr;
+    read($bsock, $hdr, 24);
+    my ($magic, $op, $keylen, $extlen, $dtype, $status, $bodylen) =
+        unpack('CCnCCnN', $hdr);
+    is($status, 0, "binary get found foo");
+    my $body;
+    read($bsock, $body, $bodylen);
+    my ($flags) = unpack('N', $body);
+    is($flags, 2**32-1, "binary get returns flags");
+    is(substr($body, $extlen), "fooval", "binary get value");
+}
+
+done_testing();
@@ -14,7 +14,8 @@ my $builddir = getcwd;
 my @unixsockets = ();
 
 @EXPORT = qw(new_memcached sleep mem_get_is mem_gets mem_gets_is mem_stats
-             supports_sasl free_port supports_drop_priv);
+             supports_sasl free_port supports_drop_priv supports_extstore
+             supports_tls supports_compression supports_numa);
 
 sub sleep {
     my $n = shift;
@@ -149,6 +150,30 @@ sub supports_sasl {
     return 0;
 }
 
+sub supports_extstore {
+    my $output = `$builddir/memcached-debug -h`;
+    return 1 if $output =~ /ext_path/i;
+    return 0;
+}
+
+sub supports_tls {
+    my $output = `$builddir/memcached-debug -h`;
+    return 1 if $output =~ /enable-ssl/i;
+    return 0;
+}
+
+sub supports_compression {
+    my $output = `$builddir/memcached-debug -h`;
+    return 1 if $output =~ /compress_min/i;
+    return 0;
+}
+
+sub supports_numa {
+    my $output = `$builddir/memcached-debug -h`;
+    return 1 if $output =~ /numa_prealloc/i;
+    return 0;
+}
+
 sub supports_drop_priv {
     my $output = `$builddir/memcached-debug -h`;
     return 1 if $output =~ /no_drop_privileges/i;
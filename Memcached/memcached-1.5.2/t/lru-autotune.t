@@ -0,0 +1,86 @@
+#!/usr/bin/perl
+# lru_autotune: keys which come back soon after being evicted move the split
+# of memory between HOT and WARM towards the part of the LRU they fell out of.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $value = "x" x 1000;
+
+# Cycles through more keys than fit, for a few seconds. Fetching each key once
+# after setting it makes its ghost a frequent one.
+sub cycle {
+    my ($sock, $fetch) = @_;
+    my $end = time + 4;
+    my $i = 0;
+    while (time < $end) {
+        my $key = "key" . ($i++ % 12000);
+        print $sock "set $key 0 0 1000 noreply\r\n$value\r\n";
+        if ($fetch) {
+            print $sock "mg $key\r\n";
+            <$sock>;
+        } elsif ($i % 100 == 0) {
+            print $sock "mn\r\n";
+            <$sock>;
+        }
+    }
+}
+
+{
+    my $server = new_memcached('-m 6 -o lru_autotune,lru_autotune_window=1');
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{lru_autotune}, 'yes', 'lru_autotune enabled');
+    is($settings->{lru_autotune_window}, 1, 'lru_autotune_window set');
+
+    cycle($sock, 0);
+    my $stats = mem_stats($sock, 'items');
+    my ($cls) = map { /^items:(\d+):ghost_hits_recent$/ ? $1 : () }
+                keys %$stats;
+    ok(defined $cls, 'ghost stats shown');
+    cmp_ok($stats->{"items:$cls:ghost_hits_recent"}, '>', 0,
+           'unfetched keys came back');
+    is($stats->{"items:$cls:ghost_hits_frequent"}, 0, 'none had been fetched');
+    cmp_ok($stats->{"items:$cls:hot_lru_pct"}, '>', 20, 'HOT grown');
+    is($stats->{"items:$cls:hot_lru_pct"} + $stats->{"items:$cls:warm_lru_pct"},
+       60, 'at the expense of WARM');
+
+    print $sock "lru tune 10 30 0.2 2.0\r\n";
+    is(scalar <$sock>, "OK\r\n", "lru tune");
+    sleep 2;
+    $stats = mem_stats($sock, 'items');
+    is($stats->{"items:$cls:hot_lru_pct"}, 10, 'lru tune resets the split');
+    is($stats->{"items:$cls:warm_lru_pct"}, 30, 'lru tune resets WARM');
+}
+
+{
+    my $server = new_memcached('-m 6 -o lru_autotune,lru_autotune_window=1');
+    my $sock = $server->sock;
+
+    cycle($sock, 1);
+    my $stats = mem_stats($sock, 'items');
+    my ($cls) = map { /^items:(\d+):ghost_hits_frequent$/ ? $1 : () }
+                keys %$stats;
+    cmp_ok($stats->{"items:$cls:ghost_hits_frequent"}, '>', 0,
+           'fetched keys came back');
+    cmp_ok($stats->{"items:$cls:warm_lru_pct"}, '>', 40, 'WARM grown');
+    is($stats->{"items:$cls:hot_lru_pct"} + $stats->{"items:$cls:warm_lru_pct"},
+       60, 'at the expense of HOT');
+}
+
+{
+    my $server = new_memcached('-m 6');
+    my $stats = mem_stats($server->sock, ' settings');
+    ok(!exists $stats->{lru_autotune}, 'off by default');
+    eval {
+        new_memcached('-o no_modern,lru_autotune');
+    };
+    ok($@, 'needs the LRU maintainer');
+}
+
+done_testing();
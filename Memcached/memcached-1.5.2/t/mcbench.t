@@ -0,0 +1,64 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use Cwd;
+
+my $builddir = getcwd;
+my $bench = "$builddir/mcbench";
+if (! -x $bench) {
+    plan skip_all => 'mcbench not built';
+    exit 0;
+}
+plan tests => 14;
+
+my $server = new_memcached("-l 127.0.0.1");
+my $port = $server->port;
+
+sub bench {
+    my $args = shift;
+    my $out = `$bench -p $port -t 2 -c 2 $args 2>&1`;
+    my %r = (rc => $? >> 8, out => $out);
+    $r{requests} = $1 if $out =~ /^requests\s+(\d+)$/m;
+    ($r{gets}, $r{keys}, $r{hits}) = ($1, $2, $3)
+        if $out =~ /^gets\s+(\d+) \(keys (\d+), hits (\d+)/m;
+    $r{sets} = $1 if $out =~ /^sets\s+(\d+)$/m;
+    $r{errors} = $1 if $out =~ /^errors\s+(\d+)$/m;
+    return \%r;
+}
+
+{
+    my $r = bench("-n 2000 -k 500 -P -V uniform:10:3000");
+    is($r->{rc}, 0, "ascii run succeeded") or diag($r->{out});
+    is($r->{requests}, 2000, "ran the requested number of requests");
+    is($r->{errors}, 0, "no errors");
+    is($r->{hits}, $r->{keys}, "every prefilled key hit");
+}
+
+{
+    my $r = bench("-n 2000 -k 500 -P -B binary -m 4 -d 4 -K zipf");
+    is($r->{rc}, 0, "binary multiget run succeeded") or diag($r->{out});
+    is($r->{errors}, 0, "no errors");
+    is($r->{keys}, $r->{gets} * 4, "four keys per get");
+    is($r->{hits}, $r->{keys}, "every prefilled key hit");
+}
+
+# The same seed replays the same request stream.
+{
+    my $a = bench("-n 1000 -r 50 -S 7 -V bimodal:10:2000:20");
+    my $b = bench("-n 1000 -r 50 -S 7 -V bimodal:10:2000:20");
+    is($a->{rc}, 0, "seeded run succeeded");
+    is($a->{gets}, $b->{gets}, "same gets with the same seed");
+    is($a->{sets}, $b->{sets}, "same sets with the same seed");
+}
+
+{
+    my $r = bench("-D 1 -k 100 -H");
+    is($r->{rc}, 0, "timed run succeeded") or diag($r->{out});
+    cmp_ok($r->{requests}, '>', 0, "requests ran");
+    like($r->{out}, qr/^from us\s+to us\s+requests$/m, "histogram printed");
+}
@@ -0,0 +1,139 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+# noop and misses
+print $sock "mn\r\n";
+is(scalar <$sock>, "MN\r\n", "noop");
+print $sock "mg none v\r\n";
+is(scalar <$sock>, "EN\r\n", "miss");
+print $sock "mg none v q\r\nmn\r\n";
+is(scalar <$sock>, "MN\r\n", "quiet miss not reported");
+print $sock "mg none v O42 k\r\n";
+is(scalar <$sock>, "EN O42 knone\r\n", "miss echoes opaque and key");
+
+# set and get with returned flags
+{
+    print $sock "ms foo 2 T100 F5 O123 k\r\nhi\r\n";
+    is(scalar <$sock>, "HD O123 kfoo\r\n", "stored with opaque and key");
+    print $sock "mg foo s v t f k O99\r\n";
+    like(scalar <$sock>, qr/^VA 2 f5 s2 t(99|100) O99 kfoo\r\n$/, "value header");
+    is(scalar <$sock>, "hi\r\n", "value");
+    print $sock "mg foo c h\r\n";
+    like(scalar <$sock>, qr/^HD c\d+ h1\r\n$/, "metadata only, fetched before");
+
+    my ($cas) = (mem_gets($sock, "foo"))[0];
+    print $sock "ms foo 2 C" . ($cas + 1) . "\r\nho\r\n";
+    is(scalar <$sock>, "EX\r\n", "bad cas");
+    print $sock "ms foo 2 C$cas\r\nho\r\n";
+    is(scalar <$sock>, "HD\r\n", "good cas");
+    mem_get_is($sock, "foo", "ho");
+    print $sock "ms foo 2 q\r\nhe\r\nmn\r\n";
+    is(scalar <$sock>, "MN\r\n", "quiet set not reported");
+    mem_get_is($sock, "foo", "he");
+}
+
+# modes
+{
+    print $sock "ms mode 2 ME\r\nho\r\n";
+    is(scalar <$sock>, "HD\r\n", "add");
+    print $sock "ms mode 2 ME\r\nho\r\n";
+    is(scalar <$sock>, "NS\r\n", "add existing");
+    print $sock "ms mode 2 MA\r\n!!\r\n";
+    is(scalar <$sock>, "HD\r\n", "append");
+    print $sock "ms mode 2 MP\r\n<<\r\n";
+    is(scalar <$sock>, "HD\r\n", "prepend");
+    mem_get_is($sock, "mode", "<<ho!!");
+    print $sock "ms nomode 2 MR\r\nho\r\n";
+    is(scalar <$sock>, "NS\r\n", "replace missing");
+    print $sock "ms mode 2 MA C1\r\nho\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "cas outside of set mode");
+    print $sock "mn\r\n";
+    is(scalar <$sock>, "MN\r\n", "data was swallowed");
+}
+
+# delete
+{
+    print $sock "md mode q\r\nmd mode O1\r\nmn\r\n";
+    is(scalar <$sock>, "NF O1\r\n", "quiet delete, then not found");
+    is(scalar <$sock>, "MN\r\n", "noop");
+    mem_get_is($sock, "mode", undef);
+}
+
+# touch
+{
+    print $sock "ms touch 2 T100\r\nhi\r\n";
+    is(scalar <$sock>, "HD\r\n", "stored");
+    print $sock "mg touch T0 t\r\n";
+    is(scalar <$sock>, "HD t-1\r\n", "touched to unlimited");
+}
+
+# thundering herd: vivify on miss
+{
+    print $sock "mg viv N30 v t\r\n";
+    like(scalar <$sock>, qr/^VA 0 t(29|30) W\r\n$/, "won vivify");
+    is(scalar <$sock>, "\r\n", "empty value");
+    print $sock "mg viv N30 v\r\n";
+    is(scalar <$sock>, "VA 0 Z\r\n", "someone else won");
+    is(scalar <$sock>, "\r\n", "empty value");
+    print $sock "ms viv 3 T60\r\nnew\r\n";
+    is(scalar <$sock>, "HD\r\n", "recached");
+    print $sock "mg viv v\r\n";
+    is(scalar <$sock>, "VA 3\r\n", "no win flags once recached");
+    is(scalar <$sock>, "new\r\n", "new value");
+}
+
+# invalidation serves stale values
+{
+    print $sock "md viv I T30\r\n";
+    is(scalar <$sock>, "HD\r\n", "invalidated");
+    print $sock "mg viv v\r\n";
+    is(scalar <$sock>, "VA 3 W X\r\n", "won recache of stale item");
+    is(scalar <$sock>, "new\r\n", "stale value");
+    print $sock "mg viv v\r\n";
+    is(scalar <$sock>, "VA 3 Z X\r\n", "stale, someone else won");
+    is(scalar <$sock>, "new\r\n", "stale value");
+    print $sock "ms viv 5\r\nnewer\r\n";
+    is(scalar <$sock>, "HD\r\n", "recached");
+    print $sock "mg viv v\r\n";
+    is(scalar <$sock>, "VA 5\r\n", "fresh again");
+    is(scalar <$sock>, "newer\r\n", "new value");
+}
+
+# early recache
+{
+    print $sock "ms rc 2 T5\r\nhi\r\n";
+    is(scalar <$sock>, "HD\r\n", "stored");
+    print $sock "mg rc R30\r\n";
+    is(scalar <$sock>, "HD W\r\n", "won early recache");
+    print $sock "mg rc R30\r\n";
+    is(scalar <$sock>, "HD Z\r\n", "someone else won early recache");
+    print $sock "mg rc R2\r\n";
+    is(scalar <$sock>, "HD Z\r\n", "still being recached");
+}
+
+# bad flags
+{
+    print $sock "mg foo zz\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "unknown flag");
+    print $sock "mg foo vv\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "flag with a token it can't take");
+    print $sock "mg foo v u" . ("x" x 300) . "\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "no-bump flag with a token");
+    print $sock "mg foo O" . ("x" x 33) . "\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "opaque too long");
+    print $sock "ms foo 2 x\r\nhi\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR/, "bad set flag");
+    print $sock "mn\r\n";
+    is(scalar <$sock>, "MN\r\n", "data was swallowed");
+}
+
+done_testing();
@@ -0,0 +1,90 @@
+#!/usr/bin/perl
+# -o numa gives every NUMA node a slab arena of its own and binds workers to
+# the nodes; items must come and go exactly as without it.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_numa()) {
+    plan skip_all => 'NUMA support not enabled';
+    exit 0;
+}
+
+{
+    my $server = eval { new_memcached('-m 32 -t 4 -o numa') };
+    if (!$server) {
+        plan skip_all => 'NUMA not available on this system';
+        exit 0;
+    }
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{numa}, 'yes', 'numa enabled');
+    cmp_ok($settings->{numa_nodes}, '>', 0, 'found nodes');
+    my $nodes = $settings->{numa_nodes};
+
+    # Spread connections over the workers, so every arena is used.
+    my @socks = map { $server->new_sock } (1 .. 8);
+    my $value = "N" x 3000;
+    for my $i (1 .. 12000) {
+        my $s = $socks[$i % 8];
+        print $s "set key$i 0 0 3000 noreply\r\n$value\r\n";
+    }
+    for my $s (@socks) {
+        print $s "mn\r\n";
+        is(scalar <$s>, "MN\r\n", "sets done");
+    }
+    for my $i (1 .. 12000) {
+        my $s = $socks[($i + 3) % 8];
+        print $s "get key$i\r\n";
+        my $line = <$s>;
+        next if $line eq "END\r\n";
+        if ($line ne "VALUE key$i 0 3000\r\n" || <$s> ne "$value\r\n"
+                || <$s> ne "END\r\n") {
+            fail("bad reply for key$i");
+            last;
+        }
+    }
+
+    my $stats = mem_stats($sock, 'slabs');
+    my $sum = 0;
+    my $seen = 0;
+    for my $k (keys %$stats) {
+        next unless $k =~ /^node\d+:total_malloced$/;
+        $sum += $stats->{$k};
+        $seen++;
+    }
+    is($seen, $nodes, 'per-node slab memory shown');
+    is($sum, $stats->{total_malloced}, 'adds up to the total');
+
+    $stats = mem_stats($sock);
+    cmp_ok($stats->{evictions}, '>', 0, 'evicted once memory filled up');
+
+    print $sock "cache_memlimit 64\r\n";
+    like(scalar <$sock>, qr/^MEMLIMIT_ADJUST_FAILED/,
+         "memory limit fixed with per-node arenas");
+}
+
+{
+    my $server = new_memcached('-m 160 -o numa_prealloc');
+    my $stats = mem_stats($server->sock, 'slabs');
+    cmp_ok($stats->{total_malloced}, '>', 0, 'numa_prealloc carves pages');
+    is(mem_stats($server->sock, ' settings')->{numa}, 'yes',
+       'numa_prealloc implies numa');
+}
+
+{
+    my $server = new_memcached();
+    my $settings = mem_stats($server->sock, ' settings');
+    ok(!exists $settings->{numa}, 'off by default');
+    eval {
+        new_memcached('-o numa -e /tmp/numa_memory_file.$$');
+    };
+    ok($@, "can't be combined with memory_file");
+}
+
+done_testing();
@@ -0,0 +1,193 @@
+#!/usr/bin/perl
+# Proxy mode: requests are spread over the backends by key, and come back
+# the same as if they'd been sent to a backend directly.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use IO::Socket::INET;
+use IO::Select;
+use Time::HiRes;
+
+my @backends = map { new_memcached('-l 127.0.0.1') } (1 .. 2);
+my $list = join(',', map { '127.0.0.1:' . $_->port } @backends);
+my $proxy = new_memcached("-x $list -o proxy_retry=1");
+my $sock = $proxy->sock;
+
+{
+    my $stats = mem_stats($sock, ' proxy');
+    is($stats->{backends}, 2, 'two backends');
+    is($stats->{'backend:0:alive'}, 'yes', 'first backend up');
+    is($stats->{'backend:1:alive'}, 'yes', 'second backend up');
+}
+
+for my $i (1 .. 50) {
+    print $sock "set key$i $i 0 " . length("val$i") . "\r\nval$i\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored key$i");
+}
+
+{
+    my $total = 0;
+    for my $b (@backends) {
+        my $stats = mem_stats($b->sock);
+        cmp_ok($stats->{curr_items}, '>', 0, 'backend holds some keys');
+        $total += $stats->{curr_items};
+    }
+    is($total, 50, 'every key on exactly one backend');
+}
+
+mem_get_is({ sock => $sock, flags => 7 }, "key7", "val7");
+
+{
+    # One multiget fans out to both backends.
+    print $sock "get " . join(' ', map { "key$_" } 1 .. 50) . " nokey\r\n";
+    my %got;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        my ($key, $flags, $len) = $line =~ /^VALUE (\S+) (\d+) (\d+)\r\n$/;
+        my $val = <$sock>;
+        $got{$key} = $val;
+        is($flags, substr($key, 3), "flags of $key");
+    }
+    is(scalar keys %got, 50, 'multiget found every key');
+    is($got{key42}, "val42\r\n", 'multiget value');
+}
+
+{
+    my ($cas, $val) = mem_gets($sock, "key1");
+    is($val, "val1", "gets value");
+    print $sock "cas key1 0 0 3 $cas\r\nnew\r\n";
+    is(scalar <$sock>, "STORED\r\n", "cas with the right token");
+    print $sock "cas key1 0 0 3 $cas\r\nold\r\n";
+    is(scalar <$sock>, "EXISTS\r\n", "cas with a stale token");
+    mem_get_is($sock, "key1", "new");
+
+    print $sock "set num 0 0 1\r\n5\r\nincr num 10\r\ndecr num 3\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored num");
+    is(scalar <$sock>, "15\r\n", "incr");
+    is(scalar <$sock>, "12\r\n", "decr");
+
+    print $sock "append key2 0 0 2\r\n!!\r\nprepend key2 0 0 2\r\n<<\r\n";
+    is(scalar <$sock>, "STORED\r\n", "append");
+    is(scalar <$sock>, "STORED\r\n", "prepend");
+    mem_get_is({ sock => $sock, flags => 2 }, "key2", "<<val2!!");
+
+    print $sock "touch key3 100\r\ndelete key3\r\ndelete key3\r\n";
+    is(scalar <$sock>, "TOUCHED\r\n", "touch");
+    is(scalar <$sock>, "DELETED\r\n", "delete");
+    is(scalar <$sock>, "NOT_FOUND\r\n", "delete again");
+
+    print $sock "set quiet 0 0 1 noreply\r\nq\r\ndelete key4 noreply\r\n";
+    mem_get_is($sock, "quiet", "q", "noreply set went through");
+    mem_get_is($sock, "key4", undef, "noreply delete went through");
+
+    my $big = "x" x (512 * 1024);
+    print $sock "set big 0 0 " . length($big) . "\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a large value");
+    mem_get_is($sock, "big", $big);
+
+    print $sock "mg key5 v\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR /, "meta commands aren't forwarded");
+    print $sock "ms key5 2\r\nhi\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR /, "meta set refused");
+    mem_get_is({ sock => $sock, flags => 5 }, "key5", "val5",
+               "meta set value swallowed");
+
+    print $sock "\r\nbogus key\r\n";
+    is(scalar <$sock>, "ERROR\r\n", "empty line");
+    is(scalar <$sock>, "ERROR\r\n", "unknown command");
+}
+
+{
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{proxy_requests}, '>', 50, 'proxy_requests counted');
+    is($stats->{proxy_errors}, 0, 'no backend errors');
+}
+
+{
+    print $sock "flush_all\r\n";
+    is(scalar <$sock>, "OK\r\n", "flush_all reaches every backend");
+    for my $b (@backends) {
+        mem_get_is($b->sock, "key42", undef);
+        mem_get_is($b->sock, "key43", undef);
+    }
+    for my $i (1 .. 20) {
+        print $sock "set key$i 0 0 " . length($i) . "\r\n$i\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored key$i again");
+    }
+}
+
+{
+    # Keys move to the surviving backend while the other one is down.
+    $backends[1]->stop;
+    sleep 1;
+    my %failed;
+    for my $i (1 .. 20) {
+        print $sock "get key$i\r\n";
+        my $line = <$sock>;
+        if ($line eq "END\r\n") {
+            $failed{$i} = 1;
+        } else {
+            <$sock>;
+            is(scalar <$sock>, "END\r\n", "key$i still there");
+        }
+    }
+    ok(scalar keys %failed, 'some keys were on the stopped backend');
+    my $stats = mem_stats($sock, ' proxy');
+    is($stats->{'backend:1:alive'}, 'no', 'stopped backend marked down');
+    for my $i (sort keys %failed) {
+        print $sock "set key$i 0 0 " . length($i) . "\r\n$i\r\n";
+        is(scalar <$sock>, "STORED\r\n", "key$i failed over");
+        mem_get_is($sock, "key$i", $i);
+    }
+    $stats = mem_stats($sock);
+    cmp_ok($stats->{proxy_errors}, '>', 0, 'proxy_errors counted');
+}
+
+{
+    # A backend that never answers is given up on after proxy_timeout.
+    my $mute = IO::Socket::INET->new(LocalAddr => '127.0.0.1', Listen => 5,
+                                     ReuseAddr => 1, Proto => 'tcp');
+    my $server = new_memcached('-x 127.0.0.1:' . $mute->sockport
+                               . ' -o proxy_timeout=1');
+    my $sock = $server->sock;
+    my $start = time;
+    print $sock "set foo 0 0 1\r\nf\r\n";
+    is(scalar <$sock>, "SERVER_ERROR backend unavailable\r\n",
+       "timed out set");
+    cmp_ok(time - $start, '<', 10, "gave up in time");
+    mem_get_is($sock, "foo", undef, "no backend left for the get");
+}
+
+{
+    # Requests that keep arriving for a hung backend don't put off the
+    # timeout of the ones already waiting on it.
+    my $mute = IO::Socket::INET->new(LocalAddr => '127.0.0.1', Listen => 5,
+                                     ReuseAddr => 1, Proto => 'tcp');
+    my $server = new_memcached('-t 1 -x 127.0.0.1:' . $mute->sockport
+                               . ' -o proxy_timeout=1');
+    my $first = $server->new_sock;
+    my $start = Time::HiRes::time();
+    print $first "set foo 0 0 1\r\nf\r\n";
+    my $sel = IO::Select->new($first);
+    my @busy;
+    my $waited;
+    for (1 .. 16) {
+        if ($sel->can_read(0.25)) {
+            $waited = Time::HiRes::time() - $start;
+            last;
+        }
+        my $s = $server->new_sock;
+        print $s "get foo\r\n";
+        push @busy, $s;
+    }
+    ok(defined $waited, "answered while requests kept coming");
+    cmp_ok($waited || 99, '<', 2.5, "timed out from the oldest request");
+    is(scalar <$first>, "SERVER_ERROR backend unavailable\r\n",
+       "timed out set");
+}
+
+done_testing();
@@ -0,0 +1,72 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More tests => 14;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $mem_file = "/tmp/memcachedtest_restart.$$";
+my $server = new_memcached("-e $mem_file");
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{memory_file}, $mem_file, 'memory file in use');
+}
+
+print $sock "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored foo");
+print $sock "set short 0 1 5\r\nshort\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored short lived item");
+for my $k (1 .. 100) {
+    print $sock "set key$k 0 0 " . length("v$k") . "\r\nv$k\r\n";
+    die "failed to store key$k" unless scalar <$sock> eq "STORED\r\n";
+}
+my ($cas) = mem_gets($sock, 'foo');
+
+# Let the short lived item expire while the cache is down.
+sleep 2;
+kill 'USR1', $server->{pid};
+waitpid($server->{pid}, 0);
+ok(-f "$mem_file.meta", "metadata saved on graceful shutdown");
+
+$server = new_memcached("-e $mem_file");
+$sock = $server->sock;
+ok(! -f "$mem_file.meta", "metadata consumed on start");
+
+mem_get_is($sock, "foo", "fooval", "foo survived the restart");
+mem_get_is($sock, "short", undef, "expired item was not restored");
+my $missing = grep {
+    print $sock "get key$_\r\n";
+    my $line = <$sock>;
+    if ($line =~ /^VALUE/) {
+        $line = <$sock> . <$sock>;
+    }
+    $line ne "v$_\r\nEND\r\n";
+} (1 .. 100);
+is($missing, 0, "all keys survived the restart");
+{
+    my $stats = mem_stats($sock);
+    is($stats->{curr_items}, 101, "item count rebuilt");
+}
+
+print $sock "set bar 0 0 6\r\nbarval\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored bar");
+my ($newcas) = mem_gets($sock, 'bar');
+cmp_ok($newcas, '>', $cas, "CAS counter carried over");
+
+print $sock "delete foo\r\n";
+is(scalar <$sock>, "DELETED\r\n", "restored item can be deleted");
+
+# Any other exit leaves nothing to restore from.
+$server->stop;
+waitpid($server->{pid}, 0);
+ok(! -f "$mem_file.meta", "no metadata without a graceful shutdown");
+
+$server = new_memcached("-e $mem_file");
+$sock = $server->sock;
+mem_get_is($sock, "bar", undef, "cold start after an unclean exit");
+
+unlink $mem_file;
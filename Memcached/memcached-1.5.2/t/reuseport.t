@@ -0,0 +1,87 @@
+#!/usr/bin/perl
+# -o reuseport gives every worker thread a TCP listener of its own, so
+# connections are accepted without the main thread handing them over.
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = eval { new_memcached('-l 127.0.0.1 -t 4 -o reuseport') };
+if (!$server) {
+    plan skip_all => 'SO_REUSEPORT not supported';
+    exit 0;
+}
+
+{
+    my $sock = $server->sock;
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{reuseport}, 'yes', 'reuseport enabled');
+
+    my $port = $server->port;
+    my $stats = mem_stats($sock, ' conns');
+    my @listeners = grep { /:state$/ && $stats->{$_} eq 'conn_listening' }
+        keys %$stats;
+    my @on_port = grep { $stats->{$_} eq "tcp:127.0.0.1:$port" }
+        map { my $k = $_; $k =~ s/:state$/:addr/; $k } @listeners;
+    is(scalar @on_port, 4, 'one listener per worker thread');
+}
+
+{
+    my @socks = map { $server->new_sock } (1 .. 64);
+    is(scalar(grep { defined } @socks), 64, 'opened connections');
+    for my $i (0 .. $#socks) {
+        my $s = $socks[$i];
+        print $s "set key$i 0 0 5\r\nval$i" . ("x" x (5 - length("val$i")))
+            . "\r\n";
+    }
+    my $stored = grep { my $s = $_; scalar <$s> eq "STORED\r\n" } @socks;
+    is($stored, 64, 'stored on every connection');
+    for my $i (0 .. $#socks) {
+        my $val = "val$i" . ("x" x (5 - length("val$i")));
+        mem_get_is($socks[($i + 1) % 64], "key$i", $val);
+    }
+
+    my $before = mem_stats($server->sock)->{curr_connections};
+    close($_) for @socks;
+    # Closes are picked up by the worker threads asynchronously.
+    my $after;
+    for (1 .. 20) {
+        $after = mem_stats($server->sock)->{curr_connections};
+        last if $after <= $before - 64;
+        select undef, undef, undef, 0.1;
+    }
+    is($after, $before - 64, 'connections closed');
+}
+
+{
+    # Run a worker out of fds: its listener backs off, and picks up again
+    # once connections have gone away.
+    my $small = new_memcached('-l 127.0.0.1 -t 4 -c 50 -o reuseport');
+    my @socks = map { $small->new_sock } (1 .. 40);
+    my $stats;
+    for (1 .. 20) {
+        $stats = mem_stats($small->sock);
+        last if $stats->{listen_disabled_num};
+        select undef, undef, undef, 0.1;
+    }
+    cmp_ok($stats->{listen_disabled_num}, '>', 0, 'listener paused');
+    is($stats->{accepting_conns}, 0, 'not accepting while paused');
+    close($_) for grep { defined } @socks;
+    my $sock = $small->new_sock;
+    print $sock "version\r\n";
+    like(scalar <$sock>, qr/^VERSION /, 'accepting again');
+    $stats = mem_stats($small->sock);
+    is($stats->{accepting_conns}, 1, 'accepting in stats');
+    cmp_ok($stats->{time_in_listen_disabled_us}, '>', 0, 'time paused counted');
+}
+
+{
+    my $plain = new_memcached('-l 127.0.0.1');
+    my $settings = mem_stats($plain->sock, ' settings');
+    ok(!exists $settings->{reuseport}, 'off by default');
+}
+
+done_testing();
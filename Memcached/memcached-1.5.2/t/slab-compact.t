@@ -0,0 +1,107 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Fills a class with several pages of small items, empties a run of them
+# from the middle, then moves one page out of the class.
+sub move_page {
+    my $opts = shift;
+    my $server = new_memcached("-m 64 -o slab_reassign,no_slab_automove$opts");
+    my $sock = $server->sock;
+    my $value = "C" x 100;
+
+    print $sock "set probe 0 0 100\r\n$value\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a probe item");
+    my $slabs = mem_stats($sock, ' slabs');
+    my ($clsid) = map { /^(\d+):used_chunks$/ ? $1 : () } keys %$slabs;
+    my $perslab = $slabs->{"$clsid:chunks_per_page"};
+
+    my $keycount = $perslab * 5;
+    for (1 .. $keycount) {
+        print $sock "set cfoo$_ 0 0 100 noreply\r\n$value\r\n";
+    }
+    # At least one whole page's worth, while the oldest page stays full.
+    for ($perslab * 2 .. $perslab * 4) {
+        print $sock "delete cfoo$_ noreply\r\n";
+    }
+    print $sock "version\r\n";
+    like(scalar <$sock>, qr/^VERSION/, "sets and deletes done");
+
+    my $before = mem_stats($sock, ' slabs')->{"$clsid:total_pages"};
+    my $items = mem_stats($sock)->{curr_items};
+    print $sock "slabs reassign $clsid 0\r\n";
+    is(scalar <$sock>, "OK\r\n", "started a reassign");
+
+    my $stats;
+    for (my $tries = 10; $tries > 0; $tries--) {
+        sleep 1;
+        $stats = mem_stats($sock);
+        last if $stats->{slabs_moved} > 0
+            && $stats->{slab_reassign_running} == 0;
+    }
+    is($stats->{slabs_moved}, 1, "page moved");
+    is(mem_stats($sock, ' slabs')->{"$clsid:total_pages"}, $before - 1,
+        "class gave up a page");
+    return {
+        perslab => $perslab,
+        touched => $stats->{slab_reassign_rescues}
+            + $stats->{slab_reassign_evictions_nomem},
+        lost => $items - $stats->{curr_items},
+    };
+}
+
+my $oldest = move_page('');
+my $compact = move_page(',slab_compact');
+
+# Without compaction the full oldest page has every item rescued.
+cmp_ok($oldest->{touched}, '>=', $oldest->{perslab} / 2,
+    "oldest page was mostly full");
+# The sample finds one of the emptied pages, so nothing needs saving.
+is($compact->{touched}, 0, "compaction moved an empty page");
+is($compact->{lost}, 0, "no items lost");
+
+# The automover starts the moves: once a class holds more than 2.5 pages of
+# free chunks and has been quiet for a window, it hands pages back to the
+# global pool, and with slab_compact those are the emptied ones.
+{
+    my $server = new_memcached('-m 64 -o slab_reassign,slab_automove=1,'
+        . 'slab_automove_window=3,slab_compact');
+    my $sock = $server->sock;
+    my $value = "C" x 100;
+
+    print $sock "set probe 0 0 100\r\n$value\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a probe item");
+    my $slabs = mem_stats($sock, ' slabs');
+    my ($clsid) = map { /^(\d+):used_chunks$/ ? $1 : () } keys %$slabs;
+    my $perslab = $slabs->{"$clsid:chunks_per_page"};
+
+    for (1 .. $perslab * 5) {
+        print $sock "set afoo$_ 0 0 100 noreply\r\n$value\r\n";
+    }
+    for ($perslab .. $perslab * 4) {
+        print $sock "delete afoo$_ noreply\r\n";
+    }
+    print $sock "version\r\n";
+    like(scalar <$sock>, qr/^VERSION/, "sets and deletes done");
+    my $items = mem_stats($sock)->{curr_items};
+
+    my $stats;
+    for (my $tries = 20; $tries > 0; $tries--) {
+        sleep 1;
+        $stats = mem_stats($sock);
+        last if $stats->{slabs_moved} > 0
+            && $stats->{slab_reassign_running} == 0;
+    }
+    cmp_ok($stats->{slabs_moved}, '>', 0, "automover reclaimed a page");
+    cmp_ok($stats->{slab_global_page_pool}, '>', 0, "page went to the pool");
+    is($stats->{slab_reassign_rescues} + $stats->{slab_reassign_evictions_nomem},
+        0, "reclaimed pages were empty");
+    is($stats->{curr_items}, $items, "no items lost");
+}
+
+done_testing();
@@ -0,0 +1,119 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# One worker, so every chunk a thread holds back is in the same cache.
+my $server = new_memcached('-t 1 -m 64 -o slab_thread_cache');
+my $sock = $server->sock;
+
+{
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{slab_thread_cache}, 'yes', 'slab thread cache enabled');
+}
+
+# Fill and empty a small and a large class. Freed chunks go to the
+# worker's cache first.
+my %sizes = (small => 100, large => 100 * 1024);
+for my $name (keys %sizes) {
+    my $value = "A" x $sizes{$name};
+    for (1 .. 100) {
+        print $sock "set $name$_ 0 0 $sizes{$name} noreply\r\n$value\r\n";
+    }
+    for (1 .. 100) {
+        print $sock "delete $name$_ noreply\r\n";
+    }
+}
+print $sock "version\r\n";
+like(scalar <$sock>, qr/^VERSION/, "sets and deletes done");
+
+# Cached chunks count as used, but hold no item.
+my $slabs = mem_stats($sock, ' slabs');
+my $items = mem_stats($sock, ' items');
+my %cached;
+for my $k (keys %$slabs) {
+    next unless $k =~ /^(\d+):used_chunks$/;
+    my $clsid = $1;
+    my $linked = $items->{"items:$clsid:number"} || 0;
+    $cached{$clsid} = {
+        chunks => $slabs->{$k} - $linked,
+        size => $slabs->{"$clsid:chunk_size"},
+    };
+}
+
+my ($small) = grep { $_->{size} < 1024 && $_->{chunks} } values %cached;
+ok(defined $small, 'small class chunks cached');
+cmp_ok($small->{chunks}, '<=', 32, 'small class cache capped by count')
+    if defined $small;
+
+for my $clsid (sort { $a <=> $b } keys %cached) {
+    my $c = $cached{$clsid};
+    cmp_ok($c->{chunks} * $c->{size}, '<=', 64 * 1024,
+        "class $clsid cache within 64KB");
+    is($c->{chunks}, 0, "class $clsid with large chunks not cached")
+        if $c->{size} > 32 * 1024;
+}
+
+# Cached chunks are handed out again before new ones are carved.
+my $before = mem_stats($sock, ' slabs');
+print $sock "set small1 0 0 100\r\n", "B" x 100, "\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored into a cached chunk");
+my $after = mem_stats($sock, ' slabs');
+is($after->{total_malloced}, $before->{total_malloced}, 'no new page');
+mem_get_is($sock, "small1", "B" x 100);
+
+# Free chunks held in worker caches must not stall a page move out of
+# their class: the mover has to find every chunk of the page.
+{
+    my $srv = new_memcached('-m 32 -o slab_thread_cache,slab_reassign,no_slab_automove');
+    my $sock = $srv->sock;
+    my $value = "A" x 1000;
+    my $keycount = 5000;
+    for (1 .. $keycount) {
+        print $sock "set tfoo$_ 0 0 1000 noreply\r\n$value\r\n";
+    }
+    # Frees land in the worker's cache first.
+    for (1 .. $keycount) {
+        next unless $_ % 2 == 0;
+        print $sock "delete tfoo$_ noreply\r\n";
+    }
+    print $sock "version\r\n";
+    like(scalar <$sock>, qr/^VERSION/, "filled the caches");
+
+    my $slabs = mem_stats($sock, ' slabs');
+    my $items = mem_stats($sock, ' items');
+    my ($clsid) = grep { $items->{"items:$_:number"} }
+        map { /^(\d+):used_chunks$/ ? $1 : () } keys %$slabs;
+    cmp_ok($slabs->{"$clsid:used_chunks"}, '>', $items->{"items:$clsid:number"},
+        "worker holds cached chunks");
+
+    print $sock "slabs reassign $clsid 0\r\n";
+    is(scalar <$sock>, "OK\r\n", "started a reassign");
+    my $stats;
+    for (my $tries = 10; $tries > 0; $tries--) {
+        sleep 1;
+        $stats = mem_stats($sock);
+        last if $stats->{slabs_moved} > 0
+            && $stats->{slab_reassign_running} == 0;
+    }
+    is($stats->{slabs_moved}, 1, "page moved");
+    is($stats->{slab_reassign_running}, 0, "mover finished");
+
+    my $bad = 0;
+    for (1 .. $keycount) {
+        next if $_ % 2 == 0;
+        print $sock "get tfoo$_\r\n";
+        my $line = scalar <$sock>;
+        next if $line =~ /^END/;
+        my $body = scalar <$sock>;
+        $bad++ unless $body eq "$value\r\n";
+        <$sock>;
+    }
+    is($bad, 0, "surviving items are intact");
+}
+
+done_testing();
@@ -0,0 +1,120 @@
+#!/usr/bin/perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use IPC::Open2;
+use IO::Socket::INET;
+
+if (!supports_tls()) {
+    plan skip_all => 'TLS not enabled';
+    exit 0;
+}
+if (system("openssl version >/dev/null 2>&1") != 0) {
+    plan skip_all => 'openssl command line tool not found';
+    exit 0;
+}
+plan tests => 15;
+
+my $sess_file = "/tmp/memcachedtest_tls.$$";
+my $server = new_memcached("-l 127.0.0.1 -Z -o ssl_chain_cert=$Bin/server_crt.pem,ssl_key=$Bin/server_key.pem");
+my $port = $server->port;
+
+# openssl s_client does the TLS; we talk plain text through its pipes.
+sub tls_client {
+    my $args = shift || '';
+    my ($out, $in);
+    my $pid = open2($out, $in, "openssl s_client -quiet -connect 127.0.0.1:$port $args 2>/dev/null");
+    return ($pid, $out, $in);
+}
+
+# -quiet ignores EOF on stdin, so the client has to be stopped.
+sub tls_close {
+    my ($pid, $in, $out) = @_;
+    close($in);
+    kill 'TERM', $pid;
+    waitpid($pid, 0);
+    close($out);
+}
+
+sub tls_stats {
+    my ($out, $in, $type) = @_;
+    my %stats;
+    print $in "stats$type\r\n";
+    while (my $line = <$out>) {
+        last if $line =~ /^END/;
+        $stats{$1} = $2 if $line =~ /^STAT (\S+) (.*?)\r\n/;
+    }
+    return \%stats;
+}
+
+my ($pid, $out, $in) = tls_client("-sess_out $sess_file");
+$in->autoflush(1);
+
+{
+    my $settings = tls_stats($out, $in, ' settings');
+    is($settings->{ssl_enabled}, 'yes', 'TLS enabled');
+}
+
+print $in "set foo 0 0 6\r\nfooval\r\n";
+is(scalar <$out>, "STORED\r\n", "stored foo");
+print $in "get foo\r\n";
+is(scalar <$out>, "VALUE foo 0 6\r\n", "got foo header");
+is(scalar <$out>, "fooval\r\n", "got foo value");
+is(scalar <$out>, "END\r\n", "got foo end");
+
+# Spans many TLS records; the trailing get shares the value's last record.
+{
+    my $len = 500 * 1024;
+    my $big = join('', map { chr(65 + $_ % 26) } (1 .. $len));
+    print $in "set big 0 0 $len\r\n$big\r\nget big\r\n";
+    is(scalar <$out>, "STORED\r\n", "stored large value");
+    is(scalar <$out>, "VALUE big 0 $len\r\n", "got large value header");
+    my $got = '';
+    while (length($got) < $len + 2) {
+        my $n = read($out, $got, $len + 2 - length($got), length($got));
+        last unless $n;
+    }
+    ok($got eq "$big\r\n", "large value intact");
+    is(scalar <$out>, "END\r\n", "got large value end");
+}
+
+# Side threads write watchers and crawler dumps straight to the socket, so
+# they have to be refused rather than corrupt the TLS stream.
+{
+    print $in "watch\r\n";
+    is(scalar <$out>, "ERROR watch not allowed over TLS\r\n", "no watch");
+    print $in "lru_crawler metadump all\r\n";
+    is(scalar <$out>, "ERROR metadump not allowed over TLS\r\n",
+       "no metadump");
+    print $in "lru_crawler dump all\r\n";
+    is(scalar <$out>, "ERROR dump not allowed over TLS\r\n", "no dump");
+    print $in "get foo\r\nversion\r\n";
+    is(scalar <$out>, "VALUE foo 0 6\r\n", "session still usable");
+    <$out> for (1 .. 3);
+}
+
+tls_close($pid, $in, $out);
+
+# A new connection resumes the session from the first one's ticket.
+{
+    ($pid, $out, $in) = tls_client("-sess_in $sess_file");
+    $in->autoflush(1);
+    my $stats = tls_stats($out, $in, '');
+    is($stats->{ssl_session_reuses}, 1, 'session resumed');
+}
+
+# A plain text client fails the handshake and is dropped.
+{
+    my $plain = IO::Socket::INET->new(PeerAddr => "127.0.0.1:$port");
+    print $plain "version\r\n";
+    my $line = <$plain>;
+    my $stats = tls_stats($out, $in, '');
+    is($stats->{ssl_handshake_errors}, 1, 'plain text client rejected');
+}
+
+tls_close($pid, $in, $out);
+unlink $sess_file;
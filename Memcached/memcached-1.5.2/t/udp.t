@@ -1,7 +1,7 @@
 #!/usr/bin/perl
 
 use strict;
-use Test::More tests => 48;
+use Test::More tests => 50;
 use FindBin qw($Bin);
 use lib "$Bin/lib";
 use MemcachedTest;
@@ -60,6 +60,26 @@ for my $prot (::IS_ASCII,::IS_BINARY) {
     udp_delete_test($prot,45,"aval$prot");
 }
 
+# requests queued up on the socket together all get answered
+{
+    my $count = 12;
+    for my $id (1 .. $count) {
+        send($usock, pack("nnnn", 200 + $id, 0, 1, 0) . "get foo\r\n", 0);
+    }
+    my %res;
+    for (1 .. $count) {
+        my $rin = '';
+        vec($rin, fileno($usock), 1) = 1;
+        last unless select(my $rout = $rin, undef, undef, 1.5);
+        my $dg;
+        $usock->recv($dg, 1500, 0);
+        $res{unpack("n", $dg)} = substr($dg, 8);
+    }
+    is(scalar keys %res, $count, "all queued requests answered");
+    is(scalar(grep { $_ eq "VALUE foo 0 6\r\nfooval\r\nEND\r\n" } values %res),
+        $count, "each with the right value");
+}
+
 sub udp_set_test {
     my ($protocol, $req_id, $key, $value, $flags, $exp) = @_;
     my $req = "";
@@ -21,6 +21,7 @@
 #include "config.h"
 #include "cache.h"
 #include "util.h"
+#include "xxh3_hash.h"
 #include "protocol_binary.h"
 
 #define TMP_TEMPLATE "/tmp/test_file.XXXXXXX"
@@ -225,6 +226,41 @@ static enum test_return test_safe_strtoull(void) {
     return TEST_PASS;
 }
 
+/* Reference values from the upstream xxHash library, picked so every input
+ * length class (including the striped path over 240 bytes) is covered. */
+static enum test_return test_xxh3(void) {
+    static const struct {
+        size_t len;
+        uint64_t hash;
+    } vectors[] = {
+        { 0, 0x2d06800538d394c2ULL },
+        { 1, 0x4c5cca45d0f4811fULL },
+        { 3, 0x6e3e2670e61106acULL },
+        { 4, 0x5c4c63133443d03fULL },
+        { 8, 0xf9fd4dd0b04d78f5ULL },
+        { 9, 0x7c20df9712c26edfULL },
+        { 16, 0x86abf6baccea0858ULL },
+        { 17, 0xb58bf5dc5022d071ULL },
+        { 64, 0x1291d2d4042330ddULL },
+        { 128, 0x10d17f72c0ccba41ULL },
+        { 129, 0x1648bdc3db49d1a2ULL },
+        { 240, 0xb6cfaf343fab81e6ULL },
+        { 241, 0x956cae592c67279eULL },
+        { 250, 0x791cb8a4fe2f84b9ULL },
+    };
+    unsigned char buf[256];
+    size_t i;
+
+    for (i = 0; i < sizeof(buf); i++) {
+        buf[i] = (unsigned char)(i * 131 + 7);
+    }
+    for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+        assert(XXH3_64bits(buf, vectors[i].len) == vectors[i].hash);
+        assert(xxh3_hash(buf, vectors[i].len) == (uint32_t)vectors[i].hash);
+    }
+    return TEST_PASS;
+}
+
 static enum test_return test_safe_strtoll(void) {
     int64_t val;
     assert(safe_strtoll("123", &val));
@@ -1951,6 +1987,7 @@ struct testcase testcases[] = {
     { "strtoll", test_safe_strtoll },
     { "strtoul", test_safe_strtoul },
     { "strtoull", test_safe_strtoull },
+    { "xxh3", test_xxh3 },
     { "issue_44", test_issue_44 },
     { "vperror", test_vperror },
     { "issue_101", test_issue_101 },
@@ -334,6 +334,36 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         fprintf(stderr, "Failed to create suffix cache\n");
         exit(EXIT_FAILURE);
     }
+#ifdef EXTSTORE
+    me->io_cache = cache_create("io", sizeof(io_wrap), sizeof(char*), NULL, NULL);
+    if (me->io_cache == NULL) {
+        fprintf(stderr, "Failed to create IO object cache\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
+    if (settings.proxy_backends) {
+        me->proxy = proxy_thread_init(me);
+        if (me->proxy == NULL) {
+            fprintf(stderr, "Failed to create proxy backend connections\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#ifdef TLS
+    if (settings.ssl_enabled) {
+        me->ssl_wbuf = malloc(settings.ssl_wbuf_size);
+        if (me->ssl_wbuf == NULL) {
+            fprintf(stderr, "Failed to allocate TLS write buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+#endif
+#ifdef COMPRESSION
+    me->compress = compress_thread_init();
+    if (me->compress == NULL) {
+        fprintf(stderr, "Failed to set up compression streams\n");
+        exit(EXIT_FAILURE);
+    }
+#endif
 }
 
 /*
@@ -350,6 +380,15 @@ static void *worker_libevent(void *arg) {
     if (me->l == NULL || me->lru_bump_buf == NULL) {
         abort();
     }
+#ifdef NUMA
+    /* Before the slab cache, so its chunks come from this node. */
+    if (settings.numa) {
+        slabs_numa_thread_init(me->numa_node);
+    }
+#endif
+    if (settings.slab_thread_cache) {
+        slabs_thread_cache_init();
+    }
 
     if (settings.drop_privileges) {
         drop_worker_privileges();
@@ -437,6 +476,60 @@ static int last_thread = -1;
  * from the main thread, either during initialization (for UDP) or because
  * of an incoming connection.
  */
+#ifdef NUMA
+/* Connections handed to each node's workers lately, halved every
+ * NUMA_RECENT_WINDOW so they follow the current mix. */
+#define NUMA_RECENT_WINDOW 4096
+static unsigned int *numa_recent;
+static unsigned int numa_recent_total;
+
+/* Whether the node already had more than 1.5 times its share of the recent
+ * connections, once there are enough of them to tell. */
+static bool numa_node_busy(const int node, const int nodes) {
+    return numa_recent_total >= 64
+        && (uint64_t)numa_recent[node] * nodes * 2 > (uint64_t)numa_recent_total * 3;
+}
+
+/*
+ * Picks the next worker, starting from tid, on the node whose CPU took the
+ * connection's packets, so the connection and the items it writes stay on
+ * that node. If the NIC's interrupts are all handled on one node that would
+ * pile every connection onto its workers, so a node that is getting well
+ * over its share gets round-robin instead.
+ */
+static int numa_pick_thread(int sfd, int tid) {
+    int nodes = slabs_numa_nodes();
+    int pick = tid;
+    int x;
+#ifdef SO_INCOMING_CPU
+    int cpu, node;
+    socklen_t len = sizeof(cpu);
+
+    if (nodes >= 2
+            && getsockopt(sfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0
+            && (node = slabs_numa_cpu_node(cpu)) >= 0
+            && !numa_node_busy(node, nodes)) {
+        for (x = 0; x < settings.num_threads; x++) {
+            int t = (tid + x) % settings.num_threads;
+            if (threads[t].numa_node == node) {
+                pick = t;
+                break;
+            }
+        }
+    }
+#endif
+    numa_recent[threads[pick].numa_node]++;
+    if (++numa_recent_total >= NUMA_RECENT_WINDOW) {
+        numa_recent_total = 0;
+        for (x = 0; x < nodes; x++) {
+            numa_recent[x] /= 2;
+            numa_recent_total += numa_recent[x];
+        }
+    }
+    return pick;
+}
+#endif
+
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport) {
     CQ_ITEM *item = cqi_new();
@@ -450,6 +543,11 @@ void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
 
     int tid = (last_thread + 1) % settings.num_threads;
 
+#ifdef NUMA
+    if (settings.numa && IS_TCP(transport) && init_state != conn_listening) {
+        tid = numa_pick_thread(sfd, tid);
+    }
+#endif
     LIBEVENT_THREAD *thread = threads + tid;
 
     last_thread = tid;
@@ -528,9 +626,12 @@ item *item_alloc(char *key, size_t nkey, int flags, rel_time_t exptime, int nbyt
  * lazy-expiring as needed.
  */
 item *item_get(const char *key, const size_t nkey, conn *c, const bool do_update) {
+    return item_get_hv(key, nkey, hash(key, nkey), c, do_update);
+}
+
+/* As item_get(), for callers which have already hashed the key. */
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, conn *c, const bool do_update) {
     item *it;
-    uint32_t hv;
-    hv = hash(key, nkey);
     item_lock(hv);
     it = do_item_get(key, nkey, hv, c, do_update);
     item_unlock(hv);
@@ -641,6 +742,12 @@ void threadlocal_stats_reset(void) {
         pthread_mutex_lock(&threads[ii].stats.mutex);
 #define X(name) threads[ii].stats.name = 0;
         THREAD_STATS_FIELDS
+#ifdef EXTSTORE
+        EXTSTORE_THREAD_STATS_FIELDS
+#endif
+#ifdef COMPRESSION
+        COMPRESSION_THREAD_STATS_FIELDS
+#endif
 #undef X
 
         memset(&threads[ii].stats.slab_stats, 0,
@@ -663,6 +770,12 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
         pthread_mutex_lock(&threads[ii].stats.mutex);
 #define X(name) stats->name += threads[ii].stats.name;
         THREAD_STATS_FIELDS
+#ifdef EXTSTORE
+        EXTSTORE_THREAD_STATS_FIELDS
+#endif
+#ifdef COMPRESSION
+        COMPRESSION_THREAD_STATS_FIELDS
+#endif
 #undef X
 
         for (sid = 0; sid < MAX_NUMBER_OF_SLAB_CLASSES; sid++) {
@@ -755,6 +868,15 @@ void memcached_thread_init(int nthreads, void *arg) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
+#ifdef NUMA
+    if (settings.numa) {
+        numa_recent = calloc(slabs_numa_nodes(), sizeof(unsigned int));
+        if (numa_recent == NULL) {
+            perror("Can't allocate NUMA dispatch counters");
+            exit(1);
+        }
+    }
+#endif
 
     for (i = 0; i < nthreads; i++) {
         int fds[2];
@@ -765,6 +887,14 @@ void memcached_thread_init(int nthreads, void *arg) {
 
         threads[i].notify_receive_fd = fds[0];
         threads[i].notify_send_fd = fds[1];
+#ifdef EXTSTORE
+        threads[i].storage = arg;
+#endif
+#ifdef NUMA
+        if (settings.numa) {
+            threads[i].numa_node = i % slabs_numa_nodes();
+        }
+#endif
 
         setup_thread(&threads[i]);
         /* Reserve three fds for the libevent base, and two for the pipe */
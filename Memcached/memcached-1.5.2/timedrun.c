@@ -29,6 +29,7 @@ static int wait_for_process(pid_t pid)
     sigaction(SIGINT, &sig_handler, NULL);
     sigaction(SIGTERM, &sig_handler, NULL);
     sigaction(SIGPIPE, &sig_handler, NULL);
+    sigaction(SIGUSR1, &sig_handler, NULL);
 
     /* Loop forever waiting for the process to quit */
     for (i = 0; ;i++) {
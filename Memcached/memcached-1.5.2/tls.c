@@ -0,0 +1,247 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Native TLS for TCP clients. Every connection gets an SSL object on the one
+ * shared context, so session tickets issued by any worker resume on any
+ * other. Reads go through SSL_read, which also drives the handshake.
+ * Responses are gathered into a per-thread buffer and encrypted with one
+ * SSL_write, unless the kernel took over record encryption (kTLS): then the
+ * connection goes back to handing transmit()'s iovecs straight to sendmsg().
+ */
+#include "memcached.h"
+#ifdef TLS
+
+#include "tls.h"
+#include <openssl/err.h>
+#include <errno.h>
+#include <string.h>
+
+/* Any fixed string works; it only has to be set for the session cache. */
+#define SSL_SESSION_ID_CONTEXT "memcached"
+
+int ssl_init(void) {
+    SSL_CTX *ctx;
+    long options = 0;
+
+    if (settings.ssl_chain_cert == NULL || settings.ssl_key == NULL) {
+        fprintf(stderr, "TLS requires ssl_chain_cert and ssl_key\n");
+        return -1;
+    }
+
+    OPENSSL_init_ssl(0, NULL);
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (ctx == NULL) {
+        fprintf(stderr, "Failed to create TLS context\n");
+        ERR_print_errors_fp(stderr);
+        return -1;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    /* transmit() retries a blocked write from the same iovecs, but they are
+     * copied into whichever buffer the thread hands us. */
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE
+            | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    /* Most clients just close the socket; treat that as a normal EOF. */
+    options |= SSL_OP_IGNORE_UNEXPECTED_EOF;
+#endif
+    if (settings.ssl_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+        options |= SSL_OP_ENABLE_KTLS;
+#else
+        fprintf(stderr, "This OpenSSL does not support kTLS; ignoring ssl_ktls\n");
+        settings.ssl_ktls = false;
+#endif
+    }
+
+    if (settings.ssl_session_cache == 0) {
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+        SSL_CTX_set_num_tickets(ctx, 0);
+#endif
+        options |= SSL_OP_NO_TICKET;
+    } else {
+        /* Tickets are stateless; the cache only serves TLSv1.2 session IDs. */
+        SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+        SSL_CTX_sess_set_cache_size(ctx, settings.ssl_session_cache);
+        SSL_CTX_set_session_id_context(ctx,
+                (const unsigned char *)SSL_SESSION_ID_CONTEXT,
+                strlen(SSL_SESSION_ID_CONTEXT));
+    }
+    SSL_CTX_set_options(ctx, options);
+
+    if (!SSL_CTX_use_certificate_chain_file(ctx, settings.ssl_chain_cert)) {
+        fprintf(stderr, "Failed to load certificate chain %s\n",
+                settings.ssl_chain_cert);
+        goto error;
+    }
+    if (!SSL_CTX_use_PrivateKey_file(ctx, settings.ssl_key, SSL_FILETYPE_PEM)
+            || !SSL_CTX_check_private_key(ctx)) {
+        fprintf(stderr, "Failed to load private key %s\n", settings.ssl_key);
+        goto error;
+    }
+    if (settings.ssl_ca_cert != NULL) {
+        STACK_OF(X509_NAME) *names;
+        if (!SSL_CTX_load_verify_locations(ctx, settings.ssl_ca_cert, NULL)
+                || (names = SSL_load_client_CA_file(settings.ssl_ca_cert)) == NULL) {
+            fprintf(stderr, "Failed to load CA certificates %s\n",
+                    settings.ssl_ca_cert);
+            goto error;
+        }
+        SSL_CTX_set_client_CA_list(ctx, names);
+    }
+    switch (settings.ssl_verify_mode) {
+        case 0:
+            SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+            break;
+        case 1:
+            SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+            break;
+        default:
+            SSL_CTX_set_verify(ctx,
+                    SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+            break;
+    }
+    if (settings.ssl_ciphers != NULL
+            && !SSL_CTX_set_cipher_list(ctx, settings.ssl_ciphers)) {
+        fprintf(stderr, "Failed to set ciphers %s\n", settings.ssl_ciphers);
+        goto error;
+    }
+
+    settings.ssl_ctx = ctx;
+    return 0;
+error:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return -1;
+}
+
+/* Sets up an accepted TCP connection to speak TLS. */
+bool ssl_conn_init(conn *c) {
+    SSL *ssl = SSL_new(settings.ssl_ctx);
+    if (ssl == NULL) {
+        return false;
+    }
+    if (!SSL_set_fd(ssl, c->sfd)) {
+        SSL_free(ssl);
+        return false;
+    }
+    SSL_set_accept_state(ssl);
+
+    c->ssl = ssl;
+    c->ssl_handshaked = false;
+    c->ssl_wait = 0;
+    c->read = ssl_read;
+    c->sendmsg = ssl_sendmsg;
+    return true;
+}
+
+void ssl_conn_close(conn *c) {
+    if (c->ssl == NULL)
+        return;
+    /* Best effort close_notify; we don't wait for the peer's. */
+    if (c->ssl_handshaked)
+        SSL_shutdown(c->ssl);
+    SSL_free(c->ssl);
+    c->ssl = NULL;
+}
+
+/* First look at a connection after its handshake finished. */
+static void ssl_handshake_done(conn *c) {
+    bool ktls = false;
+
+    c->ssl_handshaked = true;
+#ifdef BIO_get_ktls_send
+    if (BIO_get_ktls_send(SSL_get_wbio(c->ssl))) {
+        /* The kernel encrypts whatever we send from here on. */
+        c->sendmsg = tcp_sendmsg;
+        ktls = true;
+    }
+#endif
+
+    STATS_LOCK();
+    if (SSL_session_reused(c->ssl)) {
+        stats.ssl_session_reuses++;
+    } else {
+        stats.ssl_new_sessions++;
+    }
+    if (ktls)
+        stats.ssl_ktls_conns++;
+    STATS_UNLOCK();
+}
+
+/*
+ * Maps a failed SSL call onto the read()/sendmsg() conventions callers use.
+ * A read can need the socket writable and a write can need it readable, so
+ * the event to wait for is left in ssl_wait for update_event().
+ */
+static ssize_t ssl_error(conn *c, int ret) {
+    switch (SSL_get_error(c->ssl, ret)) {
+        case SSL_ERROR_WANT_READ:
+            c->ssl_wait = EV_READ;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_WANT_WRITE:
+            c->ssl_wait = EV_WRITE;
+            errno = EAGAIN;
+            return -1;
+        case SSL_ERROR_ZERO_RETURN:
+            return 0;
+        case SSL_ERROR_SYSCALL:
+            if (ret == 0)
+                return 0;
+            /* errno is still set from the failed syscall */
+            return -1;
+        default:
+            if (!c->ssl_handshaked) {
+                STATS_LOCK();
+                stats.ssl_handshake_errors++;
+                STATS_UNLOCK();
+            }
+            if (settings.verbose > 0)
+                ERR_print_errors_fp(stderr);
+            ERR_clear_error();
+            errno = EPROTO;
+            return -1;
+    }
+}
+
+ssize_t ssl_read(conn *c, void *buf, size_t count) {
+    int ret;
+
+    assert(c != NULL && c->ssl != NULL);
+    c->ssl_wait = 0;
+    ret = SSL_read(c->ssl, buf, count);
+    if (!c->ssl_handshaked && SSL_is_init_finished(c->ssl))
+        ssl_handshake_done(c);
+    if (ret > 0)
+        return ret;
+    return ssl_error(c, ret);
+}
+
+/*
+ * Copies as much of the message as fits into the thread's buffer and writes
+ * it as one SSL_write. Anything left over goes out on the next call, as with
+ * a short sendmsg().
+ */
+ssize_t ssl_sendmsg(conn *c, struct msghdr *msg, int flags) {
+    char *buf = c->thread->ssl_wbuf;
+    size_t bytes = 0;
+    int ret;
+    int i;
+
+    assert(c != NULL && c->ssl != NULL);
+    for (i = 0; i < msg->msg_iovlen && bytes < settings.ssl_wbuf_size; i++) {
+        size_t len = msg->msg_iov[i].iov_len;
+        if (len > settings.ssl_wbuf_size - bytes)
+            len = settings.ssl_wbuf_size - bytes;
+        memcpy(buf + bytes, msg->msg_iov[i].iov_base, len);
+        bytes += len;
+    }
+
+    c->ssl_wait = 0;
+    ret = SSL_write(c->ssl, buf, bytes);
+    if (ret > 0)
+        return ret;
+    return ssl_error(c, ret);
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef TLS_H
+#define TLS_H
+
+int ssl_init(void);
+bool ssl_conn_init(conn *c);
+void ssl_conn_close(conn *c);
+ssize_t ssl_read(conn *c, void *buf, size_t count);
+ssize_t ssl_sendmsg(conn *c, struct msghdr *msg, int flags);
+
+#endif
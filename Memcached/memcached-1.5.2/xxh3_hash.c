@@ -0,0 +1,275 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * XXH3 (64-bit, seed 0, default secret), from xxHash by Yann Collet:
+ *    <https://github.com/Cyan4973/xxHash>
+ *    BSD 2-Clause License, Copyright (C) 2012-2021 Yann Collet
+ *
+ * Only the one-shot variant is here; it produces the same values as
+ * XXH3_64bits() from the reference library. Keys are at most 250 bytes, so
+ * nearly everything goes through the short-input paths, which are a handful
+ * of multiplies with no loop at all. Inputs over 240 bytes use the striped
+ * accumulator, vectorized with SSE2 where the compiler allows it.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "xxh3_hash.h"
+
+#define PRIME32_1 0x9E3779B1U
+#define PRIME32_2 0x85EBCA77U
+#define PRIME32_3 0xC2B2AE3DU
+#define PRIME64_1 0x9E3779B185EBCA87ULL
+#define PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3 0x165667B19E3779F9ULL
+#define PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define PRIME64_5 0x27D4EB2F165667C5ULL
+#define PRIME_MX1 0x165667919E3779F9ULL
+#define PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define SECRET_SIZE 192
+#define SECRET_SIZE_MIN 136
+#define STRIPE_LEN 64
+#define SECRET_CONSUME_RATE 8
+#define ACC_NB 8
+#define MIDSIZE_MAX 240
+#define MIDSIZE_STARTOFFSET 3
+#define MIDSIZE_LASTOFFSET 17
+#define SECRET_LASTACC_START 7
+#define SECRET_MERGEACCS_START 11
+
+static const uint8_t kSecret[SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+/* Byte-wise little-endian loads; compilers turn these into a single load on
+ * little-endian targets, and they're correct everywhere else. */
+static inline uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8)
+        | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t read64(const uint8_t *p) {
+    return (uint64_t)read32(p) | ((uint64_t)read32(p + 4) << 32);
+}
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t swap64(uint64_t x) {
+    return ((x << 56) & 0xff00000000000000ULL) |
+           ((x << 40) & 0x00ff000000000000ULL) |
+           ((x << 24) & 0x0000ff0000000000ULL) |
+           ((x << 8)  & 0x000000ff00000000ULL) |
+           ((x >> 8)  & 0x00000000ff000000ULL) |
+           ((x >> 24) & 0x0000000000ff0000ULL) |
+           ((x >> 40) & 0x000000000000ff00ULL) |
+           ((x >> 56) & 0x00000000000000ffULL);
+}
+
+/* 64x64->128 multiply, folded back to 64 bits by xoring the halves. */
+static inline uint64_t mul128_fold64(uint64_t a, uint64_t b) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128_t;
+    uint128_t p = (uint128_t)a * b;
+    return (uint64_t)p ^ (uint64_t)(p >> 64);
+#else
+    uint64_t lo_lo = (a & 0xFFFFFFFF) * (b & 0xFFFFFFFF);
+    uint64_t hi_lo = (a >> 32) * (b & 0xFFFFFFFF);
+    uint64_t lo_hi = (a & 0xFFFFFFFF) * (b >> 32);
+    uint64_t hi_hi = (a >> 32) * (b >> 32);
+    uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+    uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+    return lower ^ upper;
+#endif
+}
+
+static inline uint64_t xxh64_avalanche(uint64_t h) {
+    h ^= h >> 33;
+    h *= PRIME64_2;
+    h ^= h >> 29;
+    h *= PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t xxh3_avalanche(uint64_t h) {
+    h ^= h >> 37;
+    h *= PRIME_MX1;
+    h ^= h >> 32;
+    return h;
+}
+
+static inline uint64_t rrmxmx(uint64_t h, uint64_t len) {
+    h ^= rotl64(h, 49) ^ rotl64(h, 24);
+    h *= PRIME_MX2;
+    h ^= (h >> 35) + len;
+    h *= PRIME_MX2;
+    return h ^ (h >> 28);
+}
+
+static inline uint64_t mix16B(const uint8_t *in, const uint8_t *secret) {
+    return mul128_fold64(read64(in) ^ read64(secret),
+            read64(in + 8) ^ read64(secret + 8));
+}
+
+static uint64_t len_0to16(const uint8_t *in, size_t len) {
+    if (len > 8) {
+        uint64_t lo = read64(in) ^ (read64(kSecret + 24) ^ read64(kSecret + 32));
+        uint64_t hi = read64(in + len - 8) ^ (read64(kSecret + 40) ^ read64(kSecret + 48));
+        uint64_t acc = len + swap64(lo) + hi + mul128_fold64(lo, hi);
+        return xxh3_avalanche(acc);
+    }
+    if (len >= 4) {
+        uint64_t in64 = read32(in + len - 4) + ((uint64_t)read32(in) << 32);
+        return rrmxmx(in64 ^ (read64(kSecret + 8) ^ read64(kSecret + 16)), len);
+    }
+    if (len > 0) {
+        uint32_t combined = ((uint32_t)in[0] << 16) | ((uint32_t)in[len >> 1] << 24)
+            | (uint32_t)in[len - 1] | ((uint32_t)len << 8);
+        return xxh64_avalanche(combined ^ (uint64_t)(read32(kSecret) ^ read32(kSecret + 4)));
+    }
+    return xxh64_avalanche(read64(kSecret + 56) ^ read64(kSecret + 64));
+}
+
+static uint64_t len_17to128(const uint8_t *in, size_t len) {
+    uint64_t acc = len * PRIME64_1;
+    if (len > 32) {
+        if (len > 64) {
+            if (len > 96) {
+                acc += mix16B(in + 48, kSecret + 96);
+                acc += mix16B(in + len - 64, kSecret + 112);
+            }
+            acc += mix16B(in + 32, kSecret + 64);
+            acc += mix16B(in + len - 48, kSecret + 80);
+        }
+        acc += mix16B(in + 16, kSecret + 32);
+        acc += mix16B(in + len - 32, kSecret + 48);
+    }
+    acc += mix16B(in, kSecret);
+    acc += mix16B(in + len - 16, kSecret + 16);
+    return xxh3_avalanche(acc);
+}
+
+static uint64_t len_129to240(const uint8_t *in, size_t len) {
+    uint64_t acc = len * PRIME64_1;
+    int rounds = (int)len / 16;
+    int i;
+    for (i = 0; i < 8; i++) {
+        acc += mix16B(in + 16 * i, kSecret + 16 * i);
+    }
+    acc = xxh3_avalanche(acc);
+    for (i = 8; i < rounds; i++) {
+        acc += mix16B(in + 16 * i, kSecret + 16 * (i - 8) + MIDSIZE_STARTOFFSET);
+    }
+    acc += mix16B(in + len - 16, kSecret + SECRET_SIZE_MIN - MIDSIZE_LASTOFFSET);
+    return xxh3_avalanche(acc);
+}
+
+static inline void accumulate_512(uint64_t *acc, const uint8_t *in,
+        const uint8_t *secret) {
+#if defined(__SSE2__)
+    __m128i *xacc = (__m128i *)acc;
+    int i;
+    for (i = 0; i < STRIPE_LEN / 16; i++) {
+        __m128i data = _mm_loadu_si128((const __m128i *)(in + 16 * i));
+        __m128i key = _mm_loadu_si128((const __m128i *)(secret + 16 * i));
+        __m128i data_key = _mm_xor_si128(data, key);
+        __m128i data_key_lo = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+        __m128i product = _mm_mul_epu32(data_key, data_key_lo);
+        __m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+        xacc[i] = _mm_add_epi64(product, _mm_add_epi64(xacc[i], swapped));
+    }
+#else
+    int i;
+    for (i = 0; i < ACC_NB; i++) {
+        uint64_t data = read64(in + 8 * i);
+        uint64_t data_key = data ^ read64(secret + 8 * i);
+        acc[i ^ 1] += data;
+        acc[i] += (data_key & 0xFFFFFFFF) * (data_key >> 32);
+    }
+#endif
+}
+
+static void scramble(uint64_t *acc, const uint8_t *secret) {
+    int i;
+    for (i = 0; i < ACC_NB; i++) {
+        uint64_t a = acc[i];
+        a ^= a >> 47;
+        a ^= read64(secret + 8 * i);
+        a *= PRIME32_1;
+        acc[i] = a;
+    }
+}
+
+static uint64_t len_long(const uint8_t *in, size_t len) {
+#if defined(__SSE2__)
+    __m128i xacc[ACC_NB / 2];
+    uint64_t *acc = (uint64_t *)xacc;
+#else
+    uint64_t acc[ACC_NB];
+#endif
+    const size_t stripes_per_block = (SECRET_SIZE - STRIPE_LEN) / SECRET_CONSUME_RATE;
+    const size_t block_len = STRIPE_LEN * stripes_per_block;
+    const size_t blocks = (len - 1) / block_len;
+    size_t n, s, stripes;
+    uint64_t result;
+
+    acc[0] = PRIME32_3; acc[1] = PRIME64_1; acc[2] = PRIME64_2; acc[3] = PRIME64_3;
+    acc[4] = PRIME64_4; acc[5] = PRIME32_2; acc[6] = PRIME64_5; acc[7] = PRIME32_1;
+
+    for (n = 0; n < blocks; n++) {
+        for (s = 0; s < stripes_per_block; s++) {
+            accumulate_512(acc, in + n * block_len + s * STRIPE_LEN,
+                    kSecret + s * SECRET_CONSUME_RATE);
+        }
+        scramble(acc, kSecret + SECRET_SIZE - STRIPE_LEN);
+    }
+    stripes = ((len - 1) - block_len * blocks) / STRIPE_LEN;
+    for (s = 0; s < stripes; s++) {
+        accumulate_512(acc, in + blocks * block_len + s * STRIPE_LEN,
+                kSecret + s * SECRET_CONSUME_RATE);
+    }
+    accumulate_512(acc, in + len - STRIPE_LEN,
+            kSecret + SECRET_SIZE - STRIPE_LEN - SECRET_LASTACC_START);
+
+    result = len * PRIME64_1;
+    for (n = 0; n < 4; n++) {
+        const uint8_t *secret = kSecret + SECRET_MERGEACCS_START + 16 * n;
+        result += mul128_fold64(acc[2 * n] ^ read64(secret),
+                acc[2 * n + 1] ^ read64(secret + 8));
+    }
+    return xxh3_avalanche(result);
+}
+
+uint64_t XXH3_64bits(const void *key, size_t length) {
+    const uint8_t *in = (const uint8_t *)key;
+    if (length <= 16)
+        return len_0to16(in, length);
+    if (length <= 128)
+        return len_17to128(in, length);
+    if (length <= MIDSIZE_MAX)
+        return len_129to240(in, length);
+    return len_long(in, length);
+}
+
+/* The hash table and item locks mask off low bits, which XXH3 mixes as well
+ * as the high ones. */
+uint32_t xxh3_hash(const void *key, size_t length) {
+    return (uint32_t)XXH3_64bits(key, length);
+}
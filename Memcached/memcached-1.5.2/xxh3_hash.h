@@ -0,0 +1,15 @@
+#ifndef XXH3_HASH_H
+#define    XXH3_HASH_H
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+uint64_t XXH3_64bits(const void *key, size_t length);
+uint32_t xxh3_hash(const void *key, size_t length);
+
+#ifdef    __cplusplus
+}
+#endif
+
+#endif    /* XXH3_HASH_H */
@@ -415,6 +415,7 @@ void clusterInit(void) {
     server.cluster->lastVoteEpoch = 0;
     server.cluster->stats_bus_messages_sent = 0;
     server.cluster->stats_bus_messages_received = 0;
+    server.cluster->stats_pfail_nodes = 0;
     memset(server.cluster->slots,0, sizeof(server.cluster->slots));
     clusterCloseAllSlots();
 
@@ -1294,19 +1295,25 @@ void clusterProcessGossipSection(clusterMsg *hdr, clusterLink *link) {
     uint16_t count = ntohs(hdr->count);
     clusterMsgDataGossip *g = (clusterMsgDataGossip*) hdr->data.ping.gossip;
     clusterNode *sender = link->node ? link->node : clusterLookupNode(hdr->sender);
+    mstime_t now = mstime();
 
     while(count--) {
         uint16_t flags = ntohs(g->flags);
         clusterNode *node;
         sds ci;
 
-        ci = representClusterNodeFlags(sdsempty(), flags);
-        serverLog(LL_DEBUG,"GOSSIP %.40s %s:%d %s",
-            g->nodename,
-            g->ip,
-            ntohs(g->port),
-            ci);
-        sdsfree(ci);
+        /* Formatting the flags is not free: in big clusters we process
+         * many gossip entries per second, so do it only when the log
+         * line is actually going to be emitted. */
+        if (server.verbosity == LL_DEBUG) {
+            ci = representClusterNodeFlags(sdsempty(), flags);
+            serverLog(LL_DEBUG,"GOSSIP %.40s %s:%d %s",
+                g->nodename,
+                g->ip,
+                ntohs(g->port),
+                ci);
+            sdsfree(ci);
+        }
 
         /* Update our state accordingly to the gossip sections */
         node = clusterLookupNode(g->nodename);
@@ -1330,6 +1337,35 @@ void clusterProcessGossipSection(clusterMsg *hdr, clusterLink *link) {
                 }
             }
 
+            /* If from our POV the node is up (no failure flags are set),
+             * we have no pending ping for the node, nor we have failure
+             * reports for this node, update the last pong time with the
+             * one we see from the other nodes. This way we don't need to
+             * ping every node directly every node_timeout/2 if the rest of
+             * the cluster is already talking with it, which is what makes
+             * the bus traffic grow with the square of the number of nodes.
+             *
+             * Senders not setting CLUSTERMSG_FLAG0_GOSSIP_SECS encode the
+             * times in a way we can't trust, so they are ignored. */
+            if (hdr->mflags[0] & CLUSTERMSG_FLAG0_GOSSIP_SECS &&
+                !(flags & (CLUSTER_NODE_FAIL|CLUSTER_NODE_PFAIL)) &&
+                node->ping_sent == 0 &&
+                clusterNodeFailureReportsCount(node) == 0)
+            {
+                mstime_t pongtime = ntohl(g->pong_received);
+                pongtime *= 1000; /* Convert back to milliseconds. */
+
+                /* Replace the pong time with the received one only if
+                 * it's greater than our view but is not in the future
+                 * (with 500 milliseconds tolerance) from the POV of our
+                 * clock. */
+                if (pongtime <= (now+500) &&
+                    pongtime > node->pong_received)
+                {
+                    node->pong_received = pongtime;
+                }
+            }
+
             /* If we already know this node, but it is not reachable, and
              * we see a different address in the gossip section of a node that
              * can talk with this other node, update the address, disconnect
@@ -2156,6 +2192,7 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* Set the message flags. */
     if (nodeIsMaster(myself) && server.cluster->mf_end)
         hdr->mflags[0] |= CLUSTERMSG_FLAG0_PAUSED;
+    hdr->mflags[0] |= CLUSTERMSG_FLAG0_GOSSIP_SECS;
 
     /* Compute the message length for certain messages. For other messages
      * this is up to the caller. */
@@ -2170,6 +2207,21 @@ void clusterBuildMessageHdr(clusterMsg *hdr, int type) {
     /* For PING, PONG, and MEET, fixing the totlen field is up to the caller. */
 }
 
+/* Set the i-th entry of the gossip section in the message pointed by 'hdr'
+ * to the info of the specified node 'n'. */
+void clusterSetGossipEntry(clusterMsg *hdr, int i, clusterNode *n) {
+    clusterMsgDataGossip *gossip;
+    gossip = &(hdr->data.ping.gossip[i]);
+    memcpy(gossip->nodename,n->name,CLUSTER_NAMELEN);
+    gossip->ping_sent = htonl(n->ping_sent/1000);
+    gossip->pong_received = htonl(n->pong_received/1000);
+    memcpy(gossip->ip,n->ip,sizeof(n->ip));
+    gossip->port = htons(n->port);
+    gossip->flags = htons(n->flags);
+    gossip->notused1 = 0;
+    gossip->notused2 = 0;
+}
+
 /* Send a PING or PONG packet to the specified node, making sure to add enough
  * gossip informations. */
 void clusterSendPing(clusterLink *link, int type) {
@@ -2214,11 +2266,20 @@ void clusterSendPing(clusterLink *link, int type) {
     if (wanted < 3) wanted = 3;
     if (wanted > freshnodes) wanted = freshnodes;
 
+    /* Include all the nodes in PFAIL state, so that failure reports are
+     * faster to propagate to go from PFAIL to FAIL state: every PING and
+     * PONG we send piggybacks the failure reports we have, instead of
+     * relying on the random sampling above to eventually pick them.
+     * The random sample keeps scaling with the cluster size as explained
+     * above: it no longer has to carry the failure reports, so it is not
+     * grown any further. */
+    int pfail_wanted = server.cluster->stats_pfail_nodes;
+
     /* Compute the maxium totlen to allocate our buffer. We'll fix the totlen
      * later according to the number of gossip sections we really were able
      * to put inside the packet. */
     totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
-    totlen += (sizeof(clusterMsgDataGossip)*wanted);
+    totlen += (sizeof(clusterMsgDataGossip)*(wanted+pfail_wanted));
     /* Note: clusterBuildMessageHdr() expects the buffer to be always at least
      * sizeof(clusterMsg) or more. */
     if (totlen < (int)sizeof(clusterMsg)) totlen = sizeof(clusterMsg);
@@ -2235,17 +2296,14 @@ void clusterSendPing(clusterLink *link, int type) {
     while(freshnodes > 0 && gossipcount < wanted && maxiterations--) {
         dictEntry *de = dictGetRandomKey(server.cluster->nodes);
         clusterNode *this = dictGetVal(de);
-        clusterMsgDataGossip *gossip;
         int j;
 
         /* Don't include this node: the whole packet header is about us
          * already, so we just gossip about other nodes. */
         if (this == myself) continue;
 
-        /* Give a bias to FAIL/PFAIL nodes. */
-        if (maxiterations > wanted*2 &&
-            !(this->flags & (CLUSTER_NODE_PFAIL|CLUSTER_NODE_FAIL)))
-            continue;
+        /* PFAIL nodes will be added at the end. */
+        if (this->flags & CLUSTER_NODE_PFAIL) continue;
 
         /* In the gossip section don't include:
          * 1) Nodes in HANDSHAKE state.
@@ -2267,19 +2325,33 @@ void clusterSendPing(clusterLink *link, int type) {
         if (j != gossipcount) continue;
 
         /* Add it */
+        clusterSetGossipEntry(hdr,gossipcount,this);
         freshnodes--;
-        gossip = &(hdr->data.ping.gossip[gossipcount]);
-        memcpy(gossip->nodename,this->name,CLUSTER_NAMELEN);
-        gossip->ping_sent = htonl(this->ping_sent);
-        gossip->pong_received = htonl(this->pong_received);
-        memcpy(gossip->ip,this->ip,sizeof(this->ip));
-        gossip->port = htons(this->port);
-        gossip->flags = htons(this->flags);
-        gossip->notused1 = 0;
-        gossip->notused2 = 0;
         gossipcount++;
     }
 
+    /* If there are PFAIL nodes, add them at the end. */
+    if (pfail_wanted) {
+        dictIterator *di;
+        dictEntry *de;
+
+        di = dictGetSafeIterator(server.cluster->nodes);
+        while((de = dictNext(di)) != NULL && pfail_wanted > 0) {
+            clusterNode *node = dictGetVal(de);
+            if (node->flags & CLUSTER_NODE_HANDSHAKE) continue;
+            if (node->flags & CLUSTER_NODE_NOADDR) continue;
+            if (!(node->flags & CLUSTER_NODE_PFAIL)) continue;
+            clusterSetGossipEntry(hdr,gossipcount,node);
+            freshnodes--;
+            gossipcount++;
+            /* We take the count of the slots we allocated, since the
+             * PFAIL stats may not match perfectly with the current number
+             * of PFAIL nodes. */
+            pfail_wanted--;
+        }
+        dictReleaseIterator(di);
+    }
+
     /* Ready to send... fix the totlen fiend and queue the message in the
      * output buffer. */
     totlen = sizeof(clusterMsg)-sizeof(union clusterMsgData);
@@ -3066,6 +3138,7 @@ void clusterCron(void) {
     int orphaned_masters; /* How many masters there are without ok slaves. */
     int max_slaves; /* Max number of ok slaves for a single master. */
     int this_slaves; /* Number of ok slaves for our master (if we are slave). */
+    int pfail_nodes = 0; /* Number of nodes in PFAIL state. */
     mstime_t min_pong = 0, now = mstime();
     clusterNode *min_pong_node = NULL;
     static unsigned long long iteration = 0;
@@ -3192,6 +3265,12 @@ void clusterCron(void) {
             (CLUSTER_NODE_MYSELF|CLUSTER_NODE_NOADDR|CLUSTER_NODE_HANDSHAKE))
                 continue;
 
+        /* Count the number of nodes in PFAIL state, so that
+         * clusterSendPing() knows how many gossip entries to reserve
+         * for the failure reports it piggybacks. The stat is only updated
+         * after the loop, since the loop itself sends pings. */
+        if (nodeTimedOut(node)) pfail_nodes++;
+
         /* Orphaned master check, useful only if the current instance
          * is a slave that may migrate to another master. */
         if (nodeIsSlave(myself) && nodeIsMaster(node) && !nodeFailed(node)) {
@@ -3268,6 +3347,7 @@ void clusterCron(void) {
         }
     }
     dictReleaseIterator(di);
+    server.cluster->stats_pfail_nodes = pfail_nodes;
 
     /* If we are a slave node but the replication is still turned off,
      * enable it if we know the address of our master and it appears to
@@ -4642,11 +4722,58 @@ void migrateCloseTimedoutSockets(void) {
     dictReleaseIterator(di);
 }
 
+/* Append to 'cmd' the RESTORE (or RESTORE-ASKING in cluster mode) commands
+ * needed to create in the target instance the 'num_keys' keys 'kv' of 'db',
+ * having values 'ov'. */
+void migrateWriteRestoreCommands(rio *cmd, redisDb *db, robj **kv, robj **ov,
+                                 int num_keys, int replace)
+{
+    rio payload;
+    int j;
+
+    for (j = 0; j < num_keys; j++) {
+        long long ttl = 0;
+        long long expireat = getExpire(db,kv[j]);
+
+        if (expireat != -1) {
+            ttl = expireat-mstime();
+            if (ttl < 1) ttl = 1;
+        }
+        serverAssert(rioWriteBulkCount(cmd,'*',replace ? 5 : 4));
+        if (server.cluster_enabled)
+            serverAssert(rioWriteBulkString(cmd,"RESTORE-ASKING",14));
+        else
+            serverAssert(rioWriteBulkString(cmd,"RESTORE",7));
+        serverAssert(sdsEncodedObject(kv[j]));
+        serverAssert(rioWriteBulkString(cmd,kv[j]->ptr,sdslen(kv[j]->ptr)));
+        serverAssert(rioWriteBulkLongLong(cmd,ttl));
+
+        /* Emit the payload argument, that is the serialized object using
+         * the DUMP format. */
+        createDumpPayload(&payload,ov[j]);
+        serverAssert(rioWriteBulkString(cmd,payload.io.buffer.ptr,
+                                        sdslen(payload.io.buffer.ptr)));
+        sdsfree(payload.io.buffer.ptr);
+
+        /* Add the REPLACE option to the RESTORE command if it was specified
+         * as a MIGRATE option. */
+        if (replace)
+            serverAssert(rioWriteBulkString(cmd,"REPLACE",7));
+    }
+}
+
+void migrateAsyncStart(client *c, long dbid, long timeout, int copy,
+                       int replace, robj **kv, int num_keys);
+
 /* MIGRATE host port key dbid timeout [COPY | REPLACE]
  *
  * On in the multiple keys form:
  *
- * MIGRATE host port "" dbid timeout [COPY | REPLACE] KEYS key1 key2 ... keyN */
+ * MIGRATE host port "" dbid timeout [COPY | REPLACE] KEYS key1 key2 ... keyN
+ *
+ * When the caller can be blocked, the transfer is performed by the
+ * non blocking implementation in migrateAsyncStart(), otherwise (MULTI/EXEC,
+ * scripts) the server waits for the target instance synchronously. */
 void migrateCommand(client *c) {
     migrateCachedSocket *cs;
     int copy, replace, j;
@@ -4655,7 +4782,7 @@ void migrateCommand(client *c) {
     robj **ov = NULL; /* Objects to migrate. */
     robj **kv = NULL; /* Key names. */
     robj **newargv = NULL; /* Used to rewrite the command as DEL ... keys ... */
-    rio cmd, payload;
+    rio cmd;
     int may_retry = 1;
     int write_error = 0;
     int argv_rewritten = 0;
@@ -4720,6 +4847,13 @@ void migrateCommand(client *c) {
         return;
     }
 
+    /* Don't stop the world if we can block just the caller. */
+    if (!(c->flags & (CLIENT_MULTI|CLIENT_LUA)) && c->fd != -1) {
+        migrateAsyncStart(c,dbid,timeout,copy,replace,kv,num_keys);
+        zfree(ov); zfree(kv);
+        return;
+    }
+
 try_again:
     write_error = 0;
 
@@ -4741,38 +4875,7 @@ try_again:
     }
 
     /* Create RESTORE payload and generate the protocol to call the command. */
-    for (j = 0; j < num_keys; j++) {
-        long long ttl = 0;
-        long long expireat = getExpire(c->db,kv[j]);
-
-        if (expireat != -1) {
-            ttl = expireat-mstime();
-            if (ttl < 1) ttl = 1;
-        }
-        serverAssertWithInfo(c,NULL,rioWriteBulkCount(&cmd,'*',replace ? 5 : 4));
-        if (server.cluster_enabled)
-            serverAssertWithInfo(c,NULL,
-                rioWriteBulkString(&cmd,"RESTORE-ASKING",14));
-        else
-            serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"RESTORE",7));
-        serverAssertWithInfo(c,NULL,sdsEncodedObject(kv[j]));
-        serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,kv[j]->ptr,
-                sdslen(kv[j]->ptr)));
-        serverAssertWithInfo(c,NULL,rioWriteBulkLongLong(&cmd,ttl));
-
-        /* Emit the payload argument, that is the serialized object using
-         * the DUMP format. */
-        createDumpPayload(&payload,ov[j]);
-        serverAssertWithInfo(c,NULL,
-            rioWriteBulkString(&cmd,payload.io.buffer.ptr,
-                               sdslen(payload.io.buffer.ptr)));
-        sdsfree(payload.io.buffer.ptr);
-
-        /* Add the REPLACE option to the RESTORE command if it was specified
-         * as a MIGRATE option. */
-        if (replace)
-            serverAssertWithInfo(c,NULL,rioWriteBulkString(&cmd,"REPLACE",7));
-    }
+    migrateWriteRestoreCommands(&cmd,c->db,kv,ov,num_keys,replace);
 
     /* Transfer the query to the other node in 64K chunks. */
     errno = 0;
@@ -4921,6 +5024,473 @@ socket_err:
     return;
 }
 
+/* -----------------------------------------------------------------------------
+ * Non blocking MIGRATE
+ *
+ * The synchronous implementation above blocks the whole server while the
+ * payload is transferred and the target replies, which is especially bad
+ * during resharding of big keys. Here the RESTORE commands are instead queued
+ * into a persistent non blocking link with the target instance, driven by
+ * the event loop, and only the calling client is blocked (BLOCKED_MIGRATE)
+ * until all the replies are received.
+ *
+ * Links are pipelined: jobs of different clients can be in flight at the same
+ * time on the same link, and replies are matched with jobs in FIFO order.
+ *
+ * Since keys remain readable and writable while they are in flight, every
+ * job uses a fake client WATCHing the keys it serialized. An acknowledged key
+ * is removed from the local instance only if no key of the job was touched
+ * after serialization, otherwise it is transferred again with REPLACE, up to
+ * MIGRATE_ASYNC_MAX_ATTEMPTS times. Keys deleted locally in the meantime are
+ * deleted on the target too, since it already has an old version of them.
+ * -------------------------------------------------------------------------- */
+
+#define MIGRATE_ASYNC_MAX_ATTEMPTS 3
+#define MIGRATE_ASYNC_IOBUF_LEN (1024*16)
+
+typedef struct migrateAsyncLink {
+    sds name;               /* host:port, key in server.migrate_async_links. */
+    int fd;                 /* Non blocking socket. */
+    int connected;          /* True once the connect() completed. */
+    sds sndbuf;             /* Data to send to the target. */
+    size_t sndpos;          /* Bytes of sndbuf already sent. */
+    sds rcvbuf;             /* Received data not yet processed. */
+    list *jobs;             /* Jobs waiting for replies, oldest first. */
+    mstime_t last_io_time;  /* Last time the link made progress. */
+    time_t last_use_time;   /* Last time a job was queued. */
+} migrateAsyncLink;
+
+typedef struct migrateJob {
+    client *c;              /* Client blocked waiting for us, or NULL. */
+    migrateAsyncLink *link; /* Link the job is queued into. */
+    redisDb *db;            /* Local DB of the keys. */
+    long dbid;              /* Target DB ID. */
+    long timeout;           /* I/O timeout in milliseconds. */
+    int copy, replace;      /* MIGRATE options. */
+    int attempts;           /* Number of transfers queued so far. */
+    robj **kv;              /* Keys to transfer. */
+    int num_keys;
+    int num_gone;           /* Last keys of kv, sent as DEL: they are no
+                               longer here but the target has them. */
+    int acked;              /* RESTORE or DEL replies received so far. */
+    int select_pending;     /* Still waiting for the SELECT reply. */
+    int asking_acked;       /* ASKING replied, the DEL reply is next. */
+    robj **retry;           /* Keys to transfer again with REPLACE. */
+    int num_retry;
+    sds error;              /* First error reply of the target, or NULL. */
+    client *watcher;        /* Fake client watching the keys. */
+} migrateJob;
+
+void migrateAsyncReadHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void migrateAsyncWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask);
+void migrateAsyncFreeLink(migrateAsyncLink *link, int write_error);
+
+/* Return a link connected (or connecting) with host:port, creating a new
+ * one if needed. On error a reply is sent to the client and NULL is
+ * returned. */
+migrateAsyncLink *migrateAsyncGetLink(client *c, robj *host, robj *port) {
+    migrateAsyncLink *link;
+    sds name = sdsempty();
+    int fd;
+
+    name = sdscatlen(name,host->ptr,sdslen(host->ptr));
+    name = sdscatlen(name,":",1);
+    name = sdscatlen(name,port->ptr,sdslen(port->ptr));
+    link = dictFetchValue(server.migrate_async_links,name);
+    if (link) {
+        sdsfree(name);
+        return link;
+    }
+
+    /* Too many links: drop an idle one at random, if any. */
+    if (dictSize(server.migrate_async_links) >= MIGRATE_SOCKET_CACHE_ITEMS) {
+        dictEntry *de = dictGetRandomKey(server.migrate_async_links);
+        migrateAsyncLink *victim = dictGetVal(de);
+        if (listLength(victim->jobs) == 0) migrateAsyncFreeLink(victim,0);
+    }
+
+    fd = anetTcpNonBlockConnect(server.neterr,host->ptr,atoi(port->ptr));
+    if (fd == -1) {
+        sdsfree(name);
+        addReplyErrorFormat(c,"Can't connect to target node: %s",
+            server.neterr);
+        return NULL;
+    }
+    anetEnableTcpNoDelay(server.neterr,fd);
+
+    link = zmalloc(sizeof(*link));
+    link->name = name;
+    link->fd = fd;
+    link->connected = 0;
+    link->sndbuf = sdsempty();
+    link->sndpos = 0;
+    link->rcvbuf = sdsempty();
+    link->jobs = listCreate();
+    link->last_io_time = mstime();
+    link->last_use_time = server.unixtime;
+    if (aeCreateFileEvent(server.el,fd,AE_READABLE,
+        migrateAsyncReadHandler,link) == AE_ERR)
+    {
+        addReplyError(c,"Can't create readable event for MIGRATE");
+        close(fd);
+        listRelease(link->jobs);
+        sdsfree(link->sndbuf);
+        sdsfree(link->rcvbuf);
+        sdsfree(name);
+        zfree(link);
+        return NULL;
+    }
+    dictAdd(server.migrate_async_links,name,link);
+    return link;
+}
+
+/* Release a job, replying to the client if it is still blocked on it. */
+void migrateJobFinish(migrateJob *job, sds ioerror) {
+    if (job->c) {
+        client *c = job->c;
+
+        if (ioerror) {
+            addReplySds(c,sdsdup(ioerror));
+        } else if (job->error) {
+            addReplyErrorFormat(c,"Target instance replied with error: %s",
+                job->error);
+        } else if (job->num_retry) {
+            addReplyError(c,"Keys modified while being migrated, "
+                            "try again");
+        } else {
+            addReply(c,shared.ok);
+        }
+        unblockClient(c); /* Sets job->c to NULL. */
+    }
+
+    while(job->num_keys) decrRefCount(job->kv[--job->num_keys]);
+    while(job->num_retry) decrRefCount(job->retry[--job->num_retry]);
+    zfree(job->kv);
+    zfree(job->retry);
+    sdsfree(job->error);
+    freeClient(job->watcher);
+    zfree(job);
+}
+
+/* Serialize the keys of the job that still exist, and queue them into the
+ * link output buffer. When transferring again, keys that no longer exist
+ * are queued as DEL, since the target got them the first time. Return the
+ * number of keys queued. */
+int migrateJobQueue(migrateJob *job) {
+    migrateAsyncLink *link = job->link;
+    robj **ov = zmalloc(sizeof(robj*)*job->num_keys);
+    robj **gone = zmalloc(sizeof(robj*)*job->num_keys);
+    rio cmd;
+    int j, num_keys = 0, num_gone = 0;
+
+    unwatchAllKeys(job->watcher);
+    job->watcher->flags &= ~CLIENT_DIRTY_CAS;
+    for (j = 0; j < job->num_keys; j++) {
+        robj *o = lookupKeyRead(job->db,job->kv[j]);
+
+        if (o == NULL) {
+            if (job->attempts == 0)
+                decrRefCount(job->kv[j]);
+            else
+                gone[num_gone++] = job->kv[j];
+            continue;
+        }
+        job->kv[num_keys] = job->kv[j];
+        ov[num_keys] = o;
+        num_keys++;
+    }
+    memcpy(job->kv+num_keys,gone,sizeof(robj*)*num_gone);
+    zfree(gone);
+    job->num_keys = num_keys+num_gone;
+    job->num_gone = num_gone;
+    job->acked = 0;
+    if (job->num_keys == 0) {
+        zfree(ov);
+        return 0;
+    }
+    /* Deleted keys are watched too: if they come back, they are
+     * transferred again. */
+    for (j = 0; j < job->num_keys; j++)
+        watchForKey(job->watcher,job->kv[j]);
+
+    /* Pipelined jobs may target different DBs, so every job selects its
+     * own DB. */
+    rioInitWithBuffer(&cmd,link->sndbuf);
+    serverAssert(rioWriteBulkCount(&cmd,'*',2));
+    serverAssert(rioWriteBulkString(&cmd,"SELECT",6));
+    serverAssert(rioWriteBulkLongLong(&cmd,job->dbid));
+    job->select_pending = 1;
+    migrateWriteRestoreCommands(&cmd,job->db,job->kv,ov,num_keys,
+                                job->replace);
+    for (j = num_keys; j < job->num_keys; j++) {
+        robj *key = job->kv[j];
+
+        if (server.cluster_enabled) {
+            serverAssert(rioWriteBulkCount(&cmd,'*',1));
+            serverAssert(rioWriteBulkString(&cmd,"ASKING",6));
+        }
+        serverAssert(rioWriteBulkCount(&cmd,'*',2));
+        serverAssert(rioWriteBulkString(&cmd,"DEL",3));
+        serverAssert(sdsEncodedObject(key));
+        serverAssert(rioWriteBulkString(&cmd,key->ptr,sdslen(key->ptr)));
+    }
+    link->sndbuf = cmd.io.buffer.ptr;
+    zfree(ov);
+
+    if (listLength(link->jobs) == 0) link->last_io_time = mstime();
+    listAddNodeTail(link->jobs,job);
+    link->last_use_time = server.unixtime;
+    job->attempts++;
+    /* If we are still connecting, the writable event also signals the
+     * connect() completion. */
+    aeCreateFileEvent(server.el,link->fd,AE_WRITABLE,
+                      migrateAsyncWriteHandler,link);
+    return job->num_keys;
+}
+
+/* Called by migrateCommand() to transfer 'kv' in the background. */
+void migrateAsyncStart(client *c, long dbid, long timeout, int copy,
+                       int replace, robj **kv, int num_keys)
+{
+    migrateAsyncLink *link;
+    migrateJob *job;
+    int j;
+
+    link = migrateAsyncGetLink(c,c->argv[1],c->argv[2]);
+    if (link == NULL) return; /* Error already sent to the client. */
+
+    job = zcalloc(sizeof(*job));
+    job->link = link;
+    job->db = c->db;
+    job->dbid = dbid;
+    job->timeout = timeout;
+    job->copy = copy;
+    job->replace = replace;
+    job->kv = zmalloc(sizeof(robj*)*num_keys);
+    for (j = 0; j < num_keys; j++) {
+        job->kv[j] = kv[j];
+        incrRefCount(kv[j]);
+    }
+    job->num_keys = num_keys;
+    job->retry = zmalloc(sizeof(robj*)*num_keys);
+    job->watcher = createClient(-1);
+    selectDb(job->watcher,c->db->id);
+
+    if (migrateJobQueue(job) == 0) {
+        migrateJobFinish(job,NULL);
+        addReplySds(c,sdsnew("+NOKEY\r\n"));
+        return;
+    }
+    job->c = c;
+    c->bpop.migrate_job = job;
+    /* The job has its own timeout: don't let clientsCronHandleTimeout()
+     * pick up the one left by a previous BLPOP or WAIT. */
+    c->bpop.timeout = 0;
+    blockClient(c,BLOCKED_MIGRATE);
+}
+
+/* Called by unblockClient(): the job goes on but has no one to reply to. */
+void unblockClientWaitingMigration(client *c) {
+    migrateJob *job = c->bpop.migrate_job;
+
+    serverAssert(job != NULL && job->c == c);
+    job->c = NULL;
+    c->bpop.migrate_job = NULL;
+}
+
+/* Process a single reply line of the target instance, that belongs to the
+ * oldest job of the link. */
+void migrateJobProcessReply(migrateJob *job, char *line) {
+    robj *key;
+    int gone;
+
+    if (job->select_pending) {
+        job->select_pending = 0;
+        if (line[0] == '-' && job->error == NULL) job->error = sdsnew(line+1);
+        return;
+    }
+
+    gone = job->acked >= job->num_keys - job->num_gone;
+    if (gone && server.cluster_enabled && !job->asking_acked) {
+        job->asking_acked = 1;
+        if (line[0] == '-' && job->error == NULL) job->error = sdsnew(line+1);
+        return;
+    }
+    job->asking_acked = 0;
+
+    key = job->kv[job->acked++];
+    if (line[0] == '-') {
+        if (job->error == NULL) job->error = sdsnew(line+1);
+    } else if (job->watcher->flags & CLIENT_DIRTY_CAS) {
+        /* The key may have changed after we serialized it: the target
+         * may have an old version, send it again. */
+        job->retry[job->num_retry++] = key;
+        incrRefCount(key);
+    } else if (!job->copy && !gone) {
+        /* No COPY option: remove the local key, signal the change. The DEL
+         * is propagated right away, so AOF and slaves see it after any
+         * write the key got while it was in flight, and before later ones. */
+        dbDelete(job->db,key);
+        signalModifiedKey(job->db,key);
+        propagateExpire(job->db,key);
+        server.dirty++;
+        /* We touched the watched key ourselves. */
+        job->watcher->flags &= ~CLIENT_DIRTY_CAS;
+    }
+
+    if (job->select_pending || job->acked != job->num_keys) return;
+
+    /* All the replies received. */
+    listDelNode(job->link->jobs,listFirst(job->link->jobs));
+    if (job->num_retry && job->error == NULL &&
+        job->attempts < MIGRATE_ASYNC_MAX_ATTEMPTS)
+    {
+        int j;
+
+        for (j = 0; j < job->num_keys; j++) decrRefCount(job->kv[j]);
+        memcpy(job->kv,job->retry,sizeof(robj*)*job->num_retry);
+        job->num_keys = job->num_retry;
+        job->num_retry = 0;
+        job->replace = 1; /* The target has an old version of the keys. */
+        if (migrateJobQueue(job)) return;
+    }
+    migrateJobFinish(job,NULL);
+}
+
+void migrateAsyncWriteHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateAsyncLink *link = privdata;
+    size_t written = 0;
+    UNUSED(el);
+    UNUSED(mask);
+
+    if (!link->connected) {
+        int sockerr = 0;
+        socklen_t errlen = sizeof(sockerr);
+
+        if (getsockopt(fd,SOL_SOCKET,SO_ERROR,&sockerr,&errlen) == -1)
+            sockerr = errno;
+        if (sockerr) {
+            serverLog(LL_VERBOSE,"MIGRATE: error connecting to %s: %s",
+                link->name, strerror(sockerr));
+            migrateAsyncFreeLink(link,1);
+            return;
+        }
+        link->connected = 1;
+    }
+
+    while(link->sndpos < sdslen(link->sndbuf)) {
+        ssize_t nwritten = write(fd,link->sndbuf+link->sndpos,
+                                 sdslen(link->sndbuf)-link->sndpos);
+        if (nwritten <= 0) {
+            if (nwritten == -1 && errno == EAGAIN) break;
+            serverLog(LL_VERBOSE,"MIGRATE: error writing to %s: %s",
+                link->name, nwritten == -1 ? strerror(errno) : "closed");
+            migrateAsyncFreeLink(link,1);
+            return;
+        }
+        link->sndpos += nwritten;
+        link->last_io_time = mstime();
+        written += nwritten;
+        /* Don't monopolize the event loop with big payloads. */
+        if (written > NET_MAX_WRITES_PER_EVENT) break;
+    }
+
+    if (link->sndpos == sdslen(link->sndbuf)) {
+        sdsclear(link->sndbuf);
+        link->sndpos = 0;
+        aeDeleteFileEvent(server.el,fd,AE_WRITABLE);
+    }
+}
+
+void migrateAsyncReadHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
+    migrateAsyncLink *link = privdata;
+    ssize_t nread;
+    char *p, *nl;
+    UNUSED(el);
+    UNUSED(mask);
+
+    link->rcvbuf = sdsMakeRoomFor(link->rcvbuf,MIGRATE_ASYNC_IOBUF_LEN);
+    nread = read(fd,link->rcvbuf+sdslen(link->rcvbuf),
+                 MIGRATE_ASYNC_IOBUF_LEN);
+    if (nread == -1 && errno == EAGAIN) return;
+    if (nread <= 0) {
+        /* Idle cached links closed by the target are a normal condition. */
+        if (listLength(link->jobs))
+            serverLog(LL_VERBOSE,"MIGRATE: error reading from %s: %s",
+                link->name, nread == -1 ? strerror(errno) : "closed");
+        migrateAsyncFreeLink(link,0);
+        return;
+    }
+    sdsIncrLen(link->rcvbuf,nread);
+    link->last_io_time = mstime();
+
+    /* Process every full reply line. SELECT and RESTORE only reply with
+     * status or error replies. */
+    p = link->rcvbuf;
+    while((nl = memchr(p,'\n',sdslen(link->rcvbuf)-(p-link->rcvbuf)))) {
+        if (listLength(link->jobs) == 0) {
+            serverLog(LL_WARNING,"MIGRATE: unexpected reply from %s",
+                link->name);
+            migrateAsyncFreeLink(link,0);
+            return;
+        }
+        if (nl > p && nl[-1] == '\r') nl[-1] = '\0';
+        nl[0] = '\0';
+        migrateJobProcessReply(listNodeValue(listFirst(link->jobs)),p);
+        p = nl+1;
+    }
+    sdsrange(link->rcvbuf,p-link->rcvbuf,-1);
+}
+
+/* Close the link, failing all the jobs still waiting for replies. Keys of
+ * those jobs that were not acknowledged are left untouched. */
+void migrateAsyncFreeLink(migrateAsyncLink *link, int write_error) {
+    sds err = sdscatprintf(sdsempty(),
+        "-IOERR error or timeout %s to target instance\r\n",
+        write_error ? "writing" : "reading");
+    listNode *ln;
+
+    aeDeleteFileEvent(server.el,link->fd,AE_READABLE|AE_WRITABLE);
+    close(link->fd);
+    dictDelete(server.migrate_async_links,link->name); /* Frees the name. */
+    while((ln = listFirst(link->jobs)) != NULL) {
+        migrateJob *job = listNodeValue(ln);
+        listDelNode(link->jobs,ln);
+        migrateJobFinish(job,err);
+    }
+    listRelease(link->jobs);
+    sdsfree(link->sndbuf);
+    sdsfree(link->rcvbuf);
+    sdsfree(err);
+    zfree(link);
+}
+
+/* Called by serverCron(): fail links waiting for the target more than the
+ * timeout of the oldest job, and close idle links after some time like
+ * migrateCloseTimedoutSockets() does for the synchronous implementation. */
+void migrateAsyncCron(void) {
+    dictIterator *di;
+    dictEntry *de;
+    mstime_t now = mstime();
+
+    if (dictSize(server.migrate_async_links) == 0) return;
+    di = dictGetSafeIterator(server.migrate_async_links);
+    while((de = dictNext(di)) != NULL) {
+        migrateAsyncLink *link = dictGetVal(de);
+
+        if (listLength(link->jobs)) {
+            migrateJob *job = listNodeValue(listFirst(link->jobs));
+            if (now - link->last_io_time > job->timeout)
+                migrateAsyncFreeLink(link,sdslen(link->sndbuf) != 0);
+        } else if ((server.unixtime - link->last_use_time) >
+                   MIGRATE_SOCKET_CACHE_TTL)
+        {
+            migrateAsyncFreeLink(link,0);
+        }
+    }
+    dictReleaseIterator(di);
+}
+
 /* -----------------------------------------------------------------------------
  * Cluster functions related to serving / redirecting clients
  * -------------------------------------------------------------------------- */
@@ -139,6 +139,8 @@ typedef struct clusterState {
     int todo_before_sleep; /* Things to do in clusterBeforeSleep(). */
     long long stats_bus_messages_sent;  /* Num of msg sent via cluster bus. */
     long long stats_bus_messages_received; /* Num of msg rcvd via cluster bus.*/
+    int stats_pfail_nodes;      /* Number of nodes in PFAIL status,
+                                   excluding nodes without address. */
 } clusterState;
 
 /* clusterState todo_before_sleep flags. */
@@ -252,6 +254,9 @@ typedef struct {
 #define CLUSTERMSG_FLAG0_PAUSED (1<<0) /* Master paused for manual failover. */
 #define CLUSTERMSG_FLAG0_FORCEACK (1<<1) /* Give ACK to AUTH_REQUEST even if
                                             master is up. */
+#define CLUSTERMSG_FLAG0_GOSSIP_SECS (1<<2) /* ping_sent and pong_received
+                                               in the gossip section are
+                                               unix times in seconds. */
 
 /* ---------------------- API exported outside cluster.c -------------------- */
 clusterNode *getNodeByQuery(client *c, struct redisCommand *cmd, robj **argv, int argc, int *hashslot, int *ask);
@@ -82,6 +82,12 @@ configEnum supervised_mode_enum[] = {
     {NULL, 0}
 };
 
+configEnum list_compress_codec_enum[] = {
+    {"lzf", QUICKLIST_NODE_ENCODING_LZF},
+    {"lz4", QUICKLIST_NODE_ENCODING_LZ4},
+    {NULL, 0}
+};
+
 configEnum aof_fsync_enum[] = {
     {"everysec", AOF_FSYNC_EVERYSEC},
     {"always", AOF_FSYNC_ALWAYS},
@@ -459,6 +465,14 @@ void loadServerConfigFromString(char *config) {
             server.list_max_ziplist_size = atoi(argv[1]);
         } else if (!strcasecmp(argv[0],"list-compress-depth") && argc == 2) {
             server.list_compress_depth = atoi(argv[1]);
+        } else if (!strcasecmp(argv[0],"list-compress-codec") && argc == 2) {
+            server.list_compress_codec =
+                configEnumGetValue(list_compress_codec_enum,argv[1]);
+            if (server.list_compress_codec == INT_MIN) {
+                err = "Invalid list compress codec";
+                goto loaderr;
+            }
+            quicklistSetCompressCodec(server.list_compress_codec);
         } else if (!strcasecmp(argv[0],"set-max-intset-entries") && argc == 2) {
             server.set_max_intset_entries = memtoll(argv[1], NULL);
         } else if (!strcasecmp(argv[0],"zset-max-ziplist-entries") && argc == 2) {
@@ -995,6 +1009,10 @@ void configSetCommand(client *c) {
       "maxmemory-policy",server.maxmemory_policy,maxmemory_policy_enum) {
     } config_set_enum_field(
       "appendfsync",server.aof_fsync,aof_fsync_enum) {
+    } config_set_enum_field(
+      "list-compress-codec",server.list_compress_codec,
+      list_compress_codec_enum) {
+        quicklistSetCompressCodec(server.list_compress_codec);
 
     /* Everyhing else is an error... */
     } config_set_else {
@@ -1152,6 +1170,8 @@ void configGetCommand(client *c) {
             server.supervised_mode,supervised_mode_enum);
     config_get_enum_field("appendfsync",
             server.aof_fsync,aof_fsync_enum);
+    config_get_enum_field("list-compress-codec",
+            server.list_compress_codec,list_compress_codec_enum);
     config_get_enum_field("syslog-facility",
             server.syslog_facility,syslog_facility_enum);
 
@@ -1841,6 +1861,7 @@ int rewriteConfig(char *path) {
     rewriteConfigNumericalOption(state,"hash-max-ziplist-value",server.hash_max_ziplist_value,OBJ_HASH_MAX_ZIPLIST_VALUE);
     rewriteConfigNumericalOption(state,"list-max-ziplist-size",server.list_max_ziplist_size,OBJ_LIST_MAX_ZIPLIST_SIZE);
     rewriteConfigNumericalOption(state,"list-compress-depth",server.list_compress_depth,OBJ_LIST_COMPRESS_DEPTH);
+    rewriteConfigEnumOption(state,"list-compress-codec",server.list_compress_codec,list_compress_codec_enum,OBJ_LIST_COMPRESS_CODEC);
     rewriteConfigNumericalOption(state,"set-max-intset-entries",server.set_max_intset_entries,OBJ_SET_MAX_INTSET_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-entries",server.zset_max_ziplist_entries,OBJ_ZSET_MAX_ZIPLIST_ENTRIES);
     rewriteConfigNumericalOption(state,"zset-max-ziplist-value",server.zset_max_ziplist_value,OBJ_ZSET_MAX_ZIPLIST_VALUE);
@@ -0,0 +1,256 @@
+/* lz4.c - LZ4 block format compressor and decompressor.
+ *
+ * Copyright (c) 2017, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* This is a small, self contained implementation of the LZ4 block format,
+ * used where we need a codec faster than LZF, trading a bit of ratio for
+ * speed (for instance to compress quicklist interior nodes). The format is
+ * a sequence of:
+ *
+ *   token | [literal length bytes] | literals | offset | [match length bytes]
+ *
+ * Where the token high nibble is the literal length and the low nibble is
+ * the match length minus LZ4_MINMATCH; a nibble of 15 means that more length
+ * bytes follow, each one added to the length, until a byte != 255 is found.
+ * The last sequence only has literals. To remain compatible with the
+ * reference implementation, the last LZ4_LASTLITERALS bytes are always
+ * literals and no match starts in the last LZ4_MFLIMIT bytes. */
+
+#include <stdint.h>
+#include <string.h>
+#include "config.h" /* for BYTE_ORDER */
+#include "lz4.h"
+
+#define LZ4_MINMATCH 4
+#define LZ4_MFLIMIT 12
+#define LZ4_LASTLITERALS 5
+#define LZ4_MAX_DISTANCE 65535
+#define LZ4_HASH_LOG 12
+#define LZ4_HASH_SIZE (1<<LZ4_HASH_LOG)
+#define LZ4_RUN_MASK 15
+#define LZ4_ML_MASK 15
+
+static inline uint32_t lz4Read32(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v,p,sizeof(v));
+    return v;
+}
+
+/* Return the number of equal bytes at 'p' and 'ref', not going past
+ * 'limit'. Compares a word at a time where we know the byte order. */
+static inline size_t lz4Count(const unsigned char *p, const unsigned char *ref,
+                              const unsigned char *limit) {
+    const unsigned char *start = p;
+
+#if defined(__GNUC__) && (BYTE_ORDER == LITTLE_ENDIAN)
+    while (p + sizeof(uint64_t) <= limit) {
+        uint64_t a, b;
+        memcpy(&a,p,sizeof(a));
+        memcpy(&b,ref,sizeof(b));
+        if (a != b) return (p - start) + (__builtin_ctzll(a ^ b) >> 3);
+        p += sizeof(uint64_t);
+        ref += sizeof(uint64_t);
+    }
+#endif
+    while (p < limit && *p == *ref) {
+        p++;
+        ref++;
+    }
+    return p - start;
+}
+
+static inline uint32_t lz4Hash(uint32_t seq) {
+    return (seq * 2654435761U) >> (32 - LZ4_HASH_LOG);
+}
+
+/* Write the variable length continuation of a length already saturated
+ * at 15 in the token, returning the new output pointer. */
+static inline unsigned char *lz4WriteLen(unsigned char *op, size_t len) {
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/* Return the worst case number of bytes needed to encode a sequence with
+ * 'litlen' literals (and a match if 'match' is true). */
+static inline size_t lz4SequenceBound(size_t litlen, size_t matchlen,
+                                      int match) {
+    size_t bound = 1 + litlen + litlen/255 + 1;
+    if (match) bound += 2 + matchlen/255 + 1;
+    return bound;
+}
+
+unsigned int lz4_compress(const void *in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len) {
+    const unsigned char *in = in_data;
+    const unsigned char *ip = in, *anchor = in;
+    const unsigned char *iend = in + in_len;
+    unsigned char *out = out_data, *op = out;
+    unsigned char *oend = out + out_len;
+    size_t litlen;
+
+    if (in_len > LZ4_MFLIMIT) {
+        /* Offsets of the last position seen for every hash bucket. Stale
+         * or uninitialized entries are harmless since every candidate is
+         * verified against the actual input. */
+        uint32_t htab[LZ4_HASH_SIZE];
+        const unsigned char *mflimit = iend - LZ4_MFLIMIT;
+        const unsigned char *matchlimit = iend - LZ4_LASTLITERALS;
+
+        memset(htab,0,sizeof(htab));
+        while (ip < mflimit) {
+            uint32_t seq = lz4Read32(ip);
+            uint32_t h = lz4Hash(seq);
+            const unsigned char *ref = in + htab[h];
+            htab[h] = ip - in;
+
+            if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE ||
+                lz4Read32(ref) != seq)
+            {
+                /* Skip faster and faster across data that does not
+                 * compress, as the reference implementation does. */
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            /* Extend the match backward, then forward. */
+            while (ip > anchor && ref > in && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const unsigned char *mp = ip + LZ4_MINMATCH;
+            mp += lz4Count(mp,ref + LZ4_MINMATCH,matchlimit);
+
+            litlen = ip - anchor;
+            size_t matchlen = (mp - ip) - LZ4_MINMATCH;
+            size_t offset = ip - ref;
+            if (lz4SequenceBound(litlen,matchlen,1) > (size_t)(oend - op))
+                return 0;
+
+            unsigned char *token = op++;
+            if (litlen >= LZ4_RUN_MASK) {
+                *token = LZ4_RUN_MASK << 4;
+                op = lz4WriteLen(op,litlen - LZ4_RUN_MASK);
+            } else {
+                *token = litlen << 4;
+            }
+            memcpy(op,anchor,litlen);
+            op += litlen;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            if (matchlen >= LZ4_ML_MASK) {
+                *token |= LZ4_ML_MASK;
+                op = lz4WriteLen(op,matchlen - LZ4_ML_MASK);
+            } else {
+                *token |= matchlen;
+            }
+
+            /* Index the position just before the end of the match, so
+             * that runs of repeated data are found again quickly. */
+            if (mp - 2 < mflimit) htab[lz4Hash(lz4Read32(mp-2))] = (mp-2) - in;
+            ip = anchor = mp;
+        }
+    }
+
+    /* Emit the remaining bytes as literals. */
+    litlen = iend - anchor;
+    if (lz4SequenceBound(litlen,0,0) > (size_t)(oend - op)) return 0;
+    if (litlen >= LZ4_RUN_MASK) {
+        *op++ = LZ4_RUN_MASK << 4;
+        op = lz4WriteLen(op,litlen - LZ4_RUN_MASK);
+    } else {
+        *op++ = litlen << 4;
+    }
+    memcpy(op,anchor,litlen);
+    op += litlen;
+    return op - out;
+}
+
+/* Read the variable length continuation of a length field. Returns 0 if
+ * the input ends before the length is complete. */
+static inline int lz4ReadLen(const unsigned char **ipp,
+                             const unsigned char *iend, size_t *len) {
+    const unsigned char *ip = *ipp;
+    unsigned char b;
+
+    do {
+        if (ip >= iend) return 0;
+        b = *ip++;
+        *len += b;
+    } while (b == 255);
+    *ipp = ip;
+    return 1;
+}
+
+unsigned int lz4_decompress(const void *in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len) {
+    const unsigned char *ip = in_data;
+    const unsigned char *iend = ip + in_len;
+    unsigned char *out = out_data, *op = out;
+    unsigned char *oend = out + out_len;
+
+    while (ip < iend) {
+        unsigned char token = *ip++;
+        size_t len = token >> 4;
+
+        /* Literals. */
+        if (len == LZ4_RUN_MASK && !lz4ReadLen(&ip,iend,&len)) return 0;
+        if (len > (size_t)(iend - ip) || len > (size_t)(oend - op)) return 0;
+        memcpy(op,ip,len);
+        op += len;
+        ip += len;
+
+        /* The last sequence has no match part. */
+        if (ip == iend) break;
+
+        /* Match. */
+        if (iend - ip < 2) return 0;
+        size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - out)) return 0;
+
+        len = token & LZ4_ML_MASK;
+        if (len == LZ4_ML_MASK && !lz4ReadLen(&ip,iend,&len)) return 0;
+        len += LZ4_MINMATCH;
+        if (len > (size_t)(oend - op)) return 0;
+
+        const unsigned char *ref = op - offset;
+        if (offset >= len) {
+            memcpy(op,ref,len);
+            op += len;
+        } else {
+            /* Overlapping copy: the match repeats the last 'offset' bytes. */
+            while (len--) *op++ = *ref++;
+        }
+    }
+    return op - out;
+}
@@ -0,0 +1,51 @@
+/* lz4.h - LZ4 block format compressor and decompressor.
+ *
+ * Copyright (c) 2017, Redis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __LZ4_H
+#define __LZ4_H
+
+/* Compress 'in_len' bytes at 'in_data' into 'out_data', writing at most
+ * 'out_len' bytes. The output is a single LZ4 block (no frame header).
+ *
+ * Returns the number of bytes written, or 0 if the output buffer is not
+ * large enough, exactly like lzf_compress(), so that callers can pass
+ * an output buffer smaller than the input to only accept a real gain. */
+unsigned int lz4_compress(const void *in_data, unsigned int in_len,
+                          void *out_data, unsigned int out_len);
+
+/* Decompress the LZ4 block of 'in_len' bytes at 'in_data' into 'out_data',
+ * writing at most 'out_len' bytes.
+ *
+ * Returns the number of bytes written, or 0 if the input is corrupted or
+ * the output buffer is too small. */
+unsigned int lz4_decompress(const void *in_data, unsigned int in_len,
+                            void *out_data, unsigned int out_len);
+
+#endif
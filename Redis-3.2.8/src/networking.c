@@ -118,6 +118,7 @@ client *createClient(int fd) {
     c->bpop.target = NULL;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.migrate_job = NULL;
     c->woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&setDictType,NULL);
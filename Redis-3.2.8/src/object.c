@@ -725,3 +725,371 @@ void objectCommand(client *c) {
     }
 }
 
+
+/* ----------------------------- Memory accounting -------------------------- */
+
+#define OBJ_COMPUTE_SIZE_DEF_SAMPLES 5 /* Default sample size. */
+
+/* Memory used by a string object, including the object itself. */
+static size_t objectComputeStringSize(robj *o) {
+    if (o->encoding == OBJ_ENCODING_RAW)
+        return zmalloc_size(o)+zmalloc_size(sdsAllocPtr(o->ptr));
+    /* INT and EMBSTR encoded strings are a single allocation. */
+    return zmalloc_size(o);
+}
+
+/* Memory used by a dict, excluding the entries. */
+static size_t objectComputeDictOverhead(dict *d) {
+    size_t asize = zmalloc_size(d);
+
+    if (d->ht[0].table) asize += zmalloc_size(d->ht[0].table);
+    if (d->ht[1].table) asize += zmalloc_size(d->ht[1].table);
+    return asize;
+}
+
+/* Memory used by a dict entry, including its key and value, that are
+ * Redis objects for all the dict encoded types. */
+static size_t objectComputeDictEntrySize(dictEntry *de) {
+    size_t elesize = zmalloc_size(de);
+    robj *val = dictGetVal(de);
+
+    elesize += objectComputeStringSize(dictGetKey(de));
+    if (val) elesize += objectComputeStringSize(val);
+    return elesize;
+}
+
+/* Estimate the memory used by the entries of 'd', sampling 'sample_size'
+ * entries, or computing the exact value if 'sample_size' is zero or not
+ * smaller than the number of entries. */
+static size_t objectComputeDictEntries(dict *d, size_t sample_size) {
+    size_t elesize = 0, samples = 0;
+    dictEntry *de;
+
+    if (dictSize(d) == 0) return 0;
+    if (sample_size == 0 || sample_size >= dictSize(d)) {
+        dictIterator *di = dictGetIterator(d);
+        while((de = dictNext(di)) != NULL)
+            elesize += objectComputeDictEntrySize(de);
+        dictReleaseIterator(di);
+        return elesize;
+    }
+
+    /* Sample random entries, so that a single call is representative of
+     * the whole collection. */
+    dictEntry **des = zmalloc(sizeof(dictEntry*)*sample_size);
+    unsigned int j, count = dictGetSomeKeys(d,des,sample_size);
+    for (j = 0; j < count; j++)
+        elesize += objectComputeDictEntrySize(des[j]);
+    samples = count;
+    zfree(des);
+    return samples ? (double)elesize/samples*dictSize(d) : 0;
+}
+
+/* Return the amount of memory used by the value 'o', as seen by the
+ * allocator. Big collections are not scanned fully: 'sample_size' elements
+ * are checked and their average size is used for the others. A
+ * 'sample_size' of zero means to check every element. */
+size_t objectComputeSize(robj *o, size_t sample_size) {
+    size_t asize = 0, elesize = 0, samples = 0;
+
+    if (o->type == OBJ_STRING) {
+        asize = objectComputeStringSize(o);
+    } else if (o->type == OBJ_LIST) {
+        if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+            quicklist *ql = o->ptr;
+            quicklistNode *node = ql->head;
+
+            /* Nodes may be compressed: node->zl is a quicklistLZF then, and
+             * its allocation is what we want to account. */
+            asize = zmalloc_size(o)+zmalloc_size(ql);
+            while(node && (sample_size == 0 || samples < sample_size)) {
+                elesize += zmalloc_size(node)+zmalloc_size(node->zl);
+                samples++;
+                node = node->next;
+            }
+            if (samples) asize += (double)elesize/samples*ql->len;
+        } else {
+            serverPanic("Unknown list encoding");
+        }
+    } else if (o->type == OBJ_SET) {
+        if (o->encoding == OBJ_ENCODING_HT) {
+            asize = zmalloc_size(o)+objectComputeDictOverhead(o->ptr);
+            asize += objectComputeDictEntries(o->ptr,sample_size);
+        } else if (o->encoding == OBJ_ENCODING_INTSET) {
+            asize = zmalloc_size(o)+zmalloc_size(o->ptr);
+        } else {
+            serverPanic("Unknown set encoding");
+        }
+    } else if (o->type == OBJ_ZSET) {
+        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+            asize = zmalloc_size(o)+zmalloc_size(o->ptr);
+        } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
+            zset *zs = o->ptr;
+            zskiplist *zsl = zs->zsl;
+            zskiplistNode *znode = zsl->header->level[0].forward;
+
+            asize = zmalloc_size(o)+zmalloc_size(zs);
+            asize += objectComputeDictOverhead(zs->dict);
+            asize += zmalloc_size(zsl)+zmalloc_size(zsl->header);
+            /* The member object is shared by the dict and the skiplist. */
+            while(znode && (sample_size == 0 || samples < sample_size)) {
+                dictEntry *de = dictFind(zs->dict,znode->obj);
+
+                elesize += zmalloc_size(znode);
+                elesize += objectComputeStringSize(znode->obj);
+                if (de) elesize += zmalloc_size(de);
+                samples++;
+                znode = znode->level[0].forward;
+            }
+            if (samples) asize += (double)elesize/samples*zsl->length;
+        } else {
+            serverPanic("Unknown sorted set encoding");
+        }
+    } else if (o->type == OBJ_HASH) {
+        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+            asize = zmalloc_size(o)+zmalloc_size(o->ptr);
+        } else if (o->encoding == OBJ_ENCODING_HT) {
+            asize = zmalloc_size(o)+objectComputeDictOverhead(o->ptr);
+            asize += objectComputeDictEntries(o->ptr,sample_size);
+        } else {
+            serverPanic("Unknown hash encoding");
+        }
+    } else {
+        serverPanic("Unknown object type");
+    }
+    return asize;
+}
+
+/* Return a struct redisMemOverhead filled with memory overhead information
+ * used for the MEMORY STATS command. The returned structure pointer should
+ * be freed calling freeMemoryOverheadData().
+ *
+ * The memory used by the server is split into the overhead of the different
+ * subsystems (replication backlog, clients buffers, AOF buffers, the hash
+ * tables of the keyspace, and so forth) and the dataset, which is what
+ * remains. */
+struct redisMemOverhead *getMemoryOverheadData(void) {
+    int j;
+    size_t mem_total = 0;
+    size_t mem = 0;
+    size_t zmalloc_used = zmalloc_used_memory();
+    struct redisMemOverhead *mh = zcalloc(sizeof(*mh));
+
+    mh->total_allocated = zmalloc_used;
+    mh->startup_allocated = server.initial_memory_usage;
+    mh->peak_allocated = server.stat_peak_memory;
+    mh->fragmentation =
+        zmalloc_get_fragmentation_ratio(server.resident_set_size);
+    mem_total += server.initial_memory_usage;
+
+    mem = 0;
+    if (server.repl_backlog)
+        mem += zmalloc_size(server.repl_backlog);
+    mh->repl_backlog = mem;
+    mem_total += mem;
+
+    /* Clients are accounted with their query buffer, output buffers and
+     * the client structure itself, that includes the static reply buffer. */
+    mem = 0;
+    if (listLength(server.slaves)) {
+        listIter li;
+        listNode *ln;
+
+        listRewind(server.slaves,&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            mem += getClientOutputBufferMemoryUsage(c);
+            mem += sdsAllocSize(c->querybuf);
+            mem += sizeof(client);
+        }
+    }
+    mh->clients_slaves = mem;
+    mem_total+=mem;
+
+    mem = 0;
+    if (listLength(server.clients)) {
+        listIter li;
+        listNode *ln;
+
+        listRewind(server.clients,&li);
+        while((ln = listNext(&li))) {
+            client *c = listNodeValue(ln);
+            if (c->flags & CLIENT_SLAVE) continue;
+            mem += getClientOutputBufferMemoryUsage(c);
+            mem += sdsAllocSize(c->querybuf);
+            mem += sizeof(client);
+        }
+    }
+    mh->clients_normal = mem;
+    mem_total+=mem;
+
+    mem = 0;
+    if (server.aof_state != AOF_OFF) {
+        mem += sdsalloc(server.aof_buf);
+        mem += aofRewriteBufferSize();
+    }
+    mh->aof_buffer = mem;
+    mem_total+=mem;
+
+    /* The Lua VM memory is not allocated via zmalloc, and is reported as
+     * used_memory_lua by INFO. Here we only account the scripts cache. */
+    mem = dictSize(server.lua_scripts) * sizeof(dictEntry) +
+          dictSlots(server.lua_scripts) * sizeof(dictEntry*);
+    mh->lua_caches = mem;
+    mem_total+=mem;
+
+    for (j = 0; j < server.dbnum; j++) {
+        redisDb *db = server.db+j;
+        long long keyscount = dictSize(db->dict);
+        if (keyscount==0) continue;
+
+        mh->total_keys += keyscount;
+        mh->db = zrealloc(mh->db,sizeof(mh->db[0])*(mh->num_dbs+1));
+        mh->db[mh->num_dbs].dbid = j;
+
+        mem = dictSize(db->dict) * sizeof(dictEntry) +
+              dictSlots(db->dict) * sizeof(dictEntry*) +
+              dictSize(db->dict) * sizeof(robj);
+        mh->db[mh->num_dbs].overhead_ht_main = mem;
+        mem_total+=mem;
+
+        mem = dictSize(db->expires) * sizeof(dictEntry) +
+              dictSlots(db->expires) * sizeof(dictEntry*);
+        mh->db[mh->num_dbs].overhead_ht_expires = mem;
+        mem_total+=mem;
+
+        mh->num_dbs++;
+    }
+
+    mh->overhead_total = mem_total;
+    mh->dataset = zmalloc_used > mem_total ? zmalloc_used - mem_total : 0;
+    mh->peak_perc = server.stat_peak_memory ?
+                    (float)zmalloc_used*100/server.stat_peak_memory : 0;
+
+    /* Metrics computed after subtracting the startup memory from
+     * the total memory. */
+    size_t net_usage = 1;
+    if (zmalloc_used > mh->startup_allocated)
+        net_usage = zmalloc_used - mh->startup_allocated;
+    mh->dataset_perc = (float)mh->dataset*100/net_usage;
+    mh->bytes_per_key = mh->total_keys ? (net_usage / mh->total_keys) : 0;
+
+    return mh;
+}
+
+void freeMemoryOverheadData(struct redisMemOverhead *mh) {
+    zfree(mh->db);
+    zfree(mh);
+}
+
+/* The memory command will eventually be a complete interface for the
+ * memory introspection capabilities of Redis.
+ *
+ * Usage: MEMORY STATS | USAGE <key> [SAMPLES <count>] */
+void memoryCommand(client *c) {
+    robj *o;
+
+    if (!strcasecmp(c->argv[1]->ptr,"usage") && c->argc >= 3) {
+        long long samples = OBJ_COMPUTE_SIZE_DEF_SAMPLES;
+        dictEntry *de;
+        size_t usage;
+        int j;
+
+        for (j = 3; j < c->argc; j++) {
+            if (!strcasecmp(c->argv[j]->ptr,"samples") &&
+                j+1 < c->argc)
+            {
+                if (getLongLongFromObjectOrReply(c,c->argv[j+1],&samples,NULL)
+                     == C_ERR) return;
+                if (samples < 0) {
+                    addReply(c,shared.syntaxerr);
+                    return;
+                }
+                j++; /* skip option argument. */
+            } else {
+                addReply(c,shared.syntaxerr);
+                return;
+            }
+        }
+        if ((o = objectCommandLookupOrReply(c,c->argv[2],shared.nullbulk))
+                == NULL) return;
+        usage = objectComputeSize(o,samples);
+
+        /* Add the key name and the main dict entry. */
+        de = dictFind(c->db->dict,c->argv[2]->ptr);
+        usage += zmalloc_size(sdsAllocPtr(dictGetKey(de)));
+        usage += zmalloc_size(de);
+        if ((de = dictFind(c->db->expires,c->argv[2]->ptr)) != NULL)
+            usage += zmalloc_size(de);
+        addReplyLongLong(c,usage);
+    } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
+        struct redisMemOverhead *mh = getMemoryOverheadData();
+
+        addReplyMultiBulkLen(c,(16+mh->num_dbs)*2);
+
+        addReplyBulkCString(c,"peak.allocated");
+        addReplyLongLong(c,mh->peak_allocated);
+
+        addReplyBulkCString(c,"total.allocated");
+        addReplyLongLong(c,mh->total_allocated);
+
+        addReplyBulkCString(c,"startup.allocated");
+        addReplyLongLong(c,mh->startup_allocated);
+
+        addReplyBulkCString(c,"replication.backlog");
+        addReplyLongLong(c,mh->repl_backlog);
+
+        addReplyBulkCString(c,"clients.slaves");
+        addReplyLongLong(c,mh->clients_slaves);
+
+        addReplyBulkCString(c,"clients.normal");
+        addReplyLongLong(c,mh->clients_normal);
+
+        addReplyBulkCString(c,"aof.buffer");
+        addReplyLongLong(c,mh->aof_buffer);
+
+        addReplyBulkCString(c,"lua.caches");
+        addReplyLongLong(c,mh->lua_caches);
+
+        addReplyBulkCString(c,"lua.vm");
+        addReplyLongLong(c,(long long)lua_gc(server.lua,LUA_GCCOUNT,0)*1024);
+
+        for (size_t j = 0; j < mh->num_dbs; j++) {
+            char dbname[32];
+            snprintf(dbname,sizeof(dbname),"db.%zu",mh->db[j].dbid);
+            addReplyBulkCString(c,dbname);
+            addReplyMultiBulkLen(c,4);
+
+            addReplyBulkCString(c,"overhead.hashtable.main");
+            addReplyLongLong(c,mh->db[j].overhead_ht_main);
+
+            addReplyBulkCString(c,"overhead.hashtable.expires");
+            addReplyLongLong(c,mh->db[j].overhead_ht_expires);
+        }
+
+        addReplyBulkCString(c,"overhead.total");
+        addReplyLongLong(c,mh->overhead_total);
+
+        addReplyBulkCString(c,"keys.count");
+        addReplyLongLong(c,mh->total_keys);
+
+        addReplyBulkCString(c,"keys.bytes-per-key");
+        addReplyLongLong(c,mh->bytes_per_key);
+
+        addReplyBulkCString(c,"dataset.bytes");
+        addReplyLongLong(c,mh->dataset);
+
+        addReplyBulkCString(c,"dataset.percentage");
+        addReplyDouble(c,mh->dataset_perc);
+
+        addReplyBulkCString(c,"peak.percentage");
+        addReplyDouble(c,mh->peak_perc);
+
+        addReplyBulkCString(c,"fragmentation");
+        addReplyDouble(c,mh->fragmentation);
+
+        freeMemoryOverheadData(mh);
+    } else {
+        addReplyError(c,"Syntax error. Try MEMORY (STATS|USAGE <key>)");
+    }
+}
@@ -34,6 +34,7 @@
 #include "ziplist.h"
 #include "util.h" /* for ll2string */
 #include "lzf.h"
+#include "lz4.h"
 
 #if defined(REDIS_TEST) || defined(REDIS_TEST_VERBOSE)
 #include <stdio.h> /* for printf (debug printing), snprintf (genstr) */
@@ -58,6 +59,29 @@ static const size_t optimization_level[] = {4096, 8192, 16384, 32768, 65536};
  * resulted in a larger size than the original data. */
 #define MIN_COMPRESS_IMPROVE 8
 
+/* An interior node that needed to be decompressed at least HOT_NODE_HEAT
+ * times in order to be accessed is considered hot: after the access it is
+ * left uncompressed in the quicklist hot nodes cache instead of being
+ * compressed again, until it is evicted by hotter nodes. */
+#define HOT_NODE_HEAT 2
+#define HOT_NODE_HEAT_MAX 15
+
+/* Codecs used to compress interior nodes, indexed by node encoding. Nodes
+ * remember the codec they were compressed with, so the codec used for new
+ * compressions can be switched at any time. */
+typedef struct quicklistCodec {
+    unsigned int (*compress)(const void *in_data, unsigned int in_len,
+                             void *out_data, unsigned int out_len);
+    unsigned int (*decompress)(const void *in_data, unsigned int in_len,
+                               void *out_data, unsigned int out_len);
+} quicklistCodec;
+
+static const quicklistCodec codecs[] = {
+    [QUICKLIST_NODE_ENCODING_LZF] = {lzf_compress, lzf_decompress},
+    [QUICKLIST_NODE_ENCODING_LZ4] = {lz4_compress, lz4_decompress}};
+
+static int compress_codec = QUICKLIST_NODE_ENCODING_LZF;
+
 /* If not verbose testing, remove all debug printing. */
 #ifndef REDIS_TEST_VERBOSE
 #define D(...)
@@ -100,6 +124,8 @@ quicklist *quicklistCreate(void) {
     quicklist->count = 0;
     quicklist->compress = 0;
     quicklist->fill = -2;
+    for (int j = 0; j < QUICKLIST_HOT_NODES; j++)
+        quicklist->hot[j] = NULL;
     return quicklist;
 }
 
@@ -128,6 +154,15 @@ void quicklistSetOptions(quicklist *quicklist, int fill, int depth) {
     quicklistSetCompressDepth(quicklist, depth);
 }
 
+/* Set the codec used to compress nodes from now on: 'encoding' is either
+ * QUICKLIST_NODE_ENCODING_LZF or QUICKLIST_NODE_ENCODING_LZ4. Nodes already
+ * compressed with the other codec are still decompressed correctly. */
+void quicklistSetCompressCodec(int encoding) {
+    if (encoding == QUICKLIST_NODE_ENCODING_LZF ||
+        encoding == QUICKLIST_NODE_ENCODING_LZ4)
+        compress_codec = encoding;
+}
+
 /* Create a new quicklist with some default parameters. */
 quicklist *quicklistNew(int fill, int compress) {
     quicklist *quicklist = quicklistCreate();
@@ -145,6 +180,7 @@ REDIS_STATIC quicklistNode *quicklistCreateNode(void) {
     node->encoding = QUICKLIST_NODE_ENCODING_RAW;
     node->container = QUICKLIST_NODE_CONTAINER_ZIPLIST;
     node->recompress = 0;
+    node->heat = 0;
     return node;
 }
 
@@ -187,17 +223,17 @@ REDIS_STATIC int __quicklistCompressNode(quicklistNode *node) {
     quicklistLZF *lzf = zmalloc(sizeof(*lzf) + node->sz);
 
     /* Cancel if compression fails or doesn't compress small enough */
-    if (((lzf->sz = lzf_compress(node->zl, node->sz, lzf->compressed,
-                                 node->sz)) == 0) ||
+    if (((lzf->sz = codecs[compress_codec].compress(
+              node->zl, node->sz, lzf->compressed, node->sz)) == 0) ||
         lzf->sz + MIN_COMPRESS_IMPROVE >= node->sz) {
-        /* lzf_compress aborts/rejects compression if value not compressable. */
+        /* The codec aborts/rejects compression if value not compressable. */
         zfree(lzf);
         return 0;
     }
     lzf = zrealloc(lzf, sizeof(*lzf) + lzf->sz);
     zfree(node->zl);
     node->zl = (unsigned char *)lzf;
-    node->encoding = QUICKLIST_NODE_ENCODING_LZF;
+    node->encoding = compress_codec;
     node->recompress = 0;
     return 1;
 }
@@ -219,7 +255,8 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 
     void *decompressed = zmalloc(node->sz);
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
-    if (lzf_decompress(lzf->compressed, lzf->sz, decompressed, node->sz) == 0) {
+    if (codecs[node->encoding].decompress(lzf->compressed, lzf->sz,
+                                          decompressed, node->sz) == 0) {
         /* Someone requested decompress, but we can't decompress.  Not good. */
         zfree(decompressed);
         return 0;
@@ -233,7 +270,7 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Decompress only compressed nodes. */
 #define quicklistDecompressNode(_node)                                         \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
         }                                                                      \
     } while (0)
@@ -241,21 +278,43 @@ REDIS_STATIC int __quicklistDecompressNode(quicklistNode *node) {
 /* Force node to not be immediately re-compresable */
 #define quicklistDecompressNodeForUse(_node)                                   \
     do {                                                                       \
-        if ((_node) && (_node)->encoding == QUICKLIST_NODE_ENCODING_LZF) {     \
+        if ((_node) && quicklistNodeIsCompressed(_node)) {                     \
             __quicklistDecompressNode((_node));                                \
             (_node)->recompress = 1;                                           \
+            if ((_node)->heat < HOT_NODE_HEAT_MAX)                             \
+                (_node)->heat++;                                               \
         }                                                                      \
     } while (0)
 
 /* Extract the raw LZF data from this quicklistNode.
  * Pointer to LZF data is assigned to '*data'.
- * Return value is the length of compressed LZF data. */
+ * Return value is the length of compressed LZF data.
+ * Only valid for nodes with QUICKLIST_NODE_ENCODING_LZF encoding. */
 size_t quicklistGetLzf(const quicklistNode *node, void **data) {
     quicklistLZF *lzf = (quicklistLZF *)node->zl;
     *data = lzf->compressed;
     return lzf->sz;
 }
 
+/* Return a newly allocated, uncompressed copy of the ziplist of 'node',
+ * leaving the node itself untouched. Free with zfree().
+ * Returns NULL if the node data can't be decompressed. */
+unsigned char *quicklistGetZiplistCopy(const quicklistNode *node) {
+    unsigned char *zl = zmalloc(node->sz);
+
+    if (quicklistNodeIsCompressed(node)) {
+        quicklistLZF *lzf = (quicklistLZF *)node->zl;
+        if (codecs[node->encoding].decompress(lzf->compressed, lzf->sz, zl,
+                                              node->sz) == 0) {
+            zfree(zl);
+            return NULL;
+        }
+    } else {
+        memcpy(zl, node->zl, node->sz);
+    }
+    return zl;
+}
+
 #define quicklistAllowsCompression(_ql) ((_ql)->compress != 0)
 
 /* Force 'quicklist' to meet compression guidelines set by compress depth.
@@ -330,10 +389,55 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
     }
 }
 
+/* Remove 'node' from the hot nodes cache, if it is there. */
+REDIS_STATIC void __quicklistHotRemove(quicklist *quicklist,
+                                       quicklistNode *node) {
+    for (int j = 0; j < QUICKLIST_HOT_NODES; j++) {
+        if (quicklist->hot[j] == node) {
+            memmove(quicklist->hot + j, quicklist->hot + j + 1,
+                    (QUICKLIST_HOT_NODES - j - 1) * sizeof(node));
+            quicklist->hot[QUICKLIST_HOT_NODES - 1] = NULL;
+            return;
+        }
+    }
+}
+
+/* Called when we are done with a node we decompressed for usage.
+ * Cold nodes are just compressed again. Hot nodes are moved at the head of
+ * the hot nodes cache and stay uncompressed; the least recently used cached
+ * node, if it falls out of the cache, is compressed instead (unless it is
+ * now within the compress depth). */
+REDIS_STATIC void __quicklistRecompress(quicklist *quicklist,
+                                        quicklistNode *node) {
+    if (node->heat < HOT_NODE_HEAT) {
+        quicklistCompressNode(node);
+        return;
+    }
+
+    quicklistNode *evicted = quicklist->hot[QUICKLIST_HOT_NODES - 1];
+    int j;
+    for (j = 0; j < QUICKLIST_HOT_NODES - 1; j++) {
+        if (quicklist->hot[j] == node)
+            break;
+    }
+    if (quicklist->hot[j] == node)
+        evicted = NULL;
+    memmove(quicklist->hot + 1, quicklist->hot, j * sizeof(node));
+    quicklist->hot[0] = node;
+
+    if (evicted) {
+        evicted->heat = 0;
+        __quicklistCompress(quicklist, evicted);
+    }
+}
+
+/* Note: the hot nodes cache is the only state of the quicklist modified
+ * while recompressing, so it's fine to do it on behalf of read only
+ * callers holding a const quicklist, such as iterators. */
 #define quicklistCompress(_ql, _node)                                          \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            __quicklistRecompress((struct quicklist *)(_ql), (_node));         \
         else                                                                   \
             __quicklistCompress((_ql), (_node));                               \
     } while (0)
@@ -342,7 +446,7 @@ REDIS_STATIC void __quicklistCompress(const quicklist *quicklist,
 #define quicklistRecompressOnly(_ql, _node)                                    \
     do {                                                                       \
         if ((_node)->recompress)                                               \
-            quicklistCompressNode((_node));                                    \
+            __quicklistRecompress((struct quicklist *)(_ql), (_node));         \
     } while (0)
 
 /* Insert 'new_node' after 'old_node' if 'after' is 1.
@@ -591,6 +695,8 @@ REDIS_STATIC void __quicklistDelNode(quicklist *quicklist,
         quicklist->head = node->next;
     }
 
+    __quicklistHotRemove(quicklist, node);
+
     /* If we deleted a node within our compress depth, we
      * now have compressed nodes needing to be decompressed. */
     __quicklistCompress(quicklist, NULL);
@@ -1192,12 +1298,12 @@ quicklist *quicklistDup(quicklist *orig) {
          current = current->next) {
         quicklistNode *node = quicklistCreateNode();
 
-        if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
-            quicklistLZF *lzf = (quicklistLZF *)node->zl;
+        if (quicklistNodeIsCompressed(current)) {
+            quicklistLZF *lzf = (quicklistLZF *)current->zl;
             size_t lzf_sz = sizeof(*lzf) + lzf->sz;
             node->zl = zmalloc(lzf_sz);
             memcpy(node->zl, current->zl, lzf_sz);
-        } else if (node->encoding == QUICKLIST_NODE_ENCODING_RAW) {
+        } else {
             node->zl = zmalloc(current->sz);
             memcpy(node->zl, current->zl, current->sz);
         }
@@ -1509,6 +1615,14 @@ static int itrprintr_rev(quicklist *ql, int print) {
     return _itrprintr(ql, print, 0);
 }
 
+/* Return true if 'node' is in the hot nodes cache of 'ql'. */
+static int ql_is_hot(quicklist *ql, quicklistNode *node) {
+    for (int j = 0; j < QUICKLIST_HOT_NODES; j++)
+        if (ql->hot[j] == node)
+            return 1;
+    return 0;
+}
+
 #define ql_verify(a, b, c, d, e)                                               \
     do {                                                                       \
         err += _ql_verify((a), (b), (c), (d), (e));                            \
@@ -1583,8 +1697,8 @@ static int _ql_verify(quicklist *ql, uint32_t len, uint32_t count,
                     errors++;
                 }
             } else {
-                if (node->encoding != QUICKLIST_NODE_ENCODING_LZF &&
-                    !node->attempted_compress) {
+                if (!quicklistNodeIsCompressed(node) &&
+                    !node->attempted_compress && !ql_is_hot(ql, node)) {
                     yell("Incorrect non-compression: node %d is NOT "
                          "compressed at depth %d ((%u, %u); total "
                          "nodes: %u; size: %u; recompress: %d; attempted: %d)",
@@ -1624,7 +1738,12 @@ int quicklistTest(int argc, char *argv[]) {
     long long runtime[option_count];
 
     for (int _i = 0; _i < (int)option_count; _i++) {
-        printf("Testing Option %d\n", options[_i]);
+        /* Alternate codecs so that every option runs with one of them. */
+        int codec = _i % 2 ? QUICKLIST_NODE_ENCODING_LZ4
+                           : QUICKLIST_NODE_ENCODING_LZF;
+        quicklistSetCompressCodec(codec);
+        printf("Testing Option %d (%s)\n", options[_i],
+               codec == QUICKLIST_NODE_ENCODING_LZ4 ? "lz4" : "lzf");
         long long start = mstime();
 
         TEST("create list") {
@@ -2049,6 +2168,52 @@ int quicklistTest(int argc, char *argv[]) {
             quicklistRelease(copy);
         }
 
+        if (options[_i]) {
+            TEST("hot interior nodes are cached uncompressed") {
+                quicklist *ql = quicklistNew(-2, options[_i]);
+                quicklistSetFill(ql, 32);
+                for (int i = 0; i < 2000; i++)
+                    quicklistPushTail(ql, genstr("hello", i), 32);
+                ql_verify(ql, 63, 2000, 32, 16);
+
+                /* Nodes holding elements 1000, 1100 and 1200. */
+                quicklistNode *a = ql->head, *b, *c;
+                for (int i = 0; i < 1000 / 32; i++)
+                    a = a->next;
+                b = a->next->next->next;
+                c = b->next->next->next;
+
+                long long idx[] = {1000, 1100, 1000, 1100, 1000, 1100,
+                                   1200, 1200};
+                for (int i = 0; i < (int)(sizeof(idx) / sizeof(*idx)); i++) {
+                    quicklistIter *iter =
+                        quicklistGetIteratorAtIdx(ql, AL_START_HEAD, idx[i]);
+                    quicklistEntry entry;
+                    quicklistNext(iter, &entry);
+                    if (strcmp((char *)entry.value, genstr("hello", idx[i])))
+                        ERR("Value: %s", entry.value);
+                    quicklistReleaseIterator(iter);
+                }
+                if (ql->hot[0] != c || ql->hot[1] != b)
+                    ERR("Unexpected hot nodes: %p %p", (void *)ql->hot[0],
+                        (void *)ql->hot[1]);
+                if (quicklistNodeIsCompressed(b) ||
+                    quicklistNodeIsCompressed(c))
+                    ERR("Hot nodes are compressed: %d %d", b->encoding,
+                        c->encoding);
+                if (!quicklistNodeIsCompressed(a))
+                    ERR("%s", "Evicted node is not compressed");
+
+                /* Deleting a hot node removes it from the cache. */
+                quicklistDelRange(ql, 1184, 32);
+                if (ql->hot[0] != b || ql->hot[1] != NULL)
+                    ERR("Unexpected hot nodes: %p %p", (void *)ql->hot[0],
+                        (void *)ql->hot[1]);
+                ql_verify(ql, 62, 1968, 32, 16);
+                quicklistRelease(ql);
+            }
+        }
+
         for (int f = optimize_start; f < 512; f++) {
             TEST_DESC("index 1,200 from 500 list at fill %d at compress %d", f,
                       options[_i]) {
@@ -2618,7 +2783,7 @@ int quicklistTest(int argc, char *argv[]) {
                                     node->sz);
                             }
                         } else {
-                            if (node->encoding != QUICKLIST_NODE_ENCODING_LZF) {
+                            if (!quicklistNodeIsCompressed(node)) {
                                 ERR("Incorrect non-compression: node %d is NOT "
                                     "compressed at depth %d ((%u, %u); total "
                                     "nodes: %u; size: %u; attempted: %d)",
@@ -36,27 +36,30 @@
 /* quicklistNode is a 32 byte struct describing a ziplist for a quicklist.
  * We use bit fields keep the quicklistNode at 32 bytes.
  * count: 16 bits, max 65536 (max zl bytes is 65k, so max count actually < 32k).
- * encoding: 2 bits, RAW=1, LZF=2.
+ * encoding: 2 bits, RAW=1, LZF=2, LZ4=3.
  * container: 2 bits, NONE=1, ZIPLIST=2.
  * recompress: 1 bit, bool, true if node is temporarry decompressed for usage.
  * attempted_compress: 1 bit, boolean, used for verifying during testing.
- * extra: 12 bits, free for future use; pads out the remainder of 32 bits */
+ * heat: 4 bits, saturating count of decompressions needed to access the node.
+ * extra: 6 bits, free for future use; pads out the remainder of 32 bits */
 typedef struct quicklistNode {
     struct quicklistNode *prev;
     struct quicklistNode *next;
     unsigned char *zl;
     unsigned int sz;             /* ziplist size in bytes */
     unsigned int count : 16;     /* count of items in ziplist */
-    unsigned int encoding : 2;   /* RAW==1 or LZF==2 */
+    unsigned int encoding : 2;   /* RAW==1, LZF==2 or LZ4==3 */
     unsigned int container : 2;  /* NONE==1 or ZIPLIST==2 */
     unsigned int recompress : 1; /* was this node previous compressed? */
     unsigned int attempted_compress : 1; /* node can't compress; too small */
-    unsigned int extra : 10; /* more bits to steal for future usage */
+    unsigned int heat : 4;       /* decompressions for access, see quicklist.c */
+    unsigned int extra : 6; /* more bits to steal for future usage */
 } quicklistNode;
 
 /* quicklistLZF is a 4+N byte struct holding 'sz' followed by 'compressed'.
  * 'sz' is byte length of 'compressed' field.
- * 'compressed' is LZF data with total (compressed) length 'sz'
+ * 'compressed' is LZF or LZ4 data (see quicklistNode->encoding) with total
+ * (compressed) length 'sz'.
  * NOTE: uncompressed length is stored in quicklistNode->sz.
  * When quicklistNode->zl is compressed, node->zl points to a quicklistLZF */
 typedef struct quicklistLZF {
@@ -64,12 +67,17 @@ typedef struct quicklistLZF {
     char compressed[];
 } quicklistLZF;
 
-/* quicklist is a 32 byte struct (on 64-bit systems) describing a quicklist.
+/* Number of hot interior nodes a quicklist keeps uncompressed. */
+#define QUICKLIST_HOT_NODES 2
+
+/* quicklist is a 48 byte struct (on 64-bit systems) describing a quicklist.
  * 'count' is the number of total entries.
  * 'len' is the number of quicklist nodes.
  * 'compress' is: -1 if compression disabled, otherwise it's the number
  *                of quicklistNodes to leave uncompressed at ends of quicklist.
- * 'fill' is the user-requested (or default) fill factor. */
+ * 'fill' is the user-requested (or default) fill factor.
+ * 'hot' are the most recently used hot interior nodes, which are left
+ *       uncompressed after access instead of being compressed again. */
 typedef struct quicklist {
     quicklistNode *head;
     quicklistNode *tail;
@@ -77,6 +85,7 @@ typedef struct quicklist {
     unsigned int len;           /* number of quicklistNodes */
     int fill : 16;              /* fill factor for individual nodes */
     unsigned int compress : 16; /* depth of end nodes not to compress;0=off */
+    quicklistNode *hot[QUICKLIST_HOT_NODES]; /* MRU first, NULL if unused */
 } quicklist;
 
 typedef struct quicklistIter {
@@ -103,6 +112,7 @@ typedef struct quicklistEntry {
 /* quicklist node encodings */
 #define QUICKLIST_NODE_ENCODING_RAW 1
 #define QUICKLIST_NODE_ENCODING_LZF 2
+#define QUICKLIST_NODE_ENCODING_LZ4 3
 
 /* quicklist compression disable */
 #define QUICKLIST_NOCOMPRESS 0
@@ -112,7 +122,7 @@ typedef struct quicklistEntry {
 #define QUICKLIST_NODE_CONTAINER_ZIPLIST 2
 
 #define quicklistNodeIsCompressed(node)                                        \
-    ((node)->encoding == QUICKLIST_NODE_ENCODING_LZF)
+    ((node)->encoding != QUICKLIST_NODE_ENCODING_RAW)
 
 /* Prototypes */
 quicklist *quicklistCreate(void);
@@ -157,6 +167,8 @@ int quicklistPop(quicklist *quicklist, int where, unsigned char **data,
 unsigned int quicklistCount(quicklist *ql);
 int quicklistCompare(unsigned char *p1, unsigned char *p2, int p2_len);
 size_t quicklistGetLzf(const quicklistNode *node, void **data);
+unsigned char *quicklistGetZiplistCopy(const quicklistNode *node);
+void quicklistSetCompressCodec(int encoding);
 
 #ifdef REDIS_TEST
 int quicklistTest(int argc, char *argv[]);
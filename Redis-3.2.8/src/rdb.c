@@ -585,11 +585,21 @@ ssize_t rdbSaveObject(rio *rdb, robj *o) {
             nwritten += n;
 
             do {
-                if (quicklistNodeIsCompressed(node)) {
+                if (node->encoding == QUICKLIST_NODE_ENCODING_LZF) {
                     void *data;
                     size_t compress_len = quicklistGetLzf(node, &data);
                     if ((n = rdbSaveLzfBlob(rdb,data,compress_len,node->sz)) == -1) return -1;
                     nwritten += n;
+                } else if (quicklistNodeIsCompressed(node)) {
+                    /* Other codecs are not part of the RDB format: save the
+                     * plain ziplist, that rdbSaveRawString() may still
+                     * compress with LZF if rdbcompression is enabled. */
+                    unsigned char *zl = quicklistGetZiplistCopy(node);
+                    if (zl == NULL) return -1;
+                    n = rdbSaveRawString(rdb,zl,node->sz);
+                    zfree(zl);
+                    if (n == -1) return -1;
+                    nwritten += n;
                 } else {
                     if ((n = rdbSaveRawString(rdb,node->zl,node->sz)) == -1) return -1;
                     nwritten += n;
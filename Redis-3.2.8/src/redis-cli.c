@@ -107,6 +107,8 @@ static struct config {
     char *pattern;
     char *rdb_filename;
     int bigkeys;
+    int memkeys;
+    int memkeys_samples; /* -1 to use the server default. */
     int stdinarg; /* get last arg from stdin. (-x option) */
     char *auth;
     int output; /* output mode, see OUTPUT_* defines */
@@ -1040,6 +1042,12 @@ static int parseOptions(int argc, char **argv) {
             config.pipe_timeout = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--bigkeys")) {
             config.bigkeys = 1;
+        } else if (!strcmp(argv[i],"--memkeys")) {
+            config.memkeys = 1;
+            config.memkeys_samples = -1; /* use redis default */
+        } else if (!strcmp(argv[i],"--memkeys-samples") && !lastarg) {
+            config.memkeys = 1;
+            config.memkeys_samples = atoi(argv[++i]);
         } else if (!strcmp(argv[i],"--eval") && !lastarg) {
             config.eval = argv[++i];
         } else if (!strcmp(argv[i],"--ldb")) {
@@ -1133,6 +1141,9 @@ static void usage(void) {
 "                     no reply is received within <n> seconds.\n"
 "                     Default timeout: %d. Use 0 to wait forever.\n"
 "  --bigkeys          Sample Redis keys looking for big keys.\n"
+"  --memkeys          Sample Redis keys looking for keys consuming a lot of memory.\n"
+"  --memkeys-samples <n> Sample Redis keys looking for keys consuming a lot of memory.\n"
+"                     And define number of key elements to sample\n"
 "  --scan             List all keys using the SCAN command.\n"
 "  --pattern <pat>    Useful with --scan to specify a SCAN pattern.\n"
 "  --intrinsic-latency <sec> Run a test to measure intrinsic system latency.\n"
@@ -2033,7 +2044,8 @@ static void getKeyTypes(redisReply *keys, int *types) {
 }
 
 static void getKeySizes(redisReply *keys, int *types,
-                        unsigned long long *sizes)
+                        unsigned long long *sizes, int memkeys,
+                        int memkeys_samples)
 {
     redisReply *reply;
     char *sizecmds[] = {"STRLEN","LLEN","SCARD","HLEN","ZCARD"};
@@ -2045,8 +2057,15 @@ static void getKeySizes(redisReply *keys, int *types,
         if(types[i]==TYPE_NONE)
             continue;
 
-        redisAppendCommand(context, "%s %s", sizecmds[types[i]],
-            keys->element[i]->str);
+        if (!memkeys)
+            redisAppendCommand(context, "%s %s", sizecmds[types[i]],
+                keys->element[i]->str);
+        else if (memkeys_samples==-1)
+            redisAppendCommand(context, "%s %s %s", "MEMORY", "USAGE",
+                keys->element[i]->str);
+        else
+            redisAppendCommand(context, "%s %s %s SAMPLES %d", "MEMORY",
+                "USAGE", keys->element[i]->str, memkeys_samples);
     }
 
     /* Retreive sizes */
@@ -2067,7 +2086,8 @@ static void getKeySizes(redisReply *keys, int *types,
              * added as a different type between TYPE and SIZE */
             fprintf(stderr,
                 "Warning:  %s on '%s' failed (may have changed type)\n",
-                 sizecmds[types[i]], keys->element[i]->str);
+                 !memkeys? sizecmds[types[i]]: "MEMORY USAGE",
+                 keys->element[i]->str);
             sizes[i] = 0;
         } else {
             sizes[i] = reply->integer;
@@ -2077,7 +2097,12 @@ static void getKeySizes(redisReply *keys, int *types,
     }
 }
 
-static void findBigKeys(void) {
+/* Scan the keyspace and report the biggest key of every type. When
+ * 'memkeys' is true the size is the memory used by the key, as reported
+ * by MEMORY USAGE checking 'memkeys_samples' elements of collections
+ * (-1 for the server default), otherwise it is the number of elements
+ * (or bytes for strings). */
+static void findBigKeys(int memkeys, int memkeys_samples) {
     unsigned long long biggest[5] = {0}, counts[5] = {0}, totalsize[5] = {0};
     unsigned long long sampled = 0, total_keys, totlen=0, *sizes=NULL, it=0;
     sds maxkeys[5] = {0};
@@ -2129,7 +2154,7 @@ static void findBigKeys(void) {
 
         /* Retreive types and then sizes */
         getKeyTypes(keys, types);
-        getKeySizes(keys, types, sizes);
+        getKeySizes(keys, types, sizes, memkeys, memkeys_samples);
 
         /* Now update our stats */
         for(i=0;i<keys->elements;i++) {
@@ -2145,7 +2170,7 @@ static void findBigKeys(void) {
                 printf(
                    "[%05.2f%%] Biggest %-6s found so far '%s' with %llu %s\n",
                    pct, typename[type], keys->element[i]->str, sizes[i],
-                   typeunit[type]);
+                   !memkeys? typeunit[type]: "bytes");
 
                 /* Keep track of biggest key name for this type */
                 maxkeys[type] = sdscpy(maxkeys[type], keys->element[i]->str);
@@ -2186,7 +2211,7 @@ static void findBigKeys(void) {
     for(i=0;i<TYPE_NONE;i++) {
         if(sdslen(maxkeys[i])>0) {
             printf("Biggest %6s found '%s' has %llu %s\n", typename[i], maxkeys[i],
-               biggest[i], typeunit[i]);
+               biggest[i], !memkeys? typeunit[i]: "bytes");
         }
     }
 
@@ -2194,7 +2219,7 @@ static void findBigKeys(void) {
 
     for(i=0;i<TYPE_NONE;i++) {
         printf("%llu %ss with %llu %s (%05.2f%% of keys, avg size %.2f)\n",
-           counts[i], typename[i], totalsize[i], typeunit[i],
+           counts[i], typename[i], totalsize[i], !memkeys? typeunit[i]: "bytes",
            sampled ? 100 * (double)counts[i]/sampled : 0,
            counts[i] ? (double)totalsize[i]/counts[i] : 0);
     }
@@ -2582,6 +2607,8 @@ int main(int argc, char **argv) {
     config.pipe_mode = 0;
     config.pipe_timeout = REDIS_CLI_DEFAULT_PIPE_TIMEOUT;
     config.bigkeys = 0;
+    config.memkeys = 0;
+    config.memkeys_samples = -1;
     config.stdinarg = 0;
     config.auth = NULL;
     config.eval = NULL;
@@ -2639,7 +2666,13 @@ int main(int argc, char **argv) {
     /* Find big keys */
     if (config.bigkeys) {
         if (cliConnect(0) == REDIS_ERR) exit(1);
-        findBigKeys();
+        findBigKeys(0, -1);
+    }
+
+    /* Find large keys */
+    if (config.memkeys) {
+        if (cliConnect(0) == REDIS_ERR) exit(1);
+        findBigKeys(1, config.memkeys_samples);
     }
 
     /* Stat mode */
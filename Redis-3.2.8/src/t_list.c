@@ -312,8 +312,14 @@ void lindexCommand(client *c) {
         return;
 
     if (o->encoding == OBJ_ENCODING_QUICKLIST) {
+        /* Use an iterator rather than quicklistIndex() so that releasing
+         * it gives the node back to the compression logic, instead of
+         * leaving interior nodes uncompressed after every access. */
+        quicklistIter *iter;
         quicklistEntry entry;
-        if (quicklistIndex(o->ptr, index, &entry)) {
+
+        iter = quicklistGetIteratorAtIdx(o->ptr, AL_START_TAIL, index);
+        if (iter && quicklistNext(iter, &entry)) {
             if (entry.value) {
                 value = createStringObject((char*)entry.value,entry.sz);
             } else {
@@ -324,6 +330,7 @@ void lindexCommand(client *c) {
         } else {
             addReply(c,shared.nullbulk);
         }
+        if (iter) quicklistReleaseIterator(iter);
     } else {
         serverPanic("Unknown list encoding");
     }
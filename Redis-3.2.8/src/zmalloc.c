@@ -68,9 +68,72 @@ void zlibc_free(void *ptr) {
 #endif
 
 #if defined(__ATOMIC_RELAXED)
-#define update_zmalloc_stat_add(__n) __atomic_add_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
-#define update_zmalloc_stat_sub(__n) __atomic_sub_fetch(&used_memory, (__n), __ATOMIC_RELAXED)
-#elif defined(HAVE_ATOMIC)
+/* Every thread accounts its allocations and frees into a counter of its own,
+ * padded to a cache line, so threads allocating at the same time never
+ * contend for the same cache line, and the owner of a counter does not even
+ * need an atomic read-modify-write to update it. The counters are only merged
+ * when zmalloc_used_memory() is called. Note that a counter may become
+ * "negative" if its thread frees memory allocated by another thread: only
+ * the sum is meaningful.
+ *
+ * Threads past the first ZMALLOC_MAX_THREADS-1 share the last counter, that
+ * is always updated atomically. */
+#define ZMALLOC_MAX_THREADS 16
+#define ZMALLOC_SHARED_COUNTER (ZMALLOC_MAX_THREADS-1)
+
+typedef struct zmallocThreadCounter {
+    size_t used;
+    char padding[64-sizeof(size_t)];
+} zmallocThreadCounter;
+
+static zmallocThreadCounter used_memory_thread[ZMALLOC_MAX_THREADS];
+static int zmalloc_threads = 0;
+static __thread int zmalloc_thread_index = -1;
+
+static inline int zmalloc_get_thread_index(void) {
+    if (zmalloc_thread_index == -1) {
+        int idx = __atomic_fetch_add(&zmalloc_threads,1,__ATOMIC_RELAXED);
+        zmalloc_thread_index = idx < ZMALLOC_SHARED_COUNTER ?
+                               idx : ZMALLOC_SHARED_COUNTER;
+    }
+    return zmalloc_thread_index;
+}
+
+#define update_zmalloc_stat_add(__n) do { \
+    int _idx = zmalloc_get_thread_index(); \
+    size_t *_used = &used_memory_thread[_idx].used; \
+    if (_idx == ZMALLOC_SHARED_COUNTER) { \
+        __atomic_add_fetch(_used, (__n), __ATOMIC_RELAXED); \
+    } else { \
+        __atomic_store_n(_used, *_used + (__n), __ATOMIC_RELAXED); \
+    } \
+} while(0)
+
+#define update_zmalloc_stat_sub(__n) do { \
+    int _idx = zmalloc_get_thread_index(); \
+    size_t *_used = &used_memory_thread[_idx].used; \
+    if (_idx == ZMALLOC_SHARED_COUNTER) { \
+        __atomic_sub_fetch(_used, (__n), __ATOMIC_RELAXED); \
+    } else { \
+        __atomic_store_n(_used, *_used - (__n), __ATOMIC_RELAXED); \
+    } \
+} while(0)
+
+#define update_zmalloc_stat_alloc(__n) do { \
+    size_t _n = (__n); \
+    if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
+    update_zmalloc_stat_add(_n); \
+} while(0)
+
+#define update_zmalloc_stat_free(__n) do { \
+    size_t _n = (__n); \
+    if (_n&(sizeof(long)-1)) _n += sizeof(long)-(_n&(sizeof(long)-1)); \
+    update_zmalloc_stat_sub(_n); \
+} while(0)
+
+#else /* !__ATOMIC_RELAXED */
+
+#if defined(HAVE_ATOMIC)
 #define update_zmalloc_stat_add(__n) __sync_add_and_fetch(&used_memory, (__n))
 #define update_zmalloc_stat_sub(__n) __sync_sub_and_fetch(&used_memory, (__n))
 #else
@@ -109,9 +172,12 @@ void zlibc_free(void *ptr) {
 } while(0)
 
 static size_t used_memory = 0;
-static int zmalloc_thread_safe = 0;
 pthread_mutex_t used_memory_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+#endif /* !__ATOMIC_RELAXED */
+
+static int zmalloc_thread_safe = 0;
+
 static void zmalloc_default_oom(size_t size) {
     fprintf(stderr, "zmalloc: Out of memory trying to allocate %zu bytes\n",
         size);
@@ -221,8 +287,15 @@ char *zstrdup(const char *s) {
 size_t zmalloc_used_memory(void) {
     size_t um;
 
+#if defined(__ATOMIC_RELAXED)
+    int j;
+
+    um = 0;
+    for (j = 0; j < ZMALLOC_MAX_THREADS; j++)
+        um += __atomic_load_n(&used_memory_thread[j].used,__ATOMIC_RELAXED);
+#else
     if (zmalloc_thread_safe) {
-#if defined(__ATOMIC_RELAXED) || defined(HAVE_ATOMIC)
+#if defined(HAVE_ATOMIC)
         um = update_zmalloc_stat_add(0);
 #else
         pthread_mutex_lock(&used_memory_mutex);
@@ -233,6 +306,7 @@ size_t zmalloc_used_memory(void) {
     else {
         um = used_memory;
     }
+#endif
 
     return um;
 }
@@ -0,0 +1,78 @@
+# Check that nodes in PFAIL state are gossiped in every PING and PONG,
+# instead of only when the random gossip sample happens to pick them.
+
+source "../tests/includes/init-tests.tcl"
+
+# Only two masters can report failures once two of them are down, which is
+# below the quorum of three: the killed masters stay in PFAIL state.
+test "Create a 4 nodes cluster" {
+    create_cluster 4 16
+}
+
+test "Cluster is up" {
+    assert_cluster_state ok
+}
+
+set failing {}
+test "Killing two masters" {
+    foreach id {2 3} {
+        lappend failing [dict get [get_myself $id] id]
+        kill_instance redis $id
+    }
+}
+
+# Return true if node 'id' flags 'name' as PFAIL.
+proc node_pfail {id name} {
+    foreach n [get_cluster_nodes $id] {
+        if {[dict get $n id] eq $name} {return [has_flag $n fail?]}
+    }
+    return 0
+}
+
+test "Every node flags the killed masters as PFAIL" {
+    foreach_redis_id id {
+        if {[instance_is_killed redis $id]} continue
+        foreach name $failing {
+            wait_for_condition 1000 50 {
+                [node_pfail $id $name]
+            } else {
+                fail "Node #$id does not flag $name as PFAIL"
+            }
+        }
+    }
+}
+
+test "PFAIL nodes are gossiped in every PING and PONG" {
+    set log [file join redis_1 log.txt]
+    set offset [file size $log]
+    R 1 config set loglevel debug
+    after 3000
+    R 1 config set loglevel notice
+    set fd [open $log]
+    seek $fd $offset
+    set lines [split [read $fd] "\n"]
+    close $fd
+
+    # Gossip lines follow the line announcing their packet. Types 0 and 1
+    # are PING and PONG.
+    set packets 0
+    set type -1
+    set gossip {}
+    foreach line [concat $lines {{--- Processing packet of type -1,}}] {
+        if {[regexp {Processing packet of type (-?[0-9]+),} $line - t]} {
+            if {$type == 0 || $type == 1} {
+                incr packets
+                foreach name $failing {
+                    if {[lsearch -exact $gossip $name] == -1} {
+                        fail "Packet without PFAIL node $name: $gossip"
+                    }
+                }
+            }
+            set type $t
+            set gossip {}
+        } elseif {[regexp {GOSSIP ([0-9a-f]{40}) } $line - name]} {
+            lappend gossip $name
+        }
+    }
+    assert {$packets > 10}
+}
@@ -218,6 +218,135 @@ start_server {tags {"dump"}} {
         }
     }
 
+    test {MIGRATE does not block other clients while waiting the target} {
+        set first [srv 0 client]
+        r set key "Some Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set rd [redis_deferring_client]
+            $rd debug sleep 1.0 ; # Make second server slow to reply.
+            set mig [redis_deferring_client -1]
+            $mig migrate $second_host $second_port key 9 5000
+            assert {[$first ping] eq {PONG}}
+            assert {[$first exists key] == 1}
+            assert {[$mig read] eq {OK}}
+            assert {[$first exists key] == 0}
+            assert {[$second get key] eq {Some Value}}
+            $rd read
+            $rd close
+            $mig close
+        }
+    }
+
+    test {MIGRATE transfers again keys modified while in flight} {
+        set first [srv 0 client]
+        r set key "Old Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set rd [redis_deferring_client]
+            $rd debug sleep 0.5 ; # Keep the key in flight for a while.
+            set mig [redis_deferring_client -1]
+            $mig migrate $second_host $second_port key 9 5000
+            $first set key "New Value"
+            assert {[$mig read] eq {OK}}
+            assert {[$first exists key] == 0}
+            assert {[$second get key] eq {New Value}}
+            $rd read
+            $rd close
+            $mig close
+        }
+    }
+
+    test {MIGRATE deletes on the target keys deleted while in flight} {
+        set first [srv 0 client]
+        r set key "Old Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set rd [redis_deferring_client]
+            $rd debug sleep 0.5 ; # Keep the key in flight for a while.
+            set mig [redis_deferring_client -1]
+            $mig migrate $second_host $second_port key 9 5000
+            $first del key
+            assert {[$mig read] eq {OK}}
+            assert {[$first exists key] == 0}
+            assert {[$second exists key] == 0}
+            $rd read
+            $rd close
+            $mig close
+        }
+    }
+
+    test {MIGRATE propagates the DEL before later writes to the key} {
+        set first [srv 0 client]
+        r flushdb
+        r set key "Some Value"
+        start_server {tags {"repl"}} {
+            set slave [srv 0 client]
+            $slave slaveof [srv -1 host] [srv -1 port]
+            wait_for_condition 50 100 {
+                [s 0 master_link_status] eq {up}
+            } else {
+                fail "Slave not connected"
+            }
+            start_server {tags {"repl"}} {
+                set second_host [srv 0 host]
+                set second_port [srv 0 port]
+
+                # The big value keeps the job in flight after the key
+                # before it was acknowledged and deleted.
+                $first set big [string repeat x 50000000]
+                set mig [redis_deferring_client -2]
+                $mig migrate $second_host $second_port "" 9 5000 keys key big
+                set tries 0
+                while {[$first exists key] && [incr tries] < 1000000} {}
+                $first set key "Written Back"
+                assert {[$first exists big] == 1}
+                $mig read
+                $first set marker done
+                wait_for_condition 50 100 {
+                    [$slave get marker] eq {done}
+                } else {
+                    fail "Slave didn't catch up"
+                }
+                assert {[$slave get key] eq {Written Back}}
+                $mig close
+            }
+            $slave slaveof no one
+        }
+    }
+
+    test {MIGRATE after a timed out BLPOP on the same client} {
+        set first [srv 0 client]
+        r set key "Some Value"
+        start_server {tags {"repl"}} {
+            set second [srv 0 client]
+            set second_host [srv 0 host]
+            set second_port [srv 0 port]
+
+            set mig [redis_deferring_client -1]
+            $mig blpop nolist 1
+            assert {[$mig read] eq {}}
+            set rd [redis_deferring_client]
+            $rd debug sleep 1.0 ; # Keep the MIGRATE blocked past the BLPOP timeout.
+            $mig migrate $second_host $second_port key 9 5000
+            assert {[$mig read] eq {OK}}
+            assert {[$first ping] eq {PONG}}
+            assert {[$second get key] eq {Some Value}}
+            $rd read
+            $rd close
+            $mig close
+        }
+    }
+
     test {MIGRATE can migrate multiple keys at once} {
         set first [srv 0 client]
         r set key1 "v1"
@@ -35,3 +35,42 @@ start_server {tags {"memefficiency"}} {
         }
     }
 }
+
+start_server {tags {"memefficiency"}} {
+    test {MEMORY STATS accounts the keyspace and the clients} {
+        r flushall
+        r debug populate 1000
+        set stats [r memory stats]
+        assert {[dict get $stats keys.count] == 1000}
+        assert {[dict get $stats clients.normal] > 0}
+        assert {[dict get [dict get $stats db.9] overhead.hashtable.main] > 0}
+        assert {[dict get $stats overhead.total] +
+                [dict get $stats dataset.bytes] ==
+                [dict get $stats total.allocated]}
+    }
+
+    test {MEMORY USAGE grows with the value size} {
+        r set small foo
+        r set big [string repeat x 10000]
+        assert {[r memory usage small] < [r memory usage big]}
+        assert {[r memory usage big] > 10000}
+        assert {[r memory usage nokey] eq {}}
+    }
+
+    test {MEMORY USAGE sampling estimates big collections} {
+        r del myset
+        for {set j 0} {$j < 1000} {incr j} {
+            r sadd myset "member:$j"
+        }
+        set exact [r memory usage myset samples 0]
+        set sampled [r memory usage myset samples 10]
+        assert {$sampled > $exact*0.8 && $sampled < $exact*1.2}
+        catch {r memory usage myset samples -1} e
+        set e
+    } {ERR*}
+
+    test {INFO memory reports the overhead and the dataset size} {
+        assert {[s used_memory_overhead] > [s used_memory_startup]}
+        assert {[s used_memory_dataset] > 0}
+    }
+}
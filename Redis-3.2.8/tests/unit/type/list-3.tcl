@@ -120,3 +120,57 @@ start_server {
         }
     }
 }
+
+start_server {
+    tags {list quicklist}
+    overrides {
+        "list-max-ziplist-size" 16
+        "list-compress-depth" 1
+        "list-compress-codec" lz4
+    }
+} {
+    test {Compressed list: LINDEX and LRANGE in the middle with both codecs} {
+        r del l
+        set l {}
+        for {set i 0} {$i < 2000} {incr i} {
+            set v "element:$i:[string repeat x [randomInt 20]]"
+            lappend l $v
+            r rpush l $v
+            if {$i == 1000} {r config set list-compress-codec lzf}
+        }
+        assert_match {*ql_compressed:1*} [r debug object l]
+        for {set j 0} {$j < 3} {incr j} {
+            foreach i {500 510 1500 1510 999 1001} {
+                assert_equal [lindex $l $i] [r lindex l $i]
+                assert_equal [lrange $l $i [expr {$i+20}]] \
+                             [r lrange l $i [expr {$i+20}]]
+            }
+        }
+        assert_equal $l [r lrange l 0 -1]
+        r config set list-compress-codec lz4
+    }
+
+    test {Compressed list: LSET and LREM on hot nodes} {
+        r lset l 500 foo
+        lset l 500 foo
+        r lrem l 0 [lindex $l 1500]
+        set l [lreplace $l 1500 1500]
+        assert_equal [lindex $l 500] [r lindex l 500]
+        assert_equal $l [r lrange l 0 -1]
+    }
+
+    test {Compressed list: LZ4 nodes survive DEBUG RELOAD} {
+        set before [r lrange l 0 -1]
+        r debug reload
+        assert_equal $before [r lrange l 0 -1]
+        r config set rdbcompression no
+        r debug reload
+        r config set rdbcompression yes
+        assert_equal $before [r lrange l 0 -1]
+    }
+
+    test {CONFIG SET list-compress-codec rejects unknown codecs} {
+        catch {r config set list-compress-codec zstd} e
+        set e
+    } {ERR*}
+}